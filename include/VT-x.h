@@ -28,8 +28,7 @@
 #ifndef __INTEL_VT_X_H__
 #define __INTEL_VT_X_H__
 
-#include <ntddk.h>
-#include <intrin.h>
+#include "ntshim.h"
 
 #include "msr64.h"
 #include "cr64.h"
@@ -41,235 +40,277 @@
 // Vol 3B, Table 21-16. Structure of VMCS Component Encoding
 typedef union _VMCS_COMPONENT_ENCODING
 {
-	UINT32 AccessType : 1;	// 0		Access type (0 = full; 1 = high); must be full 
-							//			for 16-bit, 32-bit, and natural-width fields
-	UINT32 Index : 8;		// 1-9		Index
-	UINT32 reserved0 : 12;	// 12		0
-	UINT32 Width : 2;		// 13-14	0: 16-bit, 1: 64-bit, 2: 32-bit, 3: natural-width
-	UINT32 reserved1 : 17;	// 15-31	0
+	UINT32 dwValue;
+	struct {
+		UINT32 AccessType : 1;	// 0		Access type (0 = full; 1 = high); must be full
+								//			for 16-bit, 32-bit, and natural-width fields
+		UINT32 Index : 9;		// 1-9		Index
+		UINT32 Type : 2;		// 10-11	0: control, 1: VM-exit information, 2: guest state, 3: host state
+		UINT32 reserved0 : 1;	// 12		0
+		UINT32 Width : 2;		// 13-14	0: 16-bit, 1: 64-bit, 2: 32-bit, 3: natural-width
+		UINT32 reserved1 : 17;	// 15-31	0
+	};
 } VMCS_COMPONENT_ENCODING, *PVMCS_COMPONENT_ENCODING;
 C_ASSERT(sizeof(UINT32) == sizeof(VMCS_COMPONENT_ENCODING));
 
+// Values of VMCS_COMPONENT_ENCODING.Width
+typedef enum _VMCS_FIELD_WIDTH
+{
+	VMCS_FIELD_WIDTH_16BIT = 0,
+	VMCS_FIELD_WIDTH_64BIT = 1,
+	VMCS_FIELD_WIDTH_32BIT = 2,
+	VMCS_FIELD_WIDTH_NATURAL = 3
+} VMCS_FIELD_WIDTH, *PVMCS_FIELD_WIDTH;
+
+// Values of VMCS_COMPONENT_ENCODING.Type
+typedef enum _VMCS_FIELD_TYPE
+{
+	VMCS_FIELD_TYPE_CONTROL = 0,
+	VMCS_FIELD_TYPE_READ_ONLY = 1,	// VM-exit information, writable only if IA32_VMX_MISC[29]
+	VMCS_FIELD_TYPE_GUEST = 2,
+	VMCS_FIELD_TYPE_HOST = 3
+} VMCS_FIELD_TYPE, *PVMCS_FIELD_TYPE;
+
+// Decode a VMCS field encoding, usable in constant expressions
+#define VMCS_FIELD_ACCESS_HIGH(eField)		(0 != ((UINT32)(eField) & 1))
+#define VMCS_FIELD_ENCODING_INDEX(eField)	(((UINT32)(eField) >> 1) & 0x1ff)
+#define VMCS_FIELD_TYPE_OF(eField)			((VMCS_FIELD_TYPE)(((UINT32)(eField) >> 10) & 3))
+#define VMCS_FIELD_WIDTH_OF(eField)			((VMCS_FIELD_WIDTH)(((UINT32)(eField) >> 13) & 3))
+
 // Vol 3B, APPENDIX H FIELD ENCODING IN VMCS
+// Define the VMCS fields using X-Macros, one list per width. Every 64-bit field
+// X(FieldName, Encoding) defines FieldName_FULL = Encoding and FieldName_HIGH = Encoding + 1.
+
+// 16-bit fields
+// X(FieldName, Encoding)
+#define VMCS_FIELDS_16BIT \
+	/* Vol 3B, Table H-1. Encoding for 16-Bit Control Fields (0000_00xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_VPID, 0x00000000) \
+	X(VMCS_FIELD_POSTED_INTR_NOTIFICATION_VECTOR, 0x00000002) \
+	X(VMCS_FIELD_EPTP_INDEX, 0x00000004) \
+	/* Vol 3B, Table H-2. Encodings for 16-Bit Guest-State Fields (0000_10xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_GUEST_ES_SELECTOR, 0x00000800) \
+	X(VMCS_FIELD_GUEST_CS_SELECTOR, 0x00000802) \
+	X(VMCS_FIELD_GUEST_SS_SELECTOR, 0x00000804) \
+	X(VMCS_FIELD_GUEST_DS_SELECTOR, 0x00000806) \
+	X(VMCS_FIELD_GUEST_FS_SELECTOR, 0x00000808) \
+	X(VMCS_FIELD_GUEST_GS_SELECTOR, 0x0000080a) \
+	X(VMCS_FIELD_GUEST_LDTR_SELECTOR, 0x0000080c) \
+	X(VMCS_FIELD_GUEST_TR_SELECTOR, 0x0000080e) \
+	X(VMCS_FIELD_GUEST_INTR_STATUS, 0x00000810) \
+	X(VMCS_FIELD_GUEST_PML_INDEX, 0x00000812) \
+	/* Vol 3B, Table H-3. Encodings for 16-Bit Host-State Fields (0000_11xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_HOST_ES_SELECTOR, 0x00000c00) \
+	X(VMCS_FIELD_HOST_CS_SELECTOR, 0x00000c02) \
+	X(VMCS_FIELD_HOST_SS_SELECTOR, 0x00000c04) \
+	X(VMCS_FIELD_HOST_DS_SELECTOR, 0x00000c06) \
+	X(VMCS_FIELD_HOST_FS_SELECTOR, 0x00000c08) \
+	X(VMCS_FIELD_HOST_GS_SELECTOR, 0x00000c0a) \
+	X(VMCS_FIELD_HOST_TR_SELECTOR, 0x00000c0c)
+
+// 64-bit fields, by the encoding of their full access
+// X(FieldName, Encoding)
+#define VMCS_FIELDS_64BIT \
+	/* Vol 3B, Table H-4. Encodings for 64-Bit Control Fields (0010_00xx_xxxx_xxxAb) */ \
+	X(VMCS_FIELD_IO_BITMAP_A, 0x00002000) \
+	X(VMCS_FIELD_IO_BITMAP_B, 0x00002002) \
+	X(VMCS_FIELD_MSR_BITMAP, 0x00002004) \
+	X(VMCS_FIELD_VM_EXIT_MSR_STORE_ADDR, 0x00002006) \
+	X(VMCS_FIELD_VM_EXIT_MSR_LOAD_ADDR, 0x00002008) \
+	X(VMCS_FIELD_VM_ENTRY_MSR_LOAD_ADDR, 0x0000200a) \
+	X(VMCS_FIELD_EXECUTIVE_VMCS_PTR, 0x0000200c) \
+	X(VMCS_FIELD_PML_ADDRESS, 0x0000200e) \
+	X(VMCS_FIELD_TSC_OFFSET, 0x00002010) \
+	X(VMCS_FIELD_VIRTUAL_APIC_PAGE_ADDR, 0x00002012) \
+	X(VMCS_FIELD_APIC_ACCESS_ADDR, 0x00002014) \
+	X(VMCS_FIELD_PI_DESC_ADDR, 0x00002016) \
+	X(VMCS_FIELD_VM_FUNCTION_CONTROL, 0x00002018) \
+	X(VMCS_FIELD_EPT_POINTER, 0x0000201a) \
+	X(VMCS_FIELD_EOI_EXIT_BITMAP0, 0x0000201c) \
+	X(VMCS_FIELD_EPTP_LIST_ADDR, 0x00002024) \
+	X(VMCS_FIELD_VMREAD_BITMAP, 0x00002026) \
+	X(VMCS_FIELD_VMWRITE_BITMAP, 0x00002028) \
+	X(VMCS_FIELD_VIRT_EXCEPTION_INFO, 0x0000202a) \
+	X(VMCS_FIELD_XSS_EXIT_BITMAP, 0x0000202c) \
+	X(VMCS_FIELD_TSC_MULTIPLIER, 0x00002032) \
+	/* Vol 3B, Table H-5. Encodings for 64-Bit Read-Only Data Field (0010_01xx_xxxx_xxxAb) */ \
+	X(VMCS_FIELD_GUEST_PHYSICAL_ADDRESS, 0x00002400) \
+	/* Vol 3B, Table H-6. Encodings for 64-Bit Guest-State Fields (0010_10xx_xxxx_xxxAb) */ \
+	X(VMCS_FIELD_VMCS_LINK_POINTER, 0x00002800) \
+	X(VMCS_FIELD_GUEST_IA32_DEBUGCTL, 0x00002802) \
+	X(VMCS_FIELD_GUEST_PAT, 0x00002804) \
+	X(VMCS_FIELD_GUEST_EFER, 0x00002806) \
+	X(VMCS_FIELD_GUEST_PERF_GLOBAL_CTRL, 0x00002808) \
+	X(VMCS_FIELD_GUEST_PDPTE0, 0x0000280a) \
+	X(VMCS_FIELD_GUEST_PDPTE1, 0x0000280c) \
+	X(VMCS_FIELD_GUEST_PDPTE2, 0x0000280e) \
+	X(VMCS_FIELD_GUEST_PDPTE3, 0x00002810) \
+	X(VMCS_FIELD_GUEST_BNDCFGS, 0x00002812) \
+	/* Vol 3B, Table H-7. Encodings for 64-Bit Host-State Fields (0010_11xx_xxxx_xxxAb) */ \
+	X(VMCS_FIELD_HOST_PAT, 0x00002c00) \
+	X(VMCS_FIELD_HOST_EFER, 0x00002c02) \
+	X(VMCS_FIELD_HOST_PERF_GLOBAL_CTRL, 0x00002c04)
+
+// 32-bit fields
+// X(FieldName, Encoding)
+#define VMCS_FIELDS_32BIT \
+	/* Vol 3B, Table H-8. Encodings for 32-Bit Control Fields (0100_00xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_PIN_BASED_VM_EXEC_CONTROL, 0x00004000) \
+	X(VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL, 0x00004002) \
+	X(VMCS_FIELD_EXCEPTION_BITMAP, 0x00004004) \
+	X(VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MASK, 0x00004006) \
+	X(VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MATCH, 0x00004008) \
+	X(VMCS_FIELD_CR3_TARGET_COUNT, 0x0000400a) \
+	X(VMCS_FIELD_VM_EXIT_CONTROLS, 0x0000400c) \
+	X(VMCS_FIELD_VM_EXIT_MSR_STORE_COUNT, 0x0000400e) \
+	X(VMCS_FIELD_VM_EXIT_MSR_LOAD_COUNT, 0x00004010) \
+	X(VMCS_FIELD_VM_ENTRY_CONTROLS, 0x00004012) \
+	X(VMCS_FIELD_VM_ENTRY_MSR_LOAD_COUNT, 0x00004014) \
+	X(VMCS_FIELD_VM_ENTRY_INTR_INFO, 0x00004016) \
+	X(VMCS_FIELD_VM_ENTRY_EXCEPTION_ERROR_CODE, 0x00004018) \
+	X(VMCS_FIELD_VM_ENTRY_INSTRUCTION_LEN, 0x0000401a) \
+	X(VMCS_FIELD_TPR_THRESHOLD, 0x0000401c) \
+	X(VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL, 0x0000401e) \
+	X(VMCS_FIELD_PLE_GAP, 0x00004020) \
+	X(VMCS_FIELD_PLE_WINDOW, 0x00004022) \
+	/* Vol 3B, Table H-9. Encodings for 32-Bit Read-Only Data Fields (0100_01xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_VM_INSTRUCTION_ERROR, 0x00004400) \
+	X(VMCS_FIELD_VM_EXIT_REASON, 0x00004402) \
+	X(VMCS_FIELD_VM_EXIT_INTR_INFO, 0x00004404) \
+	X(VMCS_FIELD_VM_EXIT_INTR_ERROR_CODE, 0x00004406) \
+	X(VMCS_FIELD_IDT_VECTORING_INFO, 0x00004408) \
+	X(VMCS_FIELD_IDT_VECTORING_ERROR_CODE, 0x0000440a) \
+	X(VMCS_FIELD_VM_EXIT_INSTRUCTION_LEN, 0x0000440c) \
+	X(VMCS_FIELD_VMX_INSTRUCTION_INFO, 0x0000440e) \
+	/* Vol 3B, Table H-10. Encodings for 32-Bit Guest-State Fields (0100_10xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_GUEST_ES_LIMIT, 0x00004800) \
+	X(VMCS_FIELD_GUEST_CS_LIMIT, 0x00004802) \
+	X(VMCS_FIELD_GUEST_SS_LIMIT, 0x00004804) \
+	X(VMCS_FIELD_GUEST_DS_LIMIT, 0x00004806) \
+	X(VMCS_FIELD_GUEST_FS_LIMIT, 0x00004808) \
+	X(VMCS_FIELD_GUEST_GS_LIMIT, 0x0000480a) \
+	X(VMCS_FIELD_GUEST_LDTR_LIMIT, 0x0000480c) \
+	X(VMCS_FIELD_GUEST_TR_LIMIT, 0x0000480e) \
+	X(VMCS_FIELD_GUEST_GDTR_LIMIT, 0x00004810) \
+	X(VMCS_FIELD_GUEST_IDTR_LIMIT, 0x00004812) \
+	X(VMCS_FIELD_GUEST_ES_AR_BYTES, 0x00004814) \
+	X(VMCS_FIELD_GUEST_CS_AR_BYTES, 0x00004816) \
+	X(VMCS_FIELD_GUEST_SS_AR_BYTES, 0x00004818) \
+	X(VMCS_FIELD_GUEST_DS_AR_BYTES, 0x0000481a) \
+	X(VMCS_FIELD_GUEST_FS_AR_BYTES, 0x0000481c) \
+	X(VMCS_FIELD_GUEST_GS_AR_BYTES, 0x0000481e) \
+	X(VMCS_FIELD_GUEST_LDTR_AR_BYTES, 0x00004820) \
+	X(VMCS_FIELD_GUEST_TR_AR_BYTES, 0x00004822) \
+	X(VMCS_FIELD_GUEST_INTERRUPTIBILITY_INFO, 0x00004824) \
+	X(VMCS_FIELD_GUEST_ACTIVITY_STATE, 0x00004826) \
+	X(VMCS_FIELD_GUEST_SMBASE, 0x00004828) \
+	X(VMCS_FIELD_GUEST_SYSENTER_CS, 0x0000482a) \
+	X(VMCS_FIELD_GUEST_PREEMPTION_TIMER, 0x0000482e) \
+	/* Vol 3B, Table H-11. Encoding for 32-Bit Host-State Field (0100_11xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_HOST_SYSENTER_CS, 0x00004c00)
+
+// Natural-width fields
+// X(FieldName, Encoding)
+#define VMCS_FIELDS_NATURAL \
+	/* Vol 3B, Table H-12. Encodings for Natural-Width Control Fields (0110_00xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_CR0_GUEST_HOST_MASK, 0x00006000) \
+	X(VMCS_FIELD_CR4_GUEST_HOST_MASK, 0x00006002) \
+	X(VMCS_FIELD_CR0_READ_SHADOW, 0x00006004) \
+	X(VMCS_FIELD_CR4_READ_SHADOW, 0x00006006) \
+	X(VMCS_FIELD_CR3_TARGET_VALUE0, 0x00006008) \
+	X(VMCS_FIELD_CR3_TARGET_VALUE1, 0x0000600a) \
+	X(VMCS_FIELD_CR3_TARGET_VALUE2, 0x0000600c) \
+	X(VMCS_FIELD_CR3_TARGET_VALUE3, 0x0000600e) \
+	/* Vol 3B, Table H-13. Encodings for Natural-Width Read-Only Data Fields (0110_01xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_EXIT_QUALIFICATION, 0x00006400) \
+	X(VMCS_FIELD_IO_RCX, 0x00006402) \
+	X(VMCS_FIELD_IO_RSI, 0x00006404) \
+	X(VMCS_FIELD_IO_RDI, 0x00006406) \
+	X(VMCS_FIELD_IO_RIP, 0x00006408) \
+	X(VMCS_FIELD_GUEST_LINEAR_ADDRESS, 0x0000640a) \
+	/* Vol 3B, Table H-14. Encodings for Natural-Width Guest-State Fields (0110_10xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_GUEST_CR0, 0x00006800) \
+	X(VMCS_FIELD_GUEST_CR3, 0x00006802) \
+	X(VMCS_FIELD_GUEST_CR4, 0x00006804) \
+	X(VMCS_FIELD_GUEST_ES_BASE, 0x00006806) \
+	X(VMCS_FIELD_GUEST_CS_BASE, 0x00006808) \
+	X(VMCS_FIELD_GUEST_SS_BASE, 0x0000680a) \
+	X(VMCS_FIELD_GUEST_DS_BASE, 0x0000680c) \
+	X(VMCS_FIELD_GUEST_FS_BASE, 0x0000680e) \
+	X(VMCS_FIELD_GUEST_GS_BASE, 0x00006810) \
+	X(VMCS_FIELD_GUEST_LDTR_BASE, 0x00006812) \
+	X(VMCS_FIELD_GUEST_TR_BASE, 0x00006814) \
+	X(VMCS_FIELD_GUEST_GDTR_BASE, 0x00006816) \
+	X(VMCS_FIELD_GUEST_IDTR_BASE, 0x00006818) \
+	X(VMCS_FIELD_GUEST_DR7, 0x0000681a) \
+	X(VMCS_FIELD_GUEST_RSP, 0x0000681c) \
+	X(VMCS_FIELD_GUEST_RIP, 0x0000681e) \
+	X(VMCS_FIELD_GUEST_RFLAGS, 0x00006820) \
+	X(VMCS_FIELD_GUEST_PENDING_DBG_EXCEPTIONS, 0x00006822) \
+	X(VMCS_FIELD_GUEST_SYSENTER_ESP, 0x00006824) \
+	X(VMCS_FIELD_GUEST_SYSENTER_EIP, 0x00006826) \
+	/* Vol 3B, Table H-15. Encodings for Natural-Width Host-State Fields (0110_11xx_xxxx_xxx0B) */ \
+	X(VMCS_FIELD_HOST_CR0, 0x00006c00) \
+	X(VMCS_FIELD_HOST_CR3, 0x00006c02) \
+	X(VMCS_FIELD_HOST_CR4, 0x00006c04) \
+	X(VMCS_FIELD_HOST_FS_BASE, 0x00006c06) \
+	X(VMCS_FIELD_HOST_GS_BASE, 0x00006c08) \
+	X(VMCS_FIELD_HOST_TR_BASE, 0x00006c0a) \
+	X(VMCS_FIELD_HOST_GDTR_BASE, 0x00006c0c) \
+	X(VMCS_FIELD_HOST_IDTR_BASE, 0x00006c0e) \
+	X(VMCS_FIELD_HOST_SYSENTER_ESP, 0x00006c10) \
+	X(VMCS_FIELD_HOST_SYSENTER_EIP, 0x00006c12) \
+	X(VMCS_FIELD_HOST_RSP, 0x00006c14) \
+	X(VMCS_FIELD_HOST_RIP, 0x00006c16)
+
 typedef enum _VMCS_FIELD_ENCODING
 {
-	// Vol 3B, Table H-1. Encoding for 16-Bit Control Fields (0000_00xx_xxxx_xxx0B)
-	VMCS_FIELD_VPID = 0x00000000,
-	VMCS_FIELD_POSTED_INTR_NOTIFICATION_VECTOR = 0x00000002,
-	VMCS_FIELD_EPTP_INDEX = 0x00000004,
-
-	// Vol 3B, Table H-2. Encodings for 16-Bit Guest-State Fields (0000_10xx_xxxx_xxx0B)
-	VMCS_FIELD_GUEST_ES_SELECTOR = 0x00000800,
-	VMCS_FIELD_GUEST_CS_SELECTOR = 0x00000802,
-	VMCS_FIELD_GUEST_SS_SELECTOR = 0x00000804,
-	VMCS_FIELD_GUEST_DS_SELECTOR = 0x00000806,
-	VMCS_FIELD_GUEST_FS_SELECTOR = 0x00000808,
-	VMCS_FIELD_GUEST_GS_SELECTOR = 0x0000080a,
-	VMCS_FIELD_GUEST_LDTR_SELECTOR = 0x0000080c,
-	VMCS_FIELD_GUEST_TR_SELECTOR = 0x0000080e,
-	VMCS_FIELD_GUEST_INTR_STATUS = 0x00000810,
-	VMCS_FIELD_GUEST_PML_INDEX = 0x00000812,
-
-	// Vol 3B, Table H-3. Encodings for 16-Bit Host-State Fields (0000_11xx_xxxx_xxx0B)
-	VMCS_FIELD_HOST_ES_SELECTOR = 0x00000c00,
-	VMCS_FIELD_HOST_CS_SELECTOR = 0x00000c02,
-	VMCS_FIELD_HOST_SS_SELECTOR = 0x00000c04,
-	VMCS_FIELD_HOST_DS_SELECTOR = 0x00000c06,
-	VMCS_FIELD_HOST_FS_SELECTOR = 0x00000c08,
-	VMCS_FIELD_HOST_GS_SELECTOR = 0x00000c0a,
-	VMCS_FIELD_HOST_TR_SELECTOR = 0x00000c0c,
-
-	// Vol 3B, Table H-3. Encodings for 16-Bit Host-State Fields (0000_11xx_xxxx_xxx0B)
-	VMCS_FIELD_IO_BITMAP_A_FULL = 0x00002000,
-	VMCS_FIELD_IO_BITMAP_A_HIGH = 0x00002001,
-	VMCS_FIELD_IO_BITMAP_B_FULL = 0x00002002,
-	VMCS_FIELD_IO_BITMAP_B_HIGH = 0x00002003,
-	VMCS_FIELD_MSR_BITMAP_FULL = 0x00002004,
-	VMCS_FIELD_MSR_BITMAP_HIGH = 0x00002005,
-	VMCS_FIELD_VM_EXIT_MSR_STORE_ADDR_FULL = 0x00002006,
-	VMCS_FIELD_VM_EXIT_MSR_STORE_ADDR_HIGH = 0x00002007,
-	VMCS_FIELD_VM_EXIT_MSR_LOAD_ADDR_FULL = 0x00002008,
-	VMCS_FIELD_VM_EXIT_MSR_LOAD_ADDR_HIGH = 0x00002009,
-	VMCS_FIELD_VM_ENTRY_MSR_LOAD_ADDR_FULL = 0x0000200a,
-	VMCS_FIELD_VM_ENTRY_MSR_LOAD_ADDR_HIGH = 0x0000200b,
-	VMCS_FIELD_EXECUTIVE_VMCS_PTR_FULL = 0x0000200c,
-	VMCS_FIELD_EXECUTIVE_VMCS_PTR_HIGH = 0x0000200d,
-	VMCS_FIELD_PML_ADDRESS_FULL = 0x0000200e,
-	VMCS_FIELD_PML_ADDRESS_HIGH = 0x0000200f,
-	VMCS_FIELD_TSC_OFFSET_FULL = 0x00002010,
-	VMCS_FIELD_TSC_OFFSET_HIGH = 0x00002011,
-	VMCS_FIELD_VIRTUAL_APIC_PAGE_ADDR_FULL = 0x00002012,
-	VMCS_FIELD_VIRTUAL_APIC_PAGE_ADDR_HIGH = 0x00002013,
-	VMCS_FIELD_APIC_ACCESS_ADDR_FULL = 0x00002014,
-	VMCS_FIELD_APIC_ACCESS_ADDR_HIGH = 0x00002015,
-	VMCS_FIELD_PI_DESC_ADDR_FULL = 0x00002016,
-	VMCS_FIELD_PI_DESC_ADDR_HIGH = 0x00002017,
-	VMCS_FIELD_VM_FUNCTION_CONTROL_FULL = 0x00002018,
-	VMCS_FIELD_VM_FUNCTION_CONTROL_HIGH = 0x00002019,
-	VMCS_FIELD_EPT_POINTER_FULL = 0x0000201a,
-	VMCS_FIELD_EPT_POINTER_HIGH = 0x0000201b,
-	VMCS_FIELD_EOI_EXIT_BITMAP0_FULL = 0x0000201c,
-	VMCS_FIELD_EOI_EXIT_BITMAP0_HIGH = 0x0000201d,
-	VMCS_FIELD_EPTP_LIST_ADDR_FULL = 0x00002024,
-	VMCS_FIELD_EPTP_LIST_ADDR_HIGH = 0x00002025,
-	VMCS_FIELD_VMREAD_BITMAP_FULL = 0x00002026,
-	VMCS_FIELD_VMREAD_BITMAP_HIGH = 0x00002027,
-	VMCS_FIELD_VMWRITE_BITMAP_FULL = 0x00002028,
-	VMCS_FIELD_VMWRITE_BITMAP_HIGH = 0x00002029,
-	VMCS_FIELD_VIRT_EXCEPTION_INFO_FULL = 0x0000202a,
-	VMCS_FIELD_VIRT_EXCEPTION_INFO_HIGH = 0x0000202b,
-	VMCS_FIELD_XSS_EXIT_BITMAP_FULL = 0x0000202c,
-	VMCS_FIELD_XSS_EXIT_BITMAP_HIGH = 0x0000202d,
-	VMCS_FIELD_TSC_MULTIPLIER_FULL = 0x00002032,
-	VMCS_FIELD_TSC_MULTIPLIER_HIGH = 0x00002033,
-	
-	// Vol 3B, Table H-5. Encodings for 64-Bit Read-Only Data Field (0010_01xx_xxxx_xxxAb)
-	VMCS_FIELD_GUEST_PHYSICAL_ADDRESS_FULL = 0x00002400,
-	VMCS_FIELD_GUEST_PHYSICAL_ADDRESS_HIGH = 0x00002401,
-	
-	// Vol 3B, Table H-6. Encodings for 64-Bit Guest-State Fields (0010_10xx_xxxx_xxxAb)
-	VMCS_FIELD_VMCS_LINK_POINTER_FULL = 0x00002800,
-	VMCS_FIELD_VMCS_LINK_POINTER_HIGH = 0x00002801,
-	VMCS_FIELD_GUEST_IA32_DEBUGCTL_FULL = 0x00002802,
-	VMCS_FIELD_GUEST_IA32_DEBUGCTL_HIGH = 0x00002803,
-	VMCS_FIELD_GUEST_PAT_FULL = 0x00002804,
-	VMCS_FIELD_GUEST_PAT_HIGH = 0x00002805,
-	VMCS_FIELD_GUEST_EFER_FULL = 0x00002806,
-	VMCS_FIELD_GUEST_EFER_HIGH = 0x00002807,
-	VMCS_FIELD_GUEST_PERF_GLOBAL_CTRL_FULL = 0x00002808,
-	VMCS_FIELD_GUEST_PERF_GLOBAL_CTRL_HIGH = 0x00002809,
-	VMCS_FIELD_GUEST_PDPTE0_FULL = 0x0000280a,
-	VMCS_FIELD_GUEST_PDPTE0_HIGH = 0x0000280b,
-	VMCS_FIELD_GUEST_PDPTE1_FULL = 0x0000280c,
-	VMCS_FIELD_GUEST_PDPTE1_HIGH = 0x0000280d,
-	VMCS_FIELD_GUEST_PDPTE2_FULL = 0x0000280e,
-	VMCS_FIELD_GUEST_PDPTE2_HIGH = 0x0000280f,
-	VMCS_FIELD_GUEST_PDPTE3_FULL = 0x00002810,
-	VMCS_FIELD_GUEST_PDPTE3_HIGH = 0x00002811,
-	VMCS_FIELD_GUEST_BNDCFGS_FULL = 0x00002812,
-	VMCS_FIELD_GUEST_BNDCFGS_HIGH = 0x00002813,
-	
-	// Vol 3B, Table H-7. Encodings for 64-Bit Host-State Fields (0010_11xx_xxxx_xxxAb)
-	VMCS_FIELD_HOST_PAT_FULL = 0x00002c00,
-	VMCS_FIELD_HOST_PAT_HIGH = 0x00002c01,
-	VMCS_FIELD_HOST_EFER_FULL = 0x00002c02,
-	VMCS_FIELD_HOST_EFER_HIGH = 0x00002c03,
-	VMCS_FIELD_HOST_PERF_GLOBAL_CTRL_FULL = 0x00002c04,
-	VMCS_FIELD_HOST_PERF_GLOBAL_CTRL_HIGH = 0x00002c05,
-
-	// Table H-8. Encodings for 32-Bit Control Fields (0100_00xx_xxxx_xxx0B)
-	VMCS_FIELD_PIN_BASED_VM_EXEC_CONTROL = 0x00004000,
-	VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL = 0x00004002,
-	VMCS_FIELD_EXCEPTION_BITMAP = 0x00004004,
-	VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MASK = 0x00004006,
-	VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MATCH = 0x00004008,
-	VMCS_FIELD_CR3_TARGET_COUNT = 0x0000400a,
-	VMCS_FIELD_VM_EXIT_CONTROLS = 0x0000400c,
-	VMCS_FIELD_VM_EXIT_MSR_STORE_COUNT = 0x0000400e,
-	VMCS_FIELD_VM_EXIT_MSR_LOAD_COUNT = 0x00004010,
-	VMCS_FIELD_VM_ENTRY_CONTROLS = 0x00004012,
-	VMCS_FIELD_VM_ENTRY_MSR_LOAD_COUNT = 0x00004014,
-	VMCS_FIELD_VM_ENTRY_INTR_INFO = 0x00004016,
-	VMCS_FIELD_VM_ENTRY_EXCEPTION_ERROR_CODE = 0x00004018,
-	VMCS_FIELD_VM_ENTRY_INSTRUCTION_LEN = 0x0000401a,
-	VMCS_FIELD_TPR_THRESHOLD = 0x0000401c,
-	VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL = 0x0000401e,
-	VMCS_FIELD_PLE_GAP = 0x00004020,
-	VMCS_FIELD_PLE_WINDOW = 0x00004022,
-
-	// Vol 3B, Table H-9. Encodings for 32-Bit Read-Only Data Fields (0100_01xx_xxxx_xxx0B)
-	VMCS_FIELD_VM_INSTRUCTION_ERROR = 0x00004400,
-	VMCS_FIELD_VM_EXIT_REASON = 0x00004402,
-	VMCS_FIELD_VM_EXIT_INTR_INFO = 0x00004404,
-	VMCS_FIELD_VM_EXIT_INTR_ERROR_CODE = 0x00004406,
-	VMCS_FIELD_IDT_VECTORING_INFO = 0x00004408,
-	VMCS_FIELD_IDT_VECTORING_ERROR_CODE = 0x0000440a,
-	VMCS_FIELD_VM_EXIT_INSTRUCTION_LEN = 0x0000440c,
-	VMCS_FIELD_VMX_INSTRUCTION_INFO = 0x0000440e,
-
-	// Vol 3B, Table H-10. Encodings for 32-Bit Guest-State Fields (0100_10xx_xxxx_xxx0B)
-	VMCS_FIELD_GUEST_ES_LIMIT = 0x00004800,
-	VMCS_FIELD_GUEST_CS_LIMIT = 0x00004802,
-	VMCS_FIELD_GUEST_SS_LIMIT = 0x00004804,
-	VMCS_FIELD_GUEST_DS_LIMIT = 0x00004806,
-	VMCS_FIELD_GUEST_FS_LIMIT = 0x00004808,
-	VMCS_FIELD_GUEST_GS_LIMIT = 0x0000480a,
-	VMCS_FIELD_GUEST_LDTR_LIMIT = 0x0000480c,
-	VMCS_FIELD_GUEST_TR_LIMIT = 0x0000480e,
-	VMCS_FIELD_GUEST_GDTR_LIMIT = 0x00004810,
-	VMCS_FIELD_GUEST_IDTR_LIMIT = 0x00004812,
-	VMCS_FIELD_GUEST_ES_AR_BYTES = 0x00004814,
-	VMCS_FIELD_GUEST_CS_AR_BYTES = 0x00004816,
-	VMCS_FIELD_GUEST_SS_AR_BYTES = 0x00004818,
-	VMCS_FIELD_GUEST_DS_AR_BYTES = 0x0000481a,
-	VMCS_FIELD_GUEST_FS_AR_BYTES = 0x0000481c,
-	VMCS_FIELD_GUEST_GS_AR_BYTES = 0x0000481e,
-	VMCS_FIELD_GUEST_LDTR_AR_BYTES = 0x00004820,
-	VMCS_FIELD_GUEST_TR_AR_BYTES = 0x00004822,
-	VMCS_FIELD_GUEST_INTERRUPTIBILITY_INFO = 0x00004824,
-	VMCS_FIELD_GUEST_ACTIVITY_STATE = 0x00004826,
-	VMCS_FIELD_GUEST_SMBASE = 0x00004828,
-	VMCS_FIELD_GUEST_SYSENTER_CS = 0x0000482a,
-	VMCS_FIELD_GUEST_PREEMPTION_TIMER = 0x0000482e,
-
-	// Vol 3B, Table H-11. Encoding for 32-Bit Host-State Field (0100_11xx_xxxx_xxx0B)
-	VMCS_FIELD_HOST_SYSENTER_CS = 0x00004c00,
-
-	// Vol 3B, Table H-12. Encodings for Natural-Width Control Fields (0110_00xx_xxxx_xxx0B)
-	VMCS_FIELD_CR0_GUEST_HOST_MASK = 0x00006000,
-	VMCS_FIELD_CR4_GUEST_HOST_MASK = 0x00006002,
-	VMCS_FIELD_CR0_READ_SHADOW = 0x00006004,
-	VMCS_FIELD_CR4_READ_SHADOW = 0x00006006,
-	VMCS_FIELD_CR3_TARGET_VALUE0 = 0x00006008,
-	VMCS_FIELD_CR3_TARGET_VALUE1 = 0x0000600a,
-	VMCS_FIELD_CR3_TARGET_VALUE2 = 0x0000600c,
-	VMCS_FIELD_CR3_TARGET_VALUE3 = 0x0000600e,
-
-	// Vol 3B, Table H-13. Encodings for Natural-Width Read-Only Data Fields (0110_01xx_xxxx_xxx0B)
-	VMCS_FIELD_EXIT_QUALIFICATION = 0x00006400,
-	VMCS_FIELD_IO_RCX = 0x00006402,
-	VMCS_FIELD_IO_RSI = 0x00006404,
-	VMCS_FIELD_IO_RDI = 0x00006406,
-	VMCS_FIELD_IO_RIP = 0x00006408,
-	VMCS_FIELD_GUEST_LINEAR_ADDRESS = 0x0000640a,
-
-	// Vol 3B, Table H-14. Encodings for Natural-Width Guest-State Fields (0110_10xx_xxxx_xxx0B)
-	VMCS_FIELD_GUEST_CR0 = 0x00006800,
-	VMCS_FIELD_GUEST_CR3 = 0x00006802,
-	VMCS_FIELD_GUEST_CR4 = 0x00006804,
-	VMCS_FIELD_GUEST_ES_BASE = 0x00006806,
-	VMCS_FIELD_GUEST_CS_BASE = 0x00006808,
-	VMCS_FIELD_GUEST_SS_BASE = 0x0000680a,
-	VMCS_FIELD_GUEST_DS_BASE = 0x0000680c,
-	VMCS_FIELD_GUEST_FS_BASE = 0x0000680e,
-	VMCS_FIELD_GUEST_GS_BASE = 0x00006810,
-	VMCS_FIELD_GUEST_LDTR_BASE = 0x00006812,
-	VMCS_FIELD_GUEST_TR_BASE = 0x00006814,
-	VMCS_FIELD_GUEST_GDTR_BASE = 0x00006816,
-	VMCS_FIELD_GUEST_IDTR_BASE = 0x00006818,
-	VMCS_FIELD_GUEST_DR7 = 0x0000681a,
-	VMCS_FIELD_GUEST_RSP = 0x0000681c,
-	VMCS_FIELD_GUEST_RIP = 0x0000681e,
-	VMCS_FIELD_GUEST_RFLAGS = 0x00006820,
-	VMCS_FIELD_GUEST_PENDING_DBG_EXCEPTIONS = 0x00006822,
-	VMCS_FIELD_GUEST_SYSENTER_ESP = 0x00006824,
-	VMCS_FIELD_GUEST_SYSENTER_EIP = 0x00006826,
-	
-	// Vol 3B, Table H-15. Encodings for Natural-Width Host-State Fields (0110_11xx_xxxx_xxx0B)
-	VMCS_FIELD_HOST_CR0 = 0x00006c00,
-	VMCS_FIELD_HOST_CR3 = 0x00006c02,
-	VMCS_FIELD_HOST_CR4 = 0x00006c04,
-	VMCS_FIELD_HOST_FS_BASE = 0x00006c06,
-	VMCS_FIELD_HOST_GS_BASE = 0x00006c08,
-	VMCS_FIELD_HOST_TR_BASE = 0x00006c0a,
-	VMCS_FIELD_HOST_GDTR_BASE = 0x00006c0c,
-	VMCS_FIELD_HOST_IDTR_BASE = 0x00006c0e,
-	VMCS_FIELD_HOST_SYSENTER_ESP = 0x00006c10,
-	VMCS_FIELD_HOST_SYSENTER_EIP = 0x00006c12,
-	VMCS_FIELD_HOST_RSP = 0x00006c14,
-	VMCS_FIELD_HOST_RIP = 0x00006c16,
+#define X(FieldName, Encoding) FieldName = Encoding,
+	VMCS_FIELDS_16BIT
+	VMCS_FIELDS_32BIT
+	VMCS_FIELDS_NATURAL
+#undef X
+#define X(FieldName, Encoding) FieldName##_FULL = Encoding, FieldName##_HIGH = (Encoding) + 1,
+	VMCS_FIELDS_64BIT
+#undef X
 } VMCS_FIELD_ENCODING, *PVMCS_FIELD_ENCODING;
 
+// Each list must only hold fields of its width
+#define X(FieldName, Encoding) C_ASSERT(VMCS_FIELD_WIDTH_16BIT == VMCS_FIELD_WIDTH_OF(Encoding));
+VMCS_FIELDS_16BIT
+#undef X
+#define X(FieldName, Encoding) C_ASSERT((VMCS_FIELD_WIDTH_64BIT == VMCS_FIELD_WIDTH_OF(Encoding)) \
+	&& !VMCS_FIELD_ACCESS_HIGH(Encoding));
+VMCS_FIELDS_64BIT
+#undef X
+#define X(FieldName, Encoding) C_ASSERT(VMCS_FIELD_WIDTH_32BIT == VMCS_FIELD_WIDTH_OF(Encoding));
+VMCS_FIELDS_32BIT
+#undef X
+#define X(FieldName, Encoding) C_ASSERT(VMCS_FIELD_WIDTH_NATURAL == VMCS_FIELD_WIDTH_OF(Encoding));
+VMCS_FIELDS_NATURAL
+#undef X
+
+// Dense index of every VMCS field, the two accesses of a 64-bit field share one
+typedef enum _VMCS_FIELD_INDEX
+{
+#define X(FieldName, Encoding) FieldName##_INDEX,
+	VMCS_FIELDS_16BIT
+	VMCS_FIELDS_64BIT
+	VMCS_FIELDS_32BIT
+	VMCS_FIELDS_NATURAL
+#undef X
+	VMCS_FIELD_INDEX_COUNT
+} VMCS_FIELD_INDEX, *PVMCS_FIELD_INDEX;
+
+// Metadata of a VMCS field
+typedef struct _VMCS_FIELD_INFO
+{
+	VMCS_FIELD_ENCODING eEncoding;	// Encoding of the field (of its full access for 64-bit fields)
+	VMCS_FIELD_WIDTH eWidth;
+	VMCS_FIELD_TYPE eType;
+	LPCSTR pszName;
+} VMCS_FIELD_INFO, *PVMCS_FIELD_INFO;
+
 // Vol 3B, Table I-1. Basic Exit Reasons
 typedef enum _VMEXIT_REASON
 {
@@ -403,7 +444,15 @@ typedef struct _VMX_PROCBASED_CTLS2
 									//			in real - address mode
 	UINT32 reserved0 : 2;			// 8-9
 	UINT32 PauseLoopExit : 1;		// 10		A series of executions of PAUSE can cause a VM exit
-	UINT32 reserved1 : 21;			// 11-31
+	UINT32 RdrandExit : 1;			// 11		RDRAND causes a VM exit
+	UINT32 EnableInvpcid : 1;		// 12		When clear INVPCID causes an Invalid Opcode fault
+	UINT32 EnableVmFunctions : 1;	// 13		VMFUNC is enabled in VMX non-root operation
+	UINT32 VmcsShadowing : 1;		// 14		VMREAD and VMWRITE may access the shadow VMCS
+	UINT32 EnclsExit : 1;			// 15		ENCLS may cause a VM exit
+	UINT32 RdseedExit : 1;			// 16		RDSEED causes a VM exit
+	UINT32 EnablePml : 1;			// 17		Writes setting an EPT dirty flag log the
+									//			guest-physical address to the PML log
+	UINT32 reserved1 : 14;			// 18-31
 } VMX_PROCBASED_CTLS2, *PVMX_PROCBASED_CTLS2;
 C_ASSERT(sizeof(UINT32) == sizeof(VMX_PROCBASED_CTLS2));
 
@@ -493,8 +542,275 @@ typedef struct DECLSPEC_ALIGN(PAGE_SIZE) _VMX_MSR_BITMAPS
 } VMX_MSR_BITMAPS, *PVMX_MSR_BITMAPS;
 C_ASSERT(PAGE_SIZE == sizeof(VMX_MSR_BITMAPS));
 
-// TODO:	Add EPT structures. Vol 3B only contains EPTP and it's format
-//			seems to be different from other projects seen...
+// Vol 3B, 21.6.11 Extended-Page-Table Pointer (EPTP)
+typedef union _EPTP
+{
+	UINT64 qwValue;
+	struct {
+		UINT64 memType : 3;			// 0-2		EPT paging-structure memory type (0 = UC, 6 = WB)
+		UINT64 walkLength : 3;		// 3-5		EPT page-walk length minus 1 (must be 3)
+		UINT64 accessDirty : 1;		// 6		Enables accessed and dirty flags for EPT
+		UINT64 reserved0 : 5;		// 7-11
+		UINT64 addr : 40;			// 12-51	Physical address of the EPT PML4 table
+		UINT64 reserved1 : 12;		// 52-63
+	};
+} EPTP, *PEPTP;
+C_ASSERT(sizeof(UINT64) == sizeof(EPTP));
+
+// Field descriptors, see field64.h
+#define EPTP_FIELD_LIST(X) \
+	X(EPTP, MEMTYPE,		0,	3) \
+	X(EPTP, WALKLENGTH,		3,	3) \
+	X(EPTP, ACCESSDIRTY,	6,	1) \
+	X(EPTP, RESERVED0,		7,	5) \
+	X(EPTP, ADDR,			12,	40) \
+	X(EPTP, RESERVED1,		52,	12)
+FIELD64_DECLARE(EPTP, EPTP_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(EPTP_FIELD_LIST, 64);
+
+#define EPT_PAGE_WALK_LENGTH_4	3
+
+// Vol 3B, 25.2.2 EPT Translation Mechanism
+// An EPT entry is present if any of its read/write/execute bits is set
+#define EPT_ACCESS_READ		0x1ULL
+#define EPT_ACCESS_WRITE	0x2ULL
+#define EPT_ACCESS_EXECUTE	0x4ULL
+#define EPT_ACCESS_ALL		(EPT_ACCESS_READ | EPT_ACCESS_WRITE | EPT_ACCESS_EXECUTE)
+#define EPT_ENTRY_PAGE_SIZE	0x80ULL	// Maps a page rather than a table (PDPTE/PDE only)
+#define EPT_ENTRY_PRESENT(qwEntry)	(0 != ((qwEntry) & EPT_ACCESS_ALL))
+#define EPT_IS_LEAF(qwEntry) \
+	(EPT_ENTRY_PRESENT(qwEntry) && (0 != ((qwEntry) & EPT_ENTRY_PAGE_SIZE)))
+#define EPT_IS_TABLE(qwEntry) \
+	(EPT_ENTRY_PRESENT(qwEntry) && (0 == ((qwEntry) & EPT_ENTRY_PAGE_SIZE)))
+
+// Table 25-1. Format of an EPT PML4 Entry
+typedef struct _EPT_PML4E
+{
+	UINT64 r : 1;			// 0		Read access
+	UINT64 w : 1;			// 1		Write access
+	UINT64 x : 1;			// 2		Execute access (supervisor-mode with mode-based execute)
+	UINT64 reserved0 : 5;	// 3-7
+	UINT64 a : 1;			// 8		Accessed, if EPTP.accessDirty = 1
+	UINT64 ignored0 : 1;	// 9
+	UINT64 xu : 1;			// 10		User-mode execute access, if mode-based execute control = 1
+	UINT64 ignored1 : 1;	// 11
+	UINT64 addr : 40;		// 12-51	Physical address of the EPT page-directory-pointer table
+	UINT64 ignored2 : 12;	// 52-63
+} EPT_PML4E, *PEPT_PML4E;
+C_ASSERT(sizeof(UINT64) == sizeof(EPT_PML4E));
+
+// Field descriptors, see field64.h
+#define EPT_PML4E_FIELD_LIST(X) \
+	X(EPT_PML4E, READ,		0,	1) \
+	X(EPT_PML4E, WRITE,		1,	1) \
+	X(EPT_PML4E, EXECUTE,	2,	1) \
+	X(EPT_PML4E, RESERVED0,	3,	5) \
+	X(EPT_PML4E, A,			8,	1) \
+	X(EPT_PML4E, IGNORED0,	9,	1) \
+	X(EPT_PML4E, XU,		10,	1) \
+	X(EPT_PML4E, IGNORED1,	11,	1) \
+	X(EPT_PML4E, ADDR,		12,	40) \
+	X(EPT_PML4E, IGNORED2,	52,	12)
+FIELD64_DECLARE(EPT_PML4E, EPT_PML4E_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(EPT_PML4E_FIELD_LIST, 64);
+
+// Table 25-2. Format of an EPT Page-Directory-Pointer-Table Entry (PDPTE) that Maps a 1-GByte Page
+typedef struct _EPT_PDPTE1G
+{
+	UINT64 r : 1;			// 0		Read access
+	UINT64 w : 1;			// 1		Write access
+	UINT64 x : 1;			// 2		Execute access
+	UINT64 memType : 3;		// 3-5		EPT memory type of the page
+	UINT64 ipat : 1;		// 6		Ignore PAT memory type
+	UINT64 ps : 1;			// 7		Page-Size; must be 1 to map a 1GB page
+	UINT64 a : 1;			// 8		Accessed, if EPTP.accessDirty = 1
+	UINT64 d : 1;			// 9		Dirty, if EPTP.accessDirty = 1
+	UINT64 xu : 1;			// 10		User-mode execute access, if mode-based execute control = 1
+	UINT64 ignored0 : 1;	// 11
+	UINT64 reserved0 : 18;	// 12-29
+	UINT64 addr : 22;		// 30-51	Physical address of the 1GB page
+	UINT64 ignored1 : 11;	// 52-62
+	UINT64 sve : 1;			// 63		Suppress #VE
+} EPT_PDPTE1G, *PEPT_PDPTE1G;
+C_ASSERT(sizeof(UINT64) == sizeof(EPT_PDPTE1G));
+
+// Field descriptors, see field64.h
+#define EPT_PDPTE1G_FIELD_LIST(X) \
+	X(EPT_PDPTE1G, READ,		0,	1) \
+	X(EPT_PDPTE1G, WRITE,		1,	1) \
+	X(EPT_PDPTE1G, EXECUTE,		2,	1) \
+	X(EPT_PDPTE1G, MEMTYPE,		3,	3) \
+	X(EPT_PDPTE1G, IPAT,		6,	1) \
+	X(EPT_PDPTE1G, PS,			7,	1) \
+	X(EPT_PDPTE1G, A,			8,	1) \
+	X(EPT_PDPTE1G, D,			9,	1) \
+	X(EPT_PDPTE1G, XU,			10,	1) \
+	X(EPT_PDPTE1G, IGNORED0,	11,	1) \
+	X(EPT_PDPTE1G, RESERVED0,	12,	18) \
+	X(EPT_PDPTE1G, ADDR,		30,	22) \
+	X(EPT_PDPTE1G, IGNORED1,	52,	11) \
+	X(EPT_PDPTE1G, SVE,			63,	1)
+FIELD64_DECLARE(EPT_PDPTE1G, EPT_PDPTE1G_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(EPT_PDPTE1G_FIELD_LIST, 64);
+
+// Table 25-3. Format of an EPT Page-Directory-Pointer-Table Entry (PDPTE) that References an EPT Page Directory
+// Table 25-5. Format of an EPT Page-Directory Entry that References an EPT Page Table
+typedef struct _EPT_TABLE_ENTRY
+{
+	UINT64 r : 1;			// 0		Read access
+	UINT64 w : 1;			// 1		Write access
+	UINT64 x : 1;			// 2		Execute access
+	UINT64 reserved0 : 4;	// 3-6
+	UINT64 ps : 1;			// 7		Page-Size; must be 0 to reference a table
+	UINT64 a : 1;			// 8		Accessed, if EPTP.accessDirty = 1
+	UINT64 ignored0 : 1;	// 9
+	UINT64 xu : 1;			// 10		User-mode execute access, if mode-based execute control = 1
+	UINT64 ignored1 : 1;	// 11
+	UINT64 addr : 40;		// 12-51	Physical address of the EPT page directory/page table
+	UINT64 ignored2 : 12;	// 52-63
+} EPT_TABLE_ENTRY, EPT_PDPTE, *PEPT_PDPTE, EPT_PDE, *PEPT_PDE;
+C_ASSERT(sizeof(UINT64) == sizeof(EPT_TABLE_ENTRY));
+
+// Field descriptors, see field64.h
+#define EPT_PDE_FIELD_LIST(X) \
+	X(EPT_PDE, READ,		0,	1) \
+	X(EPT_PDE, WRITE,		1,	1) \
+	X(EPT_PDE, EXECUTE,		2,	1) \
+	X(EPT_PDE, RESERVED0,	3,	4) \
+	X(EPT_PDE, PS,			7,	1) \
+	X(EPT_PDE, A,			8,	1) \
+	X(EPT_PDE, IGNORED0,	9,	1) \
+	X(EPT_PDE, XU,			10,	1) \
+	X(EPT_PDE, IGNORED1,	11,	1) \
+	X(EPT_PDE, ADDR,		12,	40) \
+	X(EPT_PDE, IGNORED2,	52,	12)
+FIELD64_DECLARE(EPT_PDE, EPT_PDE_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(EPT_PDE_FIELD_LIST, 64);
+
+// Table 25-4. Format of an EPT Page-Directory Entry (PDE) that Maps a 2-MByte Page
+typedef struct _EPT_PDE2MB
+{
+	UINT64 r : 1;			// 0		Read access
+	UINT64 w : 1;			// 1		Write access
+	UINT64 x : 1;			// 2		Execute access
+	UINT64 memType : 3;		// 3-5		EPT memory type of the page
+	UINT64 ipat : 1;		// 6		Ignore PAT memory type
+	UINT64 ps : 1;			// 7		Page-Size; must be 1 to map a 2MB page
+	UINT64 a : 1;			// 8		Accessed, if EPTP.accessDirty = 1
+	UINT64 d : 1;			// 9		Dirty, if EPTP.accessDirty = 1
+	UINT64 xu : 1;			// 10		User-mode execute access, if mode-based execute control = 1
+	UINT64 ignored0 : 1;	// 11
+	UINT64 reserved0 : 9;	// 12-20
+	UINT64 addr : 31;		// 21-51	Physical address of the 2MB page
+	UINT64 ignored1 : 11;	// 52-62
+	UINT64 sve : 1;			// 63		Suppress #VE
+} EPT_PDE2MB, *PEPT_PDE2MB;
+C_ASSERT(sizeof(UINT64) == sizeof(EPT_PDE2MB));
+
+// Field descriptors, see field64.h
+#define EPT_PDE2MB_FIELD_LIST(X) \
+	X(EPT_PDE2MB, READ,			0,	1) \
+	X(EPT_PDE2MB, WRITE,		1,	1) \
+	X(EPT_PDE2MB, EXECUTE,		2,	1) \
+	X(EPT_PDE2MB, MEMTYPE,		3,	3) \
+	X(EPT_PDE2MB, IPAT,			6,	1) \
+	X(EPT_PDE2MB, PS,			7,	1) \
+	X(EPT_PDE2MB, A,			8,	1) \
+	X(EPT_PDE2MB, D,			9,	1) \
+	X(EPT_PDE2MB, XU,			10,	1) \
+	X(EPT_PDE2MB, IGNORED0,		11,	1) \
+	X(EPT_PDE2MB, RESERVED0,	12,	9) \
+	X(EPT_PDE2MB, ADDR,			21,	31) \
+	X(EPT_PDE2MB, IGNORED1,		52,	11) \
+	X(EPT_PDE2MB, SVE,			63,	1)
+FIELD64_DECLARE(EPT_PDE2MB, EPT_PDE2MB_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(EPT_PDE2MB_FIELD_LIST, 64);
+
+// Table 25-6. Format of an EPT Page-Table Entry that Maps a 4-KByte Page
+typedef struct _EPT_PTE
+{
+	UINT64 r : 1;			// 0		Read access
+	UINT64 w : 1;			// 1		Write access
+	UINT64 x : 1;			// 2		Execute access
+	UINT64 memType : 3;		// 3-5		EPT memory type of the page
+	UINT64 ipat : 1;		// 6		Ignore PAT memory type
+	UINT64 ignored0 : 1;	// 7
+	UINT64 a : 1;			// 8		Accessed, if EPTP.accessDirty = 1
+	UINT64 d : 1;			// 9		Dirty, if EPTP.accessDirty = 1
+	UINT64 xu : 1;			// 10		User-mode execute access, if mode-based execute control = 1
+	UINT64 ignored1 : 1;	// 11
+	UINT64 addr : 40;		// 12-51	Physical address of the 4KB page
+	UINT64 ignored2 : 11;	// 52-62
+	UINT64 sve : 1;			// 63		Suppress #VE
+} EPT_PTE, *PEPT_PTE;
+C_ASSERT(sizeof(UINT64) == sizeof(EPT_PTE));
+
+// Field descriptors, see field64.h
+#define EPT_PTE_FIELD_LIST(X) \
+	X(EPT_PTE, READ,		0,	1) \
+	X(EPT_PTE, WRITE,		1,	1) \
+	X(EPT_PTE, EXECUTE,		2,	1) \
+	X(EPT_PTE, MEMTYPE,		3,	3) \
+	X(EPT_PTE, IPAT,		6,	1) \
+	X(EPT_PTE, IGNORED0,	7,	1) \
+	X(EPT_PTE, A,			8,	1) \
+	X(EPT_PTE, D,			9,	1) \
+	X(EPT_PTE, XU,			10,	1) \
+	X(EPT_PTE, IGNORED1,	11,	1) \
+	X(EPT_PTE, ADDR,		12,	40) \
+	X(EPT_PTE, IGNORED2,	52,	11) \
+	X(EPT_PTE, SVE,			63,	1)
+FIELD64_DECLARE(EPT_PTE, EPT_PTE_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(EPT_PTE_FIELD_LIST, 64);
+
+// An EPT PDPTE either maps a 1GB page or references a page directory, according to ps
+typedef union _EPT_PDPTE_ANY
+{
+	UINT64 qwValue;
+	EPT_PDPTE tTable;
+	EPT_PDPTE1G tLeaf;
+} EPT_PDPTE_ANY, *PEPT_PDPTE_ANY;
+C_ASSERT(sizeof(UINT64) == sizeof(EPT_PDPTE_ANY));
+
+// An EPT PDE either maps a 2MB page or references a page table, according to ps
+typedef union _EPT_PDE_ANY
+{
+	UINT64 qwValue;
+	EPT_PDE tTable;
+	EPT_PDE2MB tLeaf;
+} EPT_PDE_ANY, *PEPT_PDE_ANY;
+C_ASSERT(sizeof(UINT64) == sizeof(EPT_PDE_ANY));
+
+// Vol 3C, 30.3 INVEPT - Invalidate Translations Derived from EPT
+typedef enum _INVEPT_TYPE
+{
+	INVEPT_SINGLE_CONTEXT = 1,	// Mappings associated with the EPTP of the descriptor
+	INVEPT_ALL_CONTEXT = 2,		// Mappings associated with all EPTPs
+} INVEPT_TYPE, *PINVEPT_TYPE;
+
+typedef struct _INVEPT_DESCRIPTOR
+{
+	EPTP tEptp;
+	UINT64 reserved0;
+} INVEPT_DESCRIPTOR, *PINVEPT_DESCRIPTOR;
+C_ASSERT(2 * sizeof(UINT64) == sizeof(INVEPT_DESCRIPTOR));
+
+// Vol 3C, 30.3 INVVPID - Invalidate Translations Based on VPID
+typedef enum _INVVPID_TYPE
+{
+	INVVPID_INDIVIDUAL_ADDRESS = 0,					// A linear address of the descriptor's VPID
+	INVVPID_SINGLE_CONTEXT = 1,						// All mappings of the descriptor's VPID
+	INVVPID_ALL_CONTEXT = 2,						// All mappings of all VPIDs but 0
+	INVVPID_SINGLE_CONTEXT_RETAINING_GLOBALS = 3,	// Same as single-context, except global translations
+} INVVPID_TYPE, *PINVVPID_TYPE;
+
+typedef struct _INVVPID_DESCRIPTOR
+{
+	UINT64 vpid : 16;		// 0-15
+	UINT64 reserved0 : 48;	// 16-63
+	UINT64 qwLinearAddress;	// Individual-address invalidations only
+} INVVPID_DESCRIPTOR, *PINVVPID_DESCRIPTOR;
+C_ASSERT(2 * sizeof(UINT64) == sizeof(INVVPID_DESCRIPTOR));
 
 typedef enum _VMX_OPCODE_RC
 {
@@ -551,6 +867,121 @@ VTX_GetVmInstructionErrorMsg(
 	_In_ const VM_INSTRUCTION_ERROR eVmError
 );
 
+/**
+* Get the dense index of a VMCS field
+* @param eField - encoding of the field, either access of a 64-bit field
+* @return Index of the field, or VMCS_FIELD_INDEX_COUNT if the encoding is unknown
+*/
+VMCS_FIELD_INDEX
+VTX_GetVmcsFieldIndex(
+	_In_ const VMCS_FIELD_ENCODING eField
+);
+
+/**
+* Get the metadata of a VMCS field
+* @param eIndex - dense index of the field
+* @return Metadata of the field
+*/
+const VMCS_FIELD_INFO*
+VTX_GetVmcsFieldInfo(
+	_In_ const VMCS_FIELD_INDEX eIndex
+);
+
+/**
+* Read a VMCS field of a given width from the current VMCS.
+* Prefer the VMX_VMREAD* macros, that check the field's width at build time.
+* @param eField - encoding of the field
+* @param pwValue/pdwValue/pqwValue/pcbValue - receives the field's value
+* @return VMX_SUCCESS on success
+*/
+VMX_OPCODE_RC
+VmxVmread16(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT16						pwValue
+);
+
+VMX_OPCODE_RC
+VmxVmread32(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT32						pdwValue
+);
+
+VMX_OPCODE_RC
+VmxVmread64(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT64						pqwValue
+);
+
+VMX_OPCODE_RC
+VmxVmreadNatural(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_Out_	PSIZE_T						pcbValue
+);
+
+/**
+* Write a VMCS field of a given width in the current VMCS.
+* Prefer the VMX_VMWRITE* macros, that check the field's width and type at build time.
+* @param eField - encoding of the field
+* @param wValue/dwValue/qwValue/cbValue - value to write
+* @return VMX_SUCCESS on success
+*/
+VMX_OPCODE_RC
+VmxVmwrite16(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_In_	const UINT16				wValue
+);
+
+VMX_OPCODE_RC
+VmxVmwrite32(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_In_	const UINT32				dwValue
+);
+
+VMX_OPCODE_RC
+VmxVmwrite64(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_In_	const UINT64				qwValue
+);
+
+VMX_OPCODE_RC
+VmxVmwriteNatural(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_In_	const SIZE_T				cbValue
+);
+
+// Evaluates to 0, and fails the build if bCondition is FALSE. bCondition must
+// be a constant expression, so the checked macros below take constant fields only
+#define VMX_BUILD_CHECK(bCondition)	(0 * sizeof(char[(bCondition) ? 1 : -1]))
+
+// Width of a field that VMX_VMREAD64/VMX_VMWRITE64 accept: full access of a 64-bit field
+#define VMX_IS_FULL_64BIT_FIELD(eField) \
+	((VMCS_FIELD_WIDTH_64BIT == VMCS_FIELD_WIDTH_OF(eField)) && !VMCS_FIELD_ACCESS_HIGH(eField))
+
+// Writes to VM-exit information fields fail unless IA32_VMX_MISC[29] is set
+#define VMX_IS_WRITABLE_FIELD(eField)	(VMCS_FIELD_TYPE_READ_ONLY != VMCS_FIELD_TYPE_OF(eField))
+
+// Access a constant VMCS field with a value of its exact width, a field of another
+// width (or a write to a read-only field) doesn't build
+#define VMX_VMREAD16(eField, pwValue) ((VMX_OPCODE_RC)(VmxVmread16((eField), (pwValue)) \
+	+ VMX_BUILD_CHECK(VMCS_FIELD_WIDTH_16BIT == VMCS_FIELD_WIDTH_OF(eField))))
+#define VMX_VMREAD32(eField, pdwValue) ((VMX_OPCODE_RC)(VmxVmread32((eField), (pdwValue)) \
+	+ VMX_BUILD_CHECK(VMCS_FIELD_WIDTH_32BIT == VMCS_FIELD_WIDTH_OF(eField))))
+#define VMX_VMREAD64(eField, pqwValue) ((VMX_OPCODE_RC)(VmxVmread64((eField), (pqwValue)) \
+	+ VMX_BUILD_CHECK(VMX_IS_FULL_64BIT_FIELD(eField))))
+#define VMX_VMREAD_NATURAL(eField, pcbValue) ((VMX_OPCODE_RC)(VmxVmreadNatural((eField), (pcbValue)) \
+	+ VMX_BUILD_CHECK(VMCS_FIELD_WIDTH_NATURAL == VMCS_FIELD_WIDTH_OF(eField))))
+#define VMX_VMWRITE16(eField, wValue) ((VMX_OPCODE_RC)(VmxVmwrite16((eField), (wValue)) \
+	+ VMX_BUILD_CHECK((VMCS_FIELD_WIDTH_16BIT == VMCS_FIELD_WIDTH_OF(eField)) \
+		&& VMX_IS_WRITABLE_FIELD(eField))))
+#define VMX_VMWRITE32(eField, dwValue) ((VMX_OPCODE_RC)(VmxVmwrite32((eField), (dwValue)) \
+	+ VMX_BUILD_CHECK((VMCS_FIELD_WIDTH_32BIT == VMCS_FIELD_WIDTH_OF(eField)) \
+		&& VMX_IS_WRITABLE_FIELD(eField))))
+#define VMX_VMWRITE64(eField, qwValue) ((VMX_OPCODE_RC)(VmxVmwrite64((eField), (qwValue)) \
+	+ VMX_BUILD_CHECK(VMX_IS_FULL_64BIT_FIELD(eField) && VMX_IS_WRITABLE_FIELD(eField))))
+#define VMX_VMWRITE_NATURAL(eField, cbValue) ((VMX_OPCODE_RC)(VmxVmwriteNatural((eField), (cbValue)) \
+	+ VMX_BUILD_CHECK((VMCS_FIELD_WIDTH_NATURAL == VMCS_FIELD_WIDTH_OF(eField)) \
+		&& VMX_IS_WRITABLE_FIELD(eField))))
+
 // Vol 3B, 27.5 VMM SETUP & TEAR DOWN
 /**
 * Adjust the value of CR0 according to the FIXED MSRs
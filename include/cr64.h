@@ -28,7 +28,9 @@
 #ifndef __INTEL_CR64_H__
 #define __INTEL_CR64_H__
 
-#include <ntddk.h>
+#include "ntshim.h"
+
+#include "field64.h"
 
 // Disable 'warning C4214: nonstandard extension used: bit field types other than int'
 // Disable 'warning C4201: nonstandard extension used: nameless struct/union'
@@ -59,6 +61,25 @@ typedef union _CR0_REG
 } CR0_REG, *PCR0_REG;
 C_ASSERT(sizeof(UINT32) == sizeof(CR0_REG));
 
+// Field descriptors, see field64.h
+#define CR0_FIELD_LIST(X) \
+	X(CR0, PE,			0,	1) \
+	X(CR0, MP,			1,	1) \
+	X(CR0, EM,			2,	1) \
+	X(CR0, TS,			3,	1) \
+	X(CR0, ET,			4,	1) \
+	X(CR0, NE,			5,	1) \
+	X(CR0, RESERVED0,	6,	10) \
+	X(CR0, WP,			16,	1) \
+	X(CR0, RESERVED1,	17,	1) \
+	X(CR0, AM,			18,	1) \
+	X(CR0, RESERVED2,	19,	10) \
+	X(CR0, NW,			29,	1) \
+	X(CR0, CD,			30,	1) \
+	X(CR0, PG,			31,	1)
+FIELD64_DECLARE(CR0, CR0_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(CR0_FIELD_LIST, 32);
+
 // Figure 2-7. Control Registers
 typedef union _CR4_REG
 {
@@ -91,6 +112,33 @@ typedef union _CR4_REG
 } CR4_REG, *PCR4_REG;
 C_ASSERT(sizeof(UINT32) == sizeof(CR4_REG));
 
+// Field descriptors, see field64.h
+#define CR4_FIELD_LIST(X) \
+	X(CR4, VME,			0,	1) \
+	X(CR4, PVI,			1,	1) \
+	X(CR4, TSD,			2,	1) \
+	X(CR4, DE,			3,	1) \
+	X(CR4, PSE,			4,	1) \
+	X(CR4, PAE,			5,	1) \
+	X(CR4, MCE,			6,	1) \
+	X(CR4, PGE,			7,	1) \
+	X(CR4, PCE,			8,	1) \
+	X(CR4, OSFXSR,		9,	1) \
+	X(CR4, OSXMMEXCPT,	10,	1) \
+	X(CR4, RESERVED0,	11,	2) \
+	X(CR4, VMXE,		13,	1) \
+	X(CR4, SMXE,		14,	1) \
+	X(CR4, RESERVED1,	15,	2) \
+	X(CR4, PCIDE,		17,	1) \
+	X(CR4, OSXSAVE,		18,	1) \
+	X(CR4, RESERVED2,	19,	1) \
+	X(CR4, SMEP,		20,	1) \
+	X(CR4, SMAP,		21,	1) \
+	X(CR4, PKE,			22,	1) \
+	X(CR4, RESERVED3,	23,	9)
+FIELD64_DECLARE(CR4, CR4_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(CR4_FIELD_LIST, 32);
+
 typedef union _CR3_REG
 {
 	UINT64 qwValue;
@@ -112,5 +160,22 @@ typedef union _CR3_REG
 } CR3_REG, *PCR3_REG;
 C_ASSERT(sizeof(UINT64) == sizeof(CR3_REG));
 
+// Field descriptors of CR3 with CR4.PCIDE = 0 (Table 4-12), see field64.h
+#define CR3_FIELD_LIST(X) \
+	X(CR3, RESERVED0,	0,	3) \
+	X(CR3, PWT,			3,	1) \
+	X(CR3, PCD,			4,	1) \
+	X(CR3, RESERVED1,	5,	7) \
+	X(CR3, PML4,		12,	52)
+FIELD64_DECLARE(CR3, CR3_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(CR3_FIELD_LIST, 64);
+
+// Field descriptors of CR3 with CR4.PCIDE = 1 (Table 4-13)
+#define CR3_PCID_FIELD_LIST(X) \
+	X(CR3_PCID, PCID,	0,	12) \
+	X(CR3_PCID, PML4,	12,	52)
+FIELD64_DECLARE(CR3_PCID, CR3_PCID_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(CR3_PCID_FIELD_LIST, 64);
+
 #pragma warning(pop)
 #endif /* __INTEL_CR64_H__ */
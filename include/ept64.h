@@ -0,0 +1,306 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ept64.h
+* @section	Extended page table hierarchies identity mapping guest-physical memory
+*			See Intel's: Software Developers Manual Vol 3B, Section 25.2 THE EXTENDED PAGE TABLE MECHANISM (EPT)
+*/
+
+#ifndef __INTEL_EPT64_H__
+#define __INTEL_EPT64_H__
+
+#include <ntddk.h>
+
+#include "VT-x.h"
+#include "pagetable64.h"
+
+// A 4-level EPT translates 48-bit guest-physical addresses
+#define EPT64_GUEST_PHYSICAL_LIMIT	(1ULL << 48)
+
+// Range of guest-physical memory and the memory type of its pages
+typedef struct _EPT64_RANGE
+{
+	UINT64 qwBase;
+	UINT64 qwSize;
+	IA32_PAT_MEMTYPE eMemoryType;	// EPT memory types share the PAT encoding, except UCM
+} EPT64_RANGE, *PEPT64_RANGE;
+
+// EPT hierarchy whose tables are owned by an allocator
+typedef struct _EPT64_HIERARCHY
+{
+	PAGING64_TABLE_ALLOCATOR tAllocator;
+	PEPT_PML4E ptPml4;
+	UINT64 qwPml4PhysicalAddress;
+	UINT32 dwTablePages;					// Number of tables, including the PML4
+	UINT64 aqwLeafCount[PAGE_TYPES_COUNT];	// Number of leaf entries per page type
+	IA32_VMX_EPT_VPID_CAP tCapabilities;	// Decides the page sizes and EPTP fields used
+} EPT64_HIERARCHY, *PEPT64_HIERARCHY;
+
+// Pages kept ready per CPU for splits. Splitting a 1GB leaf down to 4KB takes 2.
+#define EPT64_SPLIT_RING_SIZE	16
+#define EPT64_SPLIT_RING_MASK	(EPT64_SPLIT_RING_SIZE - 1)
+C_ASSERT(0 == (EPT64_SPLIT_RING_SIZE & EPT64_SPLIT_RING_MASK));
+
+#define EPT64_SPLIT_POOL_MAX_CPUS	256
+
+// A table page in a split ring
+typedef struct _EPT64_SPLIT_PAGE
+{
+	PUINT64 pqwTable;
+	UINT64 qwPhysicalAddress;
+	UINT64 qwGeneration;	// Retired tables only: invalidation generation of the merge
+} EPT64_SPLIT_PAGE, *PEPT64_SPLIT_PAGE;
+
+// Single-producer single-consumer ring, so neither side ever waits for the other
+typedef struct _EPT64_SPLIT_RING
+{
+	volatile LONG lHead;	// Next slot taken by the consumer
+	volatile LONG lTail;	// Next slot filled by the producer
+	EPT64_SPLIT_PAGE atPages[EPT64_SPLIT_RING_SIZE];
+} EPT64_SPLIT_RING, *PEPT64_SPLIT_RING;
+
+// The exit handler of a CPU consumes tFree and produces tRetired,
+// Ept64SplitPoolRefill does the opposite
+typedef struct DECLSPEC_CACHEALIGN _EPT64_SPLIT_CPU
+{
+	EPT64_SPLIT_RING tFree;				// Pages ready for splits
+	EPT64_SPLIT_RING tRetired;			// Tables released by merges
+	volatile LONG64 qwFlushedGeneration;	// Last generation this CPU invalidated
+} EPT64_SPLIT_CPU, *PEPT64_SPLIT_CPU;
+
+// Preallocated table pages for splitting and merging the leaves of an EPT
+// hierarchy from VM-exit handlers, without calling the allocator.
+// Every split and merge advances the invalidation generation, and each CPU
+// must INVEPT before its next VM entry once its flushed generation is behind.
+// A merged table is only reused after every CPU has flushed past its merge.
+typedef struct _EPT64_SPLIT_POOL
+{
+	PEPT64_HIERARCHY ptEpt;
+	UINT32 dwCpuCount;
+	volatile LONG lRefillLock;			// Serializes the refills
+	volatile LONG64 qwGeneration;		// Bumped by every split and merge
+	EPT64_SPLIT_CPU atCpus[EPT64_SPLIT_POOL_MAX_CPUS];
+} EPT64_SPLIT_POOL, *PEPT64_SPLIT_POOL;
+
+/**
+* Initialize an empty EPT hierarchy
+* @param ptEpt - hierarchy to initialize
+* @param ptAllocator - source of the table pages
+* @param tCapabilities - value of MSR_CODE_IA32_VMX_EPT_VPID_CAP
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_SUPPORTED if the processor doesn't support 4-level EPT walks
+*		  STATUS_INSUFFICIENT_RESOURCES if the PML4 couldn't be allocated
+*/
+NTSTATUS
+Ept64HierarchyInit(
+	_Out_	PEPT64_HIERARCHY			ptEpt,
+	_In_	PPAGING64_TABLE_ALLOCATOR	ptAllocator,
+	_In_	IA32_VMX_EPT_VPID_CAP		tCapabilities
+);
+
+/**
+* Release all the tables of an EPT hierarchy.
+* The EPT must not be in use by any logical processor.
+* @param ptEpt - hierarchy to destroy
+*/
+VOID
+Ept64HierarchyDestroy(
+	_Inout_ PEPT64_HIERARCHY ptEpt
+);
+
+/**
+* Identity map guest-physical ranges with the largest pages the capabilities
+* allow: 1GB leaves where 1GB alignment allows (support1gb), 2MB leaves where
+* 2MB alignment allows (support2mb) and 4KB leaves at the unaligned edges.
+* A page never straddles two ranges, so every page gets its range's memory type.
+* Ranges are rounded out to 4KB, memory already mapped by the hierarchy is kept as is.
+* On failure the hierarchy may be partially built and should be destroyed.
+* @param ptEpt - hierarchy to map the ranges in
+* @param ptRanges - guest-physical ranges to map
+* @param dwRangeCount - number of ranges
+* @param qwAccess - EPT_ACCESS_* rights of the mapped pages
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if a range is beyond EPT64_GUEST_PHYSICAL_LIMIT,
+*		  a memory type is invalid or the access rights are a misconfiguration
+*		  STATUS_INSUFFICIENT_RESOURCES if a table couldn't be allocated
+*/
+NTSTATUS
+Ept64BuildIdentityMap(
+	_Inout_						PEPT64_HIERARCHY	ptEpt,
+	_In_reads_(dwRangeCount)	const EPT64_RANGE*	ptRanges,
+	_In_						UINT32				dwRangeCount,
+	_In_						UINT64				qwAccess
+);
+
+/**
+* Build the EPTP to load in VMCS_FIELD_EPT_POINTER_FULL for a hierarchy.
+* The tables are accessed as WB when supported (UC otherwise), and accessed and
+* dirty flags are enabled when supported.
+* @param ptEpt - hierarchy to point to
+* @return The EPTP
+*/
+EPTP
+Ept64GetEptp(
+	_In_	PEPT64_HIERARCHY	ptEpt
+);
+
+/**
+* Initialize a split pool and fill the rings of all the CPUs.
+* Must be called at an IRQL the hierarchy's allocator supports.
+* @param ptPool - pool to initialize
+* @param ptEpt - hierarchy the pool splits and merges, whose allocator fills the pool
+* @param dwCpuCount - number of CPUs using the pool
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if dwCpuCount exceeds EPT64_SPLIT_POOL_MAX_CPUS
+*		  STATUS_INSUFFICIENT_RESOURCES if the pages couldn't be allocated
+*/
+NTSTATUS
+Ept64SplitPoolInit(
+	_Out_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT32				dwCpuCount
+);
+
+/**
+* Top up the free rings of all the CPUs, recycling the retired tables every CPU
+* has flushed and allocating the rest.
+* Must be called at an IRQL the hierarchy's allocator supports, outside VMX root,
+* e.g. from a work item queued when a split reports a low ring.
+* @param ptPool - pool to refill
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES if some ring isn't full
+*/
+NTSTATUS
+Ept64SplitPoolRefill(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool
+);
+
+/**
+* Release all the pages of a split pool.
+* No CPU may use the pool anymore, and the hierarchy must not be in use by any
+* logical processor (retired tables are freed without waiting for an INVEPT).
+* @param ptPool - pool to destroy
+*/
+VOID
+Ept64SplitPoolDestroy(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool
+);
+
+/**
+* Split the large leaves that map a guest-physical address until it's mapped by
+* a page of ePageType or smaller, e.g. before hooking a single 4KB page.
+* The small leaves inherit every attribute of the large one. Each new table is
+* filled before it's published with a single compare-exchange of the parent
+* entry, so other CPUs see either the large leaf or the complete table.
+* Doesn't allocate: runs in bounded time from a VM-exit handler, taking at most
+* 2 pages from the CPU's free ring.
+* Splits and merges of a hierarchy must be serialized by the caller.
+* @param ptPool - pool of the hierarchy
+* @param dwCpu - index of the current CPU
+* @param qwGuestPhysicalAddress - address to map with smaller pages
+* @param ePageType - largest page size allowed to map the address
+* @return STATUS_SUCCESS on success, including when the address is already
+*		  mapped by small enough pages
+*		  STATUS_NOT_FOUND if the address isn't mapped
+*		  STATUS_INSUFFICIENT_RESOURCES if the CPU's free ring doesn't hold enough
+*		  pages, in which case nothing is changed
+*/
+NTSTATUS
+Ept64SplitLeaf(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	UINT32				dwCpu,
+	_In_	UINT64				qwGuestPhysicalAddress,
+	_In_	PAGE_TYPE64			ePageType
+);
+
+/**
+* Replace the table under the entry of ePageType size that maps a guest-physical
+* address with a single large leaf, e.g. once the last hook in it is removed.
+* The 512 entries of the table must be leaves that are contiguous, naturally
+* aligned and identical apart from their accessed and dirty flags, which are
+* combined. The table is retired to the CPU's ring, and reused once every CPU
+* has flushed the merge.
+* Doesn't allocate, and must be serialized with the splits by the caller.
+* @param ptPool - pool of the hierarchy
+* @param dwCpu - index of the current CPU
+* @param qwGuestPhysicalAddress - address mapped by the table
+* @param ePageType - size of the large leaf (PAGE_TYPE_2MB or PAGE_TYPE_1GB)
+* @return STATUS_SUCCESS if the table was replaced
+*		  STATUS_NOT_FOUND if the address isn't mapped by a table of that size
+*		  STATUS_NOT_SUPPORTED if the processor doesn't support pages of that size
+*		  STATUS_UNSUCCESSFUL if the leaves of the table can't be merged
+*		  STATUS_INSUFFICIENT_RESOURCES if the CPU's retired ring is full
+*/
+NTSTATUS
+Ept64MergeTable(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	UINT32				dwCpu,
+	_In_	UINT64				qwGuestPhysicalAddress,
+	_In_	PAGE_TYPE64			ePageType
+);
+
+/**
+* Check whether a CPU must invalidate the hierarchy before its next VM entry,
+* and mark the pending splits and merges as flushed by it.
+* When TRUE is returned the caller must issue a single-context INVEPT with
+* Ept64GetEptp before resuming the guest.
+* @param ptPool - pool of the hierarchy
+* @param dwCpu - index of the current CPU
+* @return TRUE if an INVEPT is needed
+*/
+BOOLEAN
+Ept64SplitPoolTakePendingInvept(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	UINT32				dwCpu
+);
+
+/**
+* Get the number of pages left in the free ring of a CPU
+* @param ptPool - pool of the hierarchy
+* @param dwCpu - index of the CPU
+* @return Number of ready pages
+*/
+UINT32
+Ept64SplitPoolGetFreeCount(
+	_In_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	UINT32				dwCpu
+);
+
+/**
+* Clear the dirty flags of the leaves that map a guest-physical range, so that
+* PML logs the next write to each of their pages again.
+* The flags are cleared atomically, flags the processor sets meanwhile are kept
+* or cleared but never corrupt the entry. Every CPU must INVEPT before the
+* cleared flags are relied on, as cached translations may still be dirty.
+* @param ptEpt - hierarchy mapping the range, with accessed and dirty flags enabled
+* @param qwGuestPhysicalAddress - start of the range
+* @param qwSize - size of the range in bytes
+* @return Number of leaves whose dirty flag was cleared
+*/
+UINT64
+Ept64ClearDirtyFlags(
+	_Inout_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT64				qwGuestPhysicalAddress,
+	_In_	UINT64				qwSize
+);
+
+#endif /* __INTEL_EPT64_H__ */
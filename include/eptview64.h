@@ -0,0 +1,209 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		eptview64.h
+* @section	Multiple EPT views sharing unchanged subtrees, switched with VMFUNC
+*			See Intel's: Software Developers Manual Vol 3C, Section 25.5.6.3 EPTP Switching
+*/
+
+#ifndef __INTEL_EPTVIEW64_H__
+#define __INTEL_EPTVIEW64_H__
+
+#include <ntddk.h>
+
+#include "ept64.h"
+
+// A view per entry of the EPTP list page, view 0 is the base hierarchy
+#define EPTVIEW64_MAX_VIEWS		512
+#define EPTVIEW64_BASE_VIEW		0
+
+// VM-function controls: VM function 0, EPTP switching
+#define EPTVIEW64_VMFUNC_EPTP_SWITCHING	0x1ULL
+
+// Reference counts of the shared tables, kept at most 3/4 full
+#define EPTVIEW64_SHARE_SHIFT	14
+#define EPTVIEW64_SHARE_SLOTS	(1 << EPTVIEW64_SHARE_SHIFT)
+#define EPTVIEW64_SHARE_LIMIT	(EPTVIEW64_SHARE_SLOTS / 4 * 3)
+
+// Number of entries, across all views, referencing a table. Tables missing from
+// the map are referenced by a single entry, their slot is freed when they drop
+// back to it.
+typedef struct _EPTVIEW64_SHARE
+{
+	UINT64 qwPhysicalAddress;	// MAXUINT64 for a free slot
+	UINT64 qwReferences;
+} EPTVIEW64_SHARE, *PEPTVIEW64_SHARE;
+
+// EPT views derived from a base hierarchy. A new view only gets its own PML4,
+// every other table is shared until a view changes a leaf below it, which
+// copies the path from the view's PML4 down to that leaf.
+// Once views exist, the base hierarchy must only be changed through the manager.
+// Not thread-safe, views are created, changed and deleted under the caller's lock.
+typedef struct _EPTVIEW64_MANAGER
+{
+	PEPT64_HIERARCHY ptBase;			// View 0, and the source of the tables
+	PEPTP ptEptpList;					// EPTVIEW64_MAX_VIEWS entries, 0 for a free view
+	UINT64 qwEptpListPhysicalAddress;
+	UINT32 dwViewCount;
+	LONG lTablePages;					// Tables allocated minus tables released by the
+										// manager, the cost of the views over the base
+	UINT32 dwSharedTables;				// Tables referenced more than once
+	EPTVIEW64_SHARE atShares[EPTVIEW64_SHARE_SLOTS];
+} EPTVIEW64_MANAGER, *PEPTVIEW64_MANAGER;
+
+/**
+* Initialize a view manager whose view 0 is an existing hierarchy
+* @param ptManager - manager to initialize
+* @param ptBase - base hierarchy, must outlive the manager
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+NTSTATUS
+EptView64Init(
+	_Out_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	PEPT64_HIERARCHY	ptBase
+);
+
+/**
+* Delete every view but the base one and release the EPTP list.
+* No view may be in use by any logical processor.
+* @param ptManager - manager to destroy
+*/
+VOID
+EptView64Destroy(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager
+);
+
+/**
+* Create a view identical to another one, sharing all its tables
+* @param ptManager - view manager
+* @param dwSourceView - view to copy
+* @param pdwView - receives the index of the new view in the EPTP list
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_FOUND if the source view doesn't exist
+*		  STATUS_INSUFFICIENT_RESOURCES if the list is full, the PML4 couldn't be
+*		  allocated or too many tables are shared
+*/
+NTSTATUS
+EptView64Create(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwSourceView,
+	_Out_	PUINT32				pdwView
+);
+
+/**
+* Remove a view from the EPTP list and release the tables no other view uses.
+* No logical processor may use the view, and its EPTP must be invalidated.
+* @param ptManager - view manager
+* @param dwView - view to delete, not the base view
+* @return STATUS_SUCCESS or STATUS_NOT_FOUND if the view doesn't exist
+*/
+NTSTATUS
+EptView64Delete(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwView
+);
+
+/**
+* Change the leaf mapping a guest-physical address in a single view, e.g. to
+* make a page execute-only in one view and read-write in another.
+* Shared tables on the path are copied first, and leaves larger than ePageType
+* are split, so the other views are left untouched. Every new table is complete
+* before it's published, the view may be in use meanwhile. The view's EPTP must
+* be invalidated afterwards.
+* Changes to view 0 aren't reflected in the base hierarchy's counters.
+* @param ptManager - view manager
+* @param dwView - view to change
+* @param qwGuestPhysicalAddress - address whose leaf is changed
+* @param ePageType - largest page size allowed to map the address
+* @param qwMask - bits of the leaf to replace, e.g. EPT_ACCESS_ALL
+* @param qwValue - new value of the bits in qwMask
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_FOUND if the view doesn't exist or doesn't map the address
+*		  STATUS_INSUFFICIENT_RESOURCES if a table couldn't be allocated or too
+*		  many tables are shared, the view is then unchanged but may own copies
+*/
+NTSTATUS
+EptView64UpdateLeaf(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwView,
+	_In_	UINT64				qwGuestPhysicalAddress,
+	_In_	PAGE_TYPE64			ePageType,
+	_In_	UINT64				qwMask,
+	_In_	UINT64				qwValue
+);
+
+/**
+* Get the EPTP of a view
+* @param ptManager - view manager
+* @param dwView - view
+* @return The EPTP, 0 if the view doesn't exist
+*/
+EPTP
+EptView64GetEptp(
+	_In_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwView
+);
+
+/**
+* Enable EPTP switching in the current VMCS, so the guest switches between the
+* views with VMFUNC (EAX = 0, ECX = view) without a VM exit.
+* The processor must report eptpSwitching in MSR_CODE_IA32_VMX_VMFUNC and allow
+* EnableVmFunctions in the secondary processor-based controls.
+* @param ptManager - view manager
+* @return STATUS_SUCCESS or STATUS_UNSUCCESSFUL if the VMCS couldn't be accessed
+*/
+NTSTATUS
+EptView64EnableVmfunc(
+	_In_	PEPTVIEW64_MANAGER	ptManager
+);
+
+/**
+* Switch the current VMCS to a view from the host, e.g. from an EPT violation handler
+* @param ptManager - view manager
+* @param dwView - view to switch to
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_FOUND if the view doesn't exist
+*		  STATUS_UNSUCCESSFUL if the VMCS couldn't be accessed
+*/
+NTSTATUS
+EptView64Switch(
+	_In_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwView
+);
+
+/**
+* Get the view the current VMCS uses, which VMFUNC may have changed since the
+* last VM exit
+* @param ptManager - view manager
+* @param pdwView - receives the current view
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_FOUND if the EPTP isn't one of the views
+*		  STATUS_UNSUCCESSFUL if the VMCS couldn't be accessed
+*/
+NTSTATUS
+EptView64GetCurrentView(
+	_In_	PEPTVIEW64_MANAGER	ptManager,
+	_Out_	PUINT32				pdwView
+);
+
+#endif /* __INTEL_EPTVIEW64_H__ */
@@ -0,0 +1,67 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		field64.h
+* @section	Register field descriptors
+*/
+
+#ifndef __INTEL_FIELD64_H__
+#define __INTEL_FIELD64_H__
+
+#include "ntshim.h"
+
+// A field descriptor is a pair of <Field>_SHIFT and <Field>_WIDTH constants.
+// The accessors below work on whole UINT64 values, so several fields are read or
+// updated with one load/store (or CAS). The width and atomicity of compiler
+// bitfield accesses are implementation-defined.
+#define FIELD64_MASK(Field)			((~0ULL >> (64 - (Field##_WIDTH))) << (Field##_SHIFT))
+#define FIELD64_GET(qwValue, Field)	(((UINT64)(qwValue) & FIELD64_MASK(Field)) >> (Field##_SHIFT))
+#define FIELD64_MAKE(Field, qwFieldValue) \
+	(((UINT64)(qwFieldValue) << (Field##_SHIFT)) & FIELD64_MASK(Field))
+#define FIELD64_SET(qwValue, Field, qwFieldValue) \
+	(((UINT64)(qwValue) & ~FIELD64_MASK(Field)) | FIELD64_MAKE(Field, qwFieldValue))
+
+// Whether a value can be stored in a field without being truncated
+#define FIELD64_FITS(Field, qwFieldValue) \
+	(0 == ((UINT64)(qwFieldValue) & ~(~0ULL >> (64 - (Field##_WIDTH)))))
+
+// Descriptors are generated from X-macro lists of X(Prefix, Name, Shift, Width),
+// one list per register layout, e.g. PTE64_FIELD_LIST
+#define FIELD64_ENUM_ENTRY(Prefix, Name, Shift, Width) \
+	Prefix##_##Name##_SHIFT = (Shift), Prefix##_##Name##_WIDTH = (Width),
+#define FIELD64_WIDTH_SUM(Prefix, Name, Shift, Width)	+ (Width)
+#define FIELD64_MASK_OR(Prefix, Name, Shift, Width)		| FIELD64_MASK(Prefix##_##Name)
+
+// Declare the descriptors of a layout as enum constants
+#define FIELD64_DECLARE(Prefix, FieldList) \
+	typedef enum _##Prefix##_FIELDS { \
+		FieldList(FIELD64_ENUM_ENTRY) \
+		Prefix##_FIELDS_END \
+	} Prefix##_FIELDS
+
+// Fail the build unless the fields of a layout are disjoint and cover all its bits
+#define FIELD64_CHECK_LAYOUT(FieldList, cBits) \
+	C_ASSERT((cBits) == (0 FieldList(FIELD64_WIDTH_SUM))); \
+	C_ASSERT((~0ULL >> (64 - (cBits))) == (0 FieldList(FIELD64_MASK_OR)))
+
+#endif /* __INTEL_FIELD64_H__ */
@@ -0,0 +1,138 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		guestpaging.h
+* @section	Translation of guest linear addresses in every paging mode
+*			See Intel's: Software Developers Manual Vol 3A, Section 4.1 PAGING MODES AND CONTROL BITS
+*/
+
+#ifndef __INTEL_GUESTPAGING_H__
+#define __INTEL_GUESTPAGING_H__
+
+#include <ntddk.h>
+
+#include "paging32.h"
+#include "pagewalk64.h"
+
+// Vol 3A, Table 4-1. Properties of Different Paging Modes
+typedef enum _GUEST_PAGING_MODE {
+	GUEST_PAGING_NONE = 0,		// CR0.PG = 0, linear addresses are physical addresses
+	GUEST_PAGING_32BIT,			// CR0.PG = 1, CR4.PAE = 0
+	GUEST_PAGING_PAE,			// CR0.PG = 1, CR4.PAE = 1, IA32_EFER.LMA = 0
+	GUEST_PAGING_IA32E,			// CR0.PG = 1, CR4.PAE = 1, IA32_EFER.LMA = 1
+	GUEST_PAGING_MODES_COUNT	// Must be last!
+} GUEST_PAGING_MODE, *PGUEST_PAGING_MODE;
+
+// Paging state of a guest, captured once and reused for any number of translations
+typedef struct _GUEST_PAGING_STATE
+{
+	GUEST_PAGING_MODE eMode;
+	CR3_REG tCr3;
+	BOOLEAN bPse;								// CR4.PSE, 32-bit PDEs may map 4MB pages
+	BOOLEAN bNxe;								// IA32_EFER.NXE, xd bits are honored
+	PDPTE_PAE atPdptes[PAGING_PAE_PDPTE_COUNT];	// PAE only, the PDPTEs loaded from CR3
+} GUEST_PAGING_STATE, *PGUEST_PAGING_STATE;
+
+// Result of translating a guest linear address
+typedef struct _GUEST_TRANSLATION
+{
+	UINT64 qwPhysicalAddress;	// Translated physical address, including the page offset
+	UINT64 qwLeafEntry;			// Raw entry that maps the page (zero-extended with 32-bit paging)
+	UINT32 dwPageShift;			// Size of the page that maps the address, PAGE_SHIFT_*
+	BOOLEAN bWritable;			// rw is set on every level of the walk
+	BOOLEAN bUser;				// us is set on every level of the walk
+	BOOLEAN bExecuteDisable;	// xd is set on some level of the walk, and IA32_EFER.NXE = 1
+} GUEST_TRANSLATION, *PGUEST_TRANSLATION;
+
+/**
+* Get the paging mode selected by the guest's control registers
+* @param tCr0 - guest CR0
+* @param tCr4 - guest CR4
+* @param tEfer - guest IA32_EFER
+* @return Paging mode of the guest
+*/
+GUEST_PAGING_MODE
+GuestPagingGetMode(
+	_In_	CR0_REG		tCr0,
+	_In_	CR4_REG		tCr4,
+	_In_	IA32_EFER	tEfer
+);
+
+/**
+* Capture the paging state of a guest from its register values
+* @param ptState - state to initialize
+* @param ptReader - reader of the guest's physical memory, used to load the PAE
+*					PDPTEs when pqwPdptes isn't given
+* @param tCr0 - guest CR0
+* @param tCr3 - guest CR3
+* @param tCr4 - guest CR4
+* @param tEfer - guest IA32_EFER
+* @param pqwPdptes - optional PAE PDPTEs already known to the caller
+* @return STATUS_SUCCESS on success
+*		  STATUS_ACCESS_VIOLATION if the PAE PDPTEs couldn't be read
+*/
+NTSTATUS
+GuestPagingInit(
+	_Out_										PGUEST_PAGING_STATE	ptState,
+	_In_										PPAGING64_READER	ptReader,
+	_In_										CR0_REG				tCr0,
+	_In_										CR3_REG				tCr3,
+	_In_										CR4_REG				tCr4,
+	_In_										IA32_EFER			tEfer,
+	_In_reads_opt_(PAGING_PAE_PDPTE_COUNT)		const UINT64*		pqwPdptes
+);
+
+/**
+* Capture the paging state of the guest of the current VMCS.
+* PAE guests are walked through VMCS_FIELD_GUEST_PDPTE0-3 rather than through
+* guest memory, so the current VMCS must have the "enable EPT" control set
+* (otherwise the processor doesn't keep the PDPTEs there, use GuestPagingInit).
+* @param ptState - state to initialize
+* @return STATUS_SUCCESS on success
+*		  STATUS_UNSUCCESSFUL if a VMREAD failed
+*/
+NTSTATUS
+GuestPagingInitFromVmcs(
+	_Out_	PGUEST_PAGING_STATE	ptState
+);
+
+/**
+* Translate a guest linear address with the walk of the guest's paging mode.
+* @param ptReader - reader of the guest's paging structures
+* @param ptState - paging state of the guest
+* @param qwVa - linear address to translate
+* @param ptTranslation - translation result
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the address is out of the mode's linear space
+*		  STATUS_NOT_FOUND if some entry on the path is not present
+*		  STATUS_ACCESS_VIOLATION if the reader failed to read a table
+*/
+NTSTATUS
+GuestPagingTranslate(
+	_In_	PPAGING64_READER		ptReader,
+	_In_	PGUEST_PAGING_STATE		ptState,
+	_In_	UINT64					qwVa,
+	_Out_	PGUEST_TRANSLATION		ptTranslation
+);
+
+#endif /* __INTEL_GUESTPAGING_H__ */
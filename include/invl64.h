@@ -0,0 +1,265 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		invl64.h
+* @section	Coalescer of the INVEPT and INVVPID invalidations pending on each CPU
+*			See Intel's: Software Developers Manual Vol 3C, Section 28.3.3 Invalidating Cached Translation Information
+*/
+
+#ifndef __INTEL_INVL64_H__
+#define __INTEL_INVL64_H__
+
+#include <ntddk.h>
+
+#include "VT-x.h"
+#include "msr64.h"
+
+#define INVL64_MAX_CPUS				256
+
+// Contexts tracked individually, beyond them requests fall back to all-context
+// when supported, or to the overflow entries below
+#define INVL64_MAX_EPT_CONTEXTS		16
+#define INVL64_MAX_VPID_CONTEXTS	16
+
+// Individual addresses kept per VPID before falling back to single-context
+#define INVL64_MAX_ADDRESSES		4
+
+// Requests kept beyond the tracked contexts when all-context invalidation isn't
+// supported, each one executed as a single-context invalidation. Once they are
+// full too, queueing fails and the caller invalidates the context itself.
+#define INVL64_MAX_OVERFLOW			32
+
+/**
+* Execute INVEPT
+* @param pvContext - backend context
+* @param eType - type of invalidation
+* @param tEptp - EPTP to invalidate (single-context only)
+*/
+typedef
+VOID
+(*PFN_INVL64_INVEPT)(
+	_In_opt_	PVOID		pvContext,
+	_In_		INVEPT_TYPE	eType,
+	_In_		EPTP		tEptp
+);
+
+/**
+* Execute INVVPID
+* @param pvContext - backend context
+* @param eType - type of invalidation
+* @param wVpid - VPID to invalidate (all but all-context)
+* @param qwLinearAddress - linear address to invalidate (individual-address only)
+*/
+typedef
+VOID
+(*PFN_INVL64_INVVPID)(
+	_In_opt_	PVOID			pvContext,
+	_In_		INVVPID_TYPE	eType,
+	_In_		UINT16			wVpid,
+	_In_		UINT64			qwLinearAddress
+);
+
+// Executes the invalidations. The instructions have no compiler intrinsics, so
+// they are left to the caller's assembly, or to a test backend.
+typedef struct _INVL64_BACKEND
+{
+	PFN_INVL64_INVEPT pfnInvept;
+	PFN_INVL64_INVVPID pfnInvvpid;
+	PVOID pvContext;
+} INVL64_BACKEND, *PINVL64_BACKEND;
+
+typedef struct _INVL64_EPT_CONTEXT
+{
+	EPTP tEptp;
+	UINT64 qwGeneration;			// Generation of the last request
+} INVL64_EPT_CONTEXT, *PINVL64_EPT_CONTEXT;
+
+typedef struct _INVL64_VPID_CONTEXT
+{
+	UINT16 wVpid;
+	UINT64 qwGeneration;			// Generation of the last single-context request
+	UINT32 dwAddressCount;
+	UINT64 aqwAddresses[INVL64_MAX_ADDRESSES];
+	UINT64 aqwAddressGenerations[INVL64_MAX_ADDRESSES];
+} INVL64_VPID_CONTEXT, *PINVL64_VPID_CONTEXT;
+
+typedef struct _INVL64_VPID_OVERFLOW
+{
+	UINT16 wVpid;
+	UINT64 qwGeneration;			// Generation of the last request
+} INVL64_VPID_OVERFLOW, *PINVL64_VPID_OVERFLOW;
+
+typedef struct DECLSPEC_CACHEALIGN _INVL64_CPU
+{
+	UINT64 qwFlushedGeneration;		// Requests up to this generation are flushed
+	UINT64 qwRequestsSeen;			// Value of qwRequests at the last flush
+	UINT64 qwRequestsCovered;		// Requests the CPU's flushes took care of
+	UINT64 qwInvalidationsIssued;	// Instructions the CPU executed
+} INVL64_CPU, *PINVL64_CPU;
+
+// Every request takes the next generation. A CPU flushing before VM entry
+// executes the cheapest set of invalidations its capabilities allow for the
+// requests newer than its last flush, then records the generation it reached.
+// An unchanged generation costs a single comparison.
+typedef struct _INVL64_TRACKER
+{
+	INVL64_BACKEND tBackend;
+	IA32_VMX_EPT_VPID_CAP tCapabilities;
+	UINT32 dwCpuCount;
+	volatile LONG lLock;				// Protects everything below but the CPUs
+	volatile LONG64 qwGeneration;		// Generation of the last request
+	UINT64 qwRequests;
+	UINT64 qwEptAllGeneration;			// Last request to invalidate every EPTP
+	UINT64 qwVpidAllGeneration;			// Last request to invalidate every VPID
+	UINT32 dwEptContextCount;
+	UINT32 dwVpidContextCount;
+	INVL64_EPT_CONTEXT atEptContexts[INVL64_MAX_EPT_CONTEXTS];
+	INVL64_VPID_CONTEXT atVpidContexts[INVL64_MAX_VPID_CONTEXTS];
+	UINT32 dwEptOverflowCount;
+	UINT32 dwVpidOverflowCount;
+	INVL64_EPT_CONTEXT atEptOverflow[INVL64_MAX_OVERFLOW];
+	INVL64_VPID_OVERFLOW atVpidOverflow[INVL64_MAX_OVERFLOW];
+	INVL64_CPU atCpus[INVL64_MAX_CPUS];
+} INVL64_TRACKER, *PINVL64_TRACKER;
+
+typedef struct _INVL64_STATISTICS
+{
+	UINT64 qwRequests;				// Invalidations requested
+	UINT64 qwInvalidationsIssued;	// INVEPT and INVVPID executed, on all CPUs
+	UINT64 qwInvalidationsSaved;	// Executions avoided compared to one per request per CPU
+} INVL64_STATISTICS, *PINVL64_STATISTICS;
+
+/**
+* Initialize a tracker with nothing pending
+* @param ptTracker - tracker to initialize
+* @param ptBackend - executes the invalidations
+* @param tCapabilities - value of MSR_CODE_IA32_VMX_EPT_VPID_CAP
+* @param dwCpuCount - number of CPUs that flush
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if dwCpuCount exceeds INVL64_MAX_CPUS
+*		  STATUS_NOT_SUPPORTED if neither INVEPT nor INVVPID is supported
+*/
+NTSTATUS
+Invl64Init(
+	_Out_	PINVL64_TRACKER			ptTracker,
+	_In_	PINVL64_BACKEND			ptBackend,
+	_In_	IA32_VMX_EPT_VPID_CAP	tCapabilities,
+	_In_	UINT32					dwCpuCount
+);
+
+/**
+* Request the invalidation of the mappings derived from an EPT, after its
+* entries changed. When every context holds requests some CPU hasn't flushed,
+* the request becomes an all-context one, or without all-context support, an
+* overflow entry: at most INVL64_MAX_EPT_CONTEXTS + INVL64_MAX_OVERFLOW EPTPs
+* may then be pending at once.
+* @param ptTracker - tracker
+* @param tEptp - EPTP of the changed EPT
+* @return STATUS_SUCCESS on success
+*		  STATUS_INSUFFICIENT_RESOURCES if too many EPTPs are pending and the request
+*		  wasn't recorded, every CPU must then execute a single-context INVEPT
+*		  of tEptp itself before its next VM entry
+*/
+NTSTATUS
+Invl64QueueEpt(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	EPTP			tEptp
+);
+
+/**
+* Request the invalidation of the mappings derived from every EPT
+* @param ptTracker - tracker
+*/
+VOID
+Invl64QueueEptAll(
+	_Inout_	PINVL64_TRACKER	ptTracker
+);
+
+/**
+* Request the invalidation of the mappings of a linear address tagged with a VPID
+* @param ptTracker - tracker
+* @param wVpid - VPID, not 0
+* @param qwLinearAddress - linear address
+* @return STATUS_SUCCESS on success
+*		  STATUS_INSUFFICIENT_RESOURCES if too many VPIDs are pending and the request
+*		  wasn't recorded, see Invl64QueueVpid
+*/
+NTSTATUS
+Invl64QueueVpidAddress(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT16			wVpid,
+	_In_	UINT64			qwLinearAddress
+);
+
+/**
+* Request the invalidation of all the mappings tagged with a VPID. Contexts
+* that overflow are handled as in Invl64QueueEpt.
+* @param ptTracker - tracker
+* @param wVpid - VPID, not 0
+* @return STATUS_SUCCESS on success
+*		  STATUS_INSUFFICIENT_RESOURCES if too many VPIDs are pending and the request
+*		  wasn't recorded, every CPU must then execute a single-context INVVPID
+*		  of wVpid itself before its next VM entry
+*/
+NTSTATUS
+Invl64QueueVpid(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT16			wVpid
+);
+
+/**
+* Request the invalidation of the mappings tagged with every VPID
+* @param ptTracker - tracker
+*/
+VOID
+Invl64QueueVpidAll(
+	_Inout_	PINVL64_TRACKER	ptTracker
+);
+
+/**
+* Execute the invalidations requested since the CPU last flushed, merged into
+* the fewest instructions: several EPTPs or VPIDs become a single all-context
+* invalidation when supported, and too many addresses of a VPID become a
+* single-context one. Call right before every VM entry.
+* @param ptTracker - tracker
+* @param dwCpu - index of the current CPU
+* @return Number of instructions executed
+*/
+UINT32
+Invl64FlushBeforeEntry(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT32			dwCpu
+);
+
+/**
+* Sum the counters of all the CPUs
+* @param ptTracker - tracker
+* @param ptStatistics - receives the counters
+*/
+VOID
+Invl64GetStatistics(
+	_In_	PINVL64_TRACKER		ptTracker,
+	_Out_	PINVL64_STATISTICS	ptStatistics
+);
+
+#endif /* __INTEL_INVL64_H__ */
@@ -0,0 +1,238 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		memslot64.h
+* @section	Guest-physical memory slots with lock-free lookups for the emulation paths
+*/
+
+#ifndef __INTEL_MEMSLOT64_H__
+#define __INTEL_MEMSLOT64_H__
+
+#include <ntddk.h>
+
+#include "ept64.h"
+
+// Maximal number of CPUs whose quiescent states are tracked
+#define MEMSLOT64_MAX_CPUS	256
+
+// Slot flags
+#define MEMSLOT64_FLAG_READONLY	0x00000001	// Guest writes must be emulated (e.g. ROM)
+#define MEMSLOT64_FLAG_MMIO		0x00000002	// No memory backs the slot, every access is emulated
+
+// A guest-physical range and the host memory that backs it
+typedef struct _MEMSLOT64_SLOT
+{
+	EPT64_RANGE tRange;					// Guest-physical range, 4KB aligned, and its memory type
+	UINT64 qwHostPhysicalAddress;		// Host-physical address of tRange.qwBase
+	PUINT8 pcHostVirtualAddress;		// Host mapping of tRange.qwBase, NULL if not mapped
+	UINT32 dwFlags;						// MEMSLOT64_FLAG_*
+} MEMSLOT64_SLOT, *PMEMSLOT64_SLOT;
+
+// Header fields of a slot table
+#define MEMSLOT64_TABLE_HEADER_SIZE	(5 * sizeof(UINT64))
+
+// Number of slots that fit in a 4KB table
+#define MEMSLOT64_MAX_SLOTS	((PAGE_SIZE_4KB - MEMSLOT64_TABLE_HEADER_SIZE) / sizeof(MEMSLOT64_SLOT))
+
+// Snapshot of all the slots, sorted by guest-physical base and non-overlapping.
+// A published table is never modified, updates publish a copy instead.
+typedef struct _MEMSLOT64_TABLE
+{
+	UINT64 qwGeneration;				// Increases with every published table
+	UINT64 qwPhysicalAddress;			// Of the table itself, to free it
+	struct _MEMSLOT64_TABLE* ptNextRetired;
+	UINT64 qwRetiredGeneration;			// Generation of the table that replaced this one
+	UINT32 dwCount;
+	MEMSLOT64_SLOT atSlots[MEMSLOT64_MAX_SLOTS];
+} MEMSLOT64_TABLE, *PMEMSLOT64_TABLE;
+C_ASSERT(sizeof(MEMSLOT64_TABLE) <= PAGE_SIZE_4KB);
+
+// Per-CPU lookup state, only touched by its own CPU
+typedef struct DECLSPEC_CACHEALIGN _MEMSLOT64_CPU
+{
+	volatile LONG64 qwQuiescentGeneration;	// Generation published at the CPU's last quiescent point
+	UINT64 qwCachedGeneration;				// Table generation of dwCachedSlot
+	UINT32 dwCachedSlot;					// Slot of the last successful lookup
+	UINT64 qwHits;							// Lookups answered by the cached slot
+	UINT64 qwMisses;						// Lookups that searched the table
+} MEMSLOT64_CPU, *PMEMSLOT64_CPU;
+
+// Slot table with read-copy-update semantics: lookups never lock nor write
+// shared memory, updates are serialized and publish a new table. A replaced
+// table is freed once every CPU went through a quiescent point, i.e. called
+// Memslot64Quiesce, after the replacement was published.
+typedef struct _MEMSLOT64
+{
+	PAGING64_TABLE_ALLOCATOR tAllocator;
+	PMEMSLOT64_TABLE volatile ptTable;		// Current table
+	volatile LONG64 qwGeneration;			// Generation of ptTable
+	volatile LONG lUpdateLock;				// Serializes the updates
+	PMEMSLOT64_TABLE ptRetired;				// Replaced tables that may still be in use
+	PEPT64_HIERARCHY ptEpt;					// Built from the slots, which can't change meanwhile
+	UINT32 dwCpuCount;
+	MEMSLOT64_CPU atCpus[MEMSLOT64_MAX_CPUS];
+} MEMSLOT64, *PMEMSLOT64;
+
+// Result of a guest-physical address lookup
+typedef struct _MEMSLOT64_TRANSLATION
+{
+	UINT64 qwHostPhysicalAddress;		// Host-physical address of the guest-physical address
+	PUINT8 pcHostVirtualAddress;		// Host mapping of the address, NULL if the slot is not mapped
+	UINT64 qwBytesLeft;					// Bytes from the address to the end of the slot
+	IA32_PAT_MEMTYPE eMemoryType;
+	UINT32 dwFlags;						// MEMSLOT64_FLAG_* of the slot
+} MEMSLOT64_TRANSLATION, *PMEMSLOT64_TRANSLATION;
+
+/**
+* Initialize an empty slot table
+* @param ptMemslots - slot table to initialize
+* @param ptAllocator - allocator of the table snapshots, called at update time only
+* @param dwCpuCount - number of CPUs that look up and quiesce
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if dwCpuCount is 0 or above MEMSLOT64_MAX_CPUS
+*		  STATUS_INSUFFICIENT_RESOURCES if the first table can't be allocated
+*/
+NTSTATUS
+Memslot64Init(
+	_Out_	PMEMSLOT64					ptMemslots,
+	_In_	PPAGING64_TABLE_ALLOCATOR	ptAllocator,
+	_In_	UINT32						dwCpuCount
+);
+
+/**
+* Free the current and retired tables. No CPU may look up concurrently.
+* @param ptMemslots - slot table to destroy
+*/
+VOID
+Memslot64Destroy(
+	_Inout_ PMEMSLOT64 ptMemslots
+);
+
+/**
+* Add a slot. Lookups running concurrently see either the old or the new table.
+* @param ptMemslots - slot table
+* @param ptSlot - slot to add, copied
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the range is empty, unaligned or overlaps another slot
+*		  STATUS_INSUFFICIENT_RESOURCES if the table is full or can't be allocated
+*		  STATUS_INVALID_DEVICE_STATE if an EPT was built from the slots and not released
+*/
+NTSTATUS
+Memslot64Add(
+	_Inout_	PMEMSLOT64				ptMemslots,
+	_In_	const MEMSLOT64_SLOT*	ptSlot
+);
+
+/**
+* Remove the slot that starts at a guest-physical address
+* @param ptMemslots - slot table
+* @param qwGuestPhysicalBase - base of the slot to remove
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_FOUND if no slot starts at qwGuestPhysicalBase
+*		  STATUS_INSUFFICIENT_RESOURCES if the new table can't be allocated
+*		  STATUS_INVALID_DEVICE_STATE if an EPT was built from the slots and not released
+*/
+NTSTATUS
+Memslot64Remove(
+	_Inout_	PMEMSLOT64	ptMemslots,
+	_In_	UINT64		qwGuestPhysicalBase
+);
+
+/**
+* Translate a guest-physical address without locking. The slot of the CPU's
+* previous lookup is tried first, the table is binary searched otherwise.
+* Must run on dwCpu, between two of its quiescent points.
+* @param ptMemslots - slot table
+* @param dwCpu - index of the current CPU
+* @param qwGuestPhysicalAddress - address to translate
+* @param ptTranslation - translation result
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_FOUND if no slot covers the address
+*/
+NTSTATUS
+Memslot64Lookup(
+	_Inout_	PMEMSLOT64				ptMemslots,
+	_In_	UINT32					dwCpu,
+	_In_	UINT64					qwGuestPhysicalAddress,
+	_Out_	PMEMSLOT64_TRANSLATION	ptTranslation
+);
+
+/**
+* Report that a CPU holds no translation nor table pointer obtained from the slot
+* table, e.g. right before VM entry. Cheap, doesn't lock.
+* @param ptMemslots - slot table
+* @param dwCpu - index of the current CPU
+*/
+VOID
+Memslot64Quiesce(
+	_Inout_	PMEMSLOT64	ptMemslots,
+	_In_	UINT32		dwCpu
+);
+
+/**
+* Free the retired tables that no CPU can still be using.
+* Updates reclaim by themselves, this is for idle periods.
+* @param ptMemslots - slot table
+* @return Number of tables freed
+*/
+UINT32
+Memslot64Reclaim(
+	_Inout_ PMEMSLOT64 ptMemslots
+);
+
+/**
+* Map every slot of the current table in an EPT hierarchy, so the EPT and the
+* slots are built from the same ranges. Read-only slots are mapped without
+* write access and MMIO slots are left unmapped, so their accesses exit.
+* The EPT builder maps identity only, so every mapped slot must back its
+* guest-physical range with the same host-physical range.
+* The EPT isn't updated by Memslot64Add and Memslot64Remove, so they fail until
+* Memslot64ReleaseEpt, after which the caller rebuilds the EPT.
+* @param ptMemslots - slot table
+* @param ptEpt - hierarchy to map the slots in
+* @param qwAccess - EPT_ACCESS_* rights of the mapped slots
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_SUPPORTED if a slot to map is not identity mapped
+*		  STATUS_INVALID_DEVICE_STATE if an EPT was already built and not released
+*		  Any error of Ept64BuildIdentityMap
+*/
+NTSTATUS
+Memslot64BuildEpt(
+	_Inout_	PMEMSLOT64			ptMemslots,
+	_Inout_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT64				qwAccess
+);
+
+/**
+* Allow the slots to change again after Memslot64BuildEpt. The EPT built from
+* them must no longer be used: destroy or rebuild it with Memslot64BuildEpt once
+* the slots are updated, and invalidate it (INVEPT) on every CPU before VM entry.
+* @param ptMemslots - slot table
+* @return The hierarchy the slots were mapped in, NULL if none
+*/
+PEPT64_HIERARCHY
+Memslot64ReleaseEpt(
+	_Inout_	PMEMSLOT64	ptMemslots
+);
+
+#endif /* __INTEL_MEMSLOT64_H__ */
@@ -28,7 +28,7 @@
 #ifndef __INTEL_MSR64_H__
 #define __INTEL_MSR64_H__
 
-#include <ntddk.h>
+#include "ntshim.h"
 
 // Disable 'warning C4214: nonstandard extension used: bit field types other than int'
 // Disable 'warning C4201: nonstandard extension used: nameless struct/union'
@@ -499,6 +499,49 @@ typedef union _IA32_PAT
 } IA32_PAT, *PIA32_PAT;
 C_ASSERT(sizeof(UINT64) == sizeof(IA32_PAT));
 
+// MSR_CODE_IA32_VMX_MISC = 0x485
+// A.6 MISCELLANEOUS DATA
+// reports miscellaneous VMX capabilities
+typedef union _IA32_VMX_MISC
+{
+	UINT64 qwValue;
+	struct {
+		UINT64 timerRate : 5;		// 0-4	the VMX-preemption timer counts down every
+									//		2^timerRate TSC ticks
+		UINT64 storeLma : 1;		// 5	VM exits store IA32_EFER.LMA in the
+									//		"IA-32e mode guest" VM-entry control
+		UINT64 activityHlt : 1;		// 6	HLT activity state is supported
+		UINT64 activityShutdown : 1;	// 7	shutdown activity state is supported
+		UINT64 activityWaitSipi : 1;	// 8	wait-for-SIPI activity state is supported
+		UINT64 reserved0 : 5;		// 9-13
+		UINT64 ptInVmx : 1;			// 14	Intel PT may be used in VMX operation
+		UINT64 smbaseMsr : 1;		// 15	RDMSR may read IA32_SMBASE in SMM
+		UINT64 cr3TargetCount : 9;	// 16-24	number of CR3-target values supported
+		UINT64 maxMsrList : 3;		// 25-27	MSR lists hold up to 512 * (maxMsrList + 1) entries
+		UINT64 smmBlockSmi : 1;		// 28	IA32_SMM_MONITOR_CTL bit 2 may be set
+		UINT64 vmwriteAll : 1;		// 29	VMWRITE may write any field, VM-exit information included
+		UINT64 injectZeroLength : 1;	// 30	VM entry may inject software interrupts and
+									//		exceptions of zero instruction length
+		UINT64 reserved1 : 1;		// 31
+		UINT64 msegRevision : 32;	// 32-63	MSEG revision identifier
+	};
+} IA32_VMX_MISC, *PIA32_VMX_MISC;
+C_ASSERT(sizeof(UINT64) == sizeof(IA32_VMX_MISC));
+
+// MSR_CODE_IA32_VMX_VMCS_ENUM = 0x48A
+// A.9 VMCS ENUMERATION
+// reports the highest index value used in the encodings of the supported VMCS fields
+typedef union _IA32_VMX_VMCS_ENUM
+{
+	UINT64 qwValue;
+	struct {
+		UINT64 reserved0 : 1;		// 0
+		UINT64 maxIndex : 9;		// 1-9	highest VMCS_FIELD_ENCODING_INDEX of any field
+		UINT64 reserved1 : 54;		// 10-63
+	};
+} IA32_VMX_VMCS_ENUM, *PIA32_VMX_VMCS_ENUM;
+C_ASSERT(sizeof(UINT64) == sizeof(IA32_VMX_VMCS_ENUM));
+
 // MSR_CODE_IA32_VMX_EPT_VPID_CAP = 0x48C
 // A.10 VPID AND EPT CAPABILITIES
 // reports information about the capabilities of the logical processor with regard 
@@ -536,6 +579,19 @@ typedef union _IA32_VMX_EPT_VPID_CAP
 } IA32_VMX_EPT_VPID_CAP, *PIA32_VMX_EPT_VPID_CAP;
 C_ASSERT(sizeof(UINT64) == sizeof(IA32_VMX_EPT_VPID_CAP));
 
+// MSR_CODE_IA32_VMX_VMFUNC = 0x491
+// A.11 VM FUNCTIONS
+// reports the VM functions that may be enabled in the VM-function controls
+typedef union _IA32_VMX_VMFUNC
+{
+	UINT64 qwValue;
+	struct {
+		UINT64 eptpSwitching : 1;	// 0	VM function 0, EPTP switching
+		UINT64 reserved0 : 63;		// 1-63
+	};
+} IA32_VMX_VMFUNC, *PIA32_VMX_VMFUNC;
+C_ASSERT(sizeof(UINT64) == sizeof(IA32_VMX_VMFUNC));
+
 // MSR_CODE_IA32_EFER = 0xC0000080
 typedef union _IA32_EFER
 {
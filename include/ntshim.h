@@ -0,0 +1,210 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ntshim.h
+* @section	Subset of the WDK used by the modules that also build in user mode
+*/
+
+#ifndef __INTEL_NTSHIM_H__
+#define __INTEL_NTSHIM_H__
+
+// Headers of the modules that make no kernel calls (paging structures, page
+// walker, arena, scanner, VMCS cache) include this instead of <ntddk.h>, so they
+// can be built and benchmarked in user mode with GCC or Clang, e.g.:
+//	gcc -O2 -fno-strict-aliasing -Iinclude -Wno-unknown-pragmas src/ptarena64.c src/ptarena64_user.c ...
+//	gcc -O2 -fno-strict-aliasing -Iinclude -Wno-unknown-pragmas src/vmcscache64.c src/vmcscache64_user.c src/vmcsfield.c ...
+// Kernel builds (the WDK defines _KERNEL_MODE) get the real definitions.
+#ifdef _KERNEL_MODE
+
+#include <ntddk.h>
+#include <intrin.h>
+
+#elif defined(__GNUC__)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <x86intrin.h>
+
+// Same types as on Windows: 64-bit types are long long, LONG is 32 bits unlike LP64 long
+#define VOID	void
+typedef void* PVOID;
+typedef char CHAR, *PCHAR;
+typedef const CHAR* LPCSTR;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef uint8_t UINT8, *PUINT8;
+typedef uint16_t UINT16, *PUINT16;
+typedef uint32_t UINT32, *PUINT32;
+typedef unsigned long long UINT64, *PUINT64;
+typedef int8_t INT8, *PINT8;
+typedef int16_t INT16, *PINT16;
+typedef int32_t INT32, *PINT32;
+typedef long long INT64, *PINT64;
+typedef uint16_t USHORT, *PUSHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef long long LONG64, *PLONG64;
+typedef unsigned long long ULONG64, *PULONG64;
+typedef size_t SIZE_T, *PSIZE_T;
+typedef UINT8 BOOLEAN, *PBOOLEAN;
+typedef LONG NTSTATUS;
+
+#define TRUE	1
+#define FALSE	0
+
+#define MAXUINT32	((UINT32)~0U)
+#define MAXUINT64	((UINT64)~0ULL)
+#define MAXLONG64	((LONG64)(MAXUINT64 >> 1))
+
+#define NT_SUCCESS(eStatus)					((NTSTATUS)(eStatus) >= 0)
+#define STATUS_SUCCESS						((NTSTATUS)0x00000000L)
+#define STATUS_UNSUCCESSFUL					((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED				((NTSTATUS)0xC0000002L)
+#define STATUS_INVALID_PARAMETER			((NTSTATUS)0xC000000DL)
+#define STATUS_ACCESS_VIOLATION				((NTSTATUS)0xC0000005L)
+#define STATUS_NO_MEMORY					((NTSTATUS)0xC0000017L)
+#define STATUS_ACCESS_DENIED				((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL				((NTSTATUS)0xC0000023L)
+#define STATUS_INSUFFICIENT_RESOURCES		((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED				((NTSTATUS)0xC00000BBL)
+#define STATUS_NOT_FOUND					((NTSTATUS)0xC0000225L)
+#define STATUS_INVALID_IMAGE_FORMAT			((NTSTATUS)0xC000007BL)
+#define STATUS_CANCELLED					((NTSTATUS)0xC0000120L)
+#define STATUS_END_OF_FILE					((NTSTATUS)0xC0000011L)
+
+#define PAGE_SIZE	0x1000
+#define PAGE_SHIFT	12
+
+#define C_ASSERT(e)						_Static_assert(e, #e)
+#define NT_ASSERT(e)					assert(e)
+#define UNREFERENCED_PARAMETER(P)		((void)(P))
+#define FIELD_OFFSET(type, field)		((LONG)offsetof(type, field))
+#define RTL_NUMBER_OF(a)				(sizeof(a) / sizeof((a)[0]))
+#define DECLSPEC_ALIGN(x)				__attribute__((aligned(x)))
+#define DECLSPEC_CACHEALIGN				DECLSPEC_ALIGN(64)
+
+// SAL annotations are only checked by the WDK's code analysis
+#define _In_
+#define _In_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _Out_
+#define _Out_opt_
+#define _In_reads_(n)
+#define _In_reads_opt_(n)
+#define _In_reads_bytes_(cb)
+#define _In_reads_bytes_opt_(cb)
+#define _Out_writes_(n)
+#define _Out_writes_opt_(n)
+#define _Out_writes_bytes_(cb)
+#define _Inout_updates_(n)
+#define _Inout_updates_opt_(n)
+
+#define RtlZeroMemory(pvDst, cbSize)			memset((pvDst), 0, (cbSize))
+#define RtlFillMemory(pvDst, cbSize, cFill)		memset((pvDst), (cFill), (cbSize))
+#define RtlCopyMemory(pvDst, pvSrc, cbSize)		memcpy((pvDst), (pvSrc), (cbSize))
+
+// Full barriers, like the Windows intrinsics; they work on both LONG and LONG64
+#define InterlockedCompareExchange(plTarget, lExchange, lComparand) \
+	__sync_val_compare_and_swap((plTarget), (lComparand), (lExchange))
+#define InterlockedCompareExchange64	InterlockedCompareExchange
+#define InterlockedExchange(plTarget, lValue)	__atomic_exchange_n((plTarget), (lValue), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64			InterlockedExchange
+#define InterlockedIncrement(plTarget)			__sync_add_and_fetch((plTarget), 1)
+#define InterlockedIncrement64			InterlockedIncrement
+#define InterlockedDecrement(plTarget)			__sync_sub_and_fetch((plTarget), 1)
+#define InterlockedDecrement64			InterlockedDecrement
+#define InterlockedExchangeAdd(plTarget, lValue)	__sync_fetch_and_add((plTarget), (lValue))
+#define InterlockedExchangeAdd64		InterlockedExchangeAdd
+#define InterlockedAdd64(plTarget, lValue)		__sync_add_and_fetch((plTarget), (lValue))
+#define InterlockedAnd64(plTarget, lValue)		__sync_fetch_and_and((plTarget), (lValue))
+#define InterlockedOr64(plTarget, lValue)		__sync_fetch_and_or((plTarget), (lValue))
+#define YieldProcessor()				_mm_pause()
+
+static
+__inline
+BOOLEAN
+_BitScanForward(
+	_Out_	ULONG*	pdwIndex,
+	_In_	ULONG	dwMask
+)
+{
+	if (0 == dwMask)
+	{
+		return FALSE;
+	}
+	*pdwIndex = (ULONG)__builtin_ctz(dwMask);
+	return TRUE;
+}
+
+static
+__inline
+BOOLEAN
+_BitScanForward64(
+	_Out_	ULONG*	pdwIndex,
+	_In_	UINT64	qwMask
+)
+{
+	if (0 == qwMask)
+	{
+		return FALSE;
+	}
+	*pdwIndex = (ULONG)__builtin_ctzll(qwMask);
+	return TRUE;
+}
+
+static
+__inline
+BOOLEAN
+_BitScanReverse64(
+	_Out_	ULONG*	pdwIndex,
+	_In_	UINT64	qwMask
+)
+{
+	if (0 == qwMask)
+	{
+		return FALSE;
+	}
+	*pdwIndex = 63 - (ULONG)__builtin_clzll(qwMask);
+	return TRUE;
+}
+
+static
+__inline
+VOID
+__cpuid(
+	_Out_writes_(4)	INT32	aiCpuInfo[4],
+	_In_			INT32	iFunction
+)
+{
+	__asm__ __volatile__("cpuid"
+		: "=a"(aiCpuInfo[0]), "=b"(aiCpuInfo[1]), "=c"(aiCpuInfo[2]), "=d"(aiCpuInfo[3])
+		: "a"(iFunction), "c"(0));
+}
+
+#else
+#error "User-mode builds need GCC or Clang, kernel builds need the WDK"
+#endif
+
+#endif /* __INTEL_NTSHIM_H__ */
@@ -0,0 +1,144 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		pagescan64.h
+* @section	Vectorized scanning of paging-structure tables
+*/
+
+#ifndef __INTEL_PAGESCAN64_H__
+#define __INTEL_PAGESCAN64_H__
+
+#include <ntddk.h>
+
+#include "paging64.h"
+
+// One bit per entry of a 512-entry paging-structure table
+#define PAGESCAN64_MASK_QWORDS	(PAGING64_PTE_COUNT / 64)
+
+// Match every entry that has a single bit set, e.g. PAGESCAN64_BIT(PTE64_A)
+#define PAGESCAN64_BIT(Field)	FIELD64_MASK(Field), FIELD64_MASK(Field)
+
+typedef struct _PAGESCAN64_MASK
+{
+	UINT64 aqwBits[PAGESCAN64_MASK_QWORDS];	// Bit i of aqwBits[j] stands for entry 64 * j + i
+} PAGESCAN64_MASK, *PPAGESCAN64_MASK;
+
+// Instruction sets the scanner can use, from slowest to fastest
+typedef enum _PAGESCAN64_ISA
+{
+	PAGESCAN64_ISA_SCALAR = 0,
+	PAGESCAN64_ISA_AVX2,
+	PAGESCAN64_ISA_AVX512
+} PAGESCAN64_ISA, *PPAGESCAN64_ISA;
+
+/**
+* Select the fastest instruction set supported by the processor and enabled by
+* the OS (CPUID and XCR0). Until called, the scalar code is used.
+* @return Instruction set selected
+*/
+PAGESCAN64_ISA
+PageScan64Init(
+	VOID
+);
+
+/**
+* Force the scanner to an instruction set, e.g. to compare implementations
+* @param eIsa - instruction set to use
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_SUPPORTED if the processor or the OS doesn't support eIsa
+*/
+NTSTATUS
+PageScan64SetIsa(
+	_In_	PAGESCAN64_ISA	eIsa
+);
+
+/**
+* Build the mask of the entries of many tables for which
+* (entry & qwMask) == qwValue, e.g. present entries with
+* PAGESCAN64_BIT(PTE64_P). Works on any table of 64-bit entries: PML4E64,
+* PDPTE64, PDE64, PTE64 and EPT entries alike.
+* Vector state is saved once per call in kernel mode, so scanning many tables
+* in one call is much cheaper than one call per table. The tables are read
+* without locking, entries changed concurrently are seen as either value.
+* @param ppqwTables - tables to scan, each of PAGING64_PTE_COUNT entries
+* @param dwTableCount - number of tables
+* @param qwMask - bits of the entries to compare
+* @param qwValue - value the bits must have
+* @param ptMasks - receives a mask per table
+*/
+VOID
+PageScan64MatchTables(
+	_In_reads_(dwTableCount)	const UINT64* const*	ppqwTables,
+	_In_						UINT32					dwTableCount,
+	_In_						UINT64					qwMask,
+	_In_						UINT64					qwValue,
+	_Out_writes_(dwTableCount)	PPAGESCAN64_MASK		ptMasks
+);
+
+/**
+* Build the mask of the entries of a single table, see PageScan64MatchTables
+*/
+VOID
+PageScan64MatchTable(
+	_In_reads_(PAGING64_PTE_COUNT)	const UINT64*		pqwTable,
+	_In_							UINT64				qwMask,
+	_In_							UINT64				qwValue,
+	_Out_							PPAGESCAN64_MASK	ptResult
+);
+
+/**
+* Atomically clear bits (typically accessed/dirty) in the selected entries of a table.
+* Entries are first scanned with vector instructions, so only the entries that
+* have some of the bits set pay for an interlocked operation.
+* Flushing the TLBs is up to the caller.
+* @param pqwTable - table of PAGING64_PTE_COUNT entries
+* @param ptSelect - optional, entries to clear the bits in (default is all of them)
+* @param qwClearMask - bits to clear, e.g. FIELD64_MASK(PTE64_A) | FIELD64_MASK(PTE64_D)
+* @param ptWasSet - optional, receives the entries that had some of the bits set
+* @return Number of entries changed
+*/
+UINT32
+PageScan64ClearBits(
+	_Inout_updates_(PAGING64_PTE_COUNT)	volatile UINT64*	pqwTable,
+	_In_opt_							PPAGESCAN64_MASK	ptSelect,
+	_In_								UINT64				qwClearMask,
+	_Out_opt_							PPAGESCAN64_MASK	ptWasSet
+);
+
+/**
+* Find the next run of consecutive set bits in a mask
+* @param ptMask - mask to search
+* @param dwStart - first entry to consider
+* @param pdwRunStart - receives the first entry of the run
+* @param pdwRunLength - receives the number of entries in the run
+* @return TRUE if a run was found
+*/
+BOOLEAN
+PageScan64NextRun(
+	_In_	PPAGESCAN64_MASK	ptMask,
+	_In_	UINT32				dwStart,
+	_Out_	PUINT32				pdwRunStart,
+	_Out_	PUINT32				pdwRunLength
+);
+
+#endif /* __INTEL_PAGESCAN64_H__ */
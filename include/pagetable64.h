@@ -0,0 +1,316 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		pagetable64.h
+* @section	Construction of IA-32e paging hierarchies
+*			See Intel's: Software Developers Manual Vol 3A, Section 4.5 IA-32E PAGING
+*/
+
+#ifndef __INTEL_PAGETABLE64_H__
+#define __INTEL_PAGETABLE64_H__
+
+#include "ntshim.h"
+
+#include "paging64.h"
+
+// Disable 'warning C4214: nonstandard extension used: bit field types other than int'
+// Disable 'warning C4201: nonstandard extension used: nameless struct/union'
+#pragma warning(push)
+#pragma warning(disable : 4214)
+#pragma warning(disable : 4201)
+
+// Linear addresses identity mapping physical memory must be in the lower canonical half
+#define PAGING64_IDENTITY_MAP_LIMIT	(1ULL << 47)
+
+/**
+* Allocate a zeroed, page aligned paging-structure table
+* @param pvContext - allocator context
+* @param pqwPhysicalAddress - receives the physical address of the table
+* @return Virtual address of the table, or NULL on failure
+*/
+typedef
+PVOID
+(*PFN_PAGING64_ALLOC_TABLE)(
+	_In_opt_	PVOID	pvContext,
+	_Out_		PUINT64	pqwPhysicalAddress
+);
+
+/**
+* Release a table returned by PFN_PAGING64_ALLOC_TABLE
+* @param pvContext - allocator context
+* @param pvTable - virtual address of the table
+* @param qwPhysicalAddress - physical address of the table
+*/
+typedef
+VOID
+(*PFN_PAGING64_FREE_TABLE)(
+	_In_opt_	PVOID	pvContext,
+	_In_		PVOID	pvTable,
+	_In_		UINT64	qwPhysicalAddress
+);
+
+/**
+* Get the virtual address of a table returned by PFN_PAGING64_ALLOC_TABLE
+* @param pvContext - allocator context
+* @param qwPhysicalAddress - physical address of the table
+* @return Virtual address of the table
+*/
+typedef
+PVOID
+(*PFN_PAGING64_PHYS_TO_VIRT)(
+	_In_opt_	PVOID	pvContext,
+	_In_		UINT64	qwPhysicalAddress
+);
+
+// Source of the table pages of a hierarchy
+typedef struct _PAGING64_TABLE_ALLOCATOR
+{
+	PFN_PAGING64_ALLOC_TABLE pfnAllocTable;
+	PFN_PAGING64_FREE_TABLE pfnFreeTable;
+	PFN_PAGING64_PHYS_TO_VIRT pfnPhysToVirt;
+	PVOID pvContext;
+} PAGING64_TABLE_ALLOCATOR, *PPAGING64_TABLE_ALLOCATOR;
+
+// Attributes of the pages mapped by leaf entries (PDPTE1G64, PDE2MB64 and PTE64)
+typedef union _PAGING64_ATTRIBUTES
+{
+	UINT32 dwValue;
+	struct {
+		UINT32 rw : 1;			// 0		Read/write
+		UINT32 us : 1;			// 1		User/supervisor
+		UINT32 pwt : 1;			// 2		Page-level write-through
+		UINT32 pcd : 1;			// 3		Page-level cache disable
+		UINT32 pat : 1;			// 4		Page Attribute Table
+		UINT32 g : 1;			// 5		Global
+		UINT32 xd : 1;			// 6		Execute-disable
+		UINT32 protkey : 4;		// 7-10		Protection key
+		UINT32 reserved0 : 21;	// 11-31
+	};
+} PAGING64_ATTRIBUTES, *PPAGING64_ATTRIBUTES;
+C_ASSERT(sizeof(UINT32) == sizeof(PAGING64_ATTRIBUTES));
+
+// Range of physical memory
+typedef struct _PAGING64_RANGE
+{
+	UINT64 qwBase;
+	UINT64 qwSize;
+} PAGING64_RANGE, *PPAGING64_RANGE;
+
+/**
+* Called whenever a leaf entry of a hierarchy starts or stops mapping a page
+* @param pvContext - context given with the callback
+* @param qwPml4PhysicalAddress - PML4 of the hierarchy (CR3.Pml4 of the address space)
+* @param qwVa - canonical linear address of the page
+* @param qwPa - physical address of the page
+* @param ePageType - size of the page
+* @param bMapped - TRUE if the page is now mapped, FALSE if it no longer is
+*/
+typedef
+VOID
+(*PFN_PAGING64_LEAF_NOTIFY)(
+	_In_opt_	PVOID		pvContext,
+	_In_		UINT64		qwPml4PhysicalAddress,
+	_In_		UINT64		qwVa,
+	_In_		UINT64		qwPa,
+	_In_		PAGE_TYPE64	ePageType,
+	_In_		BOOLEAN		bMapped
+);
+
+// Paging hierarchy whose tables are owned by an allocator
+typedef struct _PAGING64_HIERARCHY
+{
+	PAGING64_TABLE_ALLOCATOR tAllocator;
+	PPML4E64 ptPml4;
+	UINT64 qwPml4PhysicalAddress;
+	UINT32 dwTablePages;						// Number of tables, including the PML4
+	UINT64 aqwLeafCount[PAGE_TYPES_COUNT];		// Number of leaf entries per page type
+	PFN_PAGING64_LEAF_NOTIFY pfnLeafNotify;		// Optional, told about every leaf change
+	PVOID pvLeafNotifyContext;
+} PAGING64_HIERARCHY, *PPAGING64_HIERARCHY;
+
+/**
+* Initialize an empty hierarchy, allocating its PML4
+* @param ptHierarchy - hierarchy to initialize
+* @param ptAllocator - allocator of the hierarchy's tables
+* @return STATUS_SUCCESS on success
+*		  STATUS_INSUFFICIENT_RESOURCES if the PML4 couldn't be allocated
+*/
+NTSTATUS
+Paging64HierarchyInit(
+	_Out_	PPAGING64_HIERARCHY			ptHierarchy,
+	_In_	PPAGING64_TABLE_ALLOCATOR	ptAllocator
+);
+
+/**
+* Release every table of a hierarchy
+* @param ptHierarchy - hierarchy to destroy
+*/
+VOID
+Paging64HierarchyDestroy(
+	_Inout_ PPAGING64_HIERARCHY ptHierarchy
+);
+
+/**
+* Set the callback told about every leaf the hierarchy's helpers add or remove,
+* including splits, merges and the teardown in Paging64HierarchyDestroy.
+* Attribute-only changes keep the page mapped and aren't reported.
+* @param ptHierarchy - hierarchy to watch
+* @param pfnLeafNotify - callback, or NULL to stop notifying
+* @param pvContext - context passed to pfnLeafNotify
+*/
+VOID
+Paging64HierarchySetLeafNotify(
+	_Inout_		PPAGING64_HIERARCHY			ptHierarchy,
+	_In_opt_	PFN_PAGING64_LEAF_NOTIFY	pfnLeafNotify,
+	_In_opt_	PVOID						pvContext
+);
+
+/**
+* Report every leaf currently present in a hierarchy, as mapped
+* @param ptHierarchy - hierarchy to enumerate
+* @param pfnLeafNotify - called once per leaf with bMapped set
+* @param pvContext - context passed to pfnLeafNotify
+*/
+VOID
+Paging64HierarchyEnumLeaves(
+	_In_		PPAGING64_HIERARCHY			ptHierarchy,
+	_In_		PFN_PAGING64_LEAF_NOTIFY	pfnLeafNotify,
+	_In_opt_	PVOID						pvContext
+);
+
+/**
+* Identity map physical ranges with the fewest tables possible.
+* PDPTE1G64 leaves are used where 1GB alignment allows (if bUse1GbPages),
+* PDE2MB64 leaves where 2MB alignment allows and PTE64 tables only at the
+* unaligned edges. Ranges are rounded out to 4KB and may overlap each other or
+* memory already mapped by the hierarchy, such memory is kept as is.
+* For best results pass coalesced ranges.
+* On failure the hierarchy may be partially built and should be destroyed.
+* @param ptHierarchy - hierarchy to map the ranges in
+* @param ptRanges - physical ranges to map
+* @param dwRangeCount - number of ranges
+* @param tAttributes - attributes of the mapped pages
+* @param bUse1GbPages - whether 1GB pages are supported (CPUID.80000001H:EDX.Page1GB)
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if a range is beyond PAGING64_IDENTITY_MAP_LIMIT
+*		  STATUS_INSUFFICIENT_RESOURCES if a table couldn't be allocated
+*/
+NTSTATUS
+Paging64BuildIdentityMap(
+	_Inout_						PPAGING64_HIERARCHY		ptHierarchy,
+	_In_reads_(dwRangeCount)	const PAGING64_RANGE*	ptRanges,
+	_In_						UINT32					dwRangeCount,
+	_In_						PAGING64_ATTRIBUTES		tAttributes,
+	_In_						BOOLEAN					bUse1GbPages
+);
+
+/**
+* Identity map the host's physical address space into an empty hierarchy.
+* RAM (MmGetPhysicalMemoryRanges) is mapped with tAttributes. Everything else
+* below the end of RAM or 4GB, whichever is higher, is mapped uncacheable
+* (PCD and PWT, PAT entry 3), which covers the legacy VGA window, the local
+* and I/O APICs and the 32-bit PCI window. MMIO above that, e.g. 64-bit PCI
+* BARs, isn't reported by the memory manager and must be passed in ptMmioRanges.
+* Tables are only allocated for the address space that is mapped. 1GB pages
+* are used when Paging64Is1GbPageSupported says so.
+* On failure the hierarchy may be partially built and should be destroyed.
+* @param ptHierarchy - hierarchy to map the address space in
+* @param tAttributes - attributes of the RAM pages, the rest also gets PCD and PWT
+* @param ptMmioRanges - additional MMIO ranges to map uncacheable, may overlap the rest
+* @param dwMmioRangeCount - number of additional MMIO ranges
+* @return STATUS_SUCCESS on success
+*		  STATUS_INSUFFICIENT_RESOURCES if the ranges or a table couldn't be allocated
+*		  STATUS_INVALID_PARAMETER if a range is beyond PAGING64_IDENTITY_MAP_LIMIT
+*/
+NTSTATUS
+Paging64BuildHostIdentityMap(
+	_Inout_								PPAGING64_HIERARCHY		ptHierarchy,
+	_In_								PAGING64_ATTRIBUTES		tAttributes,
+	_In_reads_opt_(dwMmioRangeCount)	const PAGING64_RANGE*	ptMmioRanges,
+	_In_								UINT32					dwMmioRangeCount
+);
+
+/**
+* Map a linear range to a physical range, replacing whatever was mapped there.
+* Large leaves are split only where a range boundary falls inside them, and
+* tables whose 512 entries end up contiguous with identical attributes are
+* collapsed back into a large leaf, keeping the TLB footprint minimal.
+* Entries are replaced with single 64-bit stores, flushing the TLBs is up to the caller.
+* On failure the range may be partially mapped.
+* @param ptHierarchy - hierarchy to map the range in
+* @param qwVa - 4KB aligned canonical linear address
+* @param qwPa - 4KB aligned physical address
+* @param qwSize - size of the range in bytes, multiple of 4KB
+* @param tAttributes - attributes of the mapped pages
+* @param bUse1GbPages - whether 1GB leaves may be used
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the range is unaligned or not canonical
+*		  STATUS_INSUFFICIENT_RESOURCES if a table couldn't be allocated
+*/
+NTSTATUS
+Paging64MapRange(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwPa,
+	_In_	UINT64				qwSize,
+	_In_	PAGING64_ATTRIBUTES	tAttributes,
+	_In_	BOOLEAN				bUse1GbPages
+);
+
+/**
+* Unmap a linear range, splitting large leaves that are partially covered.
+* Tables left empty are released.
+* @param ptHierarchy - hierarchy to unmap the range from
+* @param qwVa - 4KB aligned canonical linear address
+* @param qwSize - size of the range in bytes, multiple of 4KB
+* @return Same as Paging64MapRange
+*/
+NTSTATUS
+Paging64UnmapRange(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwSize
+);
+
+/**
+* Change the attributes of the pages mapped in a linear range, keeping their
+* physical addresses. Holes in the range are left unmapped.
+* Splits and merges large leaves like Paging64MapRange.
+* @param ptHierarchy - hierarchy to change
+* @param qwVa - 4KB aligned canonical linear address
+* @param qwSize - size of the range in bytes, multiple of 4KB
+* @param tAttributes - new attributes of the pages
+* @param bUse1GbPages - whether 1GB leaves may be used
+* @return Same as Paging64MapRange
+*/
+NTSTATUS
+Paging64ProtectRange(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwSize,
+	_In_	PAGING64_ATTRIBUTES	tAttributes,
+	_In_	BOOLEAN				bUse1GbPages
+);
+
+#pragma warning(pop)
+#endif /* __INTEL_PAGETABLE64_H__ */
@@ -0,0 +1,218 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		pagewalk64.h
+* @section	Software IA-32e page walker with a set-associative translation cache
+*			See Intel's: Software Developers Manual Vol 3A, Section 4.5 IA-32E PAGING
+*/
+
+#ifndef __INTEL_PAGEWALK64_H__
+#define __INTEL_PAGEWALK64_H__
+
+#include "ntshim.h"
+
+#include "paging64.h"
+
+// Number of sets and ways in the software TLB (sets must be a power of 2)
+#define PAGING64_TLB_SETS_SHIFT	6
+#define PAGING64_TLB_SETS		(1 << PAGING64_TLB_SETS_SHIFT)
+#define PAGING64_TLB_WAYS		4
+
+/**
+* Read a single 4KB paging-structure table
+* @param pvContext - context given when the reader was set up
+* @param qwTablePhysicalAddress - page aligned physical address of the table
+* @return Pointer to the 512 entries of the table, or NULL if the table can't be read.
+*		  The pointer must stay valid until the next call to the reader
+*/
+typedef
+const VOID*
+(*PFN_PAGING64_READ_TABLE)(
+	_In_opt_	PVOID	pvContext,
+	_In_		UINT64	qwTablePhysicalAddress
+);
+
+// Pluggable physical-memory reader used by the walker
+typedef struct _PAGING64_READER
+{
+	PFN_PAGING64_READ_TABLE pfnReadTable;
+	PVOID pvContext;
+} PAGING64_READER, *PPAGING64_READER;
+
+// Result of translating a linear address
+typedef struct _PAGING64_TRANSLATION
+{
+	UINT64 qwPhysicalAddress;	// Translated physical address, including the page offset
+	UINT64 qwLeafEntry;			// Raw PDPTE1G64/PDE2MB64/PTE64 that maps the page
+	PAGE_TYPE64 ePageType;		// Size of the page that maps the address
+	BOOLEAN bWritable;			// rw is set on every level of the walk
+	BOOLEAN bUser;				// us is set on every level of the walk
+	BOOLEAN bExecuteDisable;	// xd is set on some level of the walk
+} PAGING64_TRANSLATION, *PPAGING64_TRANSLATION;
+
+// A cached translation of a single 4KB linear page (large pages are cached per 4KB)
+typedef struct _PAGING64_TLB_ENTRY
+{
+	UINT64 qwPml4;				// CR3.Pml4 of the address space
+	UINT64 qwVaPage;			// Linear address >> PAGE_SHIFT_4KB
+	UINT64 qwPaPage;			// Physical address of the 4KB page
+	UINT64 qwLeafEntry;
+	PAGE_TYPE64 ePageType;
+	BOOLEAN bValid;
+	BOOLEAN bWritable;
+	BOOLEAN bUser;
+	BOOLEAN bExecuteDisable;
+} PAGING64_TLB_ENTRY, *PPAGING64_TLB_ENTRY;
+
+// Set-associative software TLB keyed by (CR3.Pml4, linear page).
+// Entries are never invalidated implicitly, the owner must flush them whenever
+// the paging structures that produced them change.
+typedef struct _PAGING64_TLB
+{
+	PAGING64_TLB_ENTRY atEntries[PAGING64_TLB_SETS][PAGING64_TLB_WAYS];
+	UINT8 acNextVictim[PAGING64_TLB_SETS];
+	UINT64 qwHits;
+	UINT64 qwMisses;
+} PAGING64_TLB, *PPAGING64_TLB;
+
+// Page walker context. Not thread-safe, use one walker per CPU/thread.
+typedef struct _PAGING64_WALKER
+{
+	PAGING64_READER tReader;
+	PAGING64_TLB tTlb;
+} PAGING64_WALKER, *PPAGING64_WALKER;
+
+/**
+* Translate a linear address by walking the IA-32e paging structures.
+* Handles 1GB (PDPTE1G64) and 2MB (PDE2MB64) leaves.
+* @param ptReader - reader used to access the paging structures
+* @param tCr3 - CR3 of the address space
+* @param qwVa - linear address to translate
+* @param ptTranslation - translation result
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the address is non-canonical
+*		  STATUS_NOT_FOUND if some entry on the path is not present
+*		  STATUS_ACCESS_VIOLATION if the reader failed to read a table
+*/
+NTSTATUS
+Paging64Walk(
+	_In_	PPAGING64_READER		ptReader,
+	_In_	CR3_REG					tCr3,
+	_In_	UINT64					qwVa,
+	_Out_	PPAGING64_TRANSLATION	ptTranslation
+);
+
+/**
+* Initialize a page walker with an empty TLB
+* @param ptWalker - walker to initialize
+* @param pfnReadTable - reader used to access the paging structures
+* @param pvContext - context passed to pfnReadTable
+*/
+VOID
+Paging64WalkerInit(
+	_Out_		PPAGING64_WALKER		ptWalker,
+	_In_		PFN_PAGING64_READ_TABLE	pfnReadTable,
+	_In_opt_	PVOID					pvContext
+);
+
+/**
+* Translate a linear address, using the walker's TLB when possible.
+* A TLB hit costs a single hashed lookup, a miss walks and fills the TLB.
+* @param ptWalker - walker to use
+* @param tCr3 - CR3 of the address space
+* @param qwVa - linear address to translate
+* @param ptTranslation - translation result
+* @return Same as Paging64Walk
+*/
+NTSTATUS
+Paging64WalkerTranslate(
+	_Inout_	PPAGING64_WALKER		ptWalker,
+	_In_	CR3_REG					tCr3,
+	_In_	UINT64					qwVa,
+	_Out_	PPAGING64_TRANSLATION	ptTranslation
+);
+
+/**
+* Invalidate every entry in the TLB
+* @param ptTlb - TLB to flush
+*/
+VOID
+Paging64TlbFlushAll(
+	_Inout_ PPAGING64_TLB ptTlb
+);
+
+/**
+* Invalidate all the entries of a single address space
+* @param ptTlb - TLB to flush
+* @param tCr3 - CR3 of the address space
+*/
+VOID
+Paging64TlbFlushAddressSpace(
+	_Inout_	PPAGING64_TLB	ptTlb,
+	_In_	CR3_REG			tCr3
+);
+
+/**
+* Invalidate the entries of a linear range in a single address space.
+* When a large page mapping changes the whole large page range must be flushed.
+* @param ptTlb - TLB to flush
+* @param tCr3 - CR3 of the address space
+* @param qwVa - start of the linear range
+* @param qwSize - size of the linear range in bytes
+*/
+VOID
+Paging64TlbFlushRange(
+	_Inout_	PPAGING64_TLB	ptTlb,
+	_In_	CR3_REG			tCr3,
+	_In_	UINT64			qwVa,
+	_In_	UINT64			qwSize
+);
+
+/**
+* Translate many linear addresses of a single address space at once.
+* Upper-level entries (PML4E/PDPTE/PDE) are read once per group of addresses that
+* share them, so input sorted by address walks each shared table exactly once.
+* If pdwOrder is given the addresses are first sorted through it (in place, without
+* allocating), otherwise they are walked in the given order.
+* The TLB is not used nor filled, so big scans don't thrash it.
+* @param ptReader - reader used to access the paging structures
+* @param tCr3 - CR3 of the address space
+* @param pqwVas - linear addresses to translate
+* @param dwCount - number of addresses
+* @param pdwOrder - optional scratch array of dwCount entries, receives the walk order
+* @param ptTranslations - receives the translation of pqwVas[i] at index i
+* @param peStatuses - receives the status of pqwVas[i] at index i (see Paging64Walk)
+* @return Number of addresses successfully translated
+*/
+UINT32
+Paging64WalkBatch(
+	_In_								PPAGING64_READER		ptReader,
+	_In_								CR3_REG					tCr3,
+	_In_reads_(dwCount)					const UINT64*			pqwVas,
+	_In_								UINT32					dwCount,
+	_Inout_updates_opt_(dwCount)		PUINT32					pdwOrder,
+	_Out_writes_(dwCount)				PPAGING64_TRANSLATION	ptTranslations,
+	_Out_writes_(dwCount)				NTSTATUS*				peStatuses
+);
+
+#endif /* __INTEL_PAGEWALK64_H__ */
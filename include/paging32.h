@@ -0,0 +1,193 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		paging32.h
+* @section	Intel 32-bit and PAE Page Tables structures and constants
+*			See Intel's: Software Developers Manual Vol 3A, Section 4.3 32-BIT PAGING
+*			and Section 4.4 PAE PAGING
+*/
+
+#ifndef __INTEL_PAGING32_H__
+#define __INTEL_PAGING32_H__
+
+#include <ntddk.h>
+
+#include "paging64.h"
+
+#define PAGING32_PDE_COUNT		1024
+#define PAGING32_PTE_COUNT		1024
+#define PAGING_PAE_PDPTE_COUNT	4
+
+#define PAGE_SIZE_4MB	0x400000
+#define PAGE_SHIFT_4MB	22L // PAGE_SIZE_4MB == 1 << 22
+
+// Bits 12-31 of CR3 and of 32-bit paging entries hold a physical address
+#define PAGING32_PHYS_ADDR_MASK		0xFFFFF000UL
+
+// Vol 3A, 4.4.1 With PAE paging CR3 bits 31:5 locate the 32-byte aligned PDPT
+#define PAGING_PAE_CR3_PDPT_MASK	0xFFFFFFE0UL
+
+// Table 4-5. Format of a 32-Bit Page-Directory Entry that Maps a 4-MByte Page
+typedef struct _PDE4MB32
+{
+	UINT32 p : 1;			// 0 Present
+	UINT32 rw : 1;			// 1 Read/write; if 0, writes are not allowed
+	UINT32 us : 1;			// 2 User/supervisor; if 0, user-mode access isn't allowed
+	UINT32 pwt : 1;			// 3 Page-level write-through
+	UINT32 pcd : 1;			// 4 Page-level cache disable
+	UINT32 a : 1;			// 5 Accessed; indicates whether software has accessed the page
+	UINT32 d : 1;			// 6 Dirty; indicates whether software has written to the page
+	UINT32 ps : 1;			// 7 Page-Size; must be 1 (CR4.PSE = 1) to map a 4MB page
+	UINT32 g : 1;			// 8 Global; if CR4.PGE = 1, determines whether the translation is global
+	UINT32 ignored0 : 3;	// 9-11
+	UINT32 pat : 1;			// 12 Page Attribute Table
+	UINT32 addrhigh : 8;	// 13-20 Bits 39:32 of the physical address of the page (PSE-36)
+	UINT32 reserved0 : 1;	// 21
+	UINT32 addr : 10;		// 22-31 Bits 31:22 of the physical address of the page
+} PDE4MB32, *PPDE4MB32;
+C_ASSERT(sizeof(UINT32) == sizeof(PDE4MB32));
+
+// Field descriptors, see field64.h
+#define PDE4MB32_FIELD_LIST(X) \
+	X(PDE4MB32, P,			0,	1) \
+	X(PDE4MB32, RW,			1,	1) \
+	X(PDE4MB32, US,			2,	1) \
+	X(PDE4MB32, PWT,		3,	1) \
+	X(PDE4MB32, PCD,		4,	1) \
+	X(PDE4MB32, A,			5,	1) \
+	X(PDE4MB32, D,			6,	1) \
+	X(PDE4MB32, PS,			7,	1) \
+	X(PDE4MB32, G,			8,	1) \
+	X(PDE4MB32, IGNORED0,	9,	3) \
+	X(PDE4MB32, PAT,		12,	1) \
+	X(PDE4MB32, ADDRHIGH,	13,	8) \
+	X(PDE4MB32, RESERVED0,	21,	1) \
+	X(PDE4MB32, ADDR,		22,	10)
+FIELD64_DECLARE(PDE4MB32, PDE4MB32_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PDE4MB32_FIELD_LIST, 32);
+
+// Table 4-6. Format of a 32-Bit Page-Directory Entry that References a Page Table
+typedef struct _PDE32
+{
+	UINT32 p : 1;			// 0 Present
+	UINT32 rw : 1;			// 1 Read/write; if 0, writes are not allowed
+	UINT32 us : 1;			// 2 User/supervisor; if 0, user-mode access isn't allowed
+	UINT32 pwt : 1;			// 3 Page-level write-through
+	UINT32 pcd : 1;			// 4 Page-level cache disable
+	UINT32 a : 1;			// 5 Accessed; indicates whether software has accessed the page
+	UINT32 ignored0 : 1;	// 6
+	UINT32 ps : 1;			// 7 Page-Size; must be 0 to reference a page table
+	UINT32 ignored1 : 4;	// 8-11
+	UINT32 addr : 20;		// 12-31 Physical address of the page table
+} PDE32, *PPDE32;
+C_ASSERT(sizeof(UINT32) == sizeof(PDE32));
+
+// Field descriptors, see field64.h
+#define PDE32_FIELD_LIST(X) \
+	X(PDE32, P,			0,	1) \
+	X(PDE32, RW,		1,	1) \
+	X(PDE32, US,		2,	1) \
+	X(PDE32, PWT,		3,	1) \
+	X(PDE32, PCD,		4,	1) \
+	X(PDE32, A,			5,	1) \
+	X(PDE32, IGNORED0,	6,	1) \
+	X(PDE32, PS,		7,	1) \
+	X(PDE32, IGNORED1,	8,	4) \
+	X(PDE32, ADDR,		12,	20)
+FIELD64_DECLARE(PDE32, PDE32_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PDE32_FIELD_LIST, 32);
+
+// Table 4-6. Format of a 32-Bit Page-Table Entry that Maps a 4-KByte Page
+typedef struct _PTE32
+{
+	UINT32 p : 1;			// 0 Present
+	UINT32 rw : 1;			// 1 Read/write; if 0, writes are not allowed
+	UINT32 us : 1;			// 2 User/supervisor; if 0, user-mode access isn't allowed
+	UINT32 pwt : 1;			// 3 Page-level write-through
+	UINT32 pcd : 1;			// 4 Page-level cache disable
+	UINT32 a : 1;			// 5 Accessed; indicates whether software has accessed the page
+	UINT32 d : 1;			// 6 Dirty; indicates whether software has written to the page
+	UINT32 pat : 1;			// 7 Page Attribute Table
+	UINT32 g : 1;			// 8 Global; if CR4.PGE = 1, determines whether the translation is global
+	UINT32 ignored0 : 3;	// 9-11
+	UINT32 addr : 20;		// 12-31 Physical address of the page
+} PTE32, *PPTE32;
+C_ASSERT(sizeof(UINT32) == sizeof(PTE32));
+
+// Field descriptors, see field64.h
+#define PTE32_FIELD_LIST(X) \
+	X(PTE32, P,			0,	1) \
+	X(PTE32, RW,		1,	1) \
+	X(PTE32, US,		2,	1) \
+	X(PTE32, PWT,		3,	1) \
+	X(PTE32, PCD,		4,	1) \
+	X(PTE32, A,			5,	1) \
+	X(PTE32, D,			6,	1) \
+	X(PTE32, PAT,		7,	1) \
+	X(PTE32, G,			8,	1) \
+	X(PTE32, IGNORED0,	9,	3) \
+	X(PTE32, ADDR,		12,	20)
+FIELD64_DECLARE(PTE32, PTE32_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PTE32_FIELD_LIST, 32);
+
+// A 32-bit PDE either maps a 4MB page or references a page table, according to ps
+// (4MB pages are only used if CR4.PSE = 1)
+typedef union _PDE_ANY32
+{
+	UINT32 dwValue;
+	PDE32 tTable;
+	PDE4MB32 tLeaf;
+} PDE_ANY32, *PPDE_ANY32;
+C_ASSERT(sizeof(UINT32) == sizeof(PDE_ANY32));
+
+// Table 4-8. Format of a PAE Page-Directory-Pointer-Table Entry (PDPTE).
+// Unlike IA-32e PDPTEs these hold no access rights, and the processor loads all
+// four of them from CR3 when it loads CR3 (with EPT they are kept in the VMCS).
+// PAE page directories and page tables use the IA-32e PDE_ANY64/PTE64 formats.
+typedef struct _PDPTE_PAE
+{
+	UINT64 p : 1;			// 0 Present
+	UINT64 reserved0 : 2;	// 1-2
+	UINT64 pwt : 1;			// 3 Page-level write-through
+	UINT64 pcd : 1;			// 4 Page-level cache disable
+	UINT64 reserved1 : 4;	// 5-8
+	UINT64 ignored0 : 3;	// 9-11
+	UINT64 addr : 40;		// 12-51 Physical address of the page directory
+	UINT64 reserved2 : 12;	// 52-63
+} PDPTE_PAE, *PPDPTE_PAE;
+C_ASSERT(sizeof(UINT64) == sizeof(PDPTE_PAE));
+
+// Field descriptors, see field64.h
+#define PDPTE_PAE_FIELD_LIST(X) \
+	X(PDPTE_PAE, P,			0,	1) \
+	X(PDPTE_PAE, RESERVED0,	1,	2) \
+	X(PDPTE_PAE, PWT,		3,	1) \
+	X(PDPTE_PAE, PCD,		4,	1) \
+	X(PDPTE_PAE, RESERVED1,	5,	4) \
+	X(PDPTE_PAE, IGNORED0,	9,	3) \
+	X(PDPTE_PAE, ADDR,		12,	40) \
+	X(PDPTE_PAE, RESERVED2,	52,	12)
+FIELD64_DECLARE(PDPTE_PAE, PDPTE_PAE_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PDPTE_PAE_FIELD_LIST, 64);
+
+#endif /* __INTEL_PAGING32_H__ */
@@ -29,11 +29,11 @@
 #ifndef __INTEL_PAGING64_H__
 #define __INTEL_PAGING64_H__
 
-#include <ntddk.h>
-#include <intrin.h>
+#include "ntshim.h"
 
 #include "msr64.h"
 #include "cr64.h"
+#include "field64.h"
 
 #define PAGING64_PML4E_COUNT	512
 #define PAGING64_PDPTE_COUNT	512
@@ -51,6 +51,7 @@
 //  The ROUND_TO_PAGES macro takes a size in bytes and rounds it up to a
 //  multiple of the page size.
 //  NOTE: This macro fails for values 0xFFFFFFFF - (PAGE_SIZE - 1).
+//  Use PAGING64_CHUNK_ITERATOR to split spans that may reach the top of the address space.
 #define ROUND_TO_PAGES_1GB(Size)  (((UINT64)(Size) + PAGE_SIZE_1GB - 1) & ~(PAGE_SIZE_1GB - 1))
 #define ROUND_TO_PAGES_2MB(Size)  (((UINT64)(Size) + PAGE_SIZE_2MB - 1) & ~(PAGE_SIZE_2MB - 1))
 #define ROUND_TO_PAGES_4KB(Size)  (((UINT64)(Size) + PAGE_SIZE_4KB - 1) & ~(PAGE_SIZE_4KB - 1))
@@ -84,6 +85,23 @@
 #define ADDRESS_AND_SIZE_TO_SPAN_PAGES_4KB(Va,Size) \
     ((BYTE_OFFSET_4KB(Va) + ((UINT64) (Size)) + (PAGE_SIZE_4KB - 1)) >> PAGE_SHIFT_4KB)
 
+// Bits 12-51 of CR3 and of every paging-structure entry hold a physical address
+#define PAGING64_PHYS_ADDR_MASK	0x000FFFFFFFFFF000ULL
+
+// Vol 3A, 4.1.1 Linear addresses are canonical if bits 63:47 are all equal
+#define PAGING64_IS_CANONICAL(Va) \
+	((INT64)((UINT64)(Va) << 16) >> 16 == (INT64)(Va))
+
+// Bits shared by every paging-structure entry
+#define PAGING64_ENTRY_PRESENT		0x1ULL	// p
+#define PAGING64_ENTRY_PAGE_SIZE	0x80ULL	// ps, maps a page rather than a table (PDPTE/PDE only)
+#define PAGING64_IS_LEAF(qwEntry) \
+	((PAGING64_ENTRY_PRESENT | PAGING64_ENTRY_PAGE_SIZE) == \
+	 ((qwEntry) & (PAGING64_ENTRY_PRESENT | PAGING64_ENTRY_PAGE_SIZE)))
+#define PAGING64_IS_TABLE(qwEntry) \
+	(PAGING64_ENTRY_PRESENT == \
+	 ((qwEntry) & (PAGING64_ENTRY_PRESENT | PAGING64_ENTRY_PAGE_SIZE)))
+
 typedef enum _PAGE_TYPE64 {
 	PAGE_TYPE_FIRST = 0,
 	PAGE_TYPE_1GB = PAGE_TYPE_FIRST,
@@ -92,6 +110,28 @@ typedef enum _PAGE_TYPE64 {
 	PAGE_TYPES_COUNT // Must be last!
 } PAGE_TYPE64, *PPAGE_TYPE64;
 
+// Shift and size of the pages of a PAGE_TYPE64
+#define PAGE_TYPE64_SHIFT(ePageType)	(PAGE_SHIFT_1GB - 9 * (UINT32)(ePageType))
+#define PAGE_TYPE64_SIZE(ePageType)		(1ULL << PAGE_TYPE64_SHIFT(ePageType))
+
+// A run of naturally aligned pages of a single size
+typedef struct _PAGING64_CHUNK
+{
+	UINT64 qwAddress;
+	UINT64 qwPageCount;
+	PAGE_TYPE64 ePageType;
+} PAGING64_CHUNK, *PPAGING64_CHUNK;
+
+// Splits a span into the fewest chunks of 1GB/2MB/4KB pages, see Paging64ChunkIteratorInit
+typedef struct _PAGING64_CHUNK_ITERATOR
+{
+	UINT64 qwNext;			// First address not returned yet
+	UINT64 qwLast;			// Last byte of the span, inclusive so spans may end at 2^64
+	UINT64 qwAlignDelta;	// Bits that must be clear in a page offset mask to use the page
+	PAGE_TYPE64 eLargest;	// Largest page type allowed
+	BOOLEAN bDone;
+} PAGING64_CHUNK_ITERATOR, *PPAGING64_CHUNK_ITERATOR;
+
 typedef union _VA_ADDRESS64
 {
 	UINT64 qwValue;
@@ -136,11 +176,28 @@ typedef struct _PML4E64
 	UINT64 ps : 1;			// 7 Page-Size; must be 0
 	UINT64 ignored1 : 4;	// 8-11
 	UINT64 addr : 39;		// 12-50 Physical address that the entry points to
-	UINT64 ignored1 : 12;	// 51-62
+	UINT64 ignored2 : 12;	// 51-62
 	UINT64 xd : 1;			// 63 If IA32_EFER.NXE = 1, execute-disable
 } PML4E64, *PPML4E64;
 C_ASSERT(sizeof(UINT64) == sizeof(PML4E64));
 
+// Field descriptors, see field64.h
+#define PML4E64_FIELD_LIST(X) \
+	X(PML4E64, P,			0,	1) \
+	X(PML4E64, RW,			1,	1) \
+	X(PML4E64, US,			2,	1) \
+	X(PML4E64, PWT,			3,	1) \
+	X(PML4E64, PCD,			4,	1) \
+	X(PML4E64, A,			5,	1) \
+	X(PML4E64, IGNORED0,	6,	1) \
+	X(PML4E64, PS,			7,	1) \
+	X(PML4E64, IGNORED1,	8,	4) \
+	X(PML4E64, ADDR,		12,	39) \
+	X(PML4E64, IGNORED2,	51,	12) \
+	X(PML4E64, XD,			63,	1)
+FIELD64_DECLARE(PML4E64, PML4E64_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PML4E64_FIELD_LIST, 64);
+
 // Table 4-15. Format of an IA-32e Page-Directory-Pointer-Table Entry (PDPTE) that Maps a 1-GByte Page
 typedef struct _PDPTE1G64
 {
@@ -164,6 +221,27 @@ typedef struct _PDPTE1G64
 } PDPTE1G64, *PPDPTE1G64;
 C_ASSERT(sizeof(UINT64) == sizeof(PDPTE1G64));
 
+// Field descriptors, see field64.h
+#define PDPTE1G64_FIELD_LIST(X) \
+	X(PDPTE1G64, P,			0,	1) \
+	X(PDPTE1G64, RW,		1,	1) \
+	X(PDPTE1G64, US,		2,	1) \
+	X(PDPTE1G64, PWT,		3,	1) \
+	X(PDPTE1G64, PCD,		4,	1) \
+	X(PDPTE1G64, A,			5,	1) \
+	X(PDPTE1G64, D,			6,	1) \
+	X(PDPTE1G64, PS,		7,	1) \
+	X(PDPTE1G64, G,			8,	1) \
+	X(PDPTE1G64, IGNORED0,	9,	3) \
+	X(PDPTE1G64, PAT,		12,	1) \
+	X(PDPTE1G64, RESERVED0,	13,	17) \
+	X(PDPTE1G64, ADDR,		30,	21) \
+	X(PDPTE1G64, IGNORED1,	51,	8) \
+	X(PDPTE1G64, PROTKEY,	59,	4) \
+	X(PDPTE1G64, XD,		63,	1)
+FIELD64_DECLARE(PDPTE1G64, PDPTE1G64_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PDPTE1G64_FIELD_LIST, 64);
+
 // Table 4-16. Format of an IA-32e Page-Directory-Pointer-Table Entry (PDPTE) that References a Page Directory
 typedef struct _PDPTE64
 {
@@ -175,13 +253,30 @@ typedef struct _PDPTE64
 	UINT64 a			: 1;	// 5 Accessed; indicates whether software has accessed the page
 	UINT64 d			: 1;	// 6 Dirty; indicates whether software has written to the page
 	UINT64 ps			: 1;	// 7 Page-Size; must be 0 to refernce PDE
-	UINT64 reserved1	: 3;	// 8-11
+	UINT64 reserved1	: 4;	// 8-11
 	UINT64 addr			: 39;	// 12-50 Physical address that the entry points to
 	UINT64 reserved2	: 12;	// 51-62
 	UINT64 xd			: 1;	// 63 If IA32_EFER.NXE = 1, execute-disable
 } PDPTE64, *PPDPTE64;
 C_ASSERT(sizeof(UINT64) == sizeof(PDPTE64));
 
+// Field descriptors, see field64.h
+#define PDPTE64_FIELD_LIST(X) \
+	X(PDPTE64, P,			0,	1) \
+	X(PDPTE64, RW,			1,	1) \
+	X(PDPTE64, US,			2,	1) \
+	X(PDPTE64, PWT,			3,	1) \
+	X(PDPTE64, PCD,			4,	1) \
+	X(PDPTE64, A,			5,	1) \
+	X(PDPTE64, D,			6,	1) \
+	X(PDPTE64, PS,			7,	1) \
+	X(PDPTE64, RESERVED1,	8,	4) \
+	X(PDPTE64, ADDR,		12,	39) \
+	X(PDPTE64, RESERVED2,	51,	12) \
+	X(PDPTE64, XD,			63,	1)
+FIELD64_DECLARE(PDPTE64, PDPTE64_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PDPTE64_FIELD_LIST, 64);
+
 // Table 4-17. Format of an IA-32e Page-Directory Entry that Maps a 2-MByte Page
 typedef struct _PDE2MB64
 {
@@ -205,6 +300,27 @@ typedef struct _PDE2MB64
 } PDE2MB64, *PPDE2MB64;
 C_ASSERT(sizeof(UINT64) == sizeof(PDE2MB64));
 
+// Field descriptors, see field64.h
+#define PDE2MB64_FIELD_LIST(X) \
+	X(PDE2MB64, P,			0,	1) \
+	X(PDE2MB64, RW,			1,	1) \
+	X(PDE2MB64, US,			2,	1) \
+	X(PDE2MB64, PWT,		3,	1) \
+	X(PDE2MB64, PCD,		4,	1) \
+	X(PDE2MB64, A,			5,	1) \
+	X(PDE2MB64, D,			6,	1) \
+	X(PDE2MB64, PS,			7,	1) \
+	X(PDE2MB64, G,			8,	1) \
+	X(PDE2MB64, IGNORED0,	9,	3) \
+	X(PDE2MB64, PAT,		12,	1) \
+	X(PDE2MB64, RESERVED0,	13,	8) \
+	X(PDE2MB64, ADDR,		21,	30) \
+	X(PDE2MB64, IGNORED1,	51,	8) \
+	X(PDE2MB64, PROTKEY,	59,	4) \
+	X(PDE2MB64, XD,			63,	1)
+FIELD64_DECLARE(PDE2MB64, PDE2MB64_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PDE2MB64_FIELD_LIST, 64);
+
 // Table 4-18. Format of an IA-32e Page-Directory Entry that References a Page Table
 typedef struct _PDE64
 {
@@ -223,6 +339,23 @@ typedef struct _PDE64
 } PDE64, *PPDE64;
 C_ASSERT(sizeof(UINT64) == sizeof(PDE64));
 
+// Field descriptors, see field64.h
+#define PDE64_FIELD_LIST(X) \
+	X(PDE64, P,			0,	1) \
+	X(PDE64, RW,		1,	1) \
+	X(PDE64, US,		2,	1) \
+	X(PDE64, PWT,		3,	1) \
+	X(PDE64, PCD,		4,	1) \
+	X(PDE64, A,			5,	1) \
+	X(PDE64, RESERVED0,	6,	1) \
+	X(PDE64, PS,		7,	1) \
+	X(PDE64, RESERVED1,	8,	4) \
+	X(PDE64, ADDR,		12,	39) \
+	X(PDE64, RESERVED2,	51,	12) \
+	X(PDE64, XD,		63,	1)
+FIELD64_DECLARE(PDE64, PDE64_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PDE64_FIELD_LIST, 64);
+
 // Table 4-19. Format of an IA-32e Page-Table Entry that Maps a 4-KByte Page
 typedef struct _PTE64
 {
@@ -244,7 +377,143 @@ typedef struct _PTE64
 } PTE64, *PPTE64;
 C_ASSERT(sizeof(UINT64) == sizeof(PTE64));
 
+// Field descriptors, see field64.h
+#define PTE64_FIELD_LIST(X) \
+	X(PTE64, P,			0,	1) \
+	X(PTE64, RW,		1,	1) \
+	X(PTE64, US,		2,	1) \
+	X(PTE64, PWT,		3,	1) \
+	X(PTE64, PCD,		4,	1) \
+	X(PTE64, A,			5,	1) \
+	X(PTE64, D,			6,	1) \
+	X(PTE64, PAT,		7,	1) \
+	X(PTE64, G,			8,	1) \
+	X(PTE64, IGNORED0,	9,	3) \
+	X(PTE64, ADDR,		12,	39) \
+	X(PTE64, IGNORED1,	51,	8) \
+	X(PTE64, PROTKEY,	59,	4) \
+	X(PTE64, XD,		63,	1)
+FIELD64_DECLARE(PTE64, PTE64_FIELD_LIST);
+FIELD64_CHECK_LAYOUT(PTE64_FIELD_LIST, 64);
+
+// A PDPTE either maps a 1GB page or references a page directory, according to ps
+typedef union _PDPTE_ANY64
+{
+	UINT64 qwValue;
+	PDPTE64 tTable;
+	PDPTE1G64 tLeaf;
+} PDPTE_ANY64, *PPDPTE_ANY64;
+C_ASSERT(sizeof(UINT64) == sizeof(PDPTE_ANY64));
+
+// A PDE either maps a 2MB page or references a page table, according to ps
+typedef union _PDE_ANY64
+{
+	UINT64 qwValue;
+	PDE64 tTable;
+	PDE2MB64 tLeaf;
+} PDE_ANY64, *PPDE_ANY64;
+C_ASSERT(sizeof(UINT64) == sizeof(PDE_ANY64));
+
+// Paging entries shared with the processor (or other CPUs) must only be accessed
+// as whole 64-bit values: compose them with FIELD64_MAKE/FIELD64_SET and publish
+// them with one of the accessors below
+#define PAGING64_ENTRY_READ(pqwEntry)			(*(volatile UINT64*)(pqwEntry))
+#define PAGING64_ENTRY_WRITE(pqwEntry, qwValue)	(*(volatile UINT64*)(pqwEntry) = (UINT64)(qwValue))
+
+// Atomically replace an entry if it still holds qwExpected, returns the previous value
+#define PAGING64_ENTRY_COMPARE_EXCHANGE(pqwEntry, qwValue, qwExpected) \
+	((UINT64)InterlockedCompareExchange64((volatile LONG64*)(pqwEntry), \
+		(LONG64)(qwValue), (LONG64)(qwExpected)))
+
+// Atomically clear bits of an entry (e.g. FIELD64_MASK(PTE64_A)), returns the previous value
+#define PAGING64_ENTRY_CLEAR_BITS(pqwEntry, qwMask) \
+	((UINT64)InterlockedAnd64((volatile LONG64*)(pqwEntry), ~(LONG64)(qwMask)))
+
+/**
+* Atomically replace several fields of an entry with a single CAS, leaving the
+* bits outside qwMask (such as accessed/dirty bits set concurrently by the
+* processor) untouched
+* @param pqwEntry - entry to update
+* @param qwMask - bits to replace, usually an OR of FIELD64_MASK
+* @param qwValue - new value of the bits in qwMask, usually an OR of FIELD64_MAKE
+* @return Value of the entry before the update
+*/
+UINT64
+Paging64EntryUpdate(
+	_Inout_	volatile UINT64*	pqwEntry,
+	_In_	UINT64				qwMask,
+	_In_	UINT64				qwValue
+);
+
+/**
+* Same as Paging64EntryUpdate, but only if the bits in qwExpectMask still hold
+* qwExpectValue, e.g. to change a leaf only while it's present
+* @param pqwEntry - entry to update
+* @param qwExpectMask - bits to check
+* @param qwExpectValue - expected value of the bits in qwExpectMask
+* @param qwMask - bits to replace
+* @param qwValue - new value of the bits in qwMask
+* @param pqwPrevious - optional, receives the value of the entry before the attempt
+* @return TRUE if the entry was updated
+*/
+BOOLEAN
+Paging64EntryUpdateIf(
+	_Inout_		volatile UINT64*	pqwEntry,
+	_In_		UINT64				qwExpectMask,
+	_In_		UINT64				qwExpectValue,
+	_In_		UINT64				qwMask,
+	_In_		UINT64				qwValue,
+	_Out_opt_	PUINT64				pqwPrevious
+);
+
+/**
+* Start splitting a span into the minimal sequence of chunks, each a run of
+* naturally aligned pages of one size: at most a 4KB head, a 2MB head, a run of
+* 1GB pages, a 2MB tail and a 4KB tail. Doesn't allocate and never overflows,
+* spans may end exactly at the top of the address space.
+* @param ptIterator - iterator to initialize
+* @param qwAddress - start of the span, rounded down to 4KB
+* @param qwSize - size of the span in bytes, the end is rounded up to 4KB
+* @param qwAlignWith - address the span is mapped to (e.g. the physical address of a
+*					   linear span), pages are only used where both sides are aligned.
+*					   Pass qwAddress to align the span alone
+* @param bUse1GbPages - whether 1GB pages may be used
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the span wraps around the address space
+*/
+NTSTATUS
+Paging64ChunkIteratorInit(
+	_Out_	PPAGING64_CHUNK_ITERATOR	ptIterator,
+	_In_	UINT64						qwAddress,
+	_In_	UINT64						qwSize,
+	_In_	UINT64						qwAlignWith,
+	_In_	BOOLEAN						bUse1GbPages
+);
+
+/**
+* Get the next chunk of a span
+* @param ptIterator - iterator initialized by Paging64ChunkIteratorInit
+* @param ptChunk - receives the chunk
+* @return TRUE if a chunk was returned, FALSE once the whole span was returned
+*/
+BOOLEAN
+Paging64ChunkIteratorNext(
+	_Inout_	PPAGING64_CHUNK_ITERATOR	ptIterator,
+	_Out_	PPAGING64_CHUNK				ptChunk
+);
+
+/**
+* Check whether the processor supports 1GB pages (PDPTE1G64 leaves)
+* @return TRUE if CPUID.80000001H:EDX.Page1GB [bit 26] is set
+*/
+BOOLEAN
+Paging64Is1GbPageSupported(
+	VOID
+);
+
 // Page table example (sizeof(PAGE_TABLE64) is about ~2MB)
+// Maps exactly 512GB with 2MB pages, see Paging64BuildHostIdentityMap (pagetable64.h)
+// for a hierarchy sized to the host's actual memory
 typedef struct _PAGE_TABLE64
 {
 	DECLSPEC_ALIGN(PAGE_SIZE) PML4E64 atPml4[PAGING64_PML4E_COUNT];
@@ -253,4 +522,4 @@ typedef struct _PAGE_TABLE64
 	UINT64 qwPhysicalAddress;
 } PAGE_TABLE64, *PPAGE_TABLE64;
 
-#endif  /* __INTEL_MSR64_H__ */
+#endif  /* __INTEL_PAGING64_H__ */
@@ -0,0 +1,189 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		pml64.h
+* @section	Page-modification logging and the dirty page bitmap it feeds
+*			See Intel's: Software Developers Manual Vol 3C, Section 28.2.6 Page-Modification Logging
+*/
+
+#ifndef __INTEL_PML64_H__
+#define __INTEL_PML64_H__
+
+#include <ntddk.h>
+
+#include "VT-x.h"
+#include "pagetable64.h"
+
+// The log is a 4KB page of guest-physical addresses, filled from the last entry down
+#define PML64_LOG_ENTRIES		512
+#define PML64_LOG_INDEX_START	(PML64_LOG_ENTRIES - 1)
+
+// Vol 3C, 27.2.1 Basic VM-Exit Information - exit qualification of a PML-full VM exit
+#define PML64_EXIT_QUALIFICATION_NMI_UNBLOCKING	(1ULL << 12)
+
+// Vol 3C, Table 24-3. Format of Interruptibility State
+#define PML64_INTERRUPTIBILITY_BLOCKING_BY_NMI	(1ULL << 3)
+
+// Bitmap words needed to cover a number of 4KB pages
+#define PML64_BITMAP_BITS_PER_WORD	64
+#define PML64_BITMAP_WORDS(qwPageCount) \
+	(((qwPageCount) + PML64_BITMAP_BITS_PER_WORD - 1) / PML64_BITMAP_BITS_PER_WORD)
+
+// Per-VM bitmap of the 4KB guest-physical pages written since they were last
+// harvested. Marking and harvesting are lock-free and may run on any CPU at once.
+typedef struct _PML64_DIRTY_BITMAP
+{
+	volatile LONG64* pqwBits;			// PML64_BITMAP_WORDS(qwPageCount) words
+	UINT64 qwPageCount;					// Pages covered, starting at guest-physical 0
+	volatile LONG64 qwOutOfRangePages;	// Logged pages beyond qwPageCount, dropped
+} PML64_DIRTY_BITMAP, *PPML64_DIRTY_BITMAP;
+
+// Per-vCPU page-modification log. Only the vCPU's own CPU may touch it, with
+// the vCPU's VMCS current.
+typedef struct _PML64_VCPU
+{
+	PAGING64_TABLE_ALLOCATOR tAllocator;
+	PUINT64 pqwLog;						// PML64_LOG_ENTRIES guest-physical addresses
+	UINT64 qwLogPhysicalAddress;
+	PPML64_DIRTY_BITMAP ptBitmap;		// Receives the drained addresses
+	UINT64 qwFullExits;					// Number of PML-full VM exits handled
+	UINT64 qwDrainedEntries;			// Number of log entries drained
+} PML64_VCPU, *PPML64_VCPU;
+
+/**
+* Initialize an empty dirty bitmap over caller-provided storage
+* @param ptBitmap - bitmap to initialize
+* @param pqwBits - PML64_BITMAP_WORDS(qwPageCount) words of storage, cleared here
+* @param qwPageCount - number of 4KB guest-physical pages to track
+*/
+VOID
+Pml64DirtyBitmapInit(
+	_Out_								PPML64_DIRTY_BITMAP	ptBitmap,
+	_Out_writes_(PML64_BITMAP_WORDS(qwPageCount))	volatile LONG64*	pqwBits,
+	_In_								UINT64				qwPageCount
+);
+
+/**
+* Mark the page of a guest-physical address as dirty
+* @param ptBitmap - bitmap to mark
+* @param qwGuestPhysicalAddress - address of a written byte
+*/
+VOID
+Pml64DirtyBitmapMark(
+	_Inout_	PPML64_DIRTY_BITMAP	ptBitmap,
+	_In_	UINT64				qwGuestPhysicalAddress
+);
+
+/**
+* Atomically take and clear the dirty bits of a range of pages, one word at a
+* time, so a page marked concurrently is either harvested now or next time.
+* A pre-copy round harvests, clears the EPT dirty flags of the harvested pages
+* (Ept64ClearDirtyFlags), invalidates the EPT on every CPU, then copies the pages.
+* The vCPU logs should be drained right before harvesting (Pml64VcpuDrain).
+* @param ptBitmap - bitmap to harvest
+* @param qwFirstPage - first page to harvest, a multiple of PML64_BITMAP_BITS_PER_WORD
+* @param qwPageCount - number of pages to harvest, clipped to the bitmap
+* @param pqwDirtyBits - receives PML64_BITMAP_WORDS(qwPageCount) words, bit i of
+*						word j set if page qwFirstPage + 64 * j + i was dirty
+* @return Number of dirty pages harvested
+*/
+UINT64
+Pml64DirtyBitmapHarvest(
+	_Inout_								PPML64_DIRTY_BITMAP	ptBitmap,
+	_In_								UINT64				qwFirstPage,
+	_In_								UINT64				qwPageCount,
+	_Out_writes_(PML64_BITMAP_WORDS(qwPageCount))	PUINT64				pqwDirtyBits
+);
+
+/**
+* Allocate the log page of a vCPU
+* @param ptVcpu - vCPU log to initialize
+* @param ptAllocator - source of the log page
+* @param ptBitmap - bitmap of the VM the vCPU belongs to
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+NTSTATUS
+Pml64VcpuInit(
+	_Out_	PPML64_VCPU					ptVcpu,
+	_In_	PPAGING64_TABLE_ALLOCATOR	ptAllocator,
+	_In_	PPML64_DIRTY_BITMAP			ptBitmap
+);
+
+/**
+* Release the log page of a vCPU. PML must be disabled in its VMCS.
+* @param ptVcpu - vCPU log to destroy
+*/
+VOID
+Pml64VcpuDestroy(
+	_Inout_	PPML64_VCPU	ptVcpu
+);
+
+/**
+* Point the current VMCS at the vCPU's log and enable PML in the secondary
+* processor-based controls. EPT must be enabled, with accessed and dirty flags
+* (see Ept64GetEptp), as only writes setting an EPT dirty flag are logged.
+* Pages mapped by large EPT leaves are logged once per large page.
+* @param ptVcpu - vCPU log
+* @return STATUS_SUCCESS or STATUS_UNSUCCESSFUL if the VMCS couldn't be accessed
+*/
+NTSTATUS
+Pml64VcpuEnable(
+	_Inout_	PPML64_VCPU	ptVcpu
+);
+
+/**
+* Drain the vCPU's log and disable PML in the current VMCS
+* @param ptVcpu - vCPU log
+* @return STATUS_SUCCESS or STATUS_UNSUCCESSFUL if the VMCS couldn't be accessed
+*/
+NTSTATUS
+Pml64VcpuDisable(
+	_Inout_	PPML64_VCPU	ptVcpu
+);
+
+/**
+* Move the addresses logged so far into the VM's dirty bitmap and reset the log.
+* Used on demand, e.g. on every vCPU before a harvest, and by the PML-full handler.
+* @param ptVcpu - vCPU log, its VMCS must be current
+* @param pdwDrained - optional, receives the number of entries drained
+* @return STATUS_SUCCESS or STATUS_UNSUCCESSFUL if the VMCS couldn't be accessed
+*/
+NTSTATUS
+Pml64VcpuDrain(
+	_Inout_		PPML64_VCPU	ptVcpu,
+	_Out_opt_	PUINT32		pdwDrained
+);
+
+/**
+* Handle a VMEXIT_REASON_PML_FULL exit: drain the full log and, if the exit
+* interrupted an IRET that unblocked NMIs, block them again. The guest is
+* resumed without advancing RIP, so the write that filled the log is redone.
+* @param ptVcpu - vCPU log, its VMCS must be current
+* @return STATUS_SUCCESS or STATUS_UNSUCCESSFUL if the VMCS couldn't be accessed
+*/
+NTSTATUS
+Pml64HandleFullExit(
+	_Inout_	PPML64_VCPU	ptVcpu
+);
+
+#endif /* __INTEL_PML64_H__ */
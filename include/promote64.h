@@ -0,0 +1,102 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		promote64.h
+* @section	Background promotion of split EPT tables back to large pages
+*/
+
+#ifndef __INTEL_PROMOTE64_H__
+#define __INTEL_PROMOTE64_H__
+
+#include <ntddk.h>
+
+#include "ept64.h"
+
+typedef struct _PROMOTE64_STATISTICS
+{
+	UINT64 qwTablesExamined;	// Tables looked at by the scans
+	UINT64 qwPromoted2Mb;		// Page tables replaced by a 2MB leaf
+	UINT64 qwPromoted1Gb;		// Page directories replaced by a 1GB leaf
+	UINT64 qwTablesReclaimed;	// Tables retired to the split pool
+	UINT64 qwPasses;			// Complete passes over the guest-physical space
+} PROMOTE64_STATISTICS, *PPROMOTE64_STATISTICS;
+
+// Incremental scanner that walks the EPT in guest-physical order, a bounded
+// number of entries at a time, and merges the tables whose 512 leaves map a
+// contiguous, naturally aligned range with identical attributes.
+// The merged tables go to the split pool's retired rings, so the pages come
+// back to the pool once every CPU has flushed.
+typedef struct _PROMOTE64_EPT_SCANNER
+{
+	PEPT64_SPLIT_POOL ptPool;
+	UINT64 qwCursor;					// Guest-physical address the next scan starts at
+	UINT32 dwTablesPerScan;				// Rate limit, entries or tables visited per scan
+	PROMOTE64_STATISTICS tStatistics;
+} PROMOTE64_EPT_SCANNER, *PPROMOTE64_EPT_SCANNER;
+
+/**
+* Initialize a scanner starting at guest-physical address 0
+* @param ptScanner - scanner to initialize
+* @param ptPool - split pool of the hierarchy to scan
+* @param dwTablesPerScan - number of entries or tables a single scan may visit
+*/
+VOID
+Promote64EptScannerInit(
+	_Out_	PPROMOTE64_EPT_SCANNER	ptScanner,
+	_In_	PEPT64_SPLIT_POOL		ptPool,
+	_In_	UINT32					dwTablesPerScan
+);
+
+/**
+* Visit up to dwTablesPerScan entries from the cursor and promote the mergeable
+* tables: page tables to 2MB leaves, then page directories left with 2MB leaves
+* only to 1GB leaves. A visit is one PDE, or a PML4E, PDPTE, PDPT or page
+* directory skipped as a whole because it maps no table below it. Each
+* promotion is a single compare-exchange of the parent entry. The promotions
+* of a scan are invalidated together: each CPU issues one INVEPT when
+* Ept64SplitPoolTakePendingInvept tells it to, before its next VM entry.
+* A scan stops early when the CPU's retired ring is full, or after wrapping
+* around the guest-physical space, and the next scan resumes from there.
+* Must be serialized with the splits and merges of the hierarchy.
+* @param ptScanner - scanner
+* @param dwCpu - index of the current CPU
+* @return Number of tables reclaimed by the scan
+*/
+UINT32
+Promote64EptScan(
+	_Inout_	PPROMOTE64_EPT_SCANNER	ptScanner,
+	_In_	UINT32					dwCpu
+);
+
+/**
+* Get the counters accumulated by all the scans
+* @param ptScanner - scanner
+* @param ptStatistics - receives the counters
+*/
+VOID
+Promote64EptGetStatistics(
+	_In_	PPROMOTE64_EPT_SCANNER	ptScanner,
+	_Out_	PPROMOTE64_STATISTICS	ptStatistics
+);
+
+#endif /* __INTEL_PROMOTE64_H__ */
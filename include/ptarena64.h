@@ -0,0 +1,235 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptarena64.h
+* @section	Page-aligned arena allocator for paging-structure tables
+*/
+
+#ifndef __INTEL_PTARENA64_H__
+#define __INTEL_PTARENA64_H__
+
+#include "ntshim.h"
+
+#include "pagetable64.h"
+
+// Table pages are carved out of physically contiguous 2MB chunks
+#define PTARENA_CHUNK_SHIFT			PAGE_SHIFT_2MB
+#define PTARENA_CHUNK_SIZE			PAGE_SIZE_2MB
+#define PTARENA_PAGES_PER_CHUNK		(PTARENA_CHUNK_SIZE / PAGE_SIZE_4KB)
+#define PTARENA_MAX_CHUNKS			1024
+
+// Every chunk is indexed by its first and last 2MB slot, keeping the tables half empty
+#define PTARENA_HASH_SHIFT			12
+#define PTARENA_HASH_SIZE			(1 << PTARENA_HASH_SHIFT)
+C_ASSERT(PTARENA_HASH_SIZE >= 4 * PTARENA_MAX_CHUNKS);
+
+// Per-CPU free lists are refilled from and drained to the shared list in batches
+// CPUs with higher indices use the shared list directly, under the lock
+#define PTARENA_MAX_CPUS			256
+#define PTARENA_CPU_BATCH			32
+#define PTARENA_CPU_LIMIT			(4 * PTARENA_CPU_BATCH)
+
+/**
+* Allocate a physically contiguous, page aligned chunk of memory
+* @param pvContext - backend context
+* @param cbSize - size of the chunk (PTARENA_CHUNK_SIZE)
+* @param dwCpu - CPU the allocation is made for, to pick its NUMA node
+* @param pqwPhysicalAddress - receives the physical address of the chunk
+* @return Virtual address of the chunk, or NULL on failure
+*/
+typedef
+PVOID
+(*PFN_PTARENA_ALLOC_CHUNK)(
+	_In_opt_	PVOID	pvContext,
+	_In_		SIZE_T	cbSize,
+	_In_		UINT32	dwCpu,
+	_Out_		PUINT64	pqwPhysicalAddress
+);
+
+/**
+* Release a chunk returned by PFN_PTARENA_ALLOC_CHUNK
+* @param pvContext - backend context
+* @param pvChunk - virtual address of the chunk
+* @param cbSize - size of the chunk
+*/
+typedef
+VOID
+(*PFN_PTARENA_FREE_CHUNK)(
+	_In_opt_	PVOID	pvContext,
+	_In_		PVOID	pvChunk,
+	_In_		SIZE_T	cbSize
+);
+
+/**
+* Get the index of the current CPU
+* @param pvContext - backend context
+* @return Index of the current CPU (or thread, for user-mode backends)
+*/
+typedef
+UINT32
+(*PFN_PTARENA_CURRENT_CPU)(
+	_In_opt_	PVOID	pvContext
+);
+
+// Source of the arena's memory. The arena itself makes no kernel calls, so a
+// user-mode backend can be plugged in to run and benchmark it outside the kernel.
+typedef struct _PTARENA_BACKEND
+{
+	PFN_PTARENA_ALLOC_CHUNK pfnAllocChunk;
+	PFN_PTARENA_FREE_CHUNK pfnFreeChunk;
+	PFN_PTARENA_CURRENT_CPU pfnCurrentCpu;
+	PVOID pvContext;
+} PTARENA_BACKEND, *PPTARENA_BACKEND;
+
+typedef struct _PTARENA_CHUNK
+{
+	PUINT8 pcVirtualAddress;
+	UINT64 qwPhysicalAddress;
+} PTARENA_CHUNK, *PPTARENA_CHUNK;
+
+// Free pages are linked through their first bytes
+typedef struct DECLSPEC_CACHEALIGN _PTARENA_CPU_CACHE
+{
+	PVOID pvFreeList;
+	UINT32 dwCount;
+} PTARENA_CPU_CACHE, *PPTARENA_CPU_CACHE;
+
+typedef struct _PTARENA
+{
+	PTARENA_BACKEND tBackend;
+	volatile LONG lLock;					// Protects the shared list and the chunks
+	PVOID pvFreeList;						// Shared free list
+	UINT32 dwFreeCount;
+	UINT32 dwChunkCount;
+	UINT32 dwNextUnusedPage;				// First page of the last chunk never handed out
+	PTARENA_CHUNK atChunks[PTARENA_MAX_CHUNKS];
+	UINT16 awVirtualIndex[PTARENA_HASH_SIZE];	// Chunk index + 1, by virtual 2MB slot
+	UINT16 awPhysicalIndex[PTARENA_HASH_SIZE];	// Chunk index + 1, by physical 2MB slot
+	volatile LONG64 qwPagesInUse;
+	PTARENA_CPU_CACHE atCpuCaches[PTARENA_MAX_CPUS];
+} PTARENA, *PPTARENA;
+
+/**
+* Initialize an empty arena
+* @param ptArena - arena to initialize
+* @param ptBackend - source of the arena's memory
+*/
+VOID
+PtArenaInit(
+	_Out_	PPTARENA			ptArena,
+	_In_	PPTARENA_BACKEND	ptBackend
+);
+
+/**
+* Get a zeroed, page aligned table page.
+* Must not be preempted to another CPU while running (DISPATCH_LEVEL or above).
+* @param ptArena - arena to allocate from
+* @param pqwPhysicalAddress - receives the physical address of the page
+* @return Virtual address of the page, or NULL if the arena is exhausted
+*/
+PVOID
+PtArenaAllocTable(
+	_Inout_	PPTARENA	ptArena,
+	_Out_	PUINT64		pqwPhysicalAddress
+);
+
+/**
+* Return a page to the current CPU's free list.
+* Must not be preempted to another CPU while running (DISPATCH_LEVEL or above).
+* @param ptArena - arena the page was allocated from
+* @param pvTable - virtual address of the page
+*/
+VOID
+PtArenaFreeTable(
+	_Inout_	PPTARENA	ptArena,
+	_In_	PVOID		pvTable
+);
+
+/**
+* Get the physical address of a page of the arena in O(1)
+* @param ptArena - arena that owns the page
+* @param pvAddress - virtual address inside the page
+* @return Physical address, or 0 if the address isn't part of the arena
+*/
+UINT64
+PtArenaVirtToPhys(
+	_In_	PPTARENA	ptArena,
+	_In_	PVOID		pvAddress
+);
+
+/**
+* Get the virtual address of a page of the arena in O(1)
+* @param ptArena - arena that owns the page
+* @param qwPhysicalAddress - physical address inside the page
+* @return Virtual address, or NULL if the address isn't part of the arena
+*/
+PVOID
+PtArenaPhysToVirt(
+	_In_	PPTARENA	ptArena,
+	_In_	UINT64		qwPhysicalAddress
+);
+
+/**
+* Release every page of the arena at once, returning the chunks to the backend.
+* Used to drop a whole hierarchy that was allocated from a dedicated arena
+* without walking it. The arena can be reused afterwards.
+* @param ptArena - arena to release
+*/
+VOID
+PtArenaReleaseAll(
+	_Inout_ PPTARENA ptArena
+);
+
+/**
+* Fill an allocator so paging hierarchies take their tables from the arena
+* @param ptArena - arena to allocate from
+* @param ptAllocator - allocator to fill
+*/
+VOID
+PtArenaGetAllocator(
+	_In_	PPTARENA					ptArena,
+	_Out_	PPAGING64_TABLE_ALLOCATOR	ptAllocator
+);
+
+/**
+* Fill a backend with the kernel's contiguous memory allocator, allocating
+* each chunk on the NUMA node of the CPU that requested it
+* @param ptBackend - backend to fill
+*/
+VOID
+PtArenaGetKernelBackend(
+	_Out_ PPTARENA_BACKEND ptBackend
+);
+
+/**
+* Fill a backend with anonymous user-mode mappings, to run and benchmark the
+* arena outside the kernel. Virtual addresses stand for physical ones, and
+* every thread counts as a CPU.
+* @param ptBackend - backend to fill
+*/
+VOID
+PtArenaGetUserBackend(
+	_Out_ PPTARENA_BACKEND ptBackend
+);
+
+#endif /* __INTEL_PTARENA64_H__ */
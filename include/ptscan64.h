@@ -0,0 +1,231 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptscan64.h
+* @section	Parallel scan of whole IA-32e address spaces
+*/
+
+#ifndef __INTEL_PTSCAN64_H__
+#define __INTEL_PTSCAN64_H__
+
+#include "ntshim.h"
+
+#include "pagewalk64.h"
+#include "ptsnap64.h"
+
+#define PTSCAN64_MAX_WORKERS	64
+
+// Workers claim this many PDPTEs (8GB of linear space) at a time, small enough
+// to balance sparse address spaces and large enough to keep the cursor cold
+#define PTSCAN64_ITEM_PDPTES	8
+#define PTSCAN64_ITEMS_PER_PML4E	(PAGING64_PDPTE_COUNT / PTSCAN64_ITEM_PDPTES)
+
+// Effective protection of a leaf, accumulated over all the levels of its walk.
+// An OR of these is the index in the protection histogram.
+#define PTSCAN64_PROT_RW		0x1
+#define PTSCAN64_PROT_US		0x2
+#define PTSCAN64_PROT_XD		0x4
+#define PTSCAN64_PROT_COUNT		8
+
+/**
+* Called for every leaf of the scanned address space
+* @param pvContext - context given to PtScan64Init
+* @param dwWorker - index of the calling worker, for lock-free per-worker state
+* @param qwVa - canonical linear address mapped by the leaf
+* @param ptLeaf - the leaf, with the physical address of the page and its effective rights
+* @return TRUE to continue the scan, FALSE to stop every worker
+*/
+typedef
+BOOLEAN
+(*PFN_PTSCAN64_VISIT_LEAF)(
+	_In_opt_	PVOID					pvContext,
+	_In_		UINT32					dwWorker,
+	_In_		UINT64					qwVa,
+	_In_		PPAGING64_TRANSLATION	ptLeaf
+);
+
+typedef struct _PTSCAN64_STATS
+{
+	UINT64 aqwLeafCount[PAGE_TYPES_COUNT];
+	UINT64 aqwProtectionCount[PTSCAN64_PROT_COUNT];	// Leaves per PTSCAN64_PROT_* combination
+	UINT64 qwMappedBytes;
+	UINT64 qwTablesRead;
+	UINT64 qwReadFailures;		// Tables the reader failed to read, their leaves are missed
+} PTSCAN64_STATS, *PPTSCAN64_STATS;
+
+struct _PTSCAN64;
+
+// Per-worker state, on its own cache lines so workers never share a written line
+typedef struct DECLSPEC_CACHEALIGN _PTSCAN64_WORKER
+{
+	struct _PTSCAN64* ptScan;
+	UINT32 dwIndex;
+	PVOID pvReaderContext;
+	PTSCAN64_STATS tStats;
+	UINT64 aqwPd[PAGING64_PDE_COUNT];	// Copy of the page directory being walked
+} PTSCAN64_WORKER, *PPTSCAN64_WORKER;
+
+// Parallel scan of a whole IA-32e address space. Any number of threads run
+// PtScan64Work, each claiming PTSCAN64_ITEM_PDPTES-sized items from a shared
+// cursor until the address space is exhausted, so fast threads naturally take
+// over the work of slow ones.
+typedef struct _PTSCAN64
+{
+	PFN_PAGING64_READ_TABLE pfnReadTable;
+	PFN_PTSCAN64_VISIT_LEAF pfnVisitLeaf;
+	PVOID pvVisitContext;
+	UINT64 aqwPml4[PAGING64_PML4E_COUNT];		// Snapshot of the PML4 taken by PtScan64Init
+	UINT16 awPresentPml4e[PAGING64_PML4E_COUNT];
+	UINT32 dwItemCount;
+	UINT32 dwWorkerCount;
+	DECLSPEC_CACHEALIGN volatile LONG lNextItem;
+	volatile LONG lAbort;
+	PTSCAN64_WORKER atWorkers[PTSCAN64_MAX_WORKERS];
+} PTSCAN64, *PPTSCAN64;
+
+/**
+* Prepare a scan of an address space
+* @param ptScan - scan to initialize
+* @param pfnReadTable - reader used to access the paging structures
+* @param ppvReaderContexts - context of the reader per worker. Each worker needs
+*							 its own, since a table read only stays valid until
+*							 the next read with the same context
+* @param dwWorkerCount - number of workers
+* @param tCr3 - CR3 of the address space
+* @param pfnVisitLeaf - optional, called for every leaf
+* @param pvVisitContext - context passed to pfnVisitLeaf
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if dwWorkerCount is 0 or above PTSCAN64_MAX_WORKERS
+*		  STATUS_ACCESS_VIOLATION if the PML4 couldn't be read
+*/
+NTSTATUS
+PtScan64Init(
+	_Out_						PPTSCAN64				ptScan,
+	_In_						PFN_PAGING64_READ_TABLE	pfnReadTable,
+	_In_reads_(dwWorkerCount)	PVOID*					ppvReaderContexts,
+	_In_						UINT32					dwWorkerCount,
+	_In_						CR3_REG					tCr3,
+	_In_opt_					PFN_PTSCAN64_VISIT_LEAF	pfnVisitLeaf,
+	_In_opt_					PVOID					pvVisitContext
+);
+
+/**
+* Scan items until none is left. Call once per worker index, each from its own
+* thread; the scan is complete once every call returned.
+* @param ptScan - scan to work on
+* @param dwWorker - index of the worker, below the dwWorkerCount given to PtScan64Init
+*/
+VOID
+PtScan64Work(
+	_Inout_	PPTSCAN64	ptScan,
+	_In_	UINT32		dwWorker
+);
+
+/**
+* Sum the statistics of every worker, once all of them returned
+* @param ptScan - completed scan
+* @param ptStats - receives the statistics of the whole address space
+* @return STATUS_SUCCESS if the whole address space was scanned
+*		  STATUS_CANCELLED if the visitor stopped the scan
+*/
+NTSTATUS
+PtScan64GetStats(
+	_In_	PPTSCAN64		ptScan,
+	_Out_	PPTSCAN64_STATS	ptStats
+);
+
+/**
+* Run every worker of a scan on system threads and wait for them.
+* The calling thread runs worker 0. If some threads can't be created the other
+* workers take over their share. Must be called at PASSIVE_LEVEL.
+* @param ptScan - scan to run
+* @return STATUS_SUCCESS once every worker returned
+*		  STATUS_CANCELLED if the visitor stopped the scan
+*/
+NTSTATUS
+PtScan64RunKernelThreads(
+	_Inout_	PPTSCAN64	ptScan
+);
+
+// Page-table image file mapped for a user-mode scan. Either a raw image of
+// physical memory, where the table at physical address X is at offset X (e.g. a
+// guest's memory backing file), or a snapshot written by PtSnap64Write.
+typedef struct _PTSCAN64_IMAGE
+{
+	const UINT8* pcBase;
+	UINT64 cbSize;
+	BOOLEAN bSnapshot;
+	PTSNAP64_READER tSnapshot;		// Valid if bSnapshot
+	CR3_REG tCr3;					// CR3 recorded in a snapshot, 0 for raw images
+} PTSCAN64_IMAGE, *PPTSCAN64_IMAGE;
+
+/**
+* Map a page-table image file read-only, for user-mode builds
+* @param ptImage - receives the mapped image
+* @param pszPath - path of the file, snapshots are recognized by their header
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_FOUND if the file can't be opened or mapped
+*		  STATUS_INVALID_IMAGE_FORMAT if a snapshot is malformed
+*/
+NTSTATUS
+PtScan64OpenImageFile(
+	_Out_	PPTSCAN64_IMAGE	ptImage,
+	_In_	const CHAR*		pszPath
+);
+
+/**
+* Unmap an image opened by PtScan64OpenImageFile
+* @param ptImage - image to close
+*/
+VOID
+PtScan64CloseImageFile(
+	_Inout_	PPTSCAN64_IMAGE	ptImage
+);
+
+/**
+* Read a table from a mapped image, matches PFN_PAGING64_READ_TABLE.
+* Tables point into the mapping, so every worker can share the same image as
+* its reader context.
+* @param pvContext - PPTSCAN64_IMAGE to read from
+* @param qwTablePhysicalAddress - physical address of the table
+* @return The table, or NULL if it isn't in the image
+*/
+const VOID*
+PtScan64ReadImageTable(
+	_In_opt_	PVOID	pvContext,
+	_In_		UINT64	qwTablePhysicalAddress
+);
+
+/**
+* Run every worker of a scan on POSIX threads and wait for them, for user-mode
+* builds. Same contract as PtScan64RunKernelThreads.
+* @param ptScan - scan to run
+* @return STATUS_SUCCESS once every worker returned
+*		  STATUS_CANCELLED if the visitor stopped the scan
+*/
+NTSTATUS
+PtScan64RunUserThreads(
+	_Inout_	PPTSCAN64	ptScan
+);
+
+#endif /* __INTEL_PTSCAN64_H__ */
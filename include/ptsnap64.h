@@ -0,0 +1,182 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptsnap64.h
+* @section	Memory-mappable snapshots of IA-32e paging hierarchies
+*/
+
+#ifndef __INTEL_PTSNAP64_H__
+#define __INTEL_PTSNAP64_H__
+
+#include "ntshim.h"
+
+#include "pagewalk64.h"
+
+// Snapshot layout, every part starts on a 4KB boundary of the file so a mapped
+// snapshot hands out page-aligned tables:
+//	offset 0						PTSNAP64_HEADER, padded to 4KB
+//	qwTablesOffset					qwTableCount raw 4KB tables, in the order they were walked
+//	qwIndexOffset					qwTableCount PTSNAP64_INDEX_ENTRY sorted by physical address
+// All values are little-endian, as they are in the tables themselves.
+#define PTSNAP64_MAGIC		0x343650414E535450ULL	// "PTSNAP64"
+#define PTSNAP64_VERSION	1
+
+typedef struct _PTSNAP64_HEADER
+{
+	UINT64 qwMagic;
+	UINT32 dwVersion;
+	UINT32 dwHeaderSize;		// sizeof(PTSNAP64_HEADER)
+	CR3_REG tCr3;				// CR3 of the snapshotted address space
+	UINT64 qwTableCount;
+	UINT64 qwTablesOffset;
+	UINT64 qwIndexOffset;
+	UINT64 qwReadFailures;		// Tables the writer failed to read, walks through them fail
+} PTSNAP64_HEADER, *PPTSNAP64_HEADER;
+C_ASSERT(sizeof(PTSNAP64_HEADER) <= PAGE_SIZE_4KB);
+
+// Locates a table in the snapshot by its physical address
+typedef struct _PTSNAP64_INDEX_ENTRY
+{
+	UINT64 qwPhysicalAddress;
+	UINT64 qwTableNumber;		// The table is at qwTablesOffset + qwTableNumber * PAGE_SIZE_4KB
+} PTSNAP64_INDEX_ENTRY, *PPTSNAP64_INDEX_ENTRY;
+C_ASSERT(16 == sizeof(PTSNAP64_INDEX_ENTRY));
+
+/**
+* Write a part of a snapshot, pwrite-style
+* @param pvContext - context given to PtSnap64Write
+* @param qwOffset - offset in the snapshot, every offset is written exactly once
+*					except offset 0 which is rewritten last with the final header
+* @param pvData - data to write
+* @param cbData - number of bytes to write
+* @return STATUS_SUCCESS on success, anything else aborts the snapshot
+*/
+typedef
+NTSTATUS
+(*PFN_PTSNAP64_WRITE)(
+	_In_opt_				PVOID		pvContext,
+	_In_					UINT64		qwOffset,
+	_In_reads_bytes_(cbData)	const VOID*	pvData,
+	_In_					UINT32		cbData
+);
+
+// State of a snapshot being written. Big (12KB+), don't keep it on a kernel stack.
+typedef struct _PTSNAP64_WRITER
+{
+	PAGING64_READER tSource;
+	PFN_PTSNAP64_WRITE pfnWrite;
+	PVOID pvWriteContext;
+	PPTSNAP64_INDEX_ENTRY ptIndex;	// Open-addressed by physical address while walking
+	UINT32 dwIndexShift;
+	UINT64 qwTableCount;
+	UINT64 qwReadFailures;
+
+	// The source reader's tables only live until its next read, so the PML4,
+	// PDPT and PD on the current path are walked from these copies
+	UINT64 aqwPath[3][PAGING64_PML4E_COUNT];
+} PTSNAP64_WRITER, *PPTSNAP64_WRITER;
+
+// A snapshot opened for reading, see PtSnap64OpenReader
+typedef struct _PTSNAP64_READER
+{
+	const UINT8* pcBase;
+	UINT64 cbSize;
+	const PTSNAP64_HEADER* ptHeader;
+	const PTSNAP64_INDEX_ENTRY* ptIndex;
+} PTSNAP64_READER, *PPTSNAP64_READER;
+
+/**
+* Snapshot the paging hierarchy of an address space. Every table is streamed to
+* pfnWrite right after it is read from the source, nothing but the current path
+* is buffered. Tables reachable through several entries (e.g. a self-map) are
+* written once.
+* @param ptWriter - scratch state of the writer
+* @param ptSource - reader of the live paging structures
+* @param tCr3 - CR3 of the address space
+* @param pfnWrite - receives the snapshot
+* @param pvWriteContext - context passed to pfnWrite
+* @param ptIndex - scratch of 1 << dwIndexShift entries, used to deduplicate the
+*				   tables and to build the index
+* @param dwIndexShift - log2 of the capacity of ptIndex, it must exceed the
+*						number of tables by a third
+* @param pqwSnapshotSize - optionally receives the size of the snapshot in bytes
+* @return STATUS_SUCCESS on success
+*		  STATUS_BUFFER_TOO_SMALL if the hierarchy has too many tables for ptIndex
+*		  STATUS_ACCESS_VIOLATION if the PML4 couldn't be read
+*		  Any failure of pfnWrite
+*/
+NTSTATUS
+PtSnap64Write(
+	_Out_								PPTSNAP64_WRITER		ptWriter,
+	_In_								PPAGING64_READER		ptSource,
+	_In_								CR3_REG					tCr3,
+	_In_								PFN_PTSNAP64_WRITE		pfnWrite,
+	_In_opt_							PVOID					pvWriteContext,
+	_Out_writes_(1ULL << dwIndexShift)	PPTSNAP64_INDEX_ENTRY	ptIndex,
+	_In_								UINT32					dwIndexShift,
+	_Out_opt_							PUINT64					pqwSnapshotSize
+);
+
+/**
+* Validate a snapshot mapped in memory and open it for reading.
+* Nothing is copied, the mapping must outlive the reader.
+* @param ptReader - reader to initialize
+* @param pvSnapshot - the snapshot, mapped at a page-aligned address
+* @param cbSnapshot - size of the mapping
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_IMAGE_FORMAT if the snapshot is malformed or truncated
+*/
+NTSTATUS
+PtSnap64OpenReader(
+	_Out_						PPTSNAP64_READER	ptReader,
+	_In_reads_bytes_(cbSnapshot)	const VOID*			pvSnapshot,
+	_In_						UINT64				cbSnapshot
+);
+
+/**
+* Find a table in an opened snapshot, matches PFN_PAGING64_READ_TABLE.
+* Returns a pointer into the mapping that stays valid as long as the mapping.
+* @param pvContext - PPTSNAP64_READER to read from
+* @param qwTablePhysicalAddress - physical address of the table
+* @return The table, or NULL if it isn't in the snapshot
+*/
+const VOID*
+PtSnap64ReadTable(
+	_In_opt_	PVOID	pvContext,
+	_In_		UINT64	qwTablePhysicalAddress
+);
+
+/**
+* Set up a paging64 reader over an opened snapshot, so the snapshot can be
+* walked with Paging64Walk, a PAGING64_WALKER or a PTSCAN64 directly
+* @param ptSnapshot - opened snapshot
+* @param ptReader - receives the reader
+* @return CR3 of the snapshotted address space
+*/
+CR3_REG
+PtSnap64GetReader(
+	_In_	PPTSNAP64_READER	ptSnapshot,
+	_Out_	PPAGING64_READER	ptReader
+);
+
+#endif /* __INTEL_PTSNAP64_H__ */
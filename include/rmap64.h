@@ -0,0 +1,220 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		rmap64.h
+* @section	Reverse map from physical pages to the linear addresses mapping them
+*/
+
+#ifndef __INTEL_RMAP64_H__
+#define __INTEL_RMAP64_H__
+
+#include <ntddk.h>
+
+#include "pagetable64.h"
+
+// The caller owns the bucket array, sized from the number of mappings it expects
+// (see Rmap64GetBucketShift) and grown with Rmap64Resize
+#define RMAP64_MIN_BUCKET_SHIFT		10
+#define RMAP64_MAX_BUCKET_SHIFT		31
+#define RMAP64_BUCKET_COUNT(dwShift)	(1ULL << (dwShift))
+#define RMAP64_BUCKETS_SIZE(dwShift)	(RMAP64_BUCKET_COUNT(dwShift) * sizeof(PVOID))
+
+// Average chain length above which Rmap64IsOverloaded asks for a resize
+#define RMAP64_MAX_LOAD				2
+
+// A single leaf mapping a page, indexed by the PFN of the page's first 4KB frame
+typedef struct _RMAP64_ENTRY
+{
+	struct _RMAP64_ENTRY* ptNext;	// Next entry in the bucket, or in the free list
+	UINT64 qwPfn;
+	UINT64 qwPml4PhysicalAddress;
+	UINT64 qwVa;					// Canonical linear address of the page
+	PAGE_TYPE64 ePageType;
+} RMAP64_ENTRY, *PRMAP64_ENTRY;
+
+// Entries are carved out of table pages taken from the allocator
+typedef struct _RMAP64_SLAB
+{
+	struct _RMAP64_SLAB* ptNext;
+	UINT64 qwPhysicalAddress;
+	RMAP64_ENTRY atEntries[(PAGE_SIZE_4KB - 2 * sizeof(UINT64)) / sizeof(RMAP64_ENTRY)];
+} RMAP64_SLAB, *PRMAP64_SLAB;
+C_ASSERT(sizeof(RMAP64_SLAB) <= PAGE_SIZE_4KB);
+
+// A linear address mapping a physical address, as returned by Rmap64Lookup
+typedef struct _RMAP64_MAPPING
+{
+	UINT64 qwPml4PhysicalAddress;	// CR3.Pml4 of the address space
+	UINT64 qwVa;					// Linear address mapping the looked-up physical address
+	PAGE_TYPE64 ePageType;			// Size of the page that maps it
+} RMAP64_MAPPING, *PRMAP64_MAPPING;
+
+// Reverse map from physical pages to every linear address mapping them, across
+// any number of hierarchies. Kept up to date through the hierarchies' leaf
+// notifications, so answering "who maps this page" never walks the tables.
+typedef struct _RMAP64
+{
+	PAGING64_TABLE_ALLOCATOR tAllocator;
+	volatile LONG lLock;					// Protects everything below
+	BOOLEAN bIncomplete;					// An entry couldn't be allocated, see Rmap64Lookup
+	UINT32 dwHierarchyCount;				// Attached hierarchies, bIncomplete is reset with the last
+	PRMAP64_SLAB ptSlabs;
+	PRMAP64_ENTRY ptFreeList;
+	UINT64 qwEntryCount;
+	PRMAP64_ENTRY* aptBuckets;				// Indexed by hashed page frame number
+	UINT32 dwBucketShift;
+} RMAP64, *PRMAP64;
+
+/**
+* Get the bucket count, as a shift, keeping the chains of a map short
+* @param qwExpectedMappings - number of mappings the map is expected to hold
+* @return Shift to pass to Rmap64Init or Rmap64Resize, clamped to
+*		  RMAP64_MIN_BUCKET_SHIFT..RMAP64_MAX_BUCKET_SHIFT
+*/
+UINT32
+Rmap64GetBucketShift(
+	_In_	UINT64	qwExpectedMappings
+);
+
+/**
+* Initialize an empty reverse map
+* @param ptRmap - reverse map to initialize
+* @param ptAllocator - source of the pages holding the map's entries
+* @param aptBuckets - bucket array of RMAP64_BUCKETS_SIZE(dwBucketShift) bytes,
+*					  owned by the caller until Rmap64Destroy or Rmap64Resize
+* @param dwBucketShift - log2 of the number of buckets
+*/
+VOID
+Rmap64Init(
+	_Out_										PRMAP64						ptRmap,
+	_In_										PPAGING64_TABLE_ALLOCATOR	ptAllocator,
+	_Out_writes_(RMAP64_BUCKET_COUNT(dwBucketShift))	PRMAP64_ENTRY*				aptBuckets,
+	_In_										UINT32						dwBucketShift
+);
+
+/**
+* Whether the chains grew past RMAP64_MAX_LOAD entries on average, in which case
+* lookups are no longer O(1) and the map should be resized
+* @param ptRmap - reverse map
+* @return TRUE if the map should be resized
+*/
+BOOLEAN
+Rmap64IsOverloaded(
+	_In_	PRMAP64	ptRmap
+);
+
+/**
+* Move every entry of the map to a new bucket array, e.g. once the map is
+* overloaded. The map stays usable throughout, updates wait for the rehash.
+* @param ptRmap - reverse map to resize
+* @param aptBuckets - new bucket array of RMAP64_BUCKETS_SIZE(dwBucketShift) bytes
+* @param dwBucketShift - log2 of the new number of buckets
+* @param ppptOldBuckets - receives the previous bucket array, for the caller to free
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if dwBucketShift is out of range
+*/
+NTSTATUS
+Rmap64Resize(
+	_Inout_										PRMAP64			ptRmap,
+	_Out_writes_(RMAP64_BUCKET_COUNT(dwBucketShift))	PRMAP64_ENTRY*	aptBuckets,
+	_In_										UINT32			dwBucketShift,
+	_Out_										PRMAP64_ENTRY**	ppptOldBuckets
+);
+
+/**
+* Release every entry of the reverse map. The bucket array is left to the caller.
+* Hierarchies still attached to it must be detached first.
+* @param ptRmap - reverse map to destroy
+*/
+VOID
+Rmap64Destroy(
+	_Inout_ PRMAP64 ptRmap
+);
+
+/**
+* Index every leaf of a hierarchy and keep following its changes through the
+* hierarchy's leaf notification, replacing any callback it had
+* @param ptRmap - reverse map to fill
+* @param ptHierarchy - hierarchy to attach
+* @return STATUS_SUCCESS on success
+*		  STATUS_INSUFFICIENT_RESOURCES if an entry couldn't be allocated,
+*		  the hierarchy is left detached
+*/
+NTSTATUS
+Rmap64AttachHierarchy(
+	_Inout_	PRMAP64				ptRmap,
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy
+);
+
+/**
+* Stop following a hierarchy and drop all of its entries. Once the last one is
+* detached the map is empty, and no longer reports missed changes.
+* @param ptRmap - reverse map the hierarchy is attached to
+* @param ptHierarchy - hierarchy to detach
+*/
+VOID
+Rmap64DetachHierarchy(
+	_Inout_	PRMAP64				ptRmap,
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy
+);
+
+/**
+* Leaf notification updating the reverse map, matches PFN_PAGING64_LEAF_NOTIFY.
+* Set by Rmap64AttachHierarchy, exposed for owners that chain several listeners.
+* @param pvContext - PRMAP64 to update
+*/
+VOID
+Rmap64LeafNotify(
+	_In_opt_	PVOID		pvContext,
+	_In_		UINT64		qwPml4PhysicalAddress,
+	_In_		UINT64		qwVa,
+	_In_		UINT64		qwPa,
+	_In_		PAGE_TYPE64	ePageType,
+	_In_		BOOLEAN		bMapped
+);
+
+/**
+* Find every linear address mapping a physical address, whatever the size of
+* the page mapping it. Costs three hashed lookups (one per page size).
+* @param ptRmap - reverse map to search
+* @param qwPa - physical address to look up
+* @param ptMappings - receives the mappings
+* @param dwMaxMappings - capacity of ptMappings
+* @param pdwMappingCount - receives the total number of mappings found
+* @return STATUS_SUCCESS on success
+*		  STATUS_BUFFER_TOO_SMALL if ptMappings can't hold all the mappings,
+*		  the first dwMaxMappings are still returned
+*		  STATUS_INSUFFICIENT_RESOURCES if the map missed a change because an entry
+*		  couldn't be allocated, detach all the hierarchies and reattach them to
+*		  rebuild it
+*/
+NTSTATUS
+Rmap64Lookup(
+	_Inout_										PRMAP64			ptRmap,
+	_In_										UINT64			qwPa,
+	_Out_writes_to_(dwMaxMappings, dwMaxMappings)	PRMAP64_MAPPING	ptMappings,
+	_In_										UINT32			dwMaxMappings,
+	_Out_										PUINT32			pdwMappingCount
+);
+
+#endif /* __INTEL_RMAP64_H__ */
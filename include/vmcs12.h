@@ -0,0 +1,155 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcs12.h
+* @section	Software VMCS of a nested hypervisor (VMCS12) with perfect-hash field access
+*			See Intel's: Software Developers Manual Vol 3C, 24.11.2 VMREAD, VMWRITE, and Encodings of VMCS Fields
+*/
+
+#ifndef __INTEL_VMCS12_H__
+#define __INTEL_VMCS12_H__
+
+#include <ntddk.h>
+
+#include "VT-x.h"
+
+// Every field's encoding is hashed from its width, type and the low 5 bits of
+// its index. Known fields have an index below 32 and access type 0 (the full
+// access of 64-bit fields), so no two of them share a slot.
+#define VMCS12_HASH_SLOTS		512
+#define VMCS12_HASH(eField) \
+	(((((UINT32)(eField)) >> 6) & 0x180)	/* Width, bits 13-14 */ \
+	| ((((UINT32)(eField)) >> 5) & 0x60)	/* Type, bits 10-11 */ \
+	| ((((UINT32)(eField)) >> 1) & 0x1f))	/* Index, bits 1-5 */
+
+// Bits an encoding may have set and still be known (access type, index 0-31, type and width)
+#define VMCS12_ENCODING_MASK	0x00006c3f
+
+#define X(FieldName, Encoding) C_ASSERT(32 > VMCS_FIELD_ENCODING_INDEX(Encoding));
+VMCS_FIELDS_16BIT
+VMCS_FIELDS_64BIT
+VMCS_FIELDS_32BIT
+VMCS_FIELDS_NATURAL
+#undef X
+
+// Fields are grouped by width, each group starting on its own cache line.
+// The members are named after their encodings.
+typedef struct DECLSPEC_CACHEALIGN _VMCS12_NATURAL_FIELDS
+{
+#define X(FieldName, Encoding) UINT64 FieldName;
+	VMCS_FIELDS_NATURAL
+#undef X
+} VMCS12_NATURAL_FIELDS, *PVMCS12_NATURAL_FIELDS;
+
+typedef struct DECLSPEC_CACHEALIGN _VMCS12_64BIT_FIELDS
+{
+#define X(FieldName, Encoding) UINT64 FieldName;
+	VMCS_FIELDS_64BIT
+#undef X
+} VMCS12_64BIT_FIELDS, *PVMCS12_64BIT_FIELDS;
+
+typedef struct DECLSPEC_CACHEALIGN _VMCS12_32BIT_FIELDS
+{
+#define X(FieldName, Encoding) UINT32 FieldName;
+	VMCS_FIELDS_32BIT
+#undef X
+} VMCS12_32BIT_FIELDS, *PVMCS12_32BIT_FIELDS;
+
+typedef struct DECLSPEC_CACHEALIGN _VMCS12_16BIT_FIELDS
+{
+#define X(FieldName, Encoding) UINT16 FieldName;
+	VMCS_FIELDS_16BIT
+#undef X
+} VMCS12_16BIT_FIELDS, *PVMCS12_16BIT_FIELDS;
+
+// The L1 hypervisor's VMCS, as emulated in software
+typedef struct DECLSPEC_CACHEALIGN _VMCS12
+{
+	UINT32 dwRevisionId;				// VMCS revision identifier given to L1
+	UINT32 dwAbortIndicator;			// VMX-abort indicator
+	BOOLEAN bLaunched;					// Launch state, set by VMLAUNCH and cleared by VMCLEAR
+	VMCS12_NATURAL_FIELDS tNatural;
+	VMCS12_64BIT_FIELDS t64Bit;
+	VMCS12_32BIT_FIELDS t32Bit;
+	VMCS12_16BIT_FIELDS t16Bit;
+} VMCS12, *PVMCS12;
+C_ASSERT(sizeof(VMCS12) <= PAGE_SIZE);
+
+/**
+* Initialize a clear VMCS12 whose fields are all 0
+* @param ptVmcs12 - VMCS12 to initialize
+* @param dwRevisionId - VMCS revision identifier reported to L1
+*/
+VOID
+Vmcs12Init(
+	_Out_	PVMCS12	ptVmcs12,
+	_In_	UINT32	dwRevisionId
+);
+
+/**
+* Get the offset of a field in VMCS12
+* @param eField - encoding of the field, either access of a 64-bit field
+* @return Offset of the field, or 0 if the encoding is unknown
+*/
+UINT32
+Vmcs12GetFieldOffset(
+	_In_ VMCS_FIELD_ENCODING eField
+);
+
+/**
+* Emulate VMREAD: read a field of a VMCS12, zero extended. The _HIGH access of
+* a 64-bit field reads its upper 32 bits.
+* @param ptVmcs12 - VMCS12 to read
+* @param eField - encoding of the field
+* @param pqwValue - receives the value of the field
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the encoding is unknown (VMERROR_VM_RW_BAD_FIELD)
+*/
+NTSTATUS
+Vmcs12Read(
+	_In_	PVMCS12				ptVmcs12,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT64				pqwValue
+);
+
+/**
+* Emulate VMWRITE: write a field of a VMCS12, truncated to the field's width.
+* The _HIGH access of a 64-bit field writes its upper 32 bits.
+* @param ptVmcs12 - VMCS12 to write
+* @param eField - encoding of the field
+* @param qwValue - value to write
+* @param bWriteReadOnly - whether VM-exit information fields may be written, i.e.
+*		 L0 is filling them or IA32_VMX_MISC[29] is reported to L1
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the encoding is unknown (VMERROR_VM_RW_BAD_FIELD)
+*		  STATUS_ACCESS_DENIED if the field is read-only (VMERROR_VMWRITE_TO_READONLY_FIELD)
+*/
+NTSTATUS
+Vmcs12Write(
+	_Inout_	PVMCS12				ptVmcs12,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_In_	UINT64				qwValue,
+	_In_	BOOLEAN				bWriteReadOnly
+);
+
+#endif /* __INTEL_VMCS12_H__ */
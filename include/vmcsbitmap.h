@@ -0,0 +1,156 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcsbitmap.h
+* @section	Builder of the VMREAD and VMWRITE bitmaps used with VMCS shadowing
+*			See Intel's: Software Developers Manual Vol 3C, 24.6.15 VMCS Shadowing Bitmap Addresses
+*/
+
+#ifndef __INTEL_VMCSBITMAP_H__
+#define __INTEL_VMCSBITMAP_H__
+
+#include <ntddk.h>
+
+#include "VT-x.h"
+#include "msr64.h"
+
+// A bitmap is a 4KB page holding one bit per value of encoding bits 0-14.
+// A set bit makes the instruction exit, encodings above bit 14 always exit.
+#define VMCSBITMAP_SIZE				PAGE_SIZE
+#define VMCSBITMAP_ENCODING_LIMIT	(VMCSBITMAP_SIZE * 8)
+
+// Policies passing whole types of fields through to the shadow VMCS
+#define VMCSBITMAP_PASS_TYPE(eType)		(1UL << (eType))
+#define VMCSBITMAP_PASS_CONTROL			VMCSBITMAP_PASS_TYPE(VMCS_FIELD_TYPE_CONTROL)
+#define VMCSBITMAP_PASS_READ_ONLY		VMCSBITMAP_PASS_TYPE(VMCS_FIELD_TYPE_READ_ONLY)
+#define VMCSBITMAP_PASS_GUEST			VMCSBITMAP_PASS_TYPE(VMCS_FIELD_TYPE_GUEST)
+#define VMCSBITMAP_PASS_HOST			VMCSBITMAP_PASS_TYPE(VMCS_FIELD_TYPE_HOST)
+
+// Default policies: L1 reads the exit information and guest state and writes
+// the guest state without exiting, control and host fields are left to L0.
+// L0 keeps the shadow VMCS's exit information up to date with VMWRITE, so
+// VmcsBitmapBuild drops VMCSBITMAP_PASS_READ_ONLY without IA32_VMX_MISC[29].
+#define VMCSBITMAP_DEFAULT_READ_POLICY	(VMCSBITMAP_PASS_READ_ONLY | VMCSBITMAP_PASS_GUEST)
+#define VMCSBITMAP_DEFAULT_WRITE_POLICY	VMCSBITMAP_PASS_GUEST
+
+/**
+* Make every VMREAD or VMWRITE exit
+* @param pcBitmap - VMCSBITMAP_SIZE bytes bitmap to initialize
+*/
+VOID
+VmcsBitmapInit(
+	_Out_writes_bytes_(VMCSBITMAP_SIZE) PUINT8 pcBitmap
+);
+
+/**
+* Let a field be accessed in the shadow VMCS without exiting, or make it exit
+* again. Both accesses of a 64-bit field are changed together.
+* @param pcBitmap - bitmap to edit
+* @param eField - encoding of the field
+* @param bPass - TRUE to pass the field through, FALSE to make it exit
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the encoding has bits above bit 14
+*/
+NTSTATUS
+VmcsBitmapSetField(
+	_Inout_updates_bytes_(VMCSBITMAP_SIZE)	PUINT8				pcBitmap,
+	_In_									VMCS_FIELD_ENCODING	eField,
+	_In_									BOOLEAN				bPass
+);
+
+/**
+* Pass a set of fields through
+* @param pcBitmap - bitmap to edit
+* @param peFields - encodings of the fields
+* @param dwCount - number of fields
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if some encoding has bits above bit 14, the
+*		  fields before it were passed through
+*/
+NTSTATUS
+VmcsBitmapPassFields(
+	_Inout_updates_bytes_(VMCSBITMAP_SIZE)	PUINT8						pcBitmap,
+	_In_reads_(dwCount)						const VMCS_FIELD_ENCODING*	peFields,
+	_In_									UINT32						dwCount
+);
+
+/**
+* Pass every known field of some types through, up to the highest field index
+* the processor implements
+* @param pcBitmap - bitmap to edit
+* @param dwPolicy - VMCSBITMAP_PASS_* of the types to pass through
+* @param dwMaxIndex - highest VMCS_FIELD_ENCODING_INDEX to pass, see IA32_VMX_VMCS_ENUM
+* @return Number of fields passed through
+*/
+UINT32
+VmcsBitmapPassTypes(
+	_Inout_updates_bytes_(VMCSBITMAP_SIZE)	PUINT8	pcBitmap,
+	_In_									UINT32	dwPolicy,
+	_In_									UINT32	dwMaxIndex
+);
+
+/**
+* Build both bitmaps from policies, e.g. VMCSBITMAP_DEFAULT_READ_POLICY and
+* VMCSBITMAP_DEFAULT_WRITE_POLICY, for the processor's capabilities:
+* read-only fields are passed through only if IA32_VMX_MISC[29] lets L0 write
+* them in the shadow VMCS, and fields above the IA32_VMX_VMCS_ENUM index never
+* are. The index doesn't tell which optional fields below it are implemented,
+* those L1 may not access, or L0 emulates, must be made to exit again with
+* VmcsBitmapSetField, like the fields L0 must intercept.
+* @param pcVmreadBitmap - VMREAD bitmap to build
+* @param pcVmwriteBitmap - VMWRITE bitmap to build
+* @param dwReadPolicy - VMCSBITMAP_PASS_* of the fields L1 may read
+* @param dwWritePolicy - VMCSBITMAP_PASS_* of the fields L1 may write
+* @param tMisc - value of MSR_CODE_IA32_VMX_MISC
+* @param tVmcsEnum - value of MSR_CODE_IA32_VMX_VMCS_ENUM
+*/
+VOID
+VmcsBitmapBuild(
+	_Out_writes_bytes_(VMCSBITMAP_SIZE)	PUINT8				pcVmreadBitmap,
+	_Out_writes_bytes_(VMCSBITMAP_SIZE)	PUINT8				pcVmwriteBitmap,
+	_In_								UINT32				dwReadPolicy,
+	_In_								UINT32				dwWritePolicy,
+	_In_								IA32_VMX_MISC		tMisc,
+	_In_								IA32_VMX_VMCS_ENUM	tVmcsEnum
+);
+
+/**
+* Enable VMCS shadowing in the current VMCS: load the bitmaps and the shadow
+* VMCS into the VMCS and set the VMCS shadowing control, along with the
+* primary control that activates the secondary controls
+* @param qwVmreadBitmapPhysicalAddress - physical address of the VMREAD bitmap
+* @param qwVmwriteBitmapPhysicalAddress - physical address of the VMWRITE bitmap
+* @param qwShadowVmcsPhysicalAddress - physical address of the shadow VMCS, whose
+*		 shadow-VMCS indicator must be set
+* @return STATUS_SUCCESS on success
+*		  STATUS_NOT_SUPPORTED if the processor doesn't allow VMCS shadowing
+*		  STATUS_UNSUCCESSFUL if the VMCS couldn't be accessed
+*/
+NTSTATUS
+VmcsBitmapEnableShadowing(
+	_In_	UINT64	qwVmreadBitmapPhysicalAddress,
+	_In_	UINT64	qwVmwriteBitmapPhysicalAddress,
+	_In_	UINT64	qwShadowVmcsPhysicalAddress
+);
+
+#endif /* __INTEL_VMCSBITMAP_H__ */
@@ -0,0 +1,202 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcscache64.h
+* @section	Per-vCPU write-back cache of the current VMCS fields
+*/
+
+#ifndef __INTEL_VMCSCACHE64_H__
+#define __INTEL_VMCSCACHE64_H__
+
+#include "ntshim.h"
+
+#include "VT-x.h"
+
+// Bitmap words covering every VMCS_FIELD_INDEX
+#define VMCSCACHE_BITMAP_WORDS	((VMCS_FIELD_INDEX_COUNT + 63) / 64)
+
+/**
+* Read a field of the current VMCS
+* @param pvContext - backend context
+* @param eField - encoding of the field, the full access of 64-bit fields
+* @param pqwValue - receives the value of the field
+* @return VMX_SUCCESS on success
+*/
+typedef
+VMX_OPCODE_RC
+(*PFN_VMCSCACHE_READ)(
+	_In_opt_	PVOID				pvContext,
+	_In_		VMCS_FIELD_ENCODING	eField,
+	_Out_		PUINT64				pqwValue
+);
+
+/**
+* Write a field of the current VMCS
+* @param pvContext - backend context
+* @param eField - encoding of the field, the full access of 64-bit fields
+* @param qwValue - value to write
+* @return VMX_SUCCESS on success
+*/
+typedef
+VMX_OPCODE_RC
+(*PFN_VMCSCACHE_WRITE)(
+	_In_opt_	PVOID				pvContext,
+	_In_		VMCS_FIELD_ENCODING	eField,
+	_In_		UINT64				qwValue
+);
+
+// Accesses the VMCS behind the cache. The cache itself never executes VMREAD
+// or VMWRITE, so a simulated VMCS can be plugged in to run and benchmark it
+// in user mode.
+typedef struct _VMCSCACHE_BACKEND
+{
+	PFN_VMCSCACHE_READ pfnRead;
+	PFN_VMCSCACHE_WRITE pfnWrite;
+	PVOID pvContext;
+} VMCSCACHE_BACKEND, *PVMCSCACHE_BACKEND;
+
+typedef struct _VMCSCACHE_STATISTICS
+{
+	UINT64 qwAccesses;			// Reads and writes of the cache
+	UINT64 qwBackendReads;		// Fields read from the VMCS
+	UINT64 qwBackendWrites;		// Fields written to the VMCS
+	UINT64 qwCoalescedWrites;	// Writes to a field already dirty, absorbed by the cache
+	UINT64 qwDroppedWrites;		// Dirty fields discarded by an invalidation, e.g. after a failed flush
+} VMCSCACHE_STATISTICS, *PVMCSCACHE_STATISTICS;
+
+// Write-back cache of a single vCPU's VMCS, indexed by VMCS_FIELD_INDEX.
+// Fields are read from the VMCS on their first access after a VM exit, and
+// written back all at once before the next VM entry. Only the vCPU's own CPU
+// may use it, with the vCPU's VMCS current.
+typedef struct _VMCSCACHE
+{
+	VMCSCACHE_BACKEND tBackend;
+	UINT64 aqwValid[VMCSCACHE_BITMAP_WORDS];	// Fields whose value is cached
+	UINT64 aqwDirty[VMCSCACHE_BITMAP_WORDS];	// Fields written since the last flush
+	UINT64 aqwValues[VMCS_FIELD_INDEX_COUNT];
+	VMCSCACHE_STATISTICS tStatistics;
+} VMCSCACHE, *PVMCSCACHE;
+
+/**
+* Initialize an empty cache
+* @param ptCache - cache to initialize
+* @param ptBackend - accesses the VMCS
+*/
+VOID
+VmcsCacheInit(
+	_Out_	PVMCSCACHE			ptCache,
+	_In_	PVMCSCACHE_BACKEND	ptBackend
+);
+
+/**
+* Drop every cached value, e.g. at the start of each VM exit or after the vCPU's
+* VMCS was loaded on another CPU. Writes still dirty, such as the ones a failed
+* VmcsCacheFlush left behind, are discarded and counted in qwDroppedWrites.
+* @param ptCache - cache
+*/
+VOID
+VmcsCacheInvalidate(
+	_Inout_ PVMCSCACHE ptCache
+);
+
+/**
+* Read a VMCS field, from the VMCS only on its first access since the last
+* invalidation. The _HIGH access of a 64-bit field returns its upper 32 bits.
+* @param ptCache - cache
+* @param eField - encoding of the field
+* @param pqwValue - receives the value of the field
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the field is unknown
+*		  STATUS_UNSUCCESSFUL if the VMCS couldn't be read
+*/
+NTSTATUS
+VmcsCacheRead(
+	_Inout_	PVMCSCACHE			ptCache,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT64				pqwValue
+);
+
+/**
+* Write a VMCS field in the cache only, see VmcsCacheFlush.
+* Writing the _HIGH access of a 64-bit field replaces its upper 32 bits.
+* @param ptCache - cache
+* @param eField - encoding of the field
+* @param qwValue - value to write
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the field is unknown
+*		  STATUS_ACCESS_DENIED if the field is read-only (VM-exit information)
+*		  STATUS_UNSUCCESSFUL if a _HIGH write needed to read the field and couldn't
+*/
+NTSTATUS
+VmcsCacheWrite(
+	_Inout_	PVMCSCACHE			ptCache,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_In_	UINT64				qwValue
+);
+
+/**
+* Write every dirty field to the VMCS in a single pass, right before VM entry
+* @param ptCache - cache
+* @return STATUS_SUCCESS on success
+*		  STATUS_UNSUCCESSFUL if a field couldn't be written, it and the fields
+*		  after it stay dirty until the next flush or invalidation
+*/
+NTSTATUS
+VmcsCacheFlush(
+	_Inout_ PVMCSCACHE ptCache
+);
+
+/**
+* Get the counters of a cache
+* @param ptCache - cache
+* @param ptStatistics - receives the counters
+*/
+VOID
+VmcsCacheGetStatistics(
+	_In_	PVMCSCACHE				ptCache,
+	_Out_	PVMCSCACHE_STATISTICS	ptStatistics
+);
+
+/**
+* Fill a backend that executes VMREAD and VMWRITE on the current VMCS
+* @param ptBackend - backend to fill
+*/
+VOID
+VmcsCacheGetKernelBackend(
+	_Out_ PVMCSCACHE_BACKEND ptBackend
+);
+
+/**
+* Fill a backend over a VMCS simulated in memory, to run and benchmark the cache
+* outside the kernel. Every field is writable, and unknown encodings fail
+* like on the CPU.
+* @param ptBackend - backend to fill
+* @param aqwVmcs - values of the fields, indexed by VMCS_FIELD_INDEX
+*/
+VOID
+VmcsCacheGetUserBackend(
+	_Out_									PVMCSCACHE_BACKEND	ptBackend,
+	_Inout_updates_(VMCS_FIELD_INDEX_COUNT)	PUINT64				aqwVmcs
+);
+
+#endif /* __INTEL_VMCSCACHE64_H__ */
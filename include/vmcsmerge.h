@@ -0,0 +1,252 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcsmerge.h
+* @section	Incremental merge of the L1 VMCS12 and L0's policy into the VMCS02 of a nested guest
+*/
+
+#ifndef __INTEL_VMCSMERGE_H__
+#define __INTEL_VMCSMERGE_H__
+
+#include <ntddk.h>
+
+#include "VT-x.h"
+#include "paging64.h"
+#include "vmcs12.h"
+#include "vmcscache64.h"
+#include "vmcsbitmap.h"
+
+/**
+* Translate an L1 guest-physical page
+* @param pvContext - translator context
+* @param qwGuestPhysicalAddress - L1 guest-physical address
+* @param pqwHostPhysicalAddress - receives the host-physical address
+* @param ppvHostVirtualAddress - receives the host mapping of the address, NULL if not mapped
+* @return STATUS_SUCCESS on success, an error if L1 doesn't own the address
+*/
+typedef
+NTSTATUS
+(*PFN_VMCSMERGE_TRANSLATE)(
+	_In_opt_	PVOID		pvContext,
+	_In_		UINT64		qwGuestPhysicalAddress,
+	_Out_		PUINT64		pqwHostPhysicalAddress,
+	_Out_		const VOID**	ppvHostVirtualAddress
+);
+
+// Resolves the addresses L1 puts in its VMCS12, e.g. through Memslot64Lookup
+typedef struct _VMCSMERGE_TRANSLATOR
+{
+	PFN_VMCSMERGE_TRANSLATE pfnTranslate;
+	PVOID pvContext;
+} VMCSMERGE_TRANSLATOR, *PVMCSMERGE_TRANSLATOR;
+
+// VMCS02 control = (VMCS12 control & dwAllowed) | dwRequired
+typedef struct _VMCSMERGE_CONTROL_POLICY
+{
+	UINT32 dwRequired;		// Bits L0 needs, e.g. exits it must see
+	UINT32 dwAllowed;		// Bits L1 may set, i.e. features L0 can emulate for L2
+} VMCSMERGE_CONTROL_POLICY, *PVMCSMERGE_CONTROL_POLICY;
+
+// What L0 needs from every nested guest of an L1
+typedef struct _VMCSMERGE_POLICY
+{
+	VMCSMERGE_CONTROL_POLICY tPinBased;
+	VMCSMERGE_CONTROL_POLICY tProcBased;
+	VMCSMERGE_CONTROL_POLICY tProcBased2;
+	VMCSMERGE_CONTROL_POLICY tExit;
+	VMCSMERGE_CONTROL_POLICY tEntry;
+	UINT32 dwExceptionBitmap;				// Exceptions L0 intercepts
+	UINT64 qwCr0GuestHostMask;				// CR0 bits L0 owns
+	UINT64 qwCr4GuestHostMask;				// CR4 bits L0 owns
+	UINT64 qwTscOffset;						// Offset of L1's TSC from the host's
+	UINT32 dwPhysicalAddressWidth;			// MAXPHYADDR reported to L1, CPUID.80000008H:EAX[7:0]
+	const VMX_MSR_BITMAPS* ptMsrBitmaps;	// MSRs L0 intercepts, NULL for none
+	const VMX_IO_BITMAPS* ptIoBitmaps;		// I/O ports L0 intercepts, NULL for none
+} VMCSMERGE_POLICY, *PVMCSMERGE_POLICY;
+
+// Pages of the VMCS02 that hold the merged bitmaps
+typedef struct _VMCSMERGE_PAGES
+{
+	PVMX_MSR_BITMAPS ptMsrBitmaps;
+	UINT64 qwMsrBitmapsPhysicalAddress;
+	PVMX_IO_BITMAPS ptIoBitmaps;			// Physically contiguous A and B bitmaps
+	UINT64 qwIoBitmapsPhysicalAddress;
+} VMCSMERGE_PAGES, *PVMCSMERGE_PAGES;
+
+typedef struct _VMCSMERGE_STATISTICS
+{
+	UINT64 qwEntries;				// Nested VM entries merged
+	UINT64 qwFieldsMerged;			// Dirty VMCS12 fields handled
+	UINT64 qwGroupsRecomputed;		// Derived groups of VMCS02 fields recomputed
+	UINT64 qwVmcs02Writes;			// VMCS02 fields written
+} VMCSMERGE_STATISTICS, *PVMCSMERGE_STATISTICS;
+
+// Builds the VMCS02 of a nested guest incrementally: only the VMCS12 fields L1
+// wrote since the previous nested entry are merged, and fields derived from
+// several sources (controls, exception bitmap, CR masks and shadows, MSR and
+// I/O bitmaps, TSC offset) are recomputed only when one of their sources changed.
+// The fields L0 owns (VPID, EPT pointer, MSR load/store areas, VMCS link
+// pointer, host state...) are never taken from VMCS12, L0 writes them itself.
+// Changes are tracked as L1's VMWRITEs exit to L0 (VmcsMergeVmwrite). With VMCS
+// shadowing (vmcsbitmap.h) the fields the VMWRITE bitmap passes through are
+// written to the shadow VMCS instead: VmcsMergeSyncFromShadow copies them to
+// VMCS12 and marks the changed ones before the merge. Fields L0 changes in
+// VMCS12 by itself, e.g. guest state on an emulated nested VM exit, are marked
+// with VmcsMergeMarkDirty.
+typedef struct _VMCSMERGE
+{
+	PVMCS12 ptVmcs12;
+	PVMCSCACHE ptVmcs02;					// Cache of the VMCS02, flushed by the caller
+	VMCSMERGE_POLICY tPolicy;
+	VMCSMERGE_TRANSLATOR tTranslator;
+	VMCSMERGE_PAGES tPages;
+	UINT64 aqwDirty[VMCSCACHE_BITMAP_WORDS];	// VMCS12 fields to merge, by VMCS_FIELD_INDEX
+	UINT32 dwPendingGroups;					// Derived groups to recompute
+	VMCSMERGE_STATISTICS tStatistics;
+} VMCSMERGE, *PVMCSMERGE;
+
+/**
+* Initialize a merge engine. Everything is merged on the first nested entry.
+* @param ptMerge - merge engine to initialize
+* @param ptVmcs12 - VMCS12 of the nested guest
+* @param ptVmcs02 - cache of the VMCS02 of the nested guest
+* @param ptPolicy - L0 policy, copied
+* @param ptTranslator - translator of L1 guest-physical addresses
+* @param ptPages - pages of the merged bitmaps
+*/
+VOID
+VmcsMergeInit(
+	_Out_	PVMCSMERGE				ptMerge,
+	_In_	PVMCS12					ptVmcs12,
+	_In_	PVMCSCACHE				ptVmcs02,
+	_In_	PVMCSMERGE_POLICY		ptPolicy,
+	_In_	PVMCSMERGE_TRANSLATOR	ptTranslator,
+	_In_	PVMCSMERGE_PAGES		ptPages
+);
+
+/**
+* Emulate an L1 VMWRITE to the VMCS12 and remember the field for the next merge
+* @param ptMerge - merge engine
+* @param eField - encoding of the field
+* @param qwValue - value to write
+* @return Same as Vmcs12Write
+*/
+NTSTATUS
+VmcsMergeVmwrite(
+	_Inout_	PVMCSMERGE			ptMerge,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_In_	UINT64				qwValue
+);
+
+/**
+* Merge a field on the next nested entry, after L0 changed it in VMCS12 itself
+* @param ptMerge - merge engine
+* @param eField - encoding of the field
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_PARAMETER if the field is unknown
+*/
+NTSTATUS
+VmcsMergeMarkDirty(
+	_Inout_	PVMCSMERGE			ptMerge,
+	_In_	VMCS_FIELD_ENCODING	eField
+);
+
+/**
+* Copy the fields L1 could VMWRITE to its shadow VMCS without exiting into VMCS12,
+* and mark the ones whose value changed. Call on L1's VMLAUNCH or VMRESUME, before
+* VmcsMergeNestedEntry, with the shadow VMCS accessible through ptShadow.
+* @param ptMerge - merge engine
+* @param pcVmwriteBitmap - VMWRITE bitmap of L1's VMCS, a field passes through if its bit is clear
+* @param ptShadow - reads the shadow VMCS
+* @return STATUS_SUCCESS on success
+*		  STATUS_UNSUCCESSFUL if a field couldn't be read, the fields before it were synced
+*/
+NTSTATUS
+VmcsMergeSyncFromShadow(
+	_Inout_									PVMCSMERGE			ptMerge,
+	_In_reads_bytes_(VMCSBITMAP_SIZE)		const UINT8*		pcVmwriteBitmap,
+	_In_									PVMCSCACHE_BACKEND	ptShadow
+);
+
+/**
+* Merge everything on the next nested entry, e.g. after L1 loaded another VMCS12
+* or the VMCS02 was recreated
+* @param ptMerge - merge engine
+*/
+VOID
+VmcsMergeMarkAllDirty(
+	_Inout_ PVMCSMERGE ptMerge
+);
+
+/**
+* Re-merge the MSR and I/O bitmaps on the next nested entry, e.g. after L1
+* wrote to its bitmap pages
+* @param ptMerge - merge engine
+*/
+VOID
+VmcsMergeMarkBitmapsDirty(
+	_Inout_ PVMCSMERGE ptMerge
+);
+
+/**
+* Replace the L0 policy, the derived fields are recomputed on the next nested entry
+* @param ptMerge - merge engine
+* @param ptPolicy - new policy, copied
+*/
+VOID
+VmcsMergeSetPolicy(
+	_Inout_	PVMCSMERGE			ptMerge,
+	_In_	PVMCSMERGE_POLICY	ptPolicy
+);
+
+/**
+* Bring the VMCS02 cache up to date before a nested VM entry. The caller then
+* flushes the cache (VmcsCacheFlush) and enters the nested guest. On failure
+* everything that was dirty stays dirty, and is merged again on the next call.
+* If the flush fails instead, the VMCS02 may miss merged fields: the caller must
+* call VmcsMergeMarkAllDirty before the next nested entry.
+* @param ptMerge - merge engine
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_ADDRESS if an MSR or I/O bitmap address in VMCS12 isn't 4KB
+*		  aligned or exceeds L1's physical-address width, as VM entry checks: the
+*		  nested entry must fail with VMERROR_VMENTRY_INVALID_CONTROLS
+*		  Any error of the translator, if an address in VMCS12 can't be translated
+*		  (the nested entry must fail)
+*/
+NTSTATUS
+VmcsMergeNestedEntry(
+	_Inout_ PVMCSMERGE ptMerge
+);
+
+/**
+* Get the counters of a merge engine
+* @param ptMerge - merge engine
+* @param ptStatistics - receives the counters
+*/
+VOID
+VmcsMergeGetStatistics(
+	_In_	PVMCSMERGE				ptMerge,
+	_Out_	PVMCSMERGE_STATISTICS	ptStatistics
+);
+
+#endif /* __INTEL_VMCSMERGE_H__ */
@@ -43,6 +43,102 @@ VTX_GetVmInstructionErrorMsg(
 	return g_VmInstructionErrorMessages[eVmError];
 }
 
+VMX_OPCODE_RC
+VmxVmread16(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT16						pwValue
+)
+{
+	size_t cbValue = 0;
+	VMX_OPCODE_RC eRc = VMX_SUCCESS;
+
+	NT_ASSERT(NULL != pwValue);
+
+	eRc = (VMX_OPCODE_RC)__vmx_vmread(eField, &cbValue);
+	*pwValue = (UINT16)cbValue;
+	return eRc;
+}
+
+VMX_OPCODE_RC
+VmxVmread32(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT32						pdwValue
+)
+{
+	size_t cbValue = 0;
+	VMX_OPCODE_RC eRc = VMX_SUCCESS;
+
+	NT_ASSERT(NULL != pdwValue);
+
+	eRc = (VMX_OPCODE_RC)__vmx_vmread(eField, &cbValue);
+	*pdwValue = (UINT32)cbValue;
+	return eRc;
+}
+
+VMX_OPCODE_RC
+VmxVmread64(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT64						pqwValue
+)
+{
+	size_t cbValue = 0;
+	VMX_OPCODE_RC eRc = VMX_SUCCESS;
+
+	NT_ASSERT(NULL != pqwValue);
+
+	// In 64-bit mode the full access reads all 64 bits
+	eRc = (VMX_OPCODE_RC)__vmx_vmread(eField, &cbValue);
+	*pqwValue = (UINT64)cbValue;
+	return eRc;
+}
+
+VMX_OPCODE_RC
+VmxVmreadNatural(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_Out_	PSIZE_T						pcbValue
+)
+{
+	NT_ASSERT(NULL != pcbValue);
+
+	return (VMX_OPCODE_RC)__vmx_vmread(eField, pcbValue);
+}
+
+VMX_OPCODE_RC
+VmxVmwrite16(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_In_	const UINT16				wValue
+)
+{
+	return (VMX_OPCODE_RC)__vmx_vmwrite(eField, wValue);
+}
+
+VMX_OPCODE_RC
+VmxVmwrite32(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_In_	const UINT32				dwValue
+)
+{
+	return (VMX_OPCODE_RC)__vmx_vmwrite(eField, dwValue);
+}
+
+VMX_OPCODE_RC
+VmxVmwrite64(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_In_	const UINT64				qwValue
+)
+{
+	return (VMX_OPCODE_RC)__vmx_vmwrite(eField, (size_t)qwValue);
+}
+
+VMX_OPCODE_RC
+VmxVmwriteNatural(
+	_In_	const VMCS_FIELD_ENCODING	eField,
+	_In_	const SIZE_T				cbValue
+)
+{
+	return (VMX_OPCODE_RC)__vmx_vmwrite(eField, cbValue);
+}
+
 VOID
 __inline
 VmxAdjustCr0(
@@ -0,0 +1,925 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ept64.c
+* @section	Extended page table hierarchies identity mapping guest-physical memory
+*/
+
+#include "ept64.h"
+
+// Levels of the hierarchy, numbered like the walk: PT = 1 ... PML4 = 4
+#define EPT64_LEVEL_PT		1
+#define EPT64_LEVEL_PD		2
+#define EPT64_LEVEL_PDPT	3
+#define EPT64_LEVEL_PML4	4
+
+// Shift of the guest-physical range covered by a single entry of a level
+#define EPT64_LEVEL_SHIFT(dwLevel)	(PAGE_SHIFT_4KB + 9 * ((dwLevel) - 1))
+
+// Page type of the leaves a level can hold (PT, PD and PDPT only)
+#define EPT64_LEVEL_PAGE_TYPE(dwLevel)	((PAGE_TYPE64)(EPT64_LEVEL_PDPT - (dwLevel)))
+
+// Level whose leaves are pages of a type
+#define EPT64_PAGE_TYPE_LEVEL(ePageType)	((UINT32)(EPT64_LEVEL_PDPT - (ePageType)))
+
+// Accessed and dirty flags, at the same position in the leaves of all sizes
+#define EPT64_LEAF_FLAGS	(FIELD64_MASK(EPT_PTE_A) | FIELD64_MASK(EPT_PTE_D))
+
+static
+__inline
+PUINT64
+ept64_TableVa(
+	_In_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT64				qwPhysicalAddress
+)
+{
+	return (PUINT64)ptEpt->tAllocator.pfnPhysToVirt(ptEpt->tAllocator.pvContext,
+		qwPhysicalAddress);
+}
+
+static
+UINT64
+ept64_MakeLeafEntry(
+	_In_	PAGE_TYPE64			ePageType,
+	_In_	UINT64				qwPhysicalAddress,
+	_In_	IA32_PAT_MEMTYPE	eMemoryType,
+	_In_	UINT64				qwAccess
+)
+{
+	UINT64 qwEntry = qwAccess & EPT_ACCESS_ALL;
+
+	// The leaves of all sizes share the position of the bits set here
+	qwEntry |= FIELD64_MAKE(EPT_PTE_MEMTYPE, eMemoryType);
+	if (PAGE_TYPE_4KB != ePageType)
+	{
+		qwEntry |= EPT_ENTRY_PAGE_SIZE;
+	}
+	return qwEntry | (qwPhysicalAddress & PAGING64_PHYS_ADDR_MASK);
+}
+
+/**
+* Get the table referenced by an entry, allocating it if the entry isn't present
+* @param ptEpt - hierarchy the entry belongs to
+* @param pqwEntry - non-leaf entry
+* @param ppqwTable - receives the virtual address of the table
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+static
+NTSTATUS
+ept64_GetOrCreateTable(
+	_Inout_	PEPT64_HIERARCHY	ptEpt,
+	_Inout_	PUINT64				pqwEntry,
+	_Out_	PUINT64*			ppqwTable
+)
+{
+	UINT64 qwPhysicalAddress = 0;
+	PUINT64 pqwTable = NULL;
+
+	if (EPT_ENTRY_PRESENT(*pqwEntry))
+	{
+		*ppqwTable = ept64_TableVa(ptEpt, *pqwEntry & PAGING64_PHYS_ADDR_MASK);
+		return STATUS_SUCCESS;
+	}
+
+	pqwTable = (PUINT64)ptEpt->tAllocator.pfnAllocTable(ptEpt->tAllocator.pvContext,
+		&qwPhysicalAddress);
+	if (NULL == pqwTable)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// Access rights are only restricted on the leaves
+	ptEpt->dwTablePages++;
+	*pqwEntry = EPT_ACCESS_ALL | qwPhysicalAddress;
+	*ppqwTable = pqwTable;
+	return STATUS_SUCCESS;
+}
+
+static
+VOID
+ept64_FreeSubtree(
+	_Inout_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT64				qwTablePhysicalAddress,
+	_In_	UINT32				dwLevel
+)
+{
+	PUINT64 pqwTable = ept64_TableVa(ptEpt, qwTablePhysicalAddress);
+	UINT32 i = 0;
+
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		if (!EPT_ENTRY_PRESENT(pqwTable[i]))
+		{
+			continue;
+		}
+		if ((EPT64_LEVEL_PT == dwLevel) || EPT_IS_LEAF(pqwTable[i]))
+		{
+			ptEpt->aqwLeafCount[EPT64_LEVEL_PAGE_TYPE(dwLevel)]--;
+		}
+		else
+		{
+			ept64_FreeSubtree(ptEpt, pqwTable[i] & PAGING64_PHYS_ADDR_MASK, dwLevel - 1);
+		}
+	}
+
+	ptEpt->tAllocator.pfnFreeTable(ptEpt->tAllocator.pvContext, pqwTable,
+		qwTablePhysicalAddress);
+	ptEpt->dwTablePages--;
+}
+
+NTSTATUS
+Ept64HierarchyInit(
+	_Out_	PEPT64_HIERARCHY			ptEpt,
+	_In_	PPAGING64_TABLE_ALLOCATOR	ptAllocator,
+	_In_	IA32_VMX_EPT_VPID_CAP		tCapabilities
+)
+{
+	NT_ASSERT(NULL != ptEpt);
+	NT_ASSERT(NULL != ptAllocator);
+
+	RtlZeroMemory(ptEpt, sizeof(*ptEpt));
+	if (!tCapabilities.support4kb)
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+	ptEpt->tAllocator = *ptAllocator;
+	ptEpt->tCapabilities = tCapabilities;
+
+	ptEpt->ptPml4 = (PEPT_PML4E)ptAllocator->pfnAllocTable(ptAllocator->pvContext,
+		&ptEpt->qwPml4PhysicalAddress);
+	if (NULL == ptEpt->ptPml4)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ptEpt->dwTablePages = 1;
+	return STATUS_SUCCESS;
+}
+
+VOID
+Ept64HierarchyDestroy(
+	_Inout_ PEPT64_HIERARCHY ptEpt
+)
+{
+	PUINT64 pqwPml4 = NULL;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptEpt);
+
+	if (NULL == ptEpt->ptPml4)
+	{
+		return;
+	}
+
+	pqwPml4 = (PUINT64)ptEpt->ptPml4;
+	for (i = 0; i < PAGING64_PML4E_COUNT; i++)
+	{
+		if (EPT_ENTRY_PRESENT(pqwPml4[i]))
+		{
+			ept64_FreeSubtree(ptEpt, pqwPml4[i] & PAGING64_PHYS_ADDR_MASK, EPT64_LEVEL_PDPT);
+		}
+	}
+	ptEpt->tAllocator.pfnFreeTable(ptEpt->tAllocator.pvContext, ptEpt->ptPml4,
+		ptEpt->qwPml4PhysicalAddress);
+
+	ptEpt->ptPml4 = NULL;
+	ptEpt->qwPml4PhysicalAddress = 0;
+	ptEpt->dwTablePages = 0;
+	RtlZeroMemory(ptEpt->aqwLeafCount, sizeof(ptEpt->aqwLeafCount));
+}
+
+/**
+* Identity map the pages that fit at the start of [*pqwAddress, qwEnd) in a
+* single table: a run of 1GB, 2MB or 4KB leaves, whichever is the largest that
+* fits at *pqwAddress. Filling a whole table per step keeps the 256 1GB leaves
+* of a 256GB guest a single walk.
+* @param ptEpt - hierarchy to map in
+* @param pqwAddress - start of the range, advanced past the mapped pages
+* @param qwEnd - end of the range, 4KB aligned
+* @param eMemoryType - memory type of the mapped pages
+* @param qwAccess - EPT_ACCESS_* rights of the mapped pages
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+static
+NTSTATUS
+ept64_IdentityMapStep(
+	_Inout_	PEPT64_HIERARCHY	ptEpt,
+	_Inout_	PUINT64				pqwAddress,
+	_In_	UINT64				qwEnd,
+	_In_	IA32_PAT_MEMTYPE	eMemoryType,
+	_In_	UINT64				qwAccess
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	PUINT64 pqwTable = (PUINT64)ptEpt->ptPml4;
+	PUINT64 pqwEntry = NULL;
+	UINT64 qwAddress = *pqwAddress;
+	UINT64 qwPageSize = 0;
+	UINT32 dwLevel = 0;
+	UINT32 dwIndex = 0;
+	BOOLEAN bLeafAllowed = FALSE;
+
+	for (dwLevel = EPT64_LEVEL_PML4; dwLevel > EPT64_LEVEL_PT; dwLevel--)
+	{
+		pqwEntry = &pqwTable[(qwAddress >> EPT64_LEVEL_SHIFT(dwLevel)) & (PAGING64_PTE_COUNT - 1)];
+		qwPageSize = 1ULL << EPT64_LEVEL_SHIFT(dwLevel);
+		if (EPT_IS_LEAF(*pqwEntry))
+		{
+			// Already mapped by a large leaf
+			*pqwAddress = (qwAddress & ~(qwPageSize - 1)) + qwPageSize;
+			return STATUS_SUCCESS;
+		}
+
+		bLeafAllowed = ((EPT64_LEVEL_PDPT == dwLevel) && ptEpt->tCapabilities.support1gb)
+			|| ((EPT64_LEVEL_PD == dwLevel) && ptEpt->tCapabilities.support2mb);
+		if (bLeafAllowed && !EPT_ENTRY_PRESENT(*pqwEntry)
+			&& (0 == (qwAddress & (qwPageSize - 1))) && (qwEnd - qwAddress >= qwPageSize))
+		{
+			break;
+		}
+
+		eStatus = ept64_GetOrCreateTable(ptEpt, pqwEntry, &pqwTable);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+	}
+
+	// Fill the rest of the table in one go, skipping what is already mapped
+	qwPageSize = 1ULL << EPT64_LEVEL_SHIFT(dwLevel);
+	dwIndex = (UINT32)(qwAddress >> EPT64_LEVEL_SHIFT(dwLevel)) & (PAGING64_PTE_COUNT - 1);
+	do
+	{
+		pqwEntry = &pqwTable[dwIndex];
+		if (EPT_IS_TABLE(*pqwEntry) && (EPT64_LEVEL_PT != dwLevel))
+		{
+			// Partially mapped below, the next step descends into it
+			break;
+		}
+		if (!EPT_ENTRY_PRESENT(*pqwEntry))
+		{
+			*pqwEntry = ept64_MakeLeafEntry(EPT64_LEVEL_PAGE_TYPE(dwLevel), qwAddress,
+				eMemoryType, qwAccess);
+			ptEpt->aqwLeafCount[EPT64_LEVEL_PAGE_TYPE(dwLevel)]++;
+		}
+		qwAddress += qwPageSize;
+		dwIndex++;
+	} while ((dwIndex < PAGING64_PTE_COUNT) && (qwEnd - qwAddress >= qwPageSize));
+
+	*pqwAddress = qwAddress;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Ept64BuildIdentityMap(
+	_Inout_						PEPT64_HIERARCHY	ptEpt,
+	_In_reads_(dwRangeCount)	const EPT64_RANGE*	ptRanges,
+	_In_						UINT32				dwRangeCount,
+	_In_						UINT64				qwAccess
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	UINT64 qwAddress = 0;
+	UINT64 qwEnd = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptEpt);
+	NT_ASSERT(NULL != ptEpt->ptPml4);
+	NT_ASSERT((NULL != ptRanges) || (0 == dwRangeCount));
+
+	// Vol 3B, 25.2.3.1 EPT Misconfigurations - write without read, or execute-only
+	// without support for it
+	if ((0 == (qwAccess & EPT_ACCESS_ALL))
+		|| (0 != (qwAccess & ~EPT_ACCESS_ALL))
+		|| (EPT_ACCESS_WRITE == (qwAccess & (EPT_ACCESS_READ | EPT_ACCESS_WRITE)))
+		|| ((EPT_ACCESS_EXECUTE == qwAccess) && !ptEpt->tCapabilities.allowExecOnly))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	// Validate everything up front so a bad range doesn't leave a partial map
+	for (i = 0; i < dwRangeCount; i++)
+	{
+		if ((ptRanges[i].qwBase >= EPT64_GUEST_PHYSICAL_LIMIT)
+			|| (ptRanges[i].qwSize > EPT64_GUEST_PHYSICAL_LIMIT - ptRanges[i].qwBase))
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+		switch (ptRanges[i].eMemoryType)
+		{
+		case IA32_PAT_MEMTYPE_UC:
+		case IA32_PAT_MEMTYPE_WC:
+		case IA32_PAT_MEMTYPE_WT:
+		case IA32_PAT_MEMTYPE_WP:
+		case IA32_PAT_MEMTYPE_WB:
+			break;
+		default:
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	for (i = 0; i < dwRangeCount; i++)
+	{
+		qwAddress = (UINT64)PAGE_ALIGN_4KB(ptRanges[i].qwBase);
+		qwEnd = ROUND_TO_PAGES_4KB(ptRanges[i].qwBase + ptRanges[i].qwSize);
+
+		while (qwAddress < qwEnd)
+		{
+			eStatus = ept64_IdentityMapStep(ptEpt, &qwAddress, qwEnd,
+				ptRanges[i].eMemoryType, qwAccess);
+			if (!NT_SUCCESS(eStatus))
+			{
+				return eStatus;
+			}
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+EPTP
+Ept64GetEptp(
+	_In_	PEPT64_HIERARCHY	ptEpt
+)
+{
+	EPTP tEptp = { 0 };
+
+	NT_ASSERT(NULL != ptEpt);
+
+	tEptp.memType = (ptEpt->tCapabilities.wb) ? IA32_PAT_MEMTYPE_WB : IA32_PAT_MEMTYPE_UC;
+	tEptp.walkLength = EPT_PAGE_WALK_LENGTH_4;
+	tEptp.accessDirty = ptEpt->tCapabilities.accessAndDirty;
+	tEptp.addr = ptEpt->qwPml4PhysicalAddress >> PAGE_SHIFT_4KB;
+	return tEptp;
+}
+
+static
+__inline
+PUINT64
+ept64_EntryOf(
+	_In_	PUINT64	pqwTable,
+	_In_	UINT64	qwGuestPhysicalAddress,
+	_In_	UINT32	dwLevel
+)
+{
+	return &pqwTable[(qwGuestPhysicalAddress >> EPT64_LEVEL_SHIFT(dwLevel)) & (PAGING64_PTE_COUNT - 1)];
+}
+
+static
+__inline
+UINT32
+ept64_RingCount(
+	_In_	PEPT64_SPLIT_RING	ptRing
+)
+{
+	return (UINT32)ptRing->lTail - (UINT32)ptRing->lHead;
+}
+
+static
+BOOLEAN
+ept64_RingPush(
+	_Inout_	PEPT64_SPLIT_RING	ptRing,
+	_In_	PEPT64_SPLIT_PAGE	ptPage
+)
+{
+	UINT32 dwTail = (UINT32)ptRing->lTail;
+
+	if (EPT64_SPLIT_RING_SIZE == ept64_RingCount(ptRing))
+	{
+		return FALSE;
+	}
+
+	// The slot is written before the consumer can see it
+	ptRing->atPages[dwTail & EPT64_SPLIT_RING_MASK] = *ptPage;
+	InterlockedExchange(&ptRing->lTail, (LONG)(dwTail + 1));
+	return TRUE;
+}
+
+static
+__inline
+PEPT64_SPLIT_PAGE
+ept64_RingPeek(
+	_In_	PEPT64_SPLIT_RING	ptRing
+)
+{
+	if (0 == ept64_RingCount(ptRing))
+	{
+		return NULL;
+	}
+	return &ptRing->atPages[(UINT32)ptRing->lHead & EPT64_SPLIT_RING_MASK];
+}
+
+static
+BOOLEAN
+ept64_RingPop(
+	_Inout_	PEPT64_SPLIT_RING	ptRing,
+	_Out_	PEPT64_SPLIT_PAGE	ptPage
+)
+{
+	PEPT64_SPLIT_PAGE ptSlot = ept64_RingPeek(ptRing);
+
+	if (NULL == ptSlot)
+	{
+		return FALSE;
+	}
+
+	// The slot is read before the producer can reuse it
+	*ptPage = *ptSlot;
+	InterlockedExchange(&ptRing->lHead, (LONG)((UINT32)ptRing->lHead + 1));
+	return TRUE;
+}
+
+/**
+* Replace a 1GB or 2MB leaf with a table of 512 leaves of the next size down
+* @param ptPool - pool of the hierarchy
+* @param ptFree - free ring to take the table from, must not be empty
+* @param pqwEntry - PDPTE or PDE holding the leaf
+* @param dwLevel - level of the entry
+*/
+static
+VOID
+ept64_SplitEntry(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool,
+	_Inout_	PEPT64_SPLIT_RING	ptFree,
+	_Inout_	PUINT64				pqwEntry,
+	_In_	UINT32				dwLevel
+)
+{
+	PEPT64_HIERARCHY ptEpt = ptPool->ptEpt;
+	EPT64_SPLIT_PAGE tPage = { 0 };
+	UINT32 dwSmallShift = EPT64_LEVEL_SHIFT(dwLevel - 1);
+	UINT64 qwEntry = 0;
+	UINT64 qwPrevious = *(volatile UINT64*)pqwEntry;
+	UINT64 qwAttributes = 0;
+	UINT64 qwPa = 0;
+	UINT32 i = 0;
+
+	(VOID)ept64_RingPop(ptFree, &tPage);
+	NT_ASSERT(NULL != tPage.pqwTable);
+
+	// The processor may set the accessed and dirty flags of the leaf until the
+	// swap, in which case the table is filled again with them
+	do
+	{
+		qwEntry = qwPrevious;
+		qwAttributes = qwEntry & ~PAGING64_PHYS_ADDR_MASK;
+		if (EPT64_LEVEL_PD == dwLevel)
+		{
+			qwAttributes &= ~EPT_ENTRY_PAGE_SIZE;
+		}
+		qwPa = qwEntry & PAGING64_PHYS_ADDR_MASK;
+		for (i = 0; i < PAGING64_PTE_COUNT; i++)
+		{
+			tPage.pqwTable[i] = qwAttributes | (qwPa + ((UINT64)i << dwSmallShift));
+		}
+		qwPrevious = PAGING64_ENTRY_COMPARE_EXCHANGE(pqwEntry,
+			EPT_ACCESS_ALL | tPage.qwPhysicalAddress, qwEntry);
+	} while (qwPrevious != qwEntry);
+
+	ptEpt->dwTablePages++;
+	ptEpt->aqwLeafCount[EPT64_LEVEL_PAGE_TYPE(dwLevel)]--;
+	ptEpt->aqwLeafCount[EPT64_LEVEL_PAGE_TYPE(dwLevel - 1)] += PAGING64_PTE_COUNT;
+	(VOID)InterlockedIncrement64(&ptPool->qwGeneration);
+}
+
+/**
+* Build the large leaf equivalent to a table of leaves
+* @param pqwTable - table to merge
+* @param dwLevel - level of the table (PT or PD)
+* @return The large leaf, or 0 if the leaves aren't contiguous, naturally aligned
+*		  and identical apart from their accessed and dirty flags
+*/
+static
+UINT64
+ept64_MergeLeaves(
+	_In_	PUINT64	pqwTable,
+	_In_	UINT32	dwLevel
+)
+{
+	UINT32 dwShift = EPT64_LEVEL_SHIFT(dwLevel);
+	UINT64 qwFirst = pqwTable[0];
+	UINT64 qwPa = qwFirst & PAGING64_PHYS_ADDR_MASK;
+	UINT64 qwAttributes = qwFirst & ~PAGING64_PHYS_ADDR_MASK & ~EPT64_LEAF_FLAGS;
+	UINT64 qwFlags = 0;
+	UINT64 qwEntry = 0;
+	UINT32 i = 0;
+
+	if (!EPT_ENTRY_PRESENT(qwFirst)
+		|| ((EPT64_LEVEL_PT != dwLevel) && !EPT_IS_LEAF(qwFirst))
+		|| (0 != (qwPa & ((1ULL << EPT64_LEVEL_SHIFT(dwLevel + 1)) - 1))))
+	{
+		return 0;
+	}
+
+	// Matching the first leaf's attributes also makes every entry a present leaf
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		qwEntry = pqwTable[i];
+		if (((qwEntry & ~PAGING64_PHYS_ADDR_MASK & ~EPT64_LEAF_FLAGS) != qwAttributes)
+			|| ((qwEntry & PAGING64_PHYS_ADDR_MASK) != qwPa + ((UINT64)i << dwShift)))
+		{
+			return 0;
+		}
+		qwFlags |= qwEntry & EPT64_LEAF_FLAGS;
+	}
+
+	return qwAttributes | qwFlags | EPT_ENTRY_PAGE_SIZE | qwPa;
+}
+
+/**
+* Collect the accessed and dirty flags of a table of leaves
+* @param pqwTable - table to scan
+* @return OR of the EPT64_LEAF_FLAGS of all entries
+*/
+static
+UINT64
+ept64_LeafFlags(
+	_In_	PUINT64	pqwTable
+)
+{
+	UINT64 qwFlags = 0;
+	UINT32 i = 0;
+
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		qwFlags |= PAGING64_ENTRY_READ(&pqwTable[i]) & EPT64_LEAF_FLAGS;
+	}
+	return qwFlags;
+}
+
+UINT64
+Ept64ClearDirtyFlags(
+	_Inout_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT64				qwGuestPhysicalAddress,
+	_In_	UINT64				qwSize
+)
+{
+	PUINT64 pqwTable = NULL;
+	PUINT64 pqwEntry = NULL;
+	UINT64 qwAddress = 0;
+	UINT64 qwEnd = 0;
+	UINT64 qwEntrySize = 0;
+	UINT64 qwCleared = 0;
+	UINT32 dwLevel = 0;
+
+	NT_ASSERT(NULL != ptEpt);
+	NT_ASSERT(NULL != ptEpt->ptPml4);
+
+	if ((0 == qwSize) || (qwGuestPhysicalAddress >= EPT64_GUEST_PHYSICAL_LIMIT))
+	{
+		return 0;
+	}
+	qwAddress = (UINT64)PAGE_ALIGN_4KB(qwGuestPhysicalAddress);
+	qwEnd = (qwSize > EPT64_GUEST_PHYSICAL_LIMIT - qwGuestPhysicalAddress)
+		? EPT64_GUEST_PHYSICAL_LIMIT
+		: ROUND_TO_PAGES_4KB(qwGuestPhysicalAddress + qwSize);
+
+	while (qwAddress < qwEnd)
+	{
+		// Stop at the leaf or the missing entry that covers the address
+		pqwTable = (PUINT64)ptEpt->ptPml4;
+		for (dwLevel = EPT64_LEVEL_PML4; ; dwLevel--)
+		{
+			pqwEntry = ept64_EntryOf(pqwTable, qwAddress, dwLevel);
+			if ((EPT64_LEVEL_PT == dwLevel) || !EPT_IS_TABLE(*pqwEntry))
+			{
+				break;
+			}
+			pqwTable = ept64_TableVa(ptEpt, *pqwEntry & PAGING64_PHYS_ADDR_MASK);
+		}
+
+		// Skip the locked operation for the pages that weren't written
+		if (EPT_ENTRY_PRESENT(*pqwEntry) && (0 != (*pqwEntry & FIELD64_MASK(EPT_PTE_D))))
+		{
+			(VOID)PAGING64_ENTRY_CLEAR_BITS(pqwEntry, FIELD64_MASK(EPT_PTE_D));
+			qwCleared++;
+		}
+
+		qwEntrySize = 1ULL << EPT64_LEVEL_SHIFT(dwLevel);
+		qwAddress = (qwAddress & ~(qwEntrySize - 1)) + qwEntrySize;
+	}
+
+	return qwCleared;
+}
+
+NTSTATUS
+Ept64SplitPoolInit(
+	_Out_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT32				dwCpuCount
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+
+	NT_ASSERT(NULL != ptPool);
+	NT_ASSERT(NULL != ptEpt);
+
+	RtlZeroMemory(ptPool, sizeof(*ptPool));
+	if ((0 == dwCpuCount) || (dwCpuCount > EPT64_SPLIT_POOL_MAX_CPUS))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	ptPool->ptEpt = ptEpt;
+	ptPool->dwCpuCount = dwCpuCount;
+
+	eStatus = Ept64SplitPoolRefill(ptPool);
+	if (!NT_SUCCESS(eStatus))
+	{
+		Ept64SplitPoolDestroy(ptPool);
+	}
+	return eStatus;
+}
+
+NTSTATUS
+Ept64SplitPoolRefill(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	PPAGING64_TABLE_ALLOCATOR ptAllocator = NULL;
+	PEPT64_SPLIT_CPU ptCpu = NULL;
+	PEPT64_SPLIT_PAGE ptRetired = NULL;
+	EPT64_SPLIT_PAGE tPage = { 0 };
+	LONG64 qwFlushed = MAXLONG64;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptPool);
+	NT_ASSERT(NULL != ptPool->ptEpt);
+
+	ptAllocator = &ptPool->ptEpt->tAllocator;
+	while (0 != InterlockedCompareExchange(&ptPool->lRefillLock, 1, 0))
+	{
+		YieldProcessor();
+	}
+
+	// A retired table may still be cached by any CPU that hasn't flushed its merge
+	for (i = 0; i < ptPool->dwCpuCount; i++)
+	{
+		if (ptPool->atCpus[i].qwFlushedGeneration < qwFlushed)
+		{
+			qwFlushed = ptPool->atCpus[i].qwFlushedGeneration;
+		}
+	}
+
+	for (i = 0; i < ptPool->dwCpuCount; i++)
+	{
+		ptCpu = &ptPool->atCpus[i];
+
+		// Tables are retired in generation order
+		while ((NULL != (ptRetired = ept64_RingPeek(&ptCpu->tRetired)))
+			&& ((LONG64)ptRetired->qwGeneration <= qwFlushed))
+		{
+			(VOID)ept64_RingPop(&ptCpu->tRetired, &tPage);
+			if (!ept64_RingPush(&ptCpu->tFree, &tPage))
+			{
+				ptAllocator->pfnFreeTable(ptAllocator->pvContext, tPage.pqwTable,
+					tPage.qwPhysicalAddress);
+			}
+		}
+
+		while (ept64_RingCount(&ptCpu->tFree) < EPT64_SPLIT_RING_SIZE)
+		{
+			RtlZeroMemory(&tPage, sizeof(tPage));
+			tPage.pqwTable = (PUINT64)ptAllocator->pfnAllocTable(ptAllocator->pvContext,
+				&tPage.qwPhysicalAddress);
+			if (NULL == tPage.pqwTable)
+			{
+				eStatus = STATUS_INSUFFICIENT_RESOURCES;
+				break;
+			}
+			(VOID)ept64_RingPush(&ptCpu->tFree, &tPage);
+		}
+	}
+
+	InterlockedExchange(&ptPool->lRefillLock, 0);
+	return eStatus;
+}
+
+VOID
+Ept64SplitPoolDestroy(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool
+)
+{
+	PPAGING64_TABLE_ALLOCATOR ptAllocator = NULL;
+	EPT64_SPLIT_PAGE tPage = { 0 };
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptPool);
+
+	if (NULL == ptPool->ptEpt)
+	{
+		return;
+	}
+
+	ptAllocator = &ptPool->ptEpt->tAllocator;
+	for (i = 0; i < ptPool->dwCpuCount; i++)
+	{
+		while (ept64_RingPop(&ptPool->atCpus[i].tFree, &tPage)
+			|| ept64_RingPop(&ptPool->atCpus[i].tRetired, &tPage))
+		{
+			ptAllocator->pfnFreeTable(ptAllocator->pvContext, tPage.pqwTable,
+				tPage.qwPhysicalAddress);
+		}
+	}
+
+	ptPool->ptEpt = NULL;
+	ptPool->dwCpuCount = 0;
+}
+
+NTSTATUS
+Ept64SplitLeaf(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	UINT32				dwCpu,
+	_In_	UINT64				qwGuestPhysicalAddress,
+	_In_	PAGE_TYPE64			ePageType
+)
+{
+	PEPT64_SPLIT_RING ptFree = NULL;
+	PUINT64 pqwTable = NULL;
+	PUINT64 pqwEntry = NULL;
+	UINT32 dwTargetLevel = 0;
+	UINT32 dwLevel = 0;
+
+	NT_ASSERT(NULL != ptPool);
+	NT_ASSERT(NULL != ptPool->ptEpt);
+	NT_ASSERT(dwCpu < ptPool->dwCpuCount);
+	NT_ASSERT(ePageType < PAGE_TYPES_COUNT);
+
+	if (qwGuestPhysicalAddress >= EPT64_GUEST_PHYSICAL_LIMIT)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptFree = &ptPool->atCpus[dwCpu].tFree;
+	dwTargetLevel = EPT64_PAGE_TYPE_LEVEL(ePageType);
+	pqwTable = (PUINT64)ptPool->ptEpt->ptPml4;
+	for (dwLevel = EPT64_LEVEL_PML4; dwLevel > dwTargetLevel; dwLevel--)
+	{
+		pqwEntry = ept64_EntryOf(pqwTable, qwGuestPhysicalAddress, dwLevel);
+		if (!EPT_ENTRY_PRESENT(*pqwEntry))
+		{
+			return STATUS_NOT_FOUND;
+		}
+		if (EPT_IS_LEAF(*pqwEntry))
+		{
+			// Every page the splits need is checked up front, so they either all
+			// happen or none does
+			if (ept64_RingCount(ptFree) < dwLevel - dwTargetLevel)
+			{
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+			ept64_SplitEntry(ptPool, ptFree, pqwEntry, dwLevel);
+		}
+		pqwTable = ept64_TableVa(ptPool->ptEpt, *pqwEntry & PAGING64_PHYS_ADDR_MASK);
+	}
+
+	if (!EPT_ENTRY_PRESENT(*ept64_EntryOf(pqwTable, qwGuestPhysicalAddress, dwLevel)))
+	{
+		return STATUS_NOT_FOUND;
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Ept64MergeTable(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	UINT32				dwCpu,
+	_In_	UINT64				qwGuestPhysicalAddress,
+	_In_	PAGE_TYPE64			ePageType
+)
+{
+	PEPT64_HIERARCHY ptEpt = NULL;
+	PEPT64_SPLIT_RING ptRetired = NULL;
+	EPT64_SPLIT_PAGE tPage = { 0 };
+	PUINT64 pqwTable = NULL;
+	PUINT64 pqwEntry = NULL;
+	UINT64 qwEntry = 0;
+	UINT64 qwPrevious = 0;
+	UINT64 qwLeaf = 0;
+	UINT64 qwFlags = 0;
+	UINT32 dwTargetLevel = 0;
+	UINT32 dwLevel = 0;
+
+	NT_ASSERT(NULL != ptPool);
+	NT_ASSERT(NULL != ptPool->ptEpt);
+	NT_ASSERT(dwCpu < ptPool->dwCpuCount);
+	NT_ASSERT((PAGE_TYPE_2MB == ePageType) || (PAGE_TYPE_1GB == ePageType));
+
+	ptEpt = ptPool->ptEpt;
+	if (((PAGE_TYPE_1GB == ePageType) && !ptEpt->tCapabilities.support1gb)
+		|| ((PAGE_TYPE_2MB == ePageType) && !ptEpt->tCapabilities.support2mb))
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+	if (qwGuestPhysicalAddress >= EPT64_GUEST_PHYSICAL_LIMIT)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	dwTargetLevel = EPT64_PAGE_TYPE_LEVEL(ePageType);
+	pqwTable = (PUINT64)ptEpt->ptPml4;
+	for (dwLevel = EPT64_LEVEL_PML4; ; dwLevel--)
+	{
+		pqwEntry = ept64_EntryOf(pqwTable, qwGuestPhysicalAddress, dwLevel);
+		if (!EPT_IS_TABLE(*pqwEntry))
+		{
+			return STATUS_NOT_FOUND;
+		}
+		if (dwTargetLevel == dwLevel)
+		{
+			break;
+		}
+		pqwTable = ept64_TableVa(ptEpt, *pqwEntry & PAGING64_PHYS_ADDR_MASK);
+	}
+
+	ptRetired = &ptPool->atCpus[dwCpu].tRetired;
+	if (EPT64_SPLIT_RING_SIZE == ept64_RingCount(ptRetired))
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	qwEntry = *(volatile UINT64*)pqwEntry;
+	tPage.qwPhysicalAddress = qwEntry & PAGING64_PHYS_ADDR_MASK;
+	tPage.pqwTable = ept64_TableVa(ptEpt, tPage.qwPhysicalAddress);
+	qwLeaf = ept64_MergeLeaves(tPage.pqwTable, dwLevel - 1);
+	if (0 == qwLeaf)
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	// Only the accessed flag of the table entry may change meanwhile
+	while (qwEntry != (qwPrevious = PAGING64_ENTRY_COMPARE_EXCHANGE(pqwEntry, qwLeaf, qwEntry)))
+	{
+		qwEntry = qwPrevious;
+	}
+
+	// The processor may have set accessed/dirty flags in the retired table after
+	// ept64_MergeLeaves sampled them, carry them over so dirty logging doesn't miss a write
+	qwFlags = ept64_LeafFlags(tPage.pqwTable) & ~qwLeaf;
+	if (0 != qwFlags)
+	{
+		(VOID)Paging64EntryUpdate(pqwEntry, qwFlags, qwFlags);
+	}
+
+	ptEpt->dwTablePages--;
+	ptEpt->aqwLeafCount[EPT64_LEVEL_PAGE_TYPE(dwLevel - 1)] -= PAGING64_PTE_COUNT;
+	ptEpt->aqwLeafCount[ePageType]++;
+	tPage.qwGeneration = (UINT64)InterlockedIncrement64(&ptPool->qwGeneration);
+	(VOID)ept64_RingPush(ptRetired, &tPage);
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN
+Ept64SplitPoolTakePendingInvept(
+	_Inout_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	UINT32				dwCpu
+)
+{
+	LONG64 qwGeneration = 0;
+	PEPT64_SPLIT_CPU ptCpu = NULL;
+
+	NT_ASSERT(NULL != ptPool);
+	NT_ASSERT(dwCpu < ptPool->dwCpuCount);
+
+	ptCpu = &ptPool->atCpus[dwCpu];
+	qwGeneration = ptPool->qwGeneration;
+	if (ptCpu->qwFlushedGeneration == qwGeneration)
+	{
+		return FALSE;
+	}
+
+	InterlockedExchange64(&ptCpu->qwFlushedGeneration, qwGeneration);
+	return TRUE;
+}
+
+UINT32
+Ept64SplitPoolGetFreeCount(
+	_In_	PEPT64_SPLIT_POOL	ptPool,
+	_In_	UINT32				dwCpu
+)
+{
+	NT_ASSERT(NULL != ptPool);
+	NT_ASSERT(dwCpu < ptPool->dwCpuCount);
+
+	return ept64_RingCount(&ptPool->atCpus[dwCpu].tFree);
+}
@@ -0,0 +1,719 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		eptview64.c
+* @section	Multiple EPT views sharing unchanged subtrees, switched with VMFUNC
+*/
+
+#include "eptview64.h"
+
+// Levels of the hierarchy, numbered like the walk: PT = 1 ... PML4 = 4
+#define EPTVIEW64_LEVEL_PT		1
+#define EPTVIEW64_LEVEL_PD		2
+#define EPTVIEW64_LEVEL_PDPT	3
+#define EPTVIEW64_LEVEL_PML4	4
+
+// Shift of the guest-physical range covered by a single entry of a level
+#define EPTVIEW64_LEVEL_SHIFT(dwLevel)	(PAGE_SHIFT_4KB + 9 * ((dwLevel) - 1))
+
+// Level whose leaves are pages of a type
+#define EPTVIEW64_PAGE_TYPE_LEVEL(ePageType)	((UINT32)(EPTVIEW64_LEVEL_PDPT - (ePageType)))
+
+static
+__inline
+PUINT64
+eptview64_TableVa(
+	_In_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT64				qwPhysicalAddress
+)
+{
+	return (PUINT64)ptManager->ptBase->tAllocator.pfnPhysToVirt(
+		ptManager->ptBase->tAllocator.pvContext, qwPhysicalAddress);
+}
+
+static
+__inline
+PUINT64
+eptview64_GetRoot(
+	_In_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwView
+)
+{
+	if ((dwView >= EPTVIEW64_MAX_VIEWS) || (0 == ptManager->ptEptpList[dwView].qwValue))
+	{
+		return NULL;
+	}
+	return eptview64_TableVa(ptManager,
+		(UINT64)ptManager->ptEptpList[dwView].addr << PAGE_SHIFT_4KB);
+}
+
+static
+__inline
+UINT32
+eptview64_ShareHome(
+	_In_	UINT64	qwPhysicalAddress
+)
+{
+	return (UINT32)(((qwPhysicalAddress >> PAGE_SHIFT_4KB) * 0x9E3779B97F4A7C15ULL)
+		>> (64 - EPTVIEW64_SHARE_SHIFT));
+}
+
+/**
+* Find the reference count slot of a table
+* @param ptManager - view manager
+* @param qwPhysicalAddress - physical address of the table
+* @param bInsert - whether to take a slot for the table if it has none
+* @return The slot, or NULL if the table has none (and bInsert is FALSE)
+*/
+static
+PEPTVIEW64_SHARE
+eptview64_FindShare(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT64				qwPhysicalAddress,
+	_In_	BOOLEAN				bInsert
+)
+{
+	UINT32 dwSlot = eptview64_ShareHome(qwPhysicalAddress);
+	PEPTVIEW64_SHARE ptShare = NULL;
+	UINT32 i = 0;
+
+	// Only tables referenced more than once have a slot, so the map is never
+	// more than 3/4 full and a free slot always ends the probe sequence
+	for (i = 0; i < EPTVIEW64_SHARE_SLOTS; i++)
+	{
+		ptShare = &ptManager->atShares[dwSlot];
+		if (qwPhysicalAddress == ptShare->qwPhysicalAddress)
+		{
+			return ptShare;
+		}
+		if (MAXUINT64 == ptShare->qwPhysicalAddress)
+		{
+			break;
+		}
+		dwSlot = (dwSlot + 1) & (EPTVIEW64_SHARE_SLOTS - 1);
+	}
+
+	if (!bInsert)
+	{
+		return NULL;
+	}
+	NT_ASSERT(MAXUINT64 == ptShare->qwPhysicalAddress);
+	ptShare->qwPhysicalAddress = qwPhysicalAddress;
+	ptShare->qwReferences = 1;
+	return ptShare;
+}
+
+/**
+* Free the slot of a table, moving back the slots whose probe sequence went
+* through it so lookups still find them without tombstones
+* @param ptManager - view manager
+* @param ptShare - slot to free
+*/
+static
+VOID
+eptview64_RemoveShare(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_Inout_	PEPTVIEW64_SHARE	ptShare
+)
+{
+	UINT32 dwHole = (UINT32)(ptShare - ptManager->atShares);
+	UINT32 dwSlot = dwHole;
+	UINT32 dwHome = 0;
+
+	for (;;)
+	{
+		dwSlot = (dwSlot + 1) & (EPTVIEW64_SHARE_SLOTS - 1);
+		if (MAXUINT64 == ptManager->atShares[dwSlot].qwPhysicalAddress)
+		{
+			break;
+		}
+
+		// Slots whose home lies cyclically in (hole, slot] are still reachable
+		dwHome = eptview64_ShareHome(ptManager->atShares[dwSlot].qwPhysicalAddress);
+		if (((dwSlot - dwHome) & (EPTVIEW64_SHARE_SLOTS - 1))
+			< ((dwSlot - dwHole) & (EPTVIEW64_SHARE_SLOTS - 1)))
+		{
+			continue;
+		}
+		ptManager->atShares[dwHole] = ptManager->atShares[dwSlot];
+		dwHole = dwSlot;
+	}
+
+	ptManager->atShares[dwHole].qwPhysicalAddress = MAXUINT64;
+	ptManager->atShares[dwHole].qwReferences = 0;
+}
+
+static
+__inline
+UINT64
+eptview64_GetReferences(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT64				qwPhysicalAddress
+)
+{
+	PEPTVIEW64_SHARE ptShare = eptview64_FindShare(ptManager, qwPhysicalAddress, FALSE);
+
+	return (NULL == ptShare) ? 1 : ptShare->qwReferences;
+}
+
+/**
+* Count one more entry referencing a table. The caller makes sure there is room
+* in the map, see eptview64_CanShare.
+*/
+static
+VOID
+eptview64_AddReference(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT64				qwPhysicalAddress
+)
+{
+	PEPTVIEW64_SHARE ptShare = eptview64_FindShare(ptManager, qwPhysicalAddress, TRUE);
+
+	NT_ASSERT(NULL != ptShare);
+	if (1 == ptShare->qwReferences)
+	{
+		ptManager->dwSharedTables++;
+	}
+	ptShare->qwReferences++;
+}
+
+/**
+* Count one less entry referencing a table
+* @return Number of entries still referencing the table
+*/
+static
+UINT64
+eptview64_ReleaseReference(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT64				qwPhysicalAddress
+)
+{
+	PEPTVIEW64_SHARE ptShare = eptview64_FindShare(ptManager, qwPhysicalAddress, FALSE);
+
+	if ((NULL == ptShare) || (ptShare->qwReferences <= 1))
+	{
+		return 0;
+	}
+	ptShare->qwReferences--;
+	if (1 != ptShare->qwReferences)
+	{
+		return ptShare->qwReferences;
+	}
+	ptManager->dwSharedTables--;
+	eptview64_RemoveShare(ptManager, ptShare);
+	return 1;
+}
+
+static
+__inline
+BOOLEAN
+eptview64_CanShare(
+	_In_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwTables
+)
+{
+	return (ptManager->dwSharedTables + dwTables <= EPTVIEW64_SHARE_LIMIT);
+}
+
+/**
+* Make the table referenced by an entry private to the entry's view, copying it
+* if other entries reference it too. The tables below the copy become shared.
+* @param ptManager - view manager
+* @param pqwEntry - entry referencing a table, in a table private to the view
+* @param dwLevel - level of the referenced table
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+static
+NTSTATUS
+eptview64_MakePrivate(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_Inout_	PUINT64				pqwEntry,
+	_In_	UINT32				dwLevel
+)
+{
+	PPAGING64_TABLE_ALLOCATOR ptAllocator = &ptManager->ptBase->tAllocator;
+	UINT64 qwTablePhysicalAddress = *pqwEntry & PAGING64_PHYS_ADDR_MASK;
+	UINT64 qwCopyPhysicalAddress = 0;
+	PUINT64 pqwTable = NULL;
+	PUINT64 pqwCopy = NULL;
+	UINT32 i = 0;
+
+	if (eptview64_GetReferences(ptManager, qwTablePhysicalAddress) <= 1)
+	{
+		return STATUS_SUCCESS;
+	}
+	if (!eptview64_CanShare(ptManager, PAGING64_PTE_COUNT))
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	pqwCopy = (PUINT64)ptAllocator->pfnAllocTable(ptAllocator->pvContext,
+		&qwCopyPhysicalAddress);
+	if (NULL == pqwCopy)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	pqwTable = eptview64_TableVa(ptManager, qwTablePhysicalAddress);
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		pqwCopy[i] = pqwTable[i];
+		if ((EPTVIEW64_LEVEL_PT != dwLevel) && EPT_IS_TABLE(pqwCopy[i]))
+		{
+			eptview64_AddReference(ptManager, pqwCopy[i] & PAGING64_PHYS_ADDR_MASK);
+		}
+	}
+
+	// The copy is complete before it's published with a single store
+	PAGING64_ENTRY_WRITE(pqwEntry,
+		(*pqwEntry & ~PAGING64_PHYS_ADDR_MASK) | qwCopyPhysicalAddress);
+	(VOID)eptview64_ReleaseReference(ptManager, qwTablePhysicalAddress);
+	ptManager->lTablePages++;
+	return STATUS_SUCCESS;
+}
+
+/**
+* Replace a 1GB or 2MB leaf, in a table private to its view, with a private
+* table of 512 leaves of the next size down that inherit all its attributes
+* @param ptManager - view manager
+* @param pqwEntry - PDPTE or PDE holding the leaf
+* @param dwLevel - level of the entry
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+static
+NTSTATUS
+eptview64_SplitLeaf(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_Inout_	PUINT64				pqwEntry,
+	_In_	UINT32				dwLevel
+)
+{
+	PPAGING64_TABLE_ALLOCATOR ptAllocator = &ptManager->ptBase->tAllocator;
+	UINT32 dwSmallShift = EPTVIEW64_LEVEL_SHIFT(dwLevel - 1);
+	UINT64 qwTablePhysicalAddress = 0;
+	UINT64 qwPrevious = *(volatile UINT64*)pqwEntry;
+	UINT64 qwEntry = 0;
+	UINT64 qwAttributes = 0;
+	PUINT64 pqwTable = NULL;
+	UINT32 i = 0;
+
+	pqwTable = (PUINT64)ptAllocator->pfnAllocTable(ptAllocator->pvContext,
+		&qwTablePhysicalAddress);
+	if (NULL == pqwTable)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	// The processor may set the accessed and dirty flags of the leaf until the swap
+	do
+	{
+		qwEntry = qwPrevious;
+		qwAttributes = qwEntry & ~PAGING64_PHYS_ADDR_MASK;
+		if (EPTVIEW64_LEVEL_PD == dwLevel)
+		{
+			qwAttributes &= ~EPT_ENTRY_PAGE_SIZE;
+		}
+		for (i = 0; i < PAGING64_PTE_COUNT; i++)
+		{
+			pqwTable[i] = qwAttributes
+				| ((qwEntry & PAGING64_PHYS_ADDR_MASK) + ((UINT64)i << dwSmallShift));
+		}
+		qwPrevious = PAGING64_ENTRY_COMPARE_EXCHANGE(pqwEntry,
+			EPT_ACCESS_ALL | qwTablePhysicalAddress, qwEntry);
+	} while (qwPrevious != qwEntry);
+
+	ptManager->lTablePages++;
+	return STATUS_SUCCESS;
+}
+
+/**
+* Drop a reference to a table, releasing it and the references it holds once
+* no view uses it anymore
+* @param ptManager - view manager
+* @param qwTablePhysicalAddress - table to release
+* @param dwLevel - level of the table
+*/
+static
+VOID
+eptview64_ReleaseTable(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT64				qwTablePhysicalAddress,
+	_In_	UINT32				dwLevel
+)
+{
+	PPAGING64_TABLE_ALLOCATOR ptAllocator = &ptManager->ptBase->tAllocator;
+	PUINT64 pqwTable = NULL;
+	UINT32 i = 0;
+
+	if (0 != eptview64_ReleaseReference(ptManager, qwTablePhysicalAddress))
+	{
+		return;
+	}
+
+	pqwTable = eptview64_TableVa(ptManager, qwTablePhysicalAddress);
+	if (EPTVIEW64_LEVEL_PT != dwLevel)
+	{
+		for (i = 0; i < PAGING64_PTE_COUNT; i++)
+		{
+			if (EPT_IS_TABLE(pqwTable[i]))
+			{
+				eptview64_ReleaseTable(ptManager, pqwTable[i] & PAGING64_PHYS_ADDR_MASK,
+					dwLevel - 1);
+			}
+		}
+	}
+
+	ptAllocator->pfnFreeTable(ptAllocator->pvContext, pqwTable, qwTablePhysicalAddress);
+	ptManager->lTablePages--;
+}
+
+NTSTATUS
+EptView64Init(
+	_Out_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	PEPT64_HIERARCHY	ptBase
+)
+{
+	PPAGING64_TABLE_ALLOCATOR ptAllocator = NULL;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptManager);
+	NT_ASSERT(NULL != ptBase);
+	NT_ASSERT(NULL != ptBase->ptPml4);
+
+	RtlZeroMemory(ptManager, sizeof(*ptManager));
+	for (i = 0; i < EPTVIEW64_SHARE_SLOTS; i++)
+	{
+		ptManager->atShares[i].qwPhysicalAddress = MAXUINT64;
+	}
+	ptManager->ptBase = ptBase;
+
+	// Unused entries stay 0, so VMFUNC to them exits instead of loading garbage
+	ptAllocator = &ptBase->tAllocator;
+	ptManager->ptEptpList = (PEPTP)ptAllocator->pfnAllocTable(ptAllocator->pvContext,
+		&ptManager->qwEptpListPhysicalAddress);
+	if (NULL == ptManager->ptEptpList)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ptManager->ptEptpList[EPTVIEW64_BASE_VIEW] = Ept64GetEptp(ptBase);
+	ptManager->dwViewCount = 1;
+	return STATUS_SUCCESS;
+}
+
+VOID
+EptView64Destroy(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager
+)
+{
+	PPAGING64_TABLE_ALLOCATOR ptAllocator = NULL;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptManager);
+
+	if (NULL == ptManager->ptEptpList)
+	{
+		return;
+	}
+
+	for (i = EPTVIEW64_BASE_VIEW + 1; i < EPTVIEW64_MAX_VIEWS; i++)
+	{
+		(VOID)EptView64Delete(ptManager, i);
+	}
+
+	ptAllocator = &ptManager->ptBase->tAllocator;
+	ptAllocator->pfnFreeTable(ptAllocator->pvContext, ptManager->ptEptpList,
+		ptManager->qwEptpListPhysicalAddress);
+	ptManager->ptEptpList = NULL;
+	ptManager->qwEptpListPhysicalAddress = 0;
+	ptManager->dwViewCount = 0;
+}
+
+NTSTATUS
+EptView64Create(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwSourceView,
+	_Out_	PUINT32				pdwView
+)
+{
+	PPAGING64_TABLE_ALLOCATOR ptAllocator = NULL;
+	PUINT64 pqwSource = NULL;
+	PUINT64 pqwPml4 = NULL;
+	UINT64 qwPml4PhysicalAddress = 0;
+	EPTP tEptp = { 0 };
+	UINT32 dwView = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptManager);
+	NT_ASSERT(NULL != ptManager->ptEptpList);
+	NT_ASSERT(NULL != pdwView);
+
+	*pdwView = 0;
+	pqwSource = eptview64_GetRoot(ptManager, dwSourceView);
+	if (NULL == pqwSource)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	for (dwView = EPTVIEW64_BASE_VIEW + 1; dwView < EPTVIEW64_MAX_VIEWS; dwView++)
+	{
+		if (0 == ptManager->ptEptpList[dwView].qwValue)
+		{
+			break;
+		}
+	}
+	if ((EPTVIEW64_MAX_VIEWS == dwView)
+		|| !eptview64_CanShare(ptManager, PAGING64_PML4E_COUNT))
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ptAllocator = &ptManager->ptBase->tAllocator;
+	pqwPml4 = (PUINT64)ptAllocator->pfnAllocTable(ptAllocator->pvContext,
+		&qwPml4PhysicalAddress);
+	if (NULL == pqwPml4)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	ptManager->lTablePages++;
+
+	// Only the PML4 is copied, the PDPTs below it become shared
+	for (i = 0; i < PAGING64_PML4E_COUNT; i++)
+	{
+		pqwPml4[i] = pqwSource[i];
+		if (EPT_IS_TABLE(pqwPml4[i]))
+		{
+			eptview64_AddReference(ptManager, pqwPml4[i] & PAGING64_PHYS_ADDR_MASK);
+		}
+	}
+
+	tEptp = ptManager->ptEptpList[dwSourceView];
+	tEptp.addr = qwPml4PhysicalAddress >> PAGE_SHIFT_4KB;
+	ptManager->ptEptpList[dwView] = tEptp;
+	ptManager->dwViewCount++;
+	*pdwView = dwView;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EptView64Delete(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwView
+)
+{
+	PPAGING64_TABLE_ALLOCATOR ptAllocator = NULL;
+	PUINT64 pqwPml4 = NULL;
+	UINT64 qwPml4PhysicalAddress = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptManager);
+	NT_ASSERT(NULL != ptManager->ptEptpList);
+
+	pqwPml4 = eptview64_GetRoot(ptManager, dwView);
+	if ((EPTVIEW64_BASE_VIEW == dwView) || (NULL == pqwPml4))
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	qwPml4PhysicalAddress = (UINT64)ptManager->ptEptpList[dwView].addr << PAGE_SHIFT_4KB;
+	ptManager->ptEptpList[dwView].qwValue = 0;
+	ptManager->dwViewCount--;
+
+	for (i = 0; i < PAGING64_PML4E_COUNT; i++)
+	{
+		if (EPT_IS_TABLE(pqwPml4[i]))
+		{
+			eptview64_ReleaseTable(ptManager, pqwPml4[i] & PAGING64_PHYS_ADDR_MASK,
+				EPTVIEW64_LEVEL_PDPT);
+		}
+	}
+
+	ptAllocator = &ptManager->ptBase->tAllocator;
+	ptAllocator->pfnFreeTable(ptAllocator->pvContext, pqwPml4, qwPml4PhysicalAddress);
+	ptManager->lTablePages--;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EptView64UpdateLeaf(
+	_Inout_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwView,
+	_In_	UINT64				qwGuestPhysicalAddress,
+	_In_	PAGE_TYPE64			ePageType,
+	_In_	UINT64				qwMask,
+	_In_	UINT64				qwValue
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	PUINT64 pqwTable = NULL;
+	PUINT64 pqwEntry = NULL;
+	UINT32 dwTargetLevel = 0;
+	UINT32 dwLevel = 0;
+
+	NT_ASSERT(NULL != ptManager);
+	NT_ASSERT(NULL != ptManager->ptEptpList);
+	NT_ASSERT(ePageType < PAGE_TYPES_COUNT);
+	NT_ASSERT(0 == (qwMask & EPT_ENTRY_PAGE_SIZE));
+
+	pqwTable = eptview64_GetRoot(ptManager, dwView);
+	if ((NULL == pqwTable) || (qwGuestPhysicalAddress >= EPT64_GUEST_PHYSICAL_LIMIT))
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	dwTargetLevel = EPTVIEW64_PAGE_TYPE_LEVEL(ePageType);
+	for (dwLevel = EPTVIEW64_LEVEL_PML4; ; dwLevel--)
+	{
+		pqwEntry = &pqwTable[(qwGuestPhysicalAddress >> EPTVIEW64_LEVEL_SHIFT(dwLevel))
+			& (PAGING64_PTE_COUNT - 1)];
+		if (!EPT_ENTRY_PRESENT(*pqwEntry))
+		{
+			return STATUS_NOT_FOUND;
+		}
+		if (EPTVIEW64_LEVEL_PT == dwLevel)
+		{
+			break;
+		}
+
+		if (EPT_IS_LEAF(*pqwEntry))
+		{
+			if (dwLevel <= dwTargetLevel)
+			{
+				break;
+			}
+			eStatus = eptview64_SplitLeaf(ptManager, pqwEntry, dwLevel);
+		}
+		else
+		{
+			eStatus = eptview64_MakePrivate(ptManager, pqwEntry, dwLevel - 1);
+		}
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+		pqwTable = eptview64_TableVa(ptManager, *pqwEntry & PAGING64_PHYS_ADDR_MASK);
+	}
+
+	(VOID)Paging64EntryUpdate(pqwEntry, qwMask, qwValue);
+	return STATUS_SUCCESS;
+}
+
+EPTP
+EptView64GetEptp(
+	_In_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwView
+)
+{
+	EPTP tEptp = { 0 };
+
+	NT_ASSERT(NULL != ptManager);
+	NT_ASSERT(NULL != ptManager->ptEptpList);
+
+	if (dwView < EPTVIEW64_MAX_VIEWS)
+	{
+		tEptp = ptManager->ptEptpList[dwView];
+	}
+	return tEptp;
+}
+
+NTSTATUS
+EptView64EnableVmfunc(
+	_In_	PEPTVIEW64_MANAGER	ptManager
+)
+{
+	size_t cbFunctions = 0;
+	size_t cbControls = 0;
+	VMX_PROCBASED_CTLS2 tControls = { 0 };
+
+	NT_ASSERT(NULL != ptManager);
+	NT_ASSERT(NULL != ptManager->ptEptpList);
+
+	if ((VMX_SUCCESS != __vmx_vmwrite(VMCS_FIELD_EPTP_LIST_ADDR_FULL,
+			ptManager->qwEptpListPhysicalAddress))
+		|| (VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_VM_FUNCTION_CONTROL_FULL, &cbFunctions))
+		|| (VMX_SUCCESS != __vmx_vmwrite(VMCS_FIELD_VM_FUNCTION_CONTROL_FULL,
+			cbFunctions | EPTVIEW64_VMFUNC_EPTP_SWITCHING))
+		|| (VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL, &cbControls)))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	*(PUINT32)&tControls = (UINT32)cbControls;
+	tControls.EnableVmFunctions = TRUE;
+	if (VMX_SUCCESS != __vmx_vmwrite(VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL, *(PUINT32)&tControls))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EptView64Switch(
+	_In_	PEPTVIEW64_MANAGER	ptManager,
+	_In_	UINT32				dwView
+)
+{
+	NT_ASSERT(NULL != ptManager);
+	NT_ASSERT(NULL != ptManager->ptEptpList);
+
+	if (NULL == eptview64_GetRoot(ptManager, dwView))
+	{
+		return STATUS_NOT_FOUND;
+	}
+	if (VMX_SUCCESS != __vmx_vmwrite(VMCS_FIELD_EPT_POINTER_FULL,
+		ptManager->ptEptpList[dwView].qwValue))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+EptView64GetCurrentView(
+	_In_	PEPTVIEW64_MANAGER	ptManager,
+	_Out_	PUINT32				pdwView
+)
+{
+	size_t cbEptp = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptManager);
+	NT_ASSERT(NULL != ptManager->ptEptpList);
+	NT_ASSERT(NULL != pdwView);
+
+	*pdwView = 0;
+	if (VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_EPT_POINTER_FULL, &cbEptp))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	for (i = 0; i < EPTVIEW64_MAX_VIEWS; i++)
+	{
+		if ((0 != cbEptp) && (cbEptp == ptManager->ptEptpList[i].qwValue))
+		{
+			*pdwView = i;
+			return STATUS_SUCCESS;
+		}
+	}
+	return STATUS_NOT_FOUND;
+}
@@ -0,0 +1,357 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		guestpaging.c
+* @section	Translation of guest linear addresses in every paging mode
+*/
+
+#include "guestpaging.h"
+#include "VT-x.h"
+
+// Guest linear addresses are 32-bit wide unless IA-32e paging is used
+#define GUEST_PAGING_LINEAR32_LIMIT	(1ULL << 32)
+
+GUEST_PAGING_MODE
+GuestPagingGetMode(
+	_In_	CR0_REG		tCr0,
+	_In_	CR4_REG		tCr4,
+	_In_	IA32_EFER	tEfer
+)
+{
+	if (!tCr0.pg)
+	{
+		return GUEST_PAGING_NONE;
+	}
+	if (!tCr4.pae)
+	{
+		return GUEST_PAGING_32BIT;
+	}
+	return (tEfer.lma) ? GUEST_PAGING_IA32E : GUEST_PAGING_PAE;
+}
+
+NTSTATUS
+GuestPagingInit(
+	_Out_										PGUEST_PAGING_STATE	ptState,
+	_In_										PPAGING64_READER	ptReader,
+	_In_										CR0_REG				tCr0,
+	_In_										CR3_REG				tCr3,
+	_In_										CR4_REG				tCr4,
+	_In_										IA32_EFER			tEfer,
+	_In_reads_opt_(PAGING_PAE_PDPTE_COUNT)		const UINT64*		pqwPdptes
+)
+{
+	const UINT8* pcPdptPage = NULL;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptState);
+	NT_ASSERT(NULL != ptReader);
+
+	RtlZeroMemory(ptState, sizeof(*ptState));
+	ptState->eMode = GuestPagingGetMode(tCr0, tCr4, tEfer);
+	ptState->tCr3 = tCr3;
+	ptState->bPse = (BOOLEAN)tCr4.pse;
+	ptState->bNxe = (BOOLEAN)tEfer.nxe;
+	if (GUEST_PAGING_PAE != ptState->eMode)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	if (NULL == pqwPdptes)
+	{
+		// Vol 3A, 4.4.1 The PDPT is 32 bytes long and 32-byte aligned, always within one page
+		pcPdptPage = (const UINT8*)ptReader->pfnReadTable(ptReader->pvContext,
+			tCr3.qwValue & PAGING32_PHYS_ADDR_MASK);
+		if (NULL == pcPdptPage)
+		{
+			return STATUS_ACCESS_VIOLATION;
+		}
+		pqwPdptes = (const UINT64*)(pcPdptPage
+			+ BYTE_OFFSET_4KB(tCr3.qwValue & PAGING_PAE_CR3_PDPT_MASK));
+	}
+	for (i = 0; i < PAGING_PAE_PDPTE_COUNT; i++)
+	{
+		*(PUINT64)&ptState->atPdptes[i] = pqwPdptes[i];
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+GuestPagingInitFromVmcs(
+	_Out_	PGUEST_PAGING_STATE	ptState
+)
+{
+	static const UINT32 adwPdpteFields[PAGING_PAE_PDPTE_COUNT] = {
+		VMCS_FIELD_GUEST_PDPTE0_FULL,
+		VMCS_FIELD_GUEST_PDPTE1_FULL,
+		VMCS_FIELD_GUEST_PDPTE2_FULL,
+		VMCS_FIELD_GUEST_PDPTE3_FULL,
+	};
+	size_t cbCr0 = 0;
+	size_t cbCr3 = 0;
+	size_t cbCr4 = 0;
+	size_t cbEfer = 0;
+	size_t cbPdpte = 0;
+	CR0_REG tCr0 = { 0 };
+	CR4_REG tCr4 = { 0 };
+	IA32_EFER tEfer = { 0 };
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptState);
+
+	RtlZeroMemory(ptState, sizeof(*ptState));
+	if ((VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_GUEST_CR0, &cbCr0))
+		|| (VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_GUEST_CR3, &cbCr3))
+		|| (VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_GUEST_CR4, &cbCr4))
+		|| (VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_GUEST_EFER_FULL, &cbEfer)))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	tCr0.dwValue = (UINT32)cbCr0;
+	tCr4.dwValue = (UINT32)cbCr4;
+	tEfer.qwValue = cbEfer;
+
+	ptState->eMode = GuestPagingGetMode(tCr0, tCr4, tEfer);
+	ptState->tCr3.qwValue = cbCr3;
+	ptState->bPse = (BOOLEAN)tCr4.pse;
+	ptState->bNxe = (BOOLEAN)tEfer.nxe;
+	if (GUEST_PAGING_PAE != ptState->eMode)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	// The cached PDPTEs spare four guest memory reads on every PAE walk
+	for (i = 0; i < PAGING_PAE_PDPTE_COUNT; i++)
+	{
+		if (VMX_SUCCESS != __vmx_vmread(adwPdpteFields[i], &cbPdpte))
+		{
+			return STATUS_UNSUCCESSFUL;
+		}
+		*(PUINT64)&ptState->atPdptes[i] = cbPdpte;
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+* Vol 3A, 4.3 32-BIT PAGING - PDE, then PTE unless the PDE maps a 4MB page
+*/
+static
+__inline
+NTSTATUS
+guestpaging_Walk32(
+	_In_	PPAGING64_READER		ptReader,
+	_In_	PGUEST_PAGING_STATE		ptState,
+	_In_	UINT32					dwVa,
+	_Out_	PGUEST_TRANSLATION		ptTranslation
+)
+{
+	const UINT32* pdwTable = NULL;
+	PDE_ANY32 tPde = { 0 };
+	PTE32 tPte = { 0 };
+
+	pdwTable = (const UINT32*)ptReader->pfnReadTable(ptReader->pvContext,
+		ptState->tCr3.qwValue & PAGING32_PHYS_ADDR_MASK);
+	if (NULL == pdwTable)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+	tPde.dwValue = pdwTable[dwVa >> PAGE_SHIFT_4MB];
+	if (!tPde.tTable.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptTranslation->bWritable = (BOOLEAN)tPde.tTable.rw;
+	ptTranslation->bUser = (BOOLEAN)tPde.tTable.us;
+
+	if (tPde.tTable.ps && ptState->bPse)
+	{
+		ptTranslation->dwPageShift = PAGE_SHIFT_4MB;
+		ptTranslation->qwLeafEntry = tPde.dwValue;
+		ptTranslation->qwPhysicalAddress = ((UINT64)tPde.tLeaf.addrhigh << 32)
+			+ ((UINT64)tPde.tLeaf.addr << PAGE_SHIFT_4MB)
+			+ (dwVa & (PAGE_SIZE_4MB - 1));
+		return STATUS_SUCCESS;
+	}
+
+	pdwTable = (const UINT32*)ptReader->pfnReadTable(ptReader->pvContext,
+		(UINT64)tPde.tTable.addr << PAGE_SHIFT_4KB);
+	if (NULL == pdwTable)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+	*(PUINT32)&tPte = pdwTable[(dwVa >> PAGE_SHIFT_4KB) & (PAGING32_PTE_COUNT - 1)];
+	if (!tPte.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptTranslation->bWritable &= tPte.rw;
+	ptTranslation->bUser &= tPte.us;
+	ptTranslation->dwPageShift = PAGE_SHIFT_4KB;
+	ptTranslation->qwLeafEntry = *(PUINT32)&tPte;
+	ptTranslation->qwPhysicalAddress = ((UINT64)tPte.addr << PAGE_SHIFT_4KB)
+		+ BYTE_OFFSET_4KB(dwVa);
+	return STATUS_SUCCESS;
+}
+
+/**
+* Vol 3A, 4.4 PAE PAGING - PDPTE from the captured state, PDE, then PTE unless
+* the PDE maps a 2MB page
+*/
+static
+__inline
+NTSTATUS
+guestpaging_WalkPae(
+	_In_	PPAGING64_READER		ptReader,
+	_In_	PGUEST_PAGING_STATE		ptState,
+	_In_	UINT32					dwVa,
+	_Out_	PGUEST_TRANSLATION		ptTranslation
+)
+{
+	const UINT64* pqwTable = NULL;
+	PDPTE_PAE tPdpte = { 0 };
+	PDE_ANY64 tPde = { 0 };
+	PTE64 tPte = { 0 };
+
+	tPdpte = ptState->atPdptes[dwVa >> PAGE_SHIFT_1GB];
+	if (!tPdpte.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	pqwTable = (const UINT64*)ptReader->pfnReadTable(ptReader->pvContext,
+		(UINT64)tPdpte.addr << PAGE_SHIFT_4KB);
+	if (NULL == pqwTable)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+	tPde.qwValue = pqwTable[(dwVa >> PAGE_SHIFT_2MB) & (PAGING64_PDE_COUNT - 1)];
+	if (!tPde.tTable.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	// PAE PDPTEs hold no access rights
+	ptTranslation->bWritable = (BOOLEAN)tPde.tTable.rw;
+	ptTranslation->bUser = (BOOLEAN)tPde.tTable.us;
+	ptTranslation->bExecuteDisable = (BOOLEAN)(tPde.tTable.xd & ptState->bNxe);
+
+	if (tPde.tTable.ps)
+	{
+		ptTranslation->dwPageShift = PAGE_SHIFT_2MB;
+		ptTranslation->qwLeafEntry = tPde.qwValue;
+		ptTranslation->qwPhysicalAddress = ((UINT64)tPde.tLeaf.addr << PAGE_SHIFT_2MB)
+			+ (dwVa & (PAGE_SIZE_2MB - 1));
+		return STATUS_SUCCESS;
+	}
+
+	pqwTable = (const UINT64*)ptReader->pfnReadTable(ptReader->pvContext,
+		(UINT64)tPde.tTable.addr << PAGE_SHIFT_4KB);
+	if (NULL == pqwTable)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+	*(PUINT64)&tPte = pqwTable[(dwVa >> PAGE_SHIFT_4KB) & (PAGING64_PTE_COUNT - 1)];
+	if (!tPte.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptTranslation->bWritable &= tPte.rw;
+	ptTranslation->bUser &= tPte.us;
+	ptTranslation->bExecuteDisable |= (BOOLEAN)(tPte.xd & ptState->bNxe);
+	ptTranslation->dwPageShift = PAGE_SHIFT_4KB;
+	ptTranslation->qwLeafEntry = *(PUINT64)&tPte;
+	ptTranslation->qwPhysicalAddress = ((UINT64)tPte.addr << PAGE_SHIFT_4KB)
+		+ BYTE_OFFSET_4KB(dwVa);
+	return STATUS_SUCCESS;
+}
+
+/**
+* Vol 3A, 4.5 IA-32E PAGING - the host walker already handles every page size
+*/
+static
+__inline
+NTSTATUS
+guestpaging_WalkIa32e(
+	_In_	PPAGING64_READER		ptReader,
+	_In_	PGUEST_PAGING_STATE		ptState,
+	_In_	UINT64					qwVa,
+	_Out_	PGUEST_TRANSLATION		ptTranslation
+)
+{
+	NTSTATUS eStatus = STATUS_UNSUCCESSFUL;
+	PAGING64_TRANSLATION tTranslation = { 0 };
+
+	eStatus = Paging64Walk(ptReader, ptState->tCr3, qwVa, &tTranslation);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+	ptTranslation->qwPhysicalAddress = tTranslation.qwPhysicalAddress;
+	ptTranslation->qwLeafEntry = tTranslation.qwLeafEntry;
+	ptTranslation->dwPageShift = PAGE_TYPE64_SHIFT(tTranslation.ePageType);
+	ptTranslation->bWritable = tTranslation.bWritable;
+	ptTranslation->bUser = tTranslation.bUser;
+	ptTranslation->bExecuteDisable = (BOOLEAN)(tTranslation.bExecuteDisable & ptState->bNxe);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+GuestPagingTranslate(
+	_In_	PPAGING64_READER		ptReader,
+	_In_	PGUEST_PAGING_STATE		ptState,
+	_In_	UINT64					qwVa,
+	_Out_	PGUEST_TRANSLATION		ptTranslation
+)
+{
+	NT_ASSERT(NULL != ptReader);
+	NT_ASSERT(NULL != ptState);
+	NT_ASSERT(NULL != ptTranslation);
+
+	RtlZeroMemory(ptTranslation, sizeof(*ptTranslation));
+	if ((GUEST_PAGING_IA32E != ptState->eMode) && (GUEST_PAGING_LINEAR32_LIMIT <= qwVa))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	// One specialized walk per mode keeps the per-level loops free of mode checks
+	switch (ptState->eMode)
+	{
+	case GUEST_PAGING_NONE:
+		ptTranslation->qwPhysicalAddress = qwVa;
+		ptTranslation->dwPageShift = PAGE_SHIFT_4KB;
+		ptTranslation->bWritable = TRUE;
+		ptTranslation->bUser = TRUE;
+		return STATUS_SUCCESS;
+	case GUEST_PAGING_32BIT:
+		return guestpaging_Walk32(ptReader, ptState, (UINT32)qwVa, ptTranslation);
+	case GUEST_PAGING_PAE:
+		return guestpaging_WalkPae(ptReader, ptState, (UINT32)qwVa, ptTranslation);
+	case GUEST_PAGING_IA32E:
+		return guestpaging_WalkIa32e(ptReader, ptState, qwVa, ptTranslation);
+	default:
+		NT_ASSERT(FALSE);
+		return STATUS_INVALID_PARAMETER;
+	}
+}
@@ -0,0 +1,779 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		invl64.c
+* @section	Coalescer of the INVEPT and INVVPID invalidations pending on each CPU
+*/
+
+#include "invl64.h"
+
+// Invalidations one CPU executes in a flush, captured under the lock
+typedef struct _INVL64_VPID_PLAN
+{
+	UINT16 wVpid;
+	BOOLEAN bSingleContext;
+	UINT32 dwAddressCount;
+	UINT64 aqwAddresses[INVL64_MAX_ADDRESSES];
+} INVL64_VPID_PLAN, *PINVL64_VPID_PLAN;
+
+typedef struct _INVL64_PLAN
+{
+	BOOLEAN bEptAll;
+	BOOLEAN bVpidAll;
+	UINT32 dwEptCount;
+	UINT32 dwVpidCount;
+	EPTP atEptps[INVL64_MAX_EPT_CONTEXTS + INVL64_MAX_OVERFLOW];
+	INVL64_VPID_PLAN atVpids[INVL64_MAX_VPID_CONTEXTS + INVL64_MAX_OVERFLOW];
+} INVL64_PLAN, *PINVL64_PLAN;
+
+static
+__inline
+VOID
+invl64_Lock(
+	_Inout_	PINVL64_TRACKER	ptTracker
+)
+{
+	while (0 != InterlockedCompareExchange(&ptTracker->lLock, 1, 0))
+	{
+		YieldProcessor();
+	}
+}
+
+static
+__inline
+VOID
+invl64_Unlock(
+	_Inout_	PINVL64_TRACKER	ptTracker
+)
+{
+	InterlockedExchange(&ptTracker->lLock, 0);
+}
+
+/**
+* Take the generation of a new request, under the lock
+*/
+static
+__inline
+UINT64
+invl64_NextGeneration(
+	_Inout_	PINVL64_TRACKER	ptTracker
+)
+{
+	ptTracker->qwRequests++;
+	return (UINT64)++ptTracker->qwGeneration;
+}
+
+/**
+* Get the oldest generation some CPU hasn't flushed yet, minus one. Requests up
+* to it need no more tracking.
+*/
+static
+UINT64
+invl64_GetFlushedByAll(
+	_In_	PINVL64_TRACKER	ptTracker
+)
+{
+	UINT64 qwFlushed = MAXUINT64;
+	UINT32 i = 0;
+
+	for (i = 0; i < ptTracker->dwCpuCount; i++)
+	{
+		if (ptTracker->atCpus[i].qwFlushedGeneration < qwFlushed)
+		{
+			qwFlushed = ptTracker->atCpus[i].qwFlushedGeneration;
+		}
+	}
+	return qwFlushed;
+}
+
+/**
+* Find the context of an EPTP, or take one every CPU has flushed
+* @return The context, or NULL if all of them still have pending requests
+*/
+static
+PINVL64_EPT_CONTEXT
+invl64_GetEptContext(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	EPTP			tEptp
+)
+{
+	PINVL64_EPT_CONTEXT ptContext = NULL;
+	UINT64 qwFlushed = 0;
+	UINT32 i = 0;
+
+	for (i = 0; i < ptTracker->dwEptContextCount; i++)
+	{
+		if (tEptp.qwValue == ptTracker->atEptContexts[i].tEptp.qwValue)
+		{
+			return &ptTracker->atEptContexts[i];
+		}
+	}
+
+	if (ptTracker->dwEptContextCount < INVL64_MAX_EPT_CONTEXTS)
+	{
+		ptContext = &ptTracker->atEptContexts[ptTracker->dwEptContextCount++];
+		ptContext->tEptp = tEptp;
+		ptContext->qwGeneration = 0;
+		return ptContext;
+	}
+
+	qwFlushed = invl64_GetFlushedByAll(ptTracker);
+	for (i = 0; i < INVL64_MAX_EPT_CONTEXTS; i++)
+	{
+		ptContext = &ptTracker->atEptContexts[i];
+		if (ptContext->qwGeneration <= qwFlushed)
+		{
+			ptContext->tEptp = tEptp;
+			return ptContext;
+		}
+	}
+	return NULL;
+}
+
+/**
+* Find the context of a VPID, or take one every CPU has flushed
+* @return The context, or NULL if all of them still have pending requests
+*/
+static
+PINVL64_VPID_CONTEXT
+invl64_GetVpidContext(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT16			wVpid
+)
+{
+	PINVL64_VPID_CONTEXT ptContext = NULL;
+	UINT64 qwFlushed = 0;
+	UINT32 i = 0;
+	UINT32 j = 0;
+
+	for (i = 0; i < ptTracker->dwVpidContextCount; i++)
+	{
+		if (wVpid == ptTracker->atVpidContexts[i].wVpid)
+		{
+			return &ptTracker->atVpidContexts[i];
+		}
+	}
+
+	if (ptTracker->dwVpidContextCount < INVL64_MAX_VPID_CONTEXTS)
+	{
+		ptContext = &ptTracker->atVpidContexts[ptTracker->dwVpidContextCount++];
+		RtlZeroMemory(ptContext, sizeof(*ptContext));
+		ptContext->wVpid = wVpid;
+		return ptContext;
+	}
+
+	qwFlushed = invl64_GetFlushedByAll(ptTracker);
+	for (i = 0; i < INVL64_MAX_VPID_CONTEXTS; i++)
+	{
+		ptContext = &ptTracker->atVpidContexts[i];
+		if (ptContext->qwGeneration > qwFlushed)
+		{
+			continue;
+		}
+		for (j = 0; j < ptContext->dwAddressCount; j++)
+		{
+			if (ptContext->aqwAddressGenerations[j] > qwFlushed)
+			{
+				break;
+			}
+		}
+		if (j == ptContext->dwAddressCount)
+		{
+			RtlZeroMemory(ptContext, sizeof(*ptContext));
+			ptContext->wVpid = wVpid;
+			return ptContext;
+		}
+	}
+	return NULL;
+}
+
+/**
+* Find the overflow entry of an EPTP, or append one after forgetting those
+* every CPU has flushed
+* @return The entry, or NULL if all of them still have pending requests
+*/
+static
+PINVL64_EPT_CONTEXT
+invl64_GetEptOverflow(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	EPTP			tEptp
+)
+{
+	PINVL64_EPT_CONTEXT ptEntry = NULL;
+	UINT64 qwFlushed = 0;
+	UINT32 dwKept = 0;
+	UINT32 i = 0;
+
+	for (i = 0; i < ptTracker->dwEptOverflowCount; i++)
+	{
+		if (tEptp.qwValue == ptTracker->atEptOverflow[i].tEptp.qwValue)
+		{
+			return &ptTracker->atEptOverflow[i];
+		}
+	}
+
+	if (INVL64_MAX_OVERFLOW == ptTracker->dwEptOverflowCount)
+	{
+		qwFlushed = invl64_GetFlushedByAll(ptTracker);
+		for (i = 0; i < ptTracker->dwEptOverflowCount; i++)
+		{
+			if (ptTracker->atEptOverflow[i].qwGeneration > qwFlushed)
+			{
+				ptTracker->atEptOverflow[dwKept++] = ptTracker->atEptOverflow[i];
+			}
+		}
+		ptTracker->dwEptOverflowCount = dwKept;
+		if (INVL64_MAX_OVERFLOW == dwKept)
+		{
+			return NULL;
+		}
+	}
+
+	ptEntry = &ptTracker->atEptOverflow[ptTracker->dwEptOverflowCount++];
+	ptEntry->tEptp = tEptp;
+	return ptEntry;
+}
+
+/**
+* Find the overflow entry of a VPID, or append one after forgetting those
+* every CPU has flushed
+* @return The entry, or NULL if all of them still have pending requests
+*/
+static
+PINVL64_VPID_OVERFLOW
+invl64_GetVpidOverflow(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT16			wVpid
+)
+{
+	PINVL64_VPID_OVERFLOW ptEntry = NULL;
+	UINT64 qwFlushed = 0;
+	UINT32 dwKept = 0;
+	UINT32 i = 0;
+
+	for (i = 0; i < ptTracker->dwVpidOverflowCount; i++)
+	{
+		if (wVpid == ptTracker->atVpidOverflow[i].wVpid)
+		{
+			return &ptTracker->atVpidOverflow[i];
+		}
+	}
+
+	if (INVL64_MAX_OVERFLOW == ptTracker->dwVpidOverflowCount)
+	{
+		qwFlushed = invl64_GetFlushedByAll(ptTracker);
+		for (i = 0; i < ptTracker->dwVpidOverflowCount; i++)
+		{
+			if (ptTracker->atVpidOverflow[i].qwGeneration > qwFlushed)
+			{
+				ptTracker->atVpidOverflow[dwKept++] = ptTracker->atVpidOverflow[i];
+			}
+		}
+		ptTracker->dwVpidOverflowCount = dwKept;
+		if (INVL64_MAX_OVERFLOW == dwKept)
+		{
+			return NULL;
+		}
+	}
+
+	ptEntry = &ptTracker->atVpidOverflow[ptTracker->dwVpidOverflowCount++];
+	ptEntry->wVpid = wVpid;
+	return ptEntry;
+}
+
+/**
+* Record a request whose EPTP found no free context, under the lock
+* @return FALSE if the overflow entries are full too, and the request was dropped
+*/
+static
+BOOLEAN
+invl64_OverflowEpt(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	EPTP			tEptp,
+	_In_	UINT64			qwGeneration
+)
+{
+	PINVL64_EPT_CONTEXT ptEntry = NULL;
+
+	// An all-context invalidation covers it, but without one the EPTP must be kept
+	if (!ptTracker->tCapabilities.inveptAll)
+	{
+		ptEntry = invl64_GetEptOverflow(ptTracker, tEptp);
+		if (NULL == ptEntry)
+		{
+			return FALSE;
+		}
+		ptEntry->qwGeneration = qwGeneration;
+		return TRUE;
+	}
+	ptTracker->qwEptAllGeneration = qwGeneration;
+	return TRUE;
+}
+
+/**
+* Record a request whose VPID found no free context, under the lock
+* @return FALSE if the overflow entries are full too, and the request was dropped
+*/
+static
+BOOLEAN
+invl64_OverflowVpid(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT16			wVpid,
+	_In_	UINT64			qwGeneration
+)
+{
+	PINVL64_VPID_OVERFLOW ptEntry = NULL;
+
+	// An all-context invalidation covers it, but without one the VPID must be kept
+	if (!ptTracker->tCapabilities.invvpidAll)
+	{
+		ptEntry = invl64_GetVpidOverflow(ptTracker, wVpid);
+		if (NULL == ptEntry)
+		{
+			return FALSE;
+		}
+		ptEntry->qwGeneration = qwGeneration;
+		return TRUE;
+	}
+	ptTracker->qwVpidAllGeneration = qwGeneration;
+	return TRUE;
+}
+
+/**
+* Capture what a CPU must invalidate, under the lock
+* @param ptTracker - tracker
+* @param qwFlushed - last generation the CPU flushed
+* @param ptPlan - receives the invalidations, not merged yet
+*/
+static
+VOID
+invl64_BuildPlan(
+	_In_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT64			qwFlushed,
+	_Out_	PINVL64_PLAN	ptPlan
+)
+{
+	PINVL64_VPID_CONTEXT ptContext = NULL;
+	PINVL64_VPID_PLAN ptVpid = NULL;
+	BOOLEAN bEveryContext = FALSE;
+	UINT32 i = 0;
+	UINT32 j = 0;
+
+	ptPlan->bEptAll = (ptTracker->qwEptAllGeneration > qwFlushed);
+	ptPlan->bVpidAll = (ptTracker->qwVpidAllGeneration > qwFlushed);
+	ptPlan->dwEptCount = 0;
+	ptPlan->dwVpidCount = 0;
+
+	// Without all-context support, invalidating all is every tracked context
+	bEveryContext = ptPlan->bEptAll && !ptTracker->tCapabilities.inveptAll;
+	for (i = 0; i < ptTracker->dwEptContextCount; i++)
+	{
+		if (bEveryContext || (ptTracker->atEptContexts[i].qwGeneration > qwFlushed))
+		{
+			ptPlan->atEptps[ptPlan->dwEptCount++] = ptTracker->atEptContexts[i].tEptp;
+		}
+	}
+	for (i = 0; i < ptTracker->dwEptOverflowCount; i++)
+	{
+		if (bEveryContext || (ptTracker->atEptOverflow[i].qwGeneration > qwFlushed))
+		{
+			ptPlan->atEptps[ptPlan->dwEptCount++] = ptTracker->atEptOverflow[i].tEptp;
+		}
+	}
+
+	bEveryContext = ptPlan->bVpidAll && !ptTracker->tCapabilities.invvpidAll;
+	for (i = 0; i < ptTracker->dwVpidContextCount; i++)
+	{
+		ptContext = &ptTracker->atVpidContexts[i];
+		ptVpid = &ptPlan->atVpids[ptPlan->dwVpidCount];
+		ptVpid->wVpid = ptContext->wVpid;
+		ptVpid->bSingleContext = bEveryContext || (ptContext->qwGeneration > qwFlushed);
+		ptVpid->dwAddressCount = 0;
+		for (j = 0; (j < ptContext->dwAddressCount) && !ptVpid->bSingleContext; j++)
+		{
+			if (ptContext->aqwAddressGenerations[j] > qwFlushed)
+			{
+				ptVpid->aqwAddresses[ptVpid->dwAddressCount++] = ptContext->aqwAddresses[j];
+			}
+		}
+		if (ptVpid->bSingleContext || (0 != ptVpid->dwAddressCount))
+		{
+			ptPlan->dwVpidCount++;
+		}
+	}
+	for (i = 0; i < ptTracker->dwVpidOverflowCount; i++)
+	{
+		if (bEveryContext || (ptTracker->atVpidOverflow[i].qwGeneration > qwFlushed))
+		{
+			ptVpid = &ptPlan->atVpids[ptPlan->dwVpidCount++];
+			ptVpid->wVpid = ptTracker->atVpidOverflow[i].wVpid;
+			ptVpid->bSingleContext = TRUE;
+			ptVpid->dwAddressCount = 0;
+		}
+	}
+}
+
+/**
+* Execute a plan with the fewest instructions the capabilities allow
+* @return Number of instructions executed
+*/
+static
+UINT32
+invl64_ExecutePlan(
+	_In_	PINVL64_TRACKER	ptTracker,
+	_In_	PINVL64_PLAN	ptPlan
+)
+{
+	PINVL64_BACKEND ptBackend = &ptTracker->tBackend;
+	IA32_VMX_EPT_VPID_CAP tCapabilities = ptTracker->tCapabilities;
+	EPTP tNoEptp = { 0 };
+	UINT32 dwSingleContexts = 0;
+	UINT32 dwIssued = 0;
+	UINT32 i = 0;
+	UINT32 j = 0;
+
+	if (ptPlan->bEptAll || (0 != ptPlan->dwEptCount))
+	{
+		if (tCapabilities.inveptAll
+			&& (ptPlan->bEptAll || (ptPlan->dwEptCount > 1) || !tCapabilities.inveptSingle))
+		{
+			ptBackend->pfnInvept(ptBackend->pvContext, INVEPT_ALL_CONTEXT, tNoEptp);
+			dwIssued++;
+		}
+		else
+		{
+			for (i = 0; i < ptPlan->dwEptCount; i++)
+			{
+				ptBackend->pfnInvept(ptBackend->pvContext, INVEPT_SINGLE_CONTEXT,
+					ptPlan->atEptps[i]);
+				dwIssued++;
+			}
+		}
+	}
+
+	if (!ptPlan->bVpidAll && (0 == ptPlan->dwVpidCount))
+	{
+		return dwIssued;
+	}
+
+	for (i = 0; i < ptPlan->dwVpidCount; i++)
+	{
+		if (ptPlan->atVpids[i].bSingleContext)
+		{
+			dwSingleContexts++;
+		}
+	}
+	if (tCapabilities.invvpidAll
+		&& (ptPlan->bVpidAll || (dwSingleContexts > 1)
+			|| ((0 != dwSingleContexts) && !tCapabilities.invvpidSingle)))
+	{
+		ptBackend->pfnInvvpid(ptBackend->pvContext, INVVPID_ALL_CONTEXT, 0, 0);
+		return dwIssued + 1;
+	}
+
+	for (i = 0; i < ptPlan->dwVpidCount; i++)
+	{
+		if (ptPlan->atVpids[i].bSingleContext)
+		{
+			ptBackend->pfnInvvpid(ptBackend->pvContext, INVVPID_SINGLE_CONTEXT,
+				ptPlan->atVpids[i].wVpid, 0);
+			dwIssued++;
+			continue;
+		}
+		for (j = 0; j < ptPlan->atVpids[i].dwAddressCount; j++)
+		{
+			ptBackend->pfnInvvpid(ptBackend->pvContext, INVVPID_INDIVIDUAL_ADDRESS,
+				ptPlan->atVpids[i].wVpid, ptPlan->atVpids[i].aqwAddresses[j]);
+			dwIssued++;
+		}
+	}
+	return dwIssued;
+}
+
+/**
+* Record an individual-address request in the context of its VPID, under the lock
+*/
+static
+VOID
+invl64_AddVpidAddress(
+	_Inout_	PINVL64_TRACKER			ptTracker,
+	_Inout_	PINVL64_VPID_CONTEXT	ptContext,
+	_In_	UINT64					qwLinearAddress,
+	_In_	UINT64					qwGeneration
+)
+{
+	UINT64 qwFlushed = 0;
+	UINT32 dwKept = 0;
+	UINT32 i = 0;
+
+	if (!ptTracker->tCapabilities.invvpidInd)
+	{
+		ptContext->qwGeneration = qwGeneration;
+		return;
+	}
+
+	// The same address queued twice is invalidated once
+	for (i = 0; i < ptContext->dwAddressCount; i++)
+	{
+		if (qwLinearAddress == ptContext->aqwAddresses[i])
+		{
+			ptContext->aqwAddressGenerations[i] = qwGeneration;
+			return;
+		}
+	}
+
+	// Make room by forgetting the addresses every CPU has flushed
+	if (INVL64_MAX_ADDRESSES == ptContext->dwAddressCount)
+	{
+		qwFlushed = invl64_GetFlushedByAll(ptTracker);
+		for (i = 0; i < ptContext->dwAddressCount; i++)
+		{
+			if (ptContext->aqwAddressGenerations[i] > qwFlushed)
+			{
+				ptContext->aqwAddresses[dwKept] = ptContext->aqwAddresses[i];
+				ptContext->aqwAddressGenerations[dwKept] = ptContext->aqwAddressGenerations[i];
+				dwKept++;
+			}
+		}
+		ptContext->dwAddressCount = dwKept;
+	}
+
+	// Still full, a single-context invalidation covers all the addresses
+	if (INVL64_MAX_ADDRESSES == ptContext->dwAddressCount)
+	{
+		ptContext->qwGeneration = qwGeneration;
+		ptContext->dwAddressCount = 0;
+		return;
+	}
+
+	ptContext->aqwAddresses[ptContext->dwAddressCount] = qwLinearAddress;
+	ptContext->aqwAddressGenerations[ptContext->dwAddressCount] = qwGeneration;
+	ptContext->dwAddressCount++;
+}
+
+NTSTATUS
+Invl64Init(
+	_Out_	PINVL64_TRACKER			ptTracker,
+	_In_	PINVL64_BACKEND			ptBackend,
+	_In_	IA32_VMX_EPT_VPID_CAP	tCapabilities,
+	_In_	UINT32					dwCpuCount
+)
+{
+	NT_ASSERT(NULL != ptTracker);
+	NT_ASSERT(NULL != ptBackend);
+
+	RtlZeroMemory(ptTracker, sizeof(*ptTracker));
+	if ((0 == dwCpuCount) || (dwCpuCount > INVL64_MAX_CPUS))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (!tCapabilities.invept && !tCapabilities.invvpid)
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	ptTracker->tBackend = *ptBackend;
+	ptTracker->tCapabilities = tCapabilities;
+	ptTracker->dwCpuCount = dwCpuCount;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Invl64QueueEpt(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	EPTP			tEptp
+)
+{
+	PINVL64_EPT_CONTEXT ptContext = NULL;
+	UINT64 qwGeneration = 0;
+	BOOLEAN bRecorded = TRUE;
+
+	NT_ASSERT(NULL != ptTracker);
+	NT_ASSERT(ptTracker->tCapabilities.invept);
+
+	invl64_Lock(ptTracker);
+	qwGeneration = invl64_NextGeneration(ptTracker);
+	ptContext = invl64_GetEptContext(ptTracker, tEptp);
+	if (NULL != ptContext)
+	{
+		ptContext->qwGeneration = qwGeneration;
+	}
+	else
+	{
+		bRecorded = invl64_OverflowEpt(ptTracker, tEptp, qwGeneration);
+	}
+	invl64_Unlock(ptTracker);
+
+	return bRecorded ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID
+Invl64QueueEptAll(
+	_Inout_	PINVL64_TRACKER	ptTracker
+)
+{
+	NT_ASSERT(NULL != ptTracker);
+	NT_ASSERT(ptTracker->tCapabilities.invept);
+
+	invl64_Lock(ptTracker);
+	ptTracker->qwEptAllGeneration = invl64_NextGeneration(ptTracker);
+	invl64_Unlock(ptTracker);
+}
+
+NTSTATUS
+Invl64QueueVpidAddress(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT16			wVpid,
+	_In_	UINT64			qwLinearAddress
+)
+{
+	PINVL64_VPID_CONTEXT ptContext = NULL;
+	UINT64 qwGeneration = 0;
+	BOOLEAN bRecorded = TRUE;
+
+	NT_ASSERT(NULL != ptTracker);
+	NT_ASSERT(ptTracker->tCapabilities.invvpid);
+	NT_ASSERT(0 != wVpid);
+
+	invl64_Lock(ptTracker);
+	qwGeneration = invl64_NextGeneration(ptTracker);
+	ptContext = invl64_GetVpidContext(ptTracker, wVpid);
+	if (NULL != ptContext)
+	{
+		invl64_AddVpidAddress(ptTracker, ptContext, qwLinearAddress, qwGeneration);
+	}
+	else
+	{
+		bRecorded = invl64_OverflowVpid(ptTracker, wVpid, qwGeneration);
+	}
+	invl64_Unlock(ptTracker);
+
+	return bRecorded ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+NTSTATUS
+Invl64QueueVpid(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT16			wVpid
+)
+{
+	PINVL64_VPID_CONTEXT ptContext = NULL;
+	UINT64 qwGeneration = 0;
+	BOOLEAN bRecorded = TRUE;
+
+	NT_ASSERT(NULL != ptTracker);
+	NT_ASSERT(ptTracker->tCapabilities.invvpid);
+	NT_ASSERT(0 != wVpid);
+
+	invl64_Lock(ptTracker);
+	qwGeneration = invl64_NextGeneration(ptTracker);
+	ptContext = invl64_GetVpidContext(ptTracker, wVpid);
+	if (NULL != ptContext)
+	{
+		// The addresses queued so far are covered
+		ptContext->qwGeneration = qwGeneration;
+		ptContext->dwAddressCount = 0;
+	}
+	else
+	{
+		bRecorded = invl64_OverflowVpid(ptTracker, wVpid, qwGeneration);
+	}
+	invl64_Unlock(ptTracker);
+
+	return bRecorded ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID
+Invl64QueueVpidAll(
+	_Inout_	PINVL64_TRACKER	ptTracker
+)
+{
+	NT_ASSERT(NULL != ptTracker);
+	NT_ASSERT(ptTracker->tCapabilities.invvpid);
+
+	invl64_Lock(ptTracker);
+	ptTracker->qwVpidAllGeneration = invl64_NextGeneration(ptTracker);
+	invl64_Unlock(ptTracker);
+}
+
+UINT32
+Invl64FlushBeforeEntry(
+	_Inout_	PINVL64_TRACKER	ptTracker,
+	_In_	UINT32			dwCpu
+)
+{
+	PINVL64_CPU ptCpu = NULL;
+	INVL64_PLAN tPlan = { 0 };
+	UINT64 qwGeneration = 0;
+	UINT64 qwRequests = 0;
+	UINT32 dwIssued = 0;
+
+	NT_ASSERT(NULL != ptTracker);
+	NT_ASSERT(dwCpu < ptTracker->dwCpuCount);
+
+	// Nothing was requested since the last flush, the common case
+	ptCpu = &ptTracker->atCpus[dwCpu];
+	if ((UINT64)ptTracker->qwGeneration == ptCpu->qwFlushedGeneration)
+	{
+		return 0;
+	}
+
+	invl64_Lock(ptTracker);
+	qwGeneration = (UINT64)ptTracker->qwGeneration;
+	qwRequests = ptTracker->qwRequests;
+	invl64_BuildPlan(ptTracker, ptCpu->qwFlushedGeneration, &tPlan);
+	invl64_Unlock(ptTracker);
+
+	dwIssued = invl64_ExecutePlan(ptTracker, &tPlan);
+
+	ptCpu->qwRequestsCovered += qwRequests - ptCpu->qwRequestsSeen;
+	ptCpu->qwRequestsSeen = qwRequests;
+	ptCpu->qwInvalidationsIssued += dwIssued;
+	ptCpu->qwFlushedGeneration = qwGeneration;
+	return dwIssued;
+}
+
+VOID
+Invl64GetStatistics(
+	_In_	PINVL64_TRACKER		ptTracker,
+	_Out_	PINVL64_STATISTICS	ptStatistics
+)
+{
+	UINT64 qwCovered = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptTracker);
+	NT_ASSERT(NULL != ptStatistics);
+
+	RtlZeroMemory(ptStatistics, sizeof(*ptStatistics));
+	ptStatistics->qwRequests = ptTracker->qwRequests;
+	for (i = 0; i < ptTracker->dwCpuCount; i++)
+	{
+		ptStatistics->qwInvalidationsIssued += ptTracker->atCpus[i].qwInvalidationsIssued;
+		qwCovered += ptTracker->atCpus[i].qwRequestsCovered;
+	}
+	if (qwCovered > ptStatistics->qwInvalidationsIssued)
+	{
+		ptStatistics->qwInvalidationsSaved = qwCovered - ptStatistics->qwInvalidationsIssued;
+	}
+}
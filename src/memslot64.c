@@ -0,0 +1,543 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		memslot64.c
+* @section	Guest-physical memory slots with lock-free lookups for the emulation paths
+*/
+
+#include "memslot64.h"
+
+/**
+* Allocate an empty table
+* @param ptMemslots - slot table
+* @param qwGeneration - generation of the new table
+* @return The table, or NULL if it can't be allocated
+*/
+static
+PMEMSLOT64_TABLE
+memslot64_AllocTable(
+	_In_	PMEMSLOT64	ptMemslots,
+	_In_	UINT64		qwGeneration
+)
+{
+	PMEMSLOT64_TABLE ptTable = NULL;
+	UINT64 qwPhysicalAddress = 0;
+
+	ptTable = (PMEMSLOT64_TABLE)ptMemslots->tAllocator.pfnAllocTable(
+		ptMemslots->tAllocator.pvContext, &qwPhysicalAddress);
+	if (NULL == ptTable)
+	{
+		return NULL;
+	}
+
+	RtlZeroMemory(ptTable, sizeof(*ptTable));
+	ptTable->qwGeneration = qwGeneration;
+	ptTable->qwPhysicalAddress = qwPhysicalAddress;
+	return ptTable;
+}
+
+static
+__inline
+VOID
+memslot64_FreeTable(
+	_In_	PMEMSLOT64			ptMemslots,
+	_In_	PMEMSLOT64_TABLE	ptTable
+)
+{
+	ptMemslots->tAllocator.pfnFreeTable(ptMemslots->tAllocator.pvContext,
+		ptTable, ptTable->qwPhysicalAddress);
+}
+
+static
+__inline
+VOID
+memslot64_Lock(
+	_Inout_ PMEMSLOT64 ptMemslots
+)
+{
+	while (0 != InterlockedCompareExchange(&ptMemslots->lUpdateLock, 1, 0))
+	{
+		YieldProcessor();
+	}
+}
+
+static
+__inline
+VOID
+memslot64_Unlock(
+	_Inout_ PMEMSLOT64 ptMemslots
+)
+{
+	InterlockedExchange(&ptMemslots->lUpdateLock, 0);
+}
+
+/**
+* Free the retired tables that every CPU went past. Called with the update lock held.
+* @param ptMemslots - slot table
+* @return Number of tables freed
+*/
+static
+UINT32
+memslot64_ReclaimLocked(
+	_Inout_ PMEMSLOT64 ptMemslots
+)
+{
+	PMEMSLOT64_TABLE* pptLink = NULL;
+	PMEMSLOT64_TABLE ptTable = NULL;
+	UINT64 qwMinGeneration = MAXUINT64;
+	UINT32 dwCpu = 0;
+	UINT32 dwFreed = 0;
+
+	for (dwCpu = 0; dwCpu < ptMemslots->dwCpuCount; dwCpu++)
+	{
+		if ((UINT64)ptMemslots->atCpus[dwCpu].qwQuiescentGeneration < qwMinGeneration)
+		{
+			qwMinGeneration = (UINT64)ptMemslots->atCpus[dwCpu].qwQuiescentGeneration;
+		}
+	}
+
+	pptLink = &ptMemslots->ptRetired;
+	while (NULL != *pptLink)
+	{
+		ptTable = *pptLink;
+		if (ptTable->qwRetiredGeneration <= qwMinGeneration)
+		{
+			*pptLink = ptTable->ptNextRetired;
+			memslot64_FreeTable(ptMemslots, ptTable);
+			dwFreed++;
+		}
+		else
+		{
+			pptLink = &ptTable->ptNextRetired;
+		}
+	}
+	return dwFreed;
+}
+
+/**
+* Publish a new table and retire the current one. Called with the update lock held.
+* @param ptMemslots - slot table
+* @param ptNewTable - fully built table, of the next generation
+*/
+static
+VOID
+memslot64_Publish(
+	_Inout_	PMEMSLOT64			ptMemslots,
+	_In_	PMEMSLOT64_TABLE	ptNewTable
+)
+{
+	PMEMSLOT64_TABLE ptOldTable = NULL;
+
+	// The exchange is a full barrier, so the table's content is visible before the table
+	ptOldTable = (PMEMSLOT64_TABLE)InterlockedExchangePointer(
+		(PVOID volatile*)&ptMemslots->ptTable, ptNewTable);
+	InterlockedExchange64(&ptMemslots->qwGeneration, (LONG64)ptNewTable->qwGeneration);
+
+	// A CPU that reports this generation (or later) as quiescent can't hold the old table
+	ptOldTable->qwRetiredGeneration = ptNewTable->qwGeneration;
+	ptOldTable->ptNextRetired = ptMemslots->ptRetired;
+	ptMemslots->ptRetired = ptOldTable;
+
+	(VOID)memslot64_ReclaimLocked(ptMemslots);
+}
+
+/**
+* Find the slot that covers a guest-physical address
+* @param ptTable - table to search
+* @param qwGuestPhysicalAddress - address to look for
+* @return Index of the slot, or ptTable->dwCount if no slot covers the address
+*/
+static
+UINT32
+memslot64_Search(
+	_In_	const MEMSLOT64_TABLE*	ptTable,
+	_In_	UINT64					qwGuestPhysicalAddress
+)
+{
+	UINT32 dwLow = 0;
+	UINT32 dwHigh = ptTable->dwCount;
+	UINT32 dwMiddle = 0;
+	const MEMSLOT64_SLOT* ptSlot = NULL;
+
+	// Find the first slot that starts above the address, the slot before it is the candidate
+	while (dwLow < dwHigh)
+	{
+		dwMiddle = dwLow + (dwHigh - dwLow) / 2;
+		if (ptTable->atSlots[dwMiddle].tRange.qwBase <= qwGuestPhysicalAddress)
+		{
+			dwLow = dwMiddle + 1;
+		}
+		else
+		{
+			dwHigh = dwMiddle;
+		}
+	}
+
+	if (0 == dwLow)
+	{
+		return ptTable->dwCount;
+	}
+
+	ptSlot = &ptTable->atSlots[dwLow - 1];
+	if (qwGuestPhysicalAddress - ptSlot->tRange.qwBase >= ptSlot->tRange.qwSize)
+	{
+		return ptTable->dwCount;
+	}
+	return dwLow - 1;
+}
+
+NTSTATUS
+Memslot64Init(
+	_Out_	PMEMSLOT64					ptMemslots,
+	_In_	PPAGING64_TABLE_ALLOCATOR	ptAllocator,
+	_In_	UINT32						dwCpuCount
+)
+{
+	UINT32 dwCpu = 0;
+
+	NT_ASSERT(ptMemslots);
+	NT_ASSERT(ptAllocator);
+
+	RtlZeroMemory(ptMemslots, sizeof(*ptMemslots));
+	if ((0 == dwCpuCount) || (MEMSLOT64_MAX_CPUS < dwCpuCount))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	ptMemslots->tAllocator = *ptAllocator;
+	ptMemslots->dwCpuCount = dwCpuCount;
+	ptMemslots->ptTable = memslot64_AllocTable(ptMemslots, 1);
+	if (NULL == ptMemslots->ptTable)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	ptMemslots->qwGeneration = 1;
+
+	for (dwCpu = 0; dwCpu < dwCpuCount; dwCpu++)
+	{
+		ptMemslots->atCpus[dwCpu].qwQuiescentGeneration = 1;
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID
+Memslot64Destroy(
+	_Inout_ PMEMSLOT64 ptMemslots
+)
+{
+	PMEMSLOT64_TABLE ptTable = NULL;
+
+	NT_ASSERT(ptMemslots);
+
+	while (NULL != ptMemslots->ptRetired)
+	{
+		ptTable = ptMemslots->ptRetired;
+		ptMemslots->ptRetired = ptTable->ptNextRetired;
+		memslot64_FreeTable(ptMemslots, ptTable);
+	}
+
+	if (NULL != ptMemslots->ptTable)
+	{
+		memslot64_FreeTable(ptMemslots, ptMemslots->ptTable);
+		ptMemslots->ptTable = NULL;
+	}
+}
+
+NTSTATUS
+Memslot64Add(
+	_Inout_	PMEMSLOT64				ptMemslots,
+	_In_	const MEMSLOT64_SLOT*	ptSlot
+)
+{
+	PMEMSLOT64_TABLE ptOldTable = NULL;
+	PMEMSLOT64_TABLE ptNewTable = NULL;
+	UINT64 qwBase = 0;
+	UINT64 qwSize = 0;
+	UINT32 dwInsert = 0;
+
+	NT_ASSERT(ptMemslots);
+	NT_ASSERT(ptSlot);
+
+	qwBase = ptSlot->tRange.qwBase;
+	qwSize = ptSlot->tRange.qwSize;
+	if ((0 == qwSize)
+		|| (0 != ((qwBase | qwSize) & (PAGE_SIZE_4KB - 1)))
+		|| (qwBase + qwSize < qwBase))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	memslot64_Lock(ptMemslots);
+	ptOldTable = ptMemslots->ptTable;
+
+	// The EPT built from the slots would go out of sync
+	if (NULL != ptMemslots->ptEpt)
+	{
+		memslot64_Unlock(ptMemslots);
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	// Slots are sorted, so only the neighbours of the insertion point can overlap
+	while ((dwInsert < ptOldTable->dwCount)
+		&& (ptOldTable->atSlots[dwInsert].tRange.qwBase < qwBase))
+	{
+		dwInsert++;
+	}
+	if (((0 < dwInsert)
+			&& (ptOldTable->atSlots[dwInsert - 1].tRange.qwBase
+				+ ptOldTable->atSlots[dwInsert - 1].tRange.qwSize > qwBase))
+		|| ((dwInsert < ptOldTable->dwCount)
+			&& (ptOldTable->atSlots[dwInsert].tRange.qwBase < qwBase + qwSize)))
+	{
+		memslot64_Unlock(ptMemslots);
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (MEMSLOT64_MAX_SLOTS <= ptOldTable->dwCount)
+	{
+		memslot64_Unlock(ptMemslots);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ptNewTable = memslot64_AllocTable(ptMemslots, ptOldTable->qwGeneration + 1);
+	if (NULL == ptNewTable)
+	{
+		memslot64_Unlock(ptMemslots);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlCopyMemory(&ptNewTable->atSlots[0], &ptOldTable->atSlots[0],
+		dwInsert * sizeof(MEMSLOT64_SLOT));
+	ptNewTable->atSlots[dwInsert] = *ptSlot;
+	RtlCopyMemory(&ptNewTable->atSlots[dwInsert + 1], &ptOldTable->atSlots[dwInsert],
+		(ptOldTable->dwCount - dwInsert) * sizeof(MEMSLOT64_SLOT));
+	ptNewTable->dwCount = ptOldTable->dwCount + 1;
+
+	memslot64_Publish(ptMemslots, ptNewTable);
+	memslot64_Unlock(ptMemslots);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Memslot64Remove(
+	_Inout_	PMEMSLOT64	ptMemslots,
+	_In_	UINT64		qwGuestPhysicalBase
+)
+{
+	PMEMSLOT64_TABLE ptOldTable = NULL;
+	PMEMSLOT64_TABLE ptNewTable = NULL;
+	UINT32 dwRemove = 0;
+
+	NT_ASSERT(ptMemslots);
+
+	memslot64_Lock(ptMemslots);
+	ptOldTable = ptMemslots->ptTable;
+
+	// The EPT built from the slots would keep mapping the removed range
+	if (NULL != ptMemslots->ptEpt)
+	{
+		memslot64_Unlock(ptMemslots);
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	dwRemove = memslot64_Search(ptOldTable, qwGuestPhysicalBase);
+	if ((ptOldTable->dwCount == dwRemove)
+		|| (ptOldTable->atSlots[dwRemove].tRange.qwBase != qwGuestPhysicalBase))
+	{
+		memslot64_Unlock(ptMemslots);
+		return STATUS_NOT_FOUND;
+	}
+
+	ptNewTable = memslot64_AllocTable(ptMemslots, ptOldTable->qwGeneration + 1);
+	if (NULL == ptNewTable)
+	{
+		memslot64_Unlock(ptMemslots);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlCopyMemory(&ptNewTable->atSlots[0], &ptOldTable->atSlots[0],
+		dwRemove * sizeof(MEMSLOT64_SLOT));
+	RtlCopyMemory(&ptNewTable->atSlots[dwRemove], &ptOldTable->atSlots[dwRemove + 1],
+		(ptOldTable->dwCount - dwRemove - 1) * sizeof(MEMSLOT64_SLOT));
+	ptNewTable->dwCount = ptOldTable->dwCount - 1;
+
+	memslot64_Publish(ptMemslots, ptNewTable);
+	memslot64_Unlock(ptMemslots);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Memslot64Lookup(
+	_Inout_	PMEMSLOT64				ptMemslots,
+	_In_	UINT32					dwCpu,
+	_In_	UINT64					qwGuestPhysicalAddress,
+	_Out_	PMEMSLOT64_TRANSLATION	ptTranslation
+)
+{
+	const MEMSLOT64_TABLE* ptTable = NULL;
+	const MEMSLOT64_SLOT* ptSlot = NULL;
+	PMEMSLOT64_CPU ptCpu = NULL;
+	UINT32 dwSlot = 0;
+	UINT64 qwOffset = 0;
+
+	NT_ASSERT(ptMemslots);
+	NT_ASSERT(dwCpu < ptMemslots->dwCpuCount);
+	NT_ASSERT(ptTranslation);
+
+	// The table stays allocated until this CPU's next quiescent point
+	ptTable = ptMemslots->ptTable;
+	ptCpu = &ptMemslots->atCpus[dwCpu];
+
+	// Emulation tends to hit the same slot again, the cached index is only
+	// meaningful within the table generation it was found in
+	dwSlot = ptCpu->dwCachedSlot;
+	if ((ptCpu->qwCachedGeneration == ptTable->qwGeneration)
+		&& (qwGuestPhysicalAddress - ptTable->atSlots[dwSlot].tRange.qwBase
+			< ptTable->atSlots[dwSlot].tRange.qwSize))
+	{
+		ptCpu->qwHits++;
+	}
+	else
+	{
+		ptCpu->qwMisses++;
+		dwSlot = memslot64_Search(ptTable, qwGuestPhysicalAddress);
+		if (ptTable->dwCount == dwSlot)
+		{
+			RtlZeroMemory(ptTranslation, sizeof(*ptTranslation));
+			return STATUS_NOT_FOUND;
+		}
+		ptCpu->qwCachedGeneration = ptTable->qwGeneration;
+		ptCpu->dwCachedSlot = dwSlot;
+	}
+
+	ptSlot = &ptTable->atSlots[dwSlot];
+	qwOffset = qwGuestPhysicalAddress - ptSlot->tRange.qwBase;
+	ptTranslation->qwHostPhysicalAddress = ptSlot->qwHostPhysicalAddress + qwOffset;
+	ptTranslation->pcHostVirtualAddress = (NULL == ptSlot->pcHostVirtualAddress)
+		? NULL
+		: ptSlot->pcHostVirtualAddress + qwOffset;
+	ptTranslation->qwBytesLeft = ptSlot->tRange.qwSize - qwOffset;
+	ptTranslation->eMemoryType = ptSlot->tRange.eMemoryType;
+	ptTranslation->dwFlags = ptSlot->dwFlags;
+	return STATUS_SUCCESS;
+}
+
+VOID
+Memslot64Quiesce(
+	_Inout_	PMEMSLOT64	ptMemslots,
+	_In_	UINT32		dwCpu
+)
+{
+	NT_ASSERT(ptMemslots);
+	NT_ASSERT(dwCpu < ptMemslots->dwCpuCount);
+
+	// Stores aren't reordered with earlier loads, so the CPU's reads of the
+	// table are done by the time the updater sees the new generation
+	ptMemslots->atCpus[dwCpu].qwQuiescentGeneration = ptMemslots->qwGeneration;
+}
+
+UINT32
+Memslot64Reclaim(
+	_Inout_ PMEMSLOT64 ptMemslots
+)
+{
+	UINT32 dwFreed = 0;
+
+	NT_ASSERT(ptMemslots);
+
+	memslot64_Lock(ptMemslots);
+	dwFreed = memslot64_ReclaimLocked(ptMemslots);
+	memslot64_Unlock(ptMemslots);
+	return dwFreed;
+}
+
+NTSTATUS
+Memslot64BuildEpt(
+	_Inout_	PMEMSLOT64			ptMemslots,
+	_Inout_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT64				qwAccess
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	const MEMSLOT64_TABLE* ptTable = NULL;
+	const MEMSLOT64_SLOT* ptSlot = NULL;
+	UINT32 dwSlot = 0;
+
+	NT_ASSERT(ptMemslots);
+	NT_ASSERT(ptEpt);
+
+	// Hold the update lock so the EPT is built from a single table
+	memslot64_Lock(ptMemslots);
+	ptTable = ptMemslots->ptTable;
+	if (NULL != ptMemslots->ptEpt)
+	{
+		memslot64_Unlock(ptMemslots);
+		return STATUS_INVALID_DEVICE_STATE;
+	}
+
+	for (dwSlot = 0; dwSlot < ptTable->dwCount; dwSlot++)
+	{
+		ptSlot = &ptTable->atSlots[dwSlot];
+		if (ptSlot->dwFlags & MEMSLOT64_FLAG_MMIO)
+		{
+			continue;
+		}
+		if (ptSlot->qwHostPhysicalAddress != ptSlot->tRange.qwBase)
+		{
+			eStatus = STATUS_NOT_SUPPORTED;
+			break;
+		}
+
+		eStatus = Ept64BuildIdentityMap(ptEpt, &ptSlot->tRange, 1,
+			(ptSlot->dwFlags & MEMSLOT64_FLAG_READONLY)
+				? (qwAccess & ~(UINT64)EPT_ACCESS_WRITE)
+				: qwAccess);
+		if (!NT_SUCCESS(eStatus))
+		{
+			break;
+		}
+	}
+
+	if (NT_SUCCESS(eStatus))
+	{
+		ptMemslots->ptEpt = ptEpt;
+	}
+	memslot64_Unlock(ptMemslots);
+	return eStatus;
+}
+
+PEPT64_HIERARCHY
+Memslot64ReleaseEpt(
+	_Inout_	PMEMSLOT64	ptMemslots
+)
+{
+	PEPT64_HIERARCHY ptEpt = NULL;
+
+	NT_ASSERT(ptMemslots);
+
+	memslot64_Lock(ptMemslots);
+	ptEpt = ptMemslots->ptEpt;
+	ptMemslots->ptEpt = NULL;
+	memslot64_Unlock(ptMemslots);
+	return ptEpt;
+}
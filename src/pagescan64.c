@@ -0,0 +1,347 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		pagescan64.c
+* @section	Vectorized scanning of paging-structure tables
+*/
+
+#include <intrin.h>
+
+#include "pagescan64.h"
+
+// CPUID and XCR0 bits checked before using vector instructions
+#define PAGESCAN64_CPUID1_ECX_OSXSAVE	(1 << 27)
+#define PAGESCAN64_CPUID1_ECX_AVX		(1 << 28)
+#define PAGESCAN64_CPUID7_EBX_AVX2		(1 << 5)
+#define PAGESCAN64_CPUID7_EBX_AVX512F	(1 << 16)
+#define PAGESCAN64_XCR0_AVX				0x06ULL	// SSE, AVX
+#define PAGESCAN64_XCR0_AVX512			0xE6ULL	// SSE, AVX, opmask, ZMM_Hi256, Hi16_ZMM
+
+static PAGESCAN64_ISA g_ePageScanIsa = PAGESCAN64_ISA_SCALAR;
+
+static
+PAGESCAN64_ISA
+pagescan64_DetectIsa(
+	VOID
+)
+{
+	INT32 adwCpuInfo[4] = { 0 };
+	UINT64 qwXcr0 = 0;
+	UINT32 dwEbx7 = 0;
+
+	__cpuid(adwCpuInfo, 1);
+	if ((PAGESCAN64_CPUID1_ECX_OSXSAVE | PAGESCAN64_CPUID1_ECX_AVX)
+		!= (adwCpuInfo[2] & (PAGESCAN64_CPUID1_ECX_OSXSAVE | PAGESCAN64_CPUID1_ECX_AVX)))
+	{
+		return PAGESCAN64_ISA_SCALAR;
+	}
+
+	__cpuid(adwCpuInfo, 0);
+	if (adwCpuInfo[0] < 7)
+	{
+		return PAGESCAN64_ISA_SCALAR;
+	}
+	__cpuidex(adwCpuInfo, 7, 0);
+	dwEbx7 = (UINT32)adwCpuInfo[1];
+
+	qwXcr0 = _xgetbv(0);
+	if ((0 != (dwEbx7 & PAGESCAN64_CPUID7_EBX_AVX512F))
+		&& (PAGESCAN64_XCR0_AVX512 == (qwXcr0 & PAGESCAN64_XCR0_AVX512)))
+	{
+		return PAGESCAN64_ISA_AVX512;
+	}
+	if ((0 != (dwEbx7 & PAGESCAN64_CPUID7_EBX_AVX2))
+		&& (PAGESCAN64_XCR0_AVX == (qwXcr0 & PAGESCAN64_XCR0_AVX)))
+	{
+		return PAGESCAN64_ISA_AVX2;
+	}
+	return PAGESCAN64_ISA_SCALAR;
+}
+
+PAGESCAN64_ISA
+PageScan64Init(
+	VOID
+)
+{
+	g_ePageScanIsa = pagescan64_DetectIsa();
+	return g_ePageScanIsa;
+}
+
+NTSTATUS
+PageScan64SetIsa(
+	_In_	PAGESCAN64_ISA	eIsa
+)
+{
+	if (eIsa > pagescan64_DetectIsa())
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	g_ePageScanIsa = eIsa;
+	return STATUS_SUCCESS;
+}
+
+static
+VOID
+pagescan64_MatchScalar(
+	_In_	const UINT64*		pqwTable,
+	_In_	UINT64				qwMask,
+	_In_	UINT64				qwValue,
+	_Out_	PPAGESCAN64_MASK	ptResult
+)
+{
+	UINT64 qwBits = 0;
+	UINT32 i = 0;
+	UINT32 j = 0;
+
+	for (i = 0; i < PAGESCAN64_MASK_QWORDS; i++)
+	{
+		qwBits = 0;
+		for (j = 0; j < 64; j++)
+		{
+			qwBits |= (UINT64)((pqwTable[64 * i + j] & qwMask) == qwValue) << j;
+		}
+		ptResult->aqwBits[i] = qwBits;
+	}
+}
+
+static
+VOID
+pagescan64_MatchAvx2(
+	_In_	const UINT64*		pqwTable,
+	_In_	UINT64				qwMask,
+	_In_	UINT64				qwValue,
+	_Out_	PPAGESCAN64_MASK	ptResult
+)
+{
+	__m256i yMask = _mm256_set1_epi64x((INT64)qwMask);
+	__m256i yValue = _mm256_set1_epi64x((INT64)qwValue);
+	__m256i yEntries = _mm256_setzero_si256();
+	const __m256i* pyTable = (const __m256i*)pqwTable;
+	UINT64 qwBits = 0;
+	UINT32 i = 0;
+	UINT32 j = 0;
+
+	// 4 entries per compare, 16 compares per 64-bit word of the result
+	for (i = 0; i < PAGESCAN64_MASK_QWORDS; i++)
+	{
+		qwBits = 0;
+		for (j = 0; j < 16; j++)
+		{
+			yEntries = _mm256_and_si256(_mm256_loadu_si256(&pyTable[16 * i + j]), yMask);
+			qwBits |= (UINT64)_mm256_movemask_pd(
+				_mm256_castsi256_pd(_mm256_cmpeq_epi64(yEntries, yValue))) << (4 * j);
+		}
+		ptResult->aqwBits[i] = qwBits;
+	}
+}
+
+static
+VOID
+pagescan64_MatchAvx512(
+	_In_	const UINT64*		pqwTable,
+	_In_	UINT64				qwMask,
+	_In_	UINT64				qwValue,
+	_Out_	PPAGESCAN64_MASK	ptResult
+)
+{
+	__m512i zMask = _mm512_set1_epi64((INT64)qwMask);
+	__m512i zValue = _mm512_set1_epi64((INT64)qwValue);
+	UINT64 qwBits = 0;
+	UINT32 i = 0;
+	UINT32 j = 0;
+
+	// 8 entries per compare, 8 compares per 64-bit word of the result
+	for (i = 0; i < PAGESCAN64_MASK_QWORDS; i++)
+	{
+		qwBits = 0;
+		for (j = 0; j < 8; j++)
+		{
+			qwBits |= (UINT64)_mm512_cmpeq_epi64_mask(
+				_mm512_and_si512(_mm512_loadu_si512(&pqwTable[64 * i + 8 * j]), zMask),
+				zValue) << (8 * j);
+		}
+		ptResult->aqwBits[i] = qwBits;
+	}
+}
+
+VOID
+PageScan64MatchTables(
+	_In_reads_(dwTableCount)	const UINT64* const*	ppqwTables,
+	_In_						UINT32					dwTableCount,
+	_In_						UINT64					qwMask,
+	_In_						UINT64					qwValue,
+	_Out_writes_(dwTableCount)	PPAGESCAN64_MASK		ptMasks
+)
+{
+	PAGESCAN64_ISA eIsa = g_ePageScanIsa;
+	XSTATE_SAVE tSave = { 0 };
+	UINT32 i = 0;
+
+	NT_ASSERT((NULL != ppqwTables) || (0 == dwTableCount));
+	NT_ASSERT((NULL != ptMasks) || (0 == dwTableCount));
+
+	// The kernel doesn't preserve vector registers for us, fall back if they can't be saved
+	if ((PAGESCAN64_ISA_SCALAR != eIsa)
+		&& !NT_SUCCESS(KeSaveExtendedProcessorState((PAGESCAN64_ISA_AVX512 == eIsa)
+			? (XSTATE_MASK_AVX | XSTATE_MASK_AVX512) : XSTATE_MASK_AVX, &tSave)))
+	{
+		eIsa = PAGESCAN64_ISA_SCALAR;
+	}
+
+	for (i = 0; i < dwTableCount; i++)
+	{
+		switch (eIsa)
+		{
+		case PAGESCAN64_ISA_AVX512:
+			pagescan64_MatchAvx512(ppqwTables[i], qwMask, qwValue, &ptMasks[i]);
+			break;
+		case PAGESCAN64_ISA_AVX2:
+			pagescan64_MatchAvx2(ppqwTables[i], qwMask, qwValue, &ptMasks[i]);
+			break;
+		default:
+			pagescan64_MatchScalar(ppqwTables[i], qwMask, qwValue, &ptMasks[i]);
+			break;
+		}
+	}
+
+	if (PAGESCAN64_ISA_SCALAR != eIsa)
+	{
+		KeRestoreExtendedProcessorState(&tSave);
+	}
+}
+
+VOID
+PageScan64MatchTable(
+	_In_reads_(PAGING64_PTE_COUNT)	const UINT64*		pqwTable,
+	_In_							UINT64				qwMask,
+	_In_							UINT64				qwValue,
+	_Out_							PPAGESCAN64_MASK	ptResult
+)
+{
+	PageScan64MatchTables(&pqwTable, 1, qwMask, qwValue, ptResult);
+}
+
+UINT32
+PageScan64ClearBits(
+	_Inout_updates_(PAGING64_PTE_COUNT)	volatile UINT64*	pqwTable,
+	_In_opt_							PPAGESCAN64_MASK	ptSelect,
+	_In_								UINT64				qwClearMask,
+	_Out_opt_							PPAGESCAN64_MASK	ptWasSet
+)
+{
+	PAGESCAN64_MASK tClear = { 0 };
+	UINT64 qwOld = 0;
+	UINT64 qwBits = 0;
+	ULONG dwBit = 0;
+	UINT32 dwChanged = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != pqwTable);
+
+	// Entries where every bit is already clear are skipped without a locked operation
+	PageScan64MatchTable((const UINT64*)pqwTable, qwClearMask, 0, &tClear);
+
+	for (i = 0; i < PAGESCAN64_MASK_QWORDS; i++)
+	{
+		qwBits = ~tClear.aqwBits[i];
+		if (NULL != ptSelect)
+		{
+			qwBits &= ptSelect->aqwBits[i];
+		}
+		if (NULL != ptWasSet)
+		{
+			ptWasSet->aqwBits[i] = 0;
+		}
+
+		while (_BitScanForward64(&dwBit, qwBits))
+		{
+			qwBits &= qwBits - 1;
+			qwOld = PAGING64_ENTRY_CLEAR_BITS(&pqwTable[64 * i + dwBit], qwClearMask);
+
+			// The bits may have been cleared by someone else since the scan
+			if (0 != (qwOld & qwClearMask))
+			{
+				dwChanged++;
+				if (NULL != ptWasSet)
+				{
+					ptWasSet->aqwBits[i] |= 1ULL << dwBit;
+				}
+			}
+		}
+	}
+
+	return dwChanged;
+}
+
+BOOLEAN
+PageScan64NextRun(
+	_In_	PPAGESCAN64_MASK	ptMask,
+	_In_	UINT32				dwStart,
+	_Out_	PUINT32				pdwRunStart,
+	_Out_	PUINT32				pdwRunLength
+)
+{
+	UINT32 dwIndex = dwStart;
+	UINT64 qwBits = 0;
+	ULONG dwBit = 0;
+
+	NT_ASSERT(NULL != ptMask);
+	NT_ASSERT(NULL != pdwRunStart);
+	NT_ASSERT(NULL != pdwRunLength);
+
+	// Find the first set bit at or after dwStart
+	for (;;)
+	{
+		if (dwIndex >= PAGING64_PTE_COUNT)
+		{
+			return FALSE;
+		}
+		qwBits = ptMask->aqwBits[dwIndex / 64] >> (dwIndex % 64);
+		if (_BitScanForward64(&dwBit, qwBits))
+		{
+			dwIndex += dwBit;
+			break;
+		}
+		dwIndex = (dwIndex | 63) + 1;
+	}
+	*pdwRunStart = dwIndex;
+
+	// Find the first clear bit after it
+	for (;;)
+	{
+		if (dwIndex >= PAGING64_PTE_COUNT)
+		{
+			break;
+		}
+		qwBits = ~ptMask->aqwBits[dwIndex / 64] >> (dwIndex % 64);
+		if (_BitScanForward64(&dwBit, qwBits))
+		{
+			dwIndex += dwBit;
+			break;
+		}
+		dwIndex = (dwIndex | 63) + 1;
+	}
+	*pdwRunLength = dwIndex - *pdwRunStart;
+	return TRUE;
+}
@@ -0,0 +1,1010 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		pagetable64.c
+* @section	Construction of IA-32e paging hierarchies
+*/
+
+#include "pagetable64.h"
+
+// Levels of the hierarchy, numbered like the walk: PT = 1 ... PML4 = 4
+#define PAGING64_LEVEL_PT		1
+#define PAGING64_LEVEL_PD		2
+#define PAGING64_LEVEL_PDPT		3
+#define PAGING64_LEVEL_PML4		4
+
+// Shift of the linear range covered by a single entry of a level
+#define PAGING64_LEVEL_SHIFT(dwLevel)	(PAGE_SHIFT_4KB + 9 * ((dwLevel) - 1))
+
+// Page type of the leaves a level can hold (PT, PD and PDPT only)
+#define PAGING64_LEVEL_PAGE_TYPE(dwLevel)	((PAGE_TYPE64)(PAGING64_LEVEL_PDPT - (dwLevel)))
+
+// Linear addresses are handled without their sign extension internally
+#define PAGING64_LINEAR_MASK	((1ULL << 48) - 1)
+#define PAGING64_SIGN_EXTEND(Va)	\
+	((0 != ((Va) & (1ULL << 47))) ? ((Va) | ~PAGING64_LINEAR_MASK) : (Va))
+
+static
+__inline
+PUINT64
+paging64_TableVa(
+	_In_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	UINT64				qwPhysicalAddress
+)
+{
+	return (PUINT64)ptHierarchy->tAllocator.pfnPhysToVirt(ptHierarchy->tAllocator.pvContext,
+		qwPhysicalAddress);
+}
+
+static
+__inline
+UINT64
+paging64_MakeTableEntry(
+	_In_	UINT64	qwTablePhysicalAddress
+)
+{
+	// PML4E64, PDPTE64 and PDE64 share the layout of the bits set here.
+	// Access rights are only restricted on the leaves.
+	PDE64 tEntry = { 0 };
+
+	tEntry.p = 1;
+	tEntry.rw = 1;
+	tEntry.us = 1;
+	tEntry.addr = qwTablePhysicalAddress >> PAGE_SHIFT_4KB;
+	return *(PUINT64)&tEntry;
+}
+
+static
+UINT64
+paging64_MakeLeafEntry(
+	_In_	PAGE_TYPE64			ePageType,
+	_In_	UINT64				qwPhysicalAddress,
+	_In_	PAGING64_ATTRIBUTES	tAttributes
+)
+{
+	PDPTE_ANY64 tPdpte = { 0 };
+	PDE_ANY64 tPde = { 0 };
+	PTE64 tPte = { 0 };
+
+	switch (ePageType)
+	{
+	case PAGE_TYPE_1GB:
+		tPdpte.tLeaf.p = 1;
+		tPdpte.tLeaf.rw = tAttributes.rw;
+		tPdpte.tLeaf.us = tAttributes.us;
+		tPdpte.tLeaf.pwt = tAttributes.pwt;
+		tPdpte.tLeaf.pcd = tAttributes.pcd;
+		tPdpte.tLeaf.ps = 1;
+		tPdpte.tLeaf.g = tAttributes.g;
+		tPdpte.tLeaf.pat = tAttributes.pat;
+		tPdpte.tLeaf.addr = qwPhysicalAddress >> PAGE_SHIFT_1GB;
+		tPdpte.tLeaf.protkey = tAttributes.protkey;
+		tPdpte.tLeaf.xd = tAttributes.xd;
+		return tPdpte.qwValue;
+
+	case PAGE_TYPE_2MB:
+		tPde.tLeaf.p = 1;
+		tPde.tLeaf.rw = tAttributes.rw;
+		tPde.tLeaf.us = tAttributes.us;
+		tPde.tLeaf.pwt = tAttributes.pwt;
+		tPde.tLeaf.pcd = tAttributes.pcd;
+		tPde.tLeaf.ps = 1;
+		tPde.tLeaf.g = tAttributes.g;
+		tPde.tLeaf.pat = tAttributes.pat;
+		tPde.tLeaf.addr = qwPhysicalAddress >> PAGE_SHIFT_2MB;
+		tPde.tLeaf.protkey = tAttributes.protkey;
+		tPde.tLeaf.xd = tAttributes.xd;
+		return tPde.qwValue;
+
+	default:
+		tPte.p = 1;
+		tPte.rw = tAttributes.rw;
+		tPte.us = tAttributes.us;
+		tPte.pwt = tAttributes.pwt;
+		tPte.pcd = tAttributes.pcd;
+		tPte.pat = tAttributes.pat;
+		tPte.g = tAttributes.g;
+		tPte.addr = qwPhysicalAddress >> PAGE_SHIFT_4KB;
+		tPte.protkey = tAttributes.protkey;
+		tPte.xd = tAttributes.xd;
+		return *(PUINT64)&tPte;
+	}
+}
+
+static
+UINT64
+paging64_GetLeafAddress(
+	_In_	PAGE_TYPE64	ePageType,
+	_In_	UINT64		qwEntry
+)
+{
+	PDPTE_ANY64 tPdpte = { 0 };
+	PDE_ANY64 tPde = { 0 };
+
+	switch (ePageType)
+	{
+	case PAGE_TYPE_1GB:
+		tPdpte.qwValue = qwEntry;
+		return (UINT64)tPdpte.tLeaf.addr << PAGE_SHIFT_1GB;
+	case PAGE_TYPE_2MB:
+		tPde.qwValue = qwEntry;
+		return (UINT64)tPde.tLeaf.addr << PAGE_SHIFT_2MB;
+	default:
+		return qwEntry & PAGING64_PHYS_ADDR_MASK;
+	}
+}
+
+static
+PAGING64_ATTRIBUTES
+paging64_GetLeafAttributes(
+	_In_	PAGE_TYPE64	ePageType,
+	_In_	UINT64		qwEntry
+)
+{
+	PAGING64_ATTRIBUTES tAttributes = { 0 };
+	PDPTE_ANY64 tPdpte = { 0 };
+	PDE_ANY64 tPde = { 0 };
+	PTE64 tPte = { 0 };
+
+	switch (ePageType)
+	{
+	case PAGE_TYPE_1GB:
+		tPdpte.qwValue = qwEntry;
+		tAttributes.rw = tPdpte.tLeaf.rw;
+		tAttributes.us = tPdpte.tLeaf.us;
+		tAttributes.pwt = tPdpte.tLeaf.pwt;
+		tAttributes.pcd = tPdpte.tLeaf.pcd;
+		tAttributes.pat = tPdpte.tLeaf.pat;
+		tAttributes.g = tPdpte.tLeaf.g;
+		tAttributes.xd = tPdpte.tLeaf.xd;
+		tAttributes.protkey = tPdpte.tLeaf.protkey;
+		break;
+	case PAGE_TYPE_2MB:
+		tPde.qwValue = qwEntry;
+		tAttributes.rw = tPde.tLeaf.rw;
+		tAttributes.us = tPde.tLeaf.us;
+		tAttributes.pwt = tPde.tLeaf.pwt;
+		tAttributes.pcd = tPde.tLeaf.pcd;
+		tAttributes.pat = tPde.tLeaf.pat;
+		tAttributes.g = tPde.tLeaf.g;
+		tAttributes.xd = tPde.tLeaf.xd;
+		tAttributes.protkey = tPde.tLeaf.protkey;
+		break;
+	default:
+		*(PUINT64)&tPte = qwEntry;
+		tAttributes.rw = tPte.rw;
+		tAttributes.us = tPte.us;
+		tAttributes.pwt = tPte.pwt;
+		tAttributes.pcd = tPte.pcd;
+		tAttributes.pat = tPte.pat;
+		tAttributes.g = tPte.g;
+		tAttributes.xd = tPte.xd;
+		tAttributes.protkey = tPte.protkey;
+		break;
+	}
+
+	return tAttributes;
+}
+
+/**
+* Account for a leaf that was written and report it to the hierarchy's listener
+*/
+static
+VOID
+paging64_LeafAdded(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	PAGE_TYPE64			ePageType,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwPa
+)
+{
+	ptHierarchy->aqwLeafCount[ePageType]++;
+	if (NULL != ptHierarchy->pfnLeafNotify)
+	{
+		ptHierarchy->pfnLeafNotify(ptHierarchy->pvLeafNotifyContext,
+			ptHierarchy->qwPml4PhysicalAddress, PAGING64_SIGN_EXTEND(qwVa), qwPa, ePageType, TRUE);
+	}
+}
+
+/**
+* Account for a leaf that was cleared or replaced and report it to the hierarchy's listener
+*/
+static
+VOID
+paging64_LeafRemoved(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	PAGE_TYPE64			ePageType,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwEntry
+)
+{
+	ptHierarchy->aqwLeafCount[ePageType]--;
+	if (NULL != ptHierarchy->pfnLeafNotify)
+	{
+		ptHierarchy->pfnLeafNotify(ptHierarchy->pvLeafNotifyContext,
+			ptHierarchy->qwPml4PhysicalAddress, PAGING64_SIGN_EXTEND(qwVa),
+			paging64_GetLeafAddress(ePageType, qwEntry), ePageType, FALSE);
+	}
+}
+
+/**
+* Release a table and every table below it
+* @param ptHierarchy - hierarchy the table belongs to
+* @param qwTablePhysicalAddress - physical address of the table
+* @param dwLevel - level of the table
+* @param qwTableBase - first linear address covered by the table
+*/
+static
+VOID
+paging64_FreeSubtree(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	UINT64				qwTablePhysicalAddress,
+	_In_	UINT32				dwLevel,
+	_In_	UINT64				qwTableBase
+)
+{
+	PUINT64 pqwTable = paging64_TableVa(ptHierarchy, qwTablePhysicalAddress);
+	UINT64 qwEntryBase = 0;
+	UINT32 i = 0;
+
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		if (0 == (pqwTable[i] & PAGING64_ENTRY_PRESENT))
+		{
+			continue;
+		}
+		qwEntryBase = qwTableBase + ((UINT64)i << PAGING64_LEVEL_SHIFT(dwLevel));
+		if ((PAGING64_LEVEL_PT == dwLevel) || PAGING64_IS_LEAF(pqwTable[i]))
+		{
+			paging64_LeafRemoved(ptHierarchy, PAGING64_LEVEL_PAGE_TYPE(dwLevel), qwEntryBase,
+				pqwTable[i]);
+		}
+		else
+		{
+			paging64_FreeSubtree(ptHierarchy, pqwTable[i] & PAGING64_PHYS_ADDR_MASK, dwLevel - 1,
+				qwEntryBase);
+		}
+	}
+
+	ptHierarchy->tAllocator.pfnFreeTable(ptHierarchy->tAllocator.pvContext, pqwTable,
+		qwTablePhysicalAddress);
+	ptHierarchy->dwTablePages--;
+}
+
+/**
+* Clear an entry, releasing its subtree if it references a table
+*/
+static
+VOID
+paging64_ClearEntry(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_Inout_	PUINT64				pqwEntry,
+	_In_	UINT32				dwLevel,
+	_In_	UINT64				qwEntryBase
+)
+{
+	UINT64 qwOld = *pqwEntry;
+
+	if (0 == (qwOld & PAGING64_ENTRY_PRESENT))
+	{
+		return;
+	}
+
+	*pqwEntry = 0;
+	if ((PAGING64_LEVEL_PT == dwLevel) || PAGING64_IS_LEAF(qwOld))
+	{
+		paging64_LeafRemoved(ptHierarchy, PAGING64_LEVEL_PAGE_TYPE(dwLevel), qwEntryBase, qwOld);
+	}
+	else
+	{
+		paging64_FreeSubtree(ptHierarchy, qwOld & PAGING64_PHYS_ADDR_MASK, dwLevel - 1,
+			qwEntryBase);
+	}
+}
+
+/**
+* Get the table referenced by an entry, allocating it if the entry isn't present
+* @param ptHierarchy - hierarchy the entry belongs to
+* @param pqwEntry - non-leaf entry
+* @param ppqwTable - receives the virtual address of the table
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+static
+NTSTATUS
+paging64_GetOrCreateTable(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_Inout_	PUINT64				pqwEntry,
+	_Out_	PUINT64*			ppqwTable
+)
+{
+	UINT64 qwPhysicalAddress = 0;
+	PUINT64 pqwTable = NULL;
+
+	if (0 != (*pqwEntry & PAGING64_ENTRY_PRESENT))
+	{
+		*ppqwTable = paging64_TableVa(ptHierarchy, *pqwEntry & PAGING64_PHYS_ADDR_MASK);
+		return STATUS_SUCCESS;
+	}
+
+	pqwTable = (PUINT64)ptHierarchy->tAllocator.pfnAllocTable(ptHierarchy->tAllocator.pvContext,
+		&qwPhysicalAddress);
+	if (NULL == pqwTable)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ptHierarchy->dwTablePages++;
+	*pqwEntry = paging64_MakeTableEntry(qwPhysicalAddress);
+	*ppqwTable = pqwTable;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Paging64HierarchyInit(
+	_Out_	PPAGING64_HIERARCHY			ptHierarchy,
+	_In_	PPAGING64_TABLE_ALLOCATOR	ptAllocator
+)
+{
+	NT_ASSERT(NULL != ptHierarchy);
+	NT_ASSERT(NULL != ptAllocator);
+
+	RtlZeroMemory(ptHierarchy, sizeof(*ptHierarchy));
+	ptHierarchy->tAllocator = *ptAllocator;
+
+	ptHierarchy->ptPml4 = (PPML4E64)ptAllocator->pfnAllocTable(ptAllocator->pvContext,
+		&ptHierarchy->qwPml4PhysicalAddress);
+	if (NULL == ptHierarchy->ptPml4)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	ptHierarchy->dwTablePages = 1;
+	return STATUS_SUCCESS;
+}
+
+VOID
+Paging64HierarchySetLeafNotify(
+	_Inout_		PPAGING64_HIERARCHY			ptHierarchy,
+	_In_opt_	PFN_PAGING64_LEAF_NOTIFY	pfnLeafNotify,
+	_In_opt_	PVOID						pvContext
+)
+{
+	NT_ASSERT(NULL != ptHierarchy);
+
+	ptHierarchy->pfnLeafNotify = pfnLeafNotify;
+	ptHierarchy->pvLeafNotifyContext = pvContext;
+}
+
+static
+VOID
+paging64_EnumTableLeaves(
+	_In_		PPAGING64_HIERARCHY			ptHierarchy,
+	_In_		PUINT64						pqwTable,
+	_In_		UINT32						dwLevel,
+	_In_		UINT64						qwTableBase,
+	_In_		PFN_PAGING64_LEAF_NOTIFY	pfnLeafNotify,
+	_In_opt_	PVOID						pvContext
+)
+{
+	PAGE_TYPE64 ePageType = PAGE_TYPE_4KB;
+	UINT64 qwEntryBase = 0;
+	UINT32 i = 0;
+
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		if (0 == (pqwTable[i] & PAGING64_ENTRY_PRESENT))
+		{
+			continue;
+		}
+		qwEntryBase = qwTableBase + ((UINT64)i << PAGING64_LEVEL_SHIFT(dwLevel));
+		if ((PAGING64_LEVEL_PT == dwLevel) || PAGING64_IS_LEAF(pqwTable[i]))
+		{
+			ePageType = PAGING64_LEVEL_PAGE_TYPE(dwLevel);
+			pfnLeafNotify(pvContext, ptHierarchy->qwPml4PhysicalAddress,
+				PAGING64_SIGN_EXTEND(qwEntryBase), paging64_GetLeafAddress(ePageType, pqwTable[i]),
+				ePageType, TRUE);
+		}
+		else
+		{
+			paging64_EnumTableLeaves(ptHierarchy,
+				paging64_TableVa(ptHierarchy, pqwTable[i] & PAGING64_PHYS_ADDR_MASK),
+				dwLevel - 1, qwEntryBase, pfnLeafNotify, pvContext);
+		}
+	}
+}
+
+VOID
+Paging64HierarchyEnumLeaves(
+	_In_		PPAGING64_HIERARCHY			ptHierarchy,
+	_In_		PFN_PAGING64_LEAF_NOTIFY	pfnLeafNotify,
+	_In_opt_	PVOID						pvContext
+)
+{
+	NT_ASSERT(NULL != ptHierarchy);
+	NT_ASSERT(NULL != pfnLeafNotify);
+
+	if (NULL != ptHierarchy->ptPml4)
+	{
+		paging64_EnumTableLeaves(ptHierarchy, (PUINT64)ptHierarchy->ptPml4, PAGING64_LEVEL_PML4, 0,
+			pfnLeafNotify, pvContext);
+	}
+}
+
+VOID
+Paging64HierarchyDestroy(
+	_Inout_ PPAGING64_HIERARCHY ptHierarchy
+)
+{
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptHierarchy);
+
+	if (NULL == ptHierarchy->ptPml4)
+	{
+		return;
+	}
+
+	// Leaves are reported one by one so listeners drop the hierarchy's pages
+	for (i = 0; i < PAGING64_PML4E_COUNT; i++)
+	{
+		if (ptHierarchy->ptPml4[i].p)
+		{
+			paging64_FreeSubtree(ptHierarchy, (UINT64)ptHierarchy->ptPml4[i].addr << PAGE_SHIFT_4KB,
+				PAGING64_LEVEL_PDPT, (UINT64)i << PAGING64_LEVEL_SHIFT(PAGING64_LEVEL_PML4));
+		}
+	}
+	ptHierarchy->tAllocator.pfnFreeTable(ptHierarchy->tAllocator.pvContext, ptHierarchy->ptPml4,
+		ptHierarchy->qwPml4PhysicalAddress);
+
+	ptHierarchy->ptPml4 = NULL;
+	ptHierarchy->qwPml4PhysicalAddress = 0;
+	ptHierarchy->dwTablePages = 0;
+	RtlZeroMemory(ptHierarchy->aqwLeafCount, sizeof(ptHierarchy->aqwLeafCount));
+}
+
+/**
+* Identity map the largest page that fits at the start of [*pqwAddress, qwEnd)
+* @param ptHierarchy - hierarchy to map in
+* @param pqwAddress - start of the range, advanced past the mapped page
+* @param qwEnd - end of the range, 4KB aligned
+* @param tAttributes - attributes of the mapped page
+* @param bUse1GbPages - whether 1GB leaves may be used
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+static
+NTSTATUS
+paging64_IdentityMapStep(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_Inout_	PUINT64				pqwAddress,
+	_In_	UINT64				qwEnd,
+	_In_	PAGING64_ATTRIBUTES	tAttributes,
+	_In_	BOOLEAN				bUse1GbPages
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	VA_ADDRESS64 tVa = { 0 };
+	UINT64 qwRemaining = 0;
+	PUINT64 pqwPdpt = NULL;
+	PUINT64 pqwPd = NULL;
+	PUINT64 pqwPt = NULL;
+	PUINT64 pqwEntry = NULL;
+
+	tVa.qwValue = *pqwAddress;
+	qwRemaining = qwEnd - *pqwAddress;
+
+	eStatus = paging64_GetOrCreateTable(ptHierarchy,
+		(PUINT64)&ptHierarchy->ptPml4[tVa.FourKb.Pml4eIndex], &pqwPdpt);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+
+	pqwEntry = &pqwPdpt[tVa.FourKb.PdpteIndex];
+	if (PAGING64_IS_LEAF(*pqwEntry))
+	{
+		// Already mapped by a 1GB leaf
+		*pqwAddress = (UINT64)PAGE_ALIGN_1GB(*pqwAddress) + PAGE_SIZE_1GB;
+		return STATUS_SUCCESS;
+	}
+	if (bUse1GbPages && (0 == (*pqwEntry & PAGING64_ENTRY_PRESENT))
+		&& (0 == BYTE_OFFSET_1GB(*pqwAddress)) && (qwRemaining >= PAGE_SIZE_1GB))
+	{
+		*pqwEntry = paging64_MakeLeafEntry(PAGE_TYPE_1GB, *pqwAddress, tAttributes);
+		paging64_LeafAdded(ptHierarchy, PAGE_TYPE_1GB, *pqwAddress, *pqwAddress);
+		*pqwAddress += PAGE_SIZE_1GB;
+		return STATUS_SUCCESS;
+	}
+
+	eStatus = paging64_GetOrCreateTable(ptHierarchy, pqwEntry, &pqwPd);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+
+	pqwEntry = &pqwPd[tVa.FourKb.PdeIndex];
+	if (PAGING64_IS_LEAF(*pqwEntry))
+	{
+		// Already mapped by a 2MB leaf
+		*pqwAddress = (UINT64)PAGE_ALIGN_2MB(*pqwAddress) + PAGE_SIZE_2MB;
+		return STATUS_SUCCESS;
+	}
+	if ((0 == (*pqwEntry & PAGING64_ENTRY_PRESENT))
+		&& (0 == BYTE_OFFSET_2MB(*pqwAddress)) && (qwRemaining >= PAGE_SIZE_2MB))
+	{
+		*pqwEntry = paging64_MakeLeafEntry(PAGE_TYPE_2MB, *pqwAddress, tAttributes);
+		paging64_LeafAdded(ptHierarchy, PAGE_TYPE_2MB, *pqwAddress, *pqwAddress);
+		*pqwAddress += PAGE_SIZE_2MB;
+		return STATUS_SUCCESS;
+	}
+
+	eStatus = paging64_GetOrCreateTable(ptHierarchy, pqwEntry, &pqwPt);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+
+	// Fill the rest of the page table in one go
+	do
+	{
+		pqwEntry = &pqwPt[tVa.FourKb.PteIndex];
+		if (0 == (*pqwEntry & PAGING64_ENTRY_PRESENT))
+		{
+			*pqwEntry = paging64_MakeLeafEntry(PAGE_TYPE_4KB, tVa.qwValue, tAttributes);
+			paging64_LeafAdded(ptHierarchy, PAGE_TYPE_4KB, tVa.qwValue, tVa.qwValue);
+		}
+		tVa.qwValue += PAGE_SIZE_4KB;
+	} while ((tVa.qwValue < qwEnd) && (0 != tVa.FourKb.PteIndex));
+
+	*pqwAddress = tVa.qwValue;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Paging64BuildIdentityMap(
+	_Inout_						PPAGING64_HIERARCHY		ptHierarchy,
+	_In_reads_(dwRangeCount)	const PAGING64_RANGE*	ptRanges,
+	_In_						UINT32					dwRangeCount,
+	_In_						PAGING64_ATTRIBUTES		tAttributes,
+	_In_						BOOLEAN					bUse1GbPages
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	UINT64 qwAddress = 0;
+	UINT64 qwEnd = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptHierarchy);
+	NT_ASSERT(NULL != ptHierarchy->ptPml4);
+	NT_ASSERT((NULL != ptRanges) || (0 == dwRangeCount));
+
+	// Validate everything up front so a bad range doesn't leave a partial map
+	for (i = 0; i < dwRangeCount; i++)
+	{
+		if ((ptRanges[i].qwBase >= PAGING64_IDENTITY_MAP_LIMIT)
+			|| (ptRanges[i].qwSize > PAGING64_IDENTITY_MAP_LIMIT - ptRanges[i].qwBase))
+		{
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	for (i = 0; i < dwRangeCount; i++)
+	{
+		qwAddress = (UINT64)PAGE_ALIGN_4KB(ptRanges[i].qwBase);
+		qwEnd = ROUND_TO_PAGES_4KB(ptRanges[i].qwBase + ptRanges[i].qwSize);
+
+		while (qwAddress < qwEnd)
+		{
+			eStatus = paging64_IdentityMapStep(ptHierarchy, &qwAddress, qwEnd,
+				tAttributes, bUse1GbPages);
+			if (!NT_SUCCESS(eStatus))
+			{
+				return eStatus;
+			}
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+typedef enum _PAGING64_RANGE_OP_TYPE
+{
+	PAGING64_RANGE_OP_MAP = 0,
+	PAGING64_RANGE_OP_UNMAP,
+	PAGING64_RANGE_OP_PROTECT
+} PAGING64_RANGE_OP_TYPE;
+
+typedef struct _PAGING64_RANGE_OP
+{
+	PAGING64_RANGE_OP_TYPE eType;
+	UINT64 qwStart;					// Linear, without sign extension
+	UINT64 qwEnd;
+	UINT64 qwPa;					// Physical address mapped at qwStart
+	PAGING64_ATTRIBUTES tAttributes;
+	BOOLEAN bUse1GbPages;
+} PAGING64_RANGE_OP, *PPAGING64_RANGE_OP;
+
+/**
+* Replace a large leaf with a table of 512 smaller leaves mapping the same memory
+* @param ptHierarchy - hierarchy the leaf belongs to
+* @param pqwEntry - PDPTE or PDE large leaf
+* @param dwLevel - level of the entry (PDPT or PD)
+* @param qwEntryBase - linear address mapped by the leaf
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+static
+NTSTATUS
+paging64_SplitLeaf(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_Inout_	PUINT64				pqwEntry,
+	_In_	UINT32				dwLevel,
+	_In_	UINT64				qwEntryBase
+)
+{
+	PAGE_TYPE64 eLargeType = PAGING64_LEVEL_PAGE_TYPE(dwLevel);
+	PAGE_TYPE64 eSmallType = PAGING64_LEVEL_PAGE_TYPE(dwLevel - 1);
+	PAGING64_ATTRIBUTES tAttributes = paging64_GetLeafAttributes(eLargeType, *pqwEntry);
+	UINT64 qwOld = *pqwEntry;
+	UINT64 qwPa = paging64_GetLeafAddress(eLargeType, qwOld);
+	UINT64 qwTablePhysicalAddress = 0;
+	PUINT64 pqwTable = NULL;
+	UINT32 i = 0;
+
+	pqwTable = (PUINT64)ptHierarchy->tAllocator.pfnAllocTable(ptHierarchy->tAllocator.pvContext,
+		&qwTablePhysicalAddress);
+	if (NULL == pqwTable)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		pqwTable[i] = paging64_MakeLeafEntry(eSmallType,
+			qwPa + ((UINT64)i << PAGING64_LEVEL_SHIFT(dwLevel - 1)), tAttributes);
+	}
+
+	// The new table is complete before it's published with a single store
+	*pqwEntry = paging64_MakeTableEntry(qwTablePhysicalAddress);
+	ptHierarchy->dwTablePages++;
+	paging64_LeafRemoved(ptHierarchy, eLargeType, qwEntryBase, qwOld);
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		paging64_LeafAdded(ptHierarchy, eSmallType,
+			qwEntryBase + ((UINT64)i << PAGING64_LEVEL_SHIFT(dwLevel - 1)),
+			qwPa + ((UINT64)i << PAGING64_LEVEL_SHIFT(dwLevel - 1)));
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+* Release the table referenced by an entry if it's empty, or replace it with a
+* single large leaf if its 512 leaves are contiguous, naturally aligned and
+* have identical attributes
+* @param ptHierarchy - hierarchy the entry belongs to
+* @param pqwEntry - PDPTE or PDE referencing a table
+* @param dwLevel - level of the entry (PDPT or PD, PML4 entries are only released)
+* @param bUse1GbPages - whether 1GB leaves may be used
+* @param qwEntryBase - linear address mapped by the entry
+*/
+static
+VOID
+paging64_TryCollapse(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_Inout_	PUINT64				pqwEntry,
+	_In_	UINT32				dwLevel,
+	_In_	BOOLEAN				bUse1GbPages,
+	_In_	UINT64				qwEntryBase
+)
+{
+	UINT64 qwTablePhysicalAddress = *pqwEntry & PAGING64_PHYS_ADDR_MASK;
+	PUINT64 pqwTable = paging64_TableVa(ptHierarchy, qwTablePhysicalAddress);
+	PAGE_TYPE64 eSmallType = PAGE_TYPE_4KB;
+	PAGING64_ATTRIBUTES tAttributes = { 0 };
+	UINT64 qwPa = 0;
+	BOOLEAN bEmpty = TRUE;
+	UINT32 i = 0;
+
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		if (0 != (pqwTable[i] & PAGING64_ENTRY_PRESENT))
+		{
+			bEmpty = FALSE;
+			break;
+		}
+	}
+	if (bEmpty)
+	{
+		*pqwEntry = 0;
+		ptHierarchy->tAllocator.pfnFreeTable(ptHierarchy->tAllocator.pvContext, pqwTable,
+			qwTablePhysicalAddress);
+		ptHierarchy->dwTablePages--;
+		return;
+	}
+
+	if ((PAGING64_LEVEL_PML4 == dwLevel)
+		|| ((PAGING64_LEVEL_PDPT == dwLevel) && !bUse1GbPages))
+	{
+		return;
+	}
+
+	// The table must only hold leaves (PTEs, or 2MB PDEs under a PDPTE)
+	eSmallType = PAGING64_LEVEL_PAGE_TYPE(dwLevel - 1);
+	if ((PAGING64_LEVEL_PD != dwLevel) && !PAGING64_IS_LEAF(pqwTable[0]))
+	{
+		return;
+	}
+	qwPa = paging64_GetLeafAddress(eSmallType, pqwTable[0]);
+	if (0 != (qwPa & ((1ULL << PAGING64_LEVEL_SHIFT(dwLevel)) - 1)))
+	{
+		return;
+	}
+	tAttributes = paging64_GetLeafAttributes(eSmallType, pqwTable[0]);
+
+	for (i = 1; i < PAGING64_PTE_COUNT; i++)
+	{
+		if ((0 == (pqwTable[i] & PAGING64_ENTRY_PRESENT))
+			|| ((PAGING64_LEVEL_PD != dwLevel) && !PAGING64_IS_LEAF(pqwTable[i]))
+			|| (paging64_GetLeafAddress(eSmallType, pqwTable[i])
+				!= qwPa + ((UINT64)i << PAGING64_LEVEL_SHIFT(dwLevel - 1)))
+			|| (paging64_GetLeafAttributes(eSmallType, pqwTable[i]).dwValue != tAttributes.dwValue))
+		{
+			return;
+		}
+	}
+
+	*pqwEntry = paging64_MakeLeafEntry(PAGING64_LEVEL_PAGE_TYPE(dwLevel), qwPa, tAttributes);
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		paging64_LeafRemoved(ptHierarchy, eSmallType,
+			qwEntryBase + ((UINT64)i << PAGING64_LEVEL_SHIFT(dwLevel - 1)), pqwTable[i]);
+	}
+	paging64_LeafAdded(ptHierarchy, PAGING64_LEVEL_PAGE_TYPE(dwLevel), qwEntryBase, qwPa);
+	ptHierarchy->tAllocator.pfnFreeTable(ptHierarchy->tAllocator.pvContext, pqwTable,
+		qwTablePhysicalAddress);
+	ptHierarchy->dwTablePages--;
+}
+
+/**
+* Apply a range operation to the part of the range covered by a table
+* @param ptHierarchy - hierarchy the table belongs to
+* @param ptOp - operation to apply
+* @param pqwTable - table
+* @param dwLevel - level of the table
+* @param qwTableBase - first linear address covered by the table
+* @return STATUS_SUCCESS or STATUS_INSUFFICIENT_RESOURCES
+*/
+static
+NTSTATUS
+paging64_ApplyRangeOp(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	PPAGING64_RANGE_OP	ptOp,
+	_Inout_	PUINT64				pqwTable,
+	_In_	UINT32				dwLevel,
+	_In_	UINT64				qwTableBase
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	UINT32 dwShift = PAGING64_LEVEL_SHIFT(dwLevel);
+	UINT64 qwEntrySize = 1ULL << dwShift;
+	UINT64 qwEntryBase = 0;
+	UINT64 qwPa = 0;
+	UINT64 qwOld = 0;
+	UINT32 dwIndex = 0;
+	BOOLEAN bFullCover = FALSE;
+	PUINT64 pqwEntry = NULL;
+	PUINT64 pqwChild = NULL;
+
+	dwIndex = (UINT32)(((ptOp->qwStart > qwTableBase ? ptOp->qwStart : qwTableBase)
+		- qwTableBase) >> dwShift);
+
+	for (; dwIndex < PAGING64_PTE_COUNT; dwIndex++)
+	{
+		qwEntryBase = qwTableBase + ((UINT64)dwIndex << dwShift);
+		if (qwEntryBase >= ptOp->qwEnd)
+		{
+			break;
+		}
+
+		pqwEntry = &pqwTable[dwIndex];
+		bFullCover = (qwEntryBase >= ptOp->qwStart) && (qwEntryBase + qwEntrySize <= ptOp->qwEnd);
+		qwPa = ptOp->qwPa + (qwEntryBase - ptOp->qwStart);
+
+		if (PAGING64_LEVEL_PT == dwLevel)
+		{
+			switch (ptOp->eType)
+			{
+			case PAGING64_RANGE_OP_MAP:
+				qwOld = *pqwEntry;
+				*pqwEntry = paging64_MakeLeafEntry(PAGE_TYPE_4KB, qwPa, ptOp->tAttributes);
+				if (0 != (qwOld & PAGING64_ENTRY_PRESENT))
+				{
+					paging64_LeafRemoved(ptHierarchy, PAGE_TYPE_4KB, qwEntryBase, qwOld);
+				}
+				paging64_LeafAdded(ptHierarchy, PAGE_TYPE_4KB, qwEntryBase, qwPa);
+				break;
+			case PAGING64_RANGE_OP_UNMAP:
+				paging64_ClearEntry(ptHierarchy, pqwEntry, dwLevel, qwEntryBase);
+				break;
+			case PAGING64_RANGE_OP_PROTECT:
+				if (0 != (*pqwEntry & PAGING64_ENTRY_PRESENT))
+				{
+					*pqwEntry = paging64_MakeLeafEntry(PAGE_TYPE_4KB,
+						paging64_GetLeafAddress(PAGE_TYPE_4KB, *pqwEntry), ptOp->tAttributes);
+				}
+				break;
+			}
+			continue;
+		}
+
+		// Entries fully inside the range are handled without descending if possible
+		if (bFullCover)
+		{
+			if (PAGING64_RANGE_OP_UNMAP == ptOp->eType)
+			{
+				paging64_ClearEntry(ptHierarchy, pqwEntry, dwLevel, qwEntryBase);
+				continue;
+			}
+			if ((PAGING64_RANGE_OP_MAP == ptOp->eType)
+				&& ((PAGING64_LEVEL_PD == dwLevel)
+					|| ((PAGING64_LEVEL_PDPT == dwLevel) && ptOp->bUse1GbPages))
+				&& (0 == (qwPa & (qwEntrySize - 1))))
+			{
+				paging64_ClearEntry(ptHierarchy, pqwEntry, dwLevel, qwEntryBase);
+				*pqwEntry = paging64_MakeLeafEntry(PAGING64_LEVEL_PAGE_TYPE(dwLevel), qwPa,
+					ptOp->tAttributes);
+				paging64_LeafAdded(ptHierarchy, PAGING64_LEVEL_PAGE_TYPE(dwLevel), qwEntryBase, qwPa);
+				continue;
+			}
+			if ((PAGING64_RANGE_OP_PROTECT == ptOp->eType) && PAGING64_IS_LEAF(*pqwEntry))
+			{
+				*pqwEntry = paging64_MakeLeafEntry(PAGING64_LEVEL_PAGE_TYPE(dwLevel),
+					paging64_GetLeafAddress(PAGING64_LEVEL_PAGE_TYPE(dwLevel), *pqwEntry),
+					ptOp->tAttributes);
+				continue;
+			}
+		}
+
+		if (0 == (*pqwEntry & PAGING64_ENTRY_PRESENT))
+		{
+			if (PAGING64_RANGE_OP_MAP != ptOp->eType)
+			{
+				continue;
+			}
+			eStatus = paging64_GetOrCreateTable(ptHierarchy, pqwEntry, &pqwChild);
+			if (!NT_SUCCESS(eStatus))
+			{
+				return eStatus;
+			}
+		}
+		else if (PAGING64_IS_LEAF(*pqwEntry))
+		{
+			// A range boundary falls inside the large leaf
+			eStatus = paging64_SplitLeaf(ptHierarchy, pqwEntry, dwLevel, qwEntryBase);
+			if (!NT_SUCCESS(eStatus))
+			{
+				return eStatus;
+			}
+		}
+		pqwChild = paging64_TableVa(ptHierarchy, *pqwEntry & PAGING64_PHYS_ADDR_MASK);
+
+		eStatus = paging64_ApplyRangeOp(ptHierarchy, ptOp, pqwChild, dwLevel - 1, qwEntryBase);
+		paging64_TryCollapse(ptHierarchy, pqwEntry, dwLevel, ptOp->bUse1GbPages, qwEntryBase);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+paging64_RunRangeOp(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_Inout_	PPAGING64_RANGE_OP	ptOp,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwSize
+)
+{
+	NT_ASSERT(NULL != ptHierarchy);
+	NT_ASSERT(NULL != ptHierarchy->ptPml4);
+
+	if ((0 != BYTE_OFFSET_4KB(qwVa)) || (0 != BYTE_OFFSET_4KB(qwSize))
+		|| (0 != BYTE_OFFSET_4KB(ptOp->qwPa)))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (0 == qwSize)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	// The whole range must be on the same side of the canonical hole
+	if (!PAGING64_IS_CANONICAL(qwVa)
+		|| (qwSize - 1 > MAXUINT64 - qwVa)
+		|| !PAGING64_IS_CANONICAL(qwVa + qwSize - 1)
+		|| ((qwVa ^ (qwVa + qwSize - 1)) >> 63))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	ptOp->qwStart = qwVa & PAGING64_LINEAR_MASK;
+	ptOp->qwEnd = ptOp->qwStart + qwSize;
+	return paging64_ApplyRangeOp(ptHierarchy, ptOp, (PUINT64)ptHierarchy->ptPml4,
+		PAGING64_LEVEL_PML4, 0);
+}
+
+NTSTATUS
+Paging64MapRange(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwPa,
+	_In_	UINT64				qwSize,
+	_In_	PAGING64_ATTRIBUTES	tAttributes,
+	_In_	BOOLEAN				bUse1GbPages
+)
+{
+	PAGING64_RANGE_OP tOp = { 0 };
+
+	if ((qwPa > PAGING64_PHYS_ADDR_MASK)
+		|| (qwSize > PAGING64_PHYS_ADDR_MASK - qwPa + PAGE_SIZE_4KB))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	tOp.eType = PAGING64_RANGE_OP_MAP;
+	tOp.qwPa = qwPa;
+	tOp.tAttributes = tAttributes;
+	tOp.bUse1GbPages = bUse1GbPages;
+	return paging64_RunRangeOp(ptHierarchy, &tOp, qwVa, qwSize);
+}
+
+NTSTATUS
+Paging64UnmapRange(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwSize
+)
+{
+	PAGING64_RANGE_OP tOp = { 0 };
+
+	tOp.eType = PAGING64_RANGE_OP_UNMAP;
+	return paging64_RunRangeOp(ptHierarchy, &tOp, qwVa, qwSize);
+}
+
+NTSTATUS
+Paging64ProtectRange(
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwSize,
+	_In_	PAGING64_ATTRIBUTES	tAttributes,
+	_In_	BOOLEAN				bUse1GbPages
+)
+{
+	PAGING64_RANGE_OP tOp = { 0 };
+
+	tOp.eType = PAGING64_RANGE_OP_PROTECT;
+	tOp.tAttributes = tAttributes;
+	tOp.bUse1GbPages = bUse1GbPages;
+	return paging64_RunRangeOp(ptHierarchy, &tOp, qwVa, qwSize);
+}
@@ -0,0 +1,99 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		pagetable64_kernel.c
+* @section	Kernel helpers of the IA-32e paging hierarchies.
+*			Kept in their own file so user-mode builds can leave them out.
+*/
+
+#include "pagetable64.h"
+
+// The chipset decodes MMIO up to 4GB however little RAM the host has
+#define PAGING64_HOST_MMIO_LIMIT	(4ULL * PAGE_SIZE_1GB)
+
+NTSTATUS
+Paging64BuildHostIdentityMap(
+	_Inout_								PPAGING64_HIERARCHY		ptHierarchy,
+	_In_								PAGING64_ATTRIBUTES		tAttributes,
+	_In_reads_opt_(dwMmioRangeCount)	const PAGING64_RANGE*	ptMmioRanges,
+	_In_								UINT32					dwMmioRangeCount
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	PPHYSICAL_MEMORY_RANGE ptMemoryRanges = NULL;
+	PAGING64_ATTRIBUTES tUncached = tAttributes;
+	PAGING64_RANGE tRange = { 0 };
+	BOOLEAN bUse1GbPages = FALSE;
+	UINT64 qwBase = 0;
+	UINT64 qwEnd = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptHierarchy);
+	NT_ASSERT((NULL != ptMmioRanges) || (0 == dwMmioRangeCount));
+
+	// The array ends with an empty range
+	ptMemoryRanges = MmGetPhysicalMemoryRanges();
+	if (NULL == ptMemoryRanges)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	bUse1GbPages = Paging64Is1GbPageSupported();
+	tUncached.pcd = 1;
+	tUncached.pwt = 1;
+	tUncached.pat = 0;
+
+	// Map the whole space uncacheable, then remap RAM over it. The ranges don't
+	// have to be sorted, and large pages are only split where RAM and MMIO meet.
+	tRange.qwSize = PAGING64_HOST_MMIO_LIMIT;
+	for (i = 0; (0 != ptMemoryRanges[i].BaseAddress.QuadPart)
+		|| (0 != ptMemoryRanges[i].NumberOfBytes.QuadPart); i++)
+	{
+		qwEnd = (UINT64)ptMemoryRanges[i].BaseAddress.QuadPart
+			+ (UINT64)ptMemoryRanges[i].NumberOfBytes.QuadPart;
+		if (tRange.qwSize < qwEnd)
+		{
+			tRange.qwSize = qwEnd;
+		}
+	}
+	eStatus = Paging64BuildIdentityMap(ptHierarchy, &tRange, 1, tUncached, bUse1GbPages);
+
+	for (i = 0; NT_SUCCESS(eStatus) && ((0 != ptMemoryRanges[i].BaseAddress.QuadPart)
+		|| (0 != ptMemoryRanges[i].NumberOfBytes.QuadPart)); i++)
+	{
+		qwBase = (UINT64)ptMemoryRanges[i].BaseAddress.QuadPart;
+		eStatus = Paging64MapRange(ptHierarchy, qwBase, qwBase,
+			(UINT64)ptMemoryRanges[i].NumberOfBytes.QuadPart, tAttributes, bUse1GbPages);
+	}
+	ExFreePool(ptMemoryRanges);
+
+	for (i = 0; NT_SUCCESS(eStatus) && (i < dwMmioRangeCount); i++)
+	{
+		qwBase = (UINT64)PAGE_ALIGN_4KB(ptMmioRanges[i].qwBase);
+		qwEnd = ROUND_TO_PAGES_4KB(ptMmioRanges[i].qwBase + ptMmioRanges[i].qwSize);
+		eStatus = Paging64MapRange(ptHierarchy, qwBase, qwBase, qwEnd - qwBase, tUncached,
+			bUse1GbPages);
+	}
+
+	return eStatus;
+}
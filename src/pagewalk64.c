@@ -0,0 +1,586 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		pagewalk64.c
+* @section	Software IA-32e page walker with a set-associative translation cache
+*/
+
+#include "pagewalk64.h"
+
+static
+__inline
+UINT32
+paging64_TlbSet(
+	_In_	UINT64	qwPml4,
+	_In_	UINT64	qwVaPage
+)
+{
+	// Fibonacci hashing spreads both sequential pages and address spaces over the sets
+	return (UINT32)(((qwVaPage ^ (qwPml4 >> PAGE_SHIFT_4KB)) * 0x9E3779B97F4A7C15ULL)
+		>> (64 - PAGING64_TLB_SETS_SHIFT));
+}
+
+static
+__inline
+UINT64
+paging64_Cr3ToPml4(
+	_In_	CR3_REG	tCr3
+)
+{
+	return tCr3.qwValue & PAGING64_PHYS_ADDR_MASK;
+}
+
+NTSTATUS
+Paging64Walk(
+	_In_	PPAGING64_READER		ptReader,
+	_In_	CR3_REG					tCr3,
+	_In_	UINT64					qwVa,
+	_Out_	PPAGING64_TRANSLATION	ptTranslation
+)
+{
+	VA_ADDRESS64 tVa = { 0 };
+	const PML4E64* ptPml4 = NULL;
+	const UINT64* pqwTable = NULL;
+	PML4E64 tPml4e = { 0 };
+	PDPTE_ANY64 tPdpte = { 0 };
+	PDE_ANY64 tPde = { 0 };
+	PTE64 tPte = { 0 };
+
+	NT_ASSERT(NULL != ptReader);
+	NT_ASSERT(NULL != ptTranslation);
+
+	RtlZeroMemory(ptTranslation, sizeof(*ptTranslation));
+	if (!PAGING64_IS_CANONICAL(qwVa))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	tVa.qwValue = qwVa;
+
+	// Vol 3A, 4.5 IA-32E PAGING - Each level is read once into a local copy
+	ptPml4 = (const PML4E64*)ptReader->pfnReadTable(ptReader->pvContext, paging64_Cr3ToPml4(tCr3));
+	if (NULL == ptPml4)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+	tPml4e = ptPml4[tVa.FourKb.Pml4eIndex];
+	if (!tPml4e.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	pqwTable = (const UINT64*)ptReader->pfnReadTable(ptReader->pvContext,
+		(UINT64)tPml4e.addr << PAGE_SHIFT_4KB);
+	if (NULL == pqwTable)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+	tPdpte.qwValue = pqwTable[tVa.FourKb.PdpteIndex];
+	if (!tPdpte.tTable.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptTranslation->bWritable = (BOOLEAN)(tPml4e.rw & tPdpte.tTable.rw);
+	ptTranslation->bUser = (BOOLEAN)(tPml4e.us & tPdpte.tTable.us);
+	ptTranslation->bExecuteDisable = (BOOLEAN)(tPml4e.xd | tPdpte.tTable.xd);
+
+	if (tPdpte.tTable.ps)
+	{
+		ptTranslation->ePageType = PAGE_TYPE_1GB;
+		ptTranslation->qwLeafEntry = tPdpte.qwValue;
+		ptTranslation->qwPhysicalAddress = ((UINT64)tPdpte.tLeaf.addr << PAGE_SHIFT_1GB)
+			+ tVa.OneGb.Offset;
+		return STATUS_SUCCESS;
+	}
+
+	pqwTable = (const UINT64*)ptReader->pfnReadTable(ptReader->pvContext,
+		(UINT64)tPdpte.tTable.addr << PAGE_SHIFT_4KB);
+	if (NULL == pqwTable)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+	tPde.qwValue = pqwTable[tVa.FourKb.PdeIndex];
+	if (!tPde.tTable.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptTranslation->bWritable &= tPde.tTable.rw;
+	ptTranslation->bUser &= tPde.tTable.us;
+	ptTranslation->bExecuteDisable |= tPde.tTable.xd;
+
+	if (tPde.tTable.ps)
+	{
+		ptTranslation->ePageType = PAGE_TYPE_2MB;
+		ptTranslation->qwLeafEntry = tPde.qwValue;
+		ptTranslation->qwPhysicalAddress = ((UINT64)tPde.tLeaf.addr << PAGE_SHIFT_2MB)
+			+ tVa.TwoMb.Offset;
+		return STATUS_SUCCESS;
+	}
+
+	pqwTable = (const UINT64*)ptReader->pfnReadTable(ptReader->pvContext,
+		(UINT64)tPde.tTable.addr << PAGE_SHIFT_4KB);
+	if (NULL == pqwTable)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+	tPte = ((const PTE64*)pqwTable)[tVa.FourKb.PteIndex];
+	if (!tPte.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptTranslation->bWritable &= tPte.rw;
+	ptTranslation->bUser &= tPte.us;
+	ptTranslation->bExecuteDisable |= tPte.xd;
+	ptTranslation->ePageType = PAGE_TYPE_4KB;
+	ptTranslation->qwLeafEntry = pqwTable[tVa.FourKb.PteIndex];
+	ptTranslation->qwPhysicalAddress = ((UINT64)tPte.addr << PAGE_SHIFT_4KB)
+		+ tVa.FourKb.Offset;
+	return STATUS_SUCCESS;
+}
+
+VOID
+Paging64WalkerInit(
+	_Out_		PPAGING64_WALKER		ptWalker,
+	_In_		PFN_PAGING64_READ_TABLE	pfnReadTable,
+	_In_opt_	PVOID					pvContext
+)
+{
+	NT_ASSERT(NULL != ptWalker);
+	NT_ASSERT(NULL != pfnReadTable);
+
+	RtlZeroMemory(ptWalker, sizeof(*ptWalker));
+	ptWalker->tReader.pfnReadTable = pfnReadTable;
+	ptWalker->tReader.pvContext = pvContext;
+}
+
+NTSTATUS
+Paging64WalkerTranslate(
+	_Inout_	PPAGING64_WALKER		ptWalker,
+	_In_	CR3_REG					tCr3,
+	_In_	UINT64					qwVa,
+	_Out_	PPAGING64_TRANSLATION	ptTranslation
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	UINT64 qwPml4 = 0;
+	UINT64 qwVaPage = 0;
+	UINT32 dwSet = 0;
+	UINT32 dwWay = 0;
+	PPAGING64_TLB_ENTRY ptEntry = NULL;
+
+	NT_ASSERT(NULL != ptWalker);
+	NT_ASSERT(NULL != ptTranslation);
+
+	qwPml4 = paging64_Cr3ToPml4(tCr3);
+	qwVaPage = qwVa >> PAGE_SHIFT_4KB;
+	dwSet = paging64_TlbSet(qwPml4, qwVaPage);
+
+	for (dwWay = 0; dwWay < PAGING64_TLB_WAYS; dwWay++)
+	{
+		ptEntry = &ptWalker->tTlb.atEntries[dwSet][dwWay];
+		if (ptEntry->bValid && (qwVaPage == ptEntry->qwVaPage) && (qwPml4 == ptEntry->qwPml4))
+		{
+			ptWalker->tTlb.qwHits++;
+			ptTranslation->qwPhysicalAddress = ptEntry->qwPaPage + BYTE_OFFSET_4KB(qwVa);
+			ptTranslation->qwLeafEntry = ptEntry->qwLeafEntry;
+			ptTranslation->ePageType = ptEntry->ePageType;
+			ptTranslation->bWritable = ptEntry->bWritable;
+			ptTranslation->bUser = ptEntry->bUser;
+			ptTranslation->bExecuteDisable = ptEntry->bExecuteDisable;
+			return STATUS_SUCCESS;
+		}
+	}
+
+	ptWalker->tTlb.qwMisses++;
+	eStatus = Paging64Walk(&ptWalker->tReader, tCr3, qwVa, ptTranslation);
+	if (!NT_SUCCESS(eStatus))
+	{
+		// Like the hardware TLB, failed translations are never cached
+		return eStatus;
+	}
+
+	dwWay = ptWalker->tTlb.acNextVictim[dwSet];
+	ptWalker->tTlb.acNextVictim[dwSet] = (UINT8)((dwWay + 1) % PAGING64_TLB_WAYS);
+
+	ptEntry = &ptWalker->tTlb.atEntries[dwSet][dwWay];
+	ptEntry->qwPml4 = qwPml4;
+	ptEntry->qwVaPage = qwVaPage;
+	ptEntry->qwPaPage = ptTranslation->qwPhysicalAddress & ~((UINT64)PAGE_SIZE_4KB - 1);
+	ptEntry->qwLeafEntry = ptTranslation->qwLeafEntry;
+	ptEntry->ePageType = ptTranslation->ePageType;
+	ptEntry->bWritable = ptTranslation->bWritable;
+	ptEntry->bUser = ptTranslation->bUser;
+	ptEntry->bExecuteDisable = ptTranslation->bExecuteDisable;
+	ptEntry->bValid = TRUE;
+	return STATUS_SUCCESS;
+}
+
+VOID
+Paging64TlbFlushAll(
+	_Inout_ PPAGING64_TLB ptTlb
+)
+{
+	NT_ASSERT(NULL != ptTlb);
+
+	RtlZeroMemory(ptTlb->atEntries, sizeof(ptTlb->atEntries));
+	RtlZeroMemory(ptTlb->acNextVictim, sizeof(ptTlb->acNextVictim));
+}
+
+VOID
+Paging64TlbFlushAddressSpace(
+	_Inout_	PPAGING64_TLB	ptTlb,
+	_In_	CR3_REG			tCr3
+)
+{
+	UINT64 qwPml4 = 0;
+	UINT32 dwSet = 0;
+	UINT32 dwWay = 0;
+
+	NT_ASSERT(NULL != ptTlb);
+
+	qwPml4 = paging64_Cr3ToPml4(tCr3);
+	for (dwSet = 0; dwSet < PAGING64_TLB_SETS; dwSet++)
+	{
+		for (dwWay = 0; dwWay < PAGING64_TLB_WAYS; dwWay++)
+		{
+			if (qwPml4 == ptTlb->atEntries[dwSet][dwWay].qwPml4)
+			{
+				ptTlb->atEntries[dwSet][dwWay].bValid = FALSE;
+			}
+		}
+	}
+}
+
+VOID
+Paging64TlbFlushRange(
+	_Inout_	PPAGING64_TLB	ptTlb,
+	_In_	CR3_REG			tCr3,
+	_In_	UINT64			qwVa,
+	_In_	UINT64			qwSize
+)
+{
+	UINT64 qwPml4 = 0;
+	UINT64 qwFirstPage = 0;
+	UINT64 qwLastPage = 0;
+	UINT64 qwPage = 0;
+	UINT32 dwSet = 0;
+	UINT32 dwWay = 0;
+	PPAGING64_TLB_ENTRY ptEntry = NULL;
+
+	NT_ASSERT(NULL != ptTlb);
+
+	if (0 == qwSize)
+	{
+		return;
+	}
+
+	qwPml4 = paging64_Cr3ToPml4(tCr3);
+	qwFirstPage = qwVa >> PAGE_SHIFT_4KB;
+	// Clamp to the top of the address space instead of wrapping around
+	qwLastPage = (qwSize - 1 > MAXUINT64 - qwVa) ?
+		(MAXUINT64 >> PAGE_SHIFT_4KB) : ((qwVa + qwSize - 1) >> PAGE_SHIFT_4KB);
+
+	if (qwLastPage - qwFirstPage < PAGING64_TLB_SETS * PAGING64_TLB_WAYS)
+	{
+		// Small range - probe only the sets the pages hash to
+		for (qwPage = qwFirstPage; qwPage <= qwLastPage; qwPage++)
+		{
+			dwSet = paging64_TlbSet(qwPml4, qwPage);
+			for (dwWay = 0; dwWay < PAGING64_TLB_WAYS; dwWay++)
+			{
+				ptEntry = &ptTlb->atEntries[dwSet][dwWay];
+				if ((qwPage == ptEntry->qwVaPage) && (qwPml4 == ptEntry->qwPml4))
+				{
+					ptEntry->bValid = FALSE;
+				}
+			}
+		}
+		return;
+	}
+
+	// Large range - cheaper to scan the whole TLB once
+	for (dwSet = 0; dwSet < PAGING64_TLB_SETS; dwSet++)
+	{
+		for (dwWay = 0; dwWay < PAGING64_TLB_WAYS; dwWay++)
+		{
+			ptEntry = &ptTlb->atEntries[dwSet][dwWay];
+			if ((qwPml4 == ptEntry->qwPml4)
+				&& (ptEntry->qwVaPage >= qwFirstPage)
+				&& (ptEntry->qwVaPage <= qwLastPage))
+			{
+				ptEntry->bValid = FALSE;
+			}
+		}
+	}
+}
+
+// Keys of the cursor levels that hold no entry
+#define PAGING64_BATCH_NO_KEY	MAXUINT64
+
+// Upper-level entries shared by the group of addresses being translated in a batch
+typedef struct _PAGING64_BATCH_CURSOR
+{
+	UINT64 qwPml4eKey;			// Linear address >> 39 of tPml4e
+	UINT64 qwPdpteKey;			// Linear address >> PAGE_SHIFT_1GB of tPdpte
+	UINT64 qwPdeKey;			// Linear address >> PAGE_SHIFT_2MB of tPde
+	PML4E64 tPml4e;
+	PDPTE_ANY64 tPdpte;
+	PDE_ANY64 tPde;
+	const PTE64* ptPt;			// Page table of tPde, valid until the next read
+} PAGING64_BATCH_CURSOR, *PPAGING64_BATCH_CURSOR;
+
+static
+NTSTATUS
+paging64_BatchTranslateOne(
+	_In_	PPAGING64_READER		ptReader,
+	_In_	CR3_REG					tCr3,
+	_Inout_	PPAGING64_BATCH_CURSOR	ptCursor,
+	_In_	UINT64					qwVa,
+	_Out_	PPAGING64_TRANSLATION	ptTranslation
+)
+{
+	VA_ADDRESS64 tVa = { 0 };
+	const UINT64* pqwTable = NULL;
+	PTE64 tPte = { 0 };
+
+	RtlZeroMemory(ptTranslation, sizeof(*ptTranslation));
+	if (!PAGING64_IS_CANONICAL(qwVa))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	tVa.qwValue = qwVa;
+
+	if ((qwVa >> 39) != ptCursor->qwPml4eKey)
+	{
+		ptCursor->qwPml4eKey = PAGING64_BATCH_NO_KEY;
+		ptCursor->qwPdpteKey = PAGING64_BATCH_NO_KEY;
+		ptCursor->qwPdeKey = PAGING64_BATCH_NO_KEY;
+		ptCursor->ptPt = NULL;
+
+		pqwTable = (const UINT64*)ptReader->pfnReadTable(ptReader->pvContext,
+			paging64_Cr3ToPml4(tCr3));
+		if (NULL == pqwTable)
+		{
+			return STATUS_ACCESS_VIOLATION;
+		}
+		ptCursor->tPml4e = ((const PML4E64*)pqwTable)[tVa.FourKb.Pml4eIndex];
+		ptCursor->qwPml4eKey = qwVa >> 39;
+	}
+	if (!ptCursor->tPml4e.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	if ((qwVa >> PAGE_SHIFT_1GB) != ptCursor->qwPdpteKey)
+	{
+		ptCursor->qwPdpteKey = PAGING64_BATCH_NO_KEY;
+		ptCursor->qwPdeKey = PAGING64_BATCH_NO_KEY;
+		ptCursor->ptPt = NULL;
+
+		pqwTable = (const UINT64*)ptReader->pfnReadTable(ptReader->pvContext,
+			(UINT64)ptCursor->tPml4e.addr << PAGE_SHIFT_4KB);
+		if (NULL == pqwTable)
+		{
+			return STATUS_ACCESS_VIOLATION;
+		}
+		ptCursor->tPdpte.qwValue = pqwTable[tVa.FourKb.PdpteIndex];
+		ptCursor->qwPdpteKey = qwVa >> PAGE_SHIFT_1GB;
+	}
+	if (!ptCursor->tPdpte.tTable.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptTranslation->bWritable = (BOOLEAN)(ptCursor->tPml4e.rw & ptCursor->tPdpte.tTable.rw);
+	ptTranslation->bUser = (BOOLEAN)(ptCursor->tPml4e.us & ptCursor->tPdpte.tTable.us);
+	ptTranslation->bExecuteDisable = (BOOLEAN)(ptCursor->tPml4e.xd | ptCursor->tPdpte.tTable.xd);
+
+	if (ptCursor->tPdpte.tTable.ps)
+	{
+		ptTranslation->ePageType = PAGE_TYPE_1GB;
+		ptTranslation->qwLeafEntry = ptCursor->tPdpte.qwValue;
+		ptTranslation->qwPhysicalAddress =
+			((UINT64)ptCursor->tPdpte.tLeaf.addr << PAGE_SHIFT_1GB) + tVa.OneGb.Offset;
+		return STATUS_SUCCESS;
+	}
+
+	if ((qwVa >> PAGE_SHIFT_2MB) != ptCursor->qwPdeKey)
+	{
+		ptCursor->qwPdeKey = PAGING64_BATCH_NO_KEY;
+		ptCursor->ptPt = NULL;
+
+		pqwTable = (const UINT64*)ptReader->pfnReadTable(ptReader->pvContext,
+			(UINT64)ptCursor->tPdpte.tTable.addr << PAGE_SHIFT_4KB);
+		if (NULL == pqwTable)
+		{
+			return STATUS_ACCESS_VIOLATION;
+		}
+		ptCursor->tPde.qwValue = pqwTable[tVa.FourKb.PdeIndex];
+		ptCursor->qwPdeKey = qwVa >> PAGE_SHIFT_2MB;
+	}
+	if (!ptCursor->tPde.tTable.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptTranslation->bWritable &= ptCursor->tPde.tTable.rw;
+	ptTranslation->bUser &= ptCursor->tPde.tTable.us;
+	ptTranslation->bExecuteDisable |= ptCursor->tPde.tTable.xd;
+
+	if (ptCursor->tPde.tTable.ps)
+	{
+		ptTranslation->ePageType = PAGE_TYPE_2MB;
+		ptTranslation->qwLeafEntry = ptCursor->tPde.qwValue;
+		ptTranslation->qwPhysicalAddress =
+			((UINT64)ptCursor->tPde.tLeaf.addr << PAGE_SHIFT_2MB) + tVa.TwoMb.Offset;
+		return STATUS_SUCCESS;
+	}
+
+	// The page table stays mapped for as long as the group only needs PTEs
+	if (NULL == ptCursor->ptPt)
+	{
+		ptCursor->ptPt = (const PTE64*)ptReader->pfnReadTable(ptReader->pvContext,
+			(UINT64)ptCursor->tPde.tTable.addr << PAGE_SHIFT_4KB);
+		if (NULL == ptCursor->ptPt)
+		{
+			return STATUS_ACCESS_VIOLATION;
+		}
+	}
+	tPte = ptCursor->ptPt[tVa.FourKb.PteIndex];
+	if (!tPte.p)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	ptTranslation->bWritable &= tPte.rw;
+	ptTranslation->bUser &= tPte.us;
+	ptTranslation->bExecuteDisable |= tPte.xd;
+	ptTranslation->ePageType = PAGE_TYPE_4KB;
+	ptTranslation->qwLeafEntry = ((const UINT64*)ptCursor->ptPt)[tVa.FourKb.PteIndex];
+	ptTranslation->qwPhysicalAddress = ((UINT64)tPte.addr << PAGE_SHIFT_4KB) + tVa.FourKb.Offset;
+	return STATUS_SUCCESS;
+}
+
+static
+VOID
+paging64_SiftDown(
+	_In_	const UINT64*	pqwVas,
+	_Inout_	PUINT32			pdwOrder,
+	_In_	UINT32			dwRoot,
+	_In_	UINT32			dwCount
+)
+{
+	UINT32 dwChild = 0;
+	UINT32 dwTemp = 0;
+
+	while ((dwChild = 2 * dwRoot + 1) < dwCount)
+	{
+		if ((dwChild + 1 < dwCount) && (pqwVas[pdwOrder[dwChild]] < pqwVas[pdwOrder[dwChild + 1]]))
+		{
+			dwChild++;
+		}
+		if (pqwVas[pdwOrder[dwRoot]] >= pqwVas[pdwOrder[dwChild]])
+		{
+			return;
+		}
+		dwTemp = pdwOrder[dwRoot];
+		pdwOrder[dwRoot] = pdwOrder[dwChild];
+		pdwOrder[dwChild] = dwTemp;
+		dwRoot = dwChild;
+	}
+}
+
+static
+VOID
+paging64_SortByAddress(
+	_In_						const UINT64*	pqwVas,
+	_In_						UINT32			dwCount,
+	_Out_writes_(dwCount)		PUINT32			pdwOrder
+)
+{
+	UINT32 i = 0;
+	UINT32 dwTemp = 0;
+
+	// Heapsort keeps the batch path free of allocations and recursion
+	for (i = 0; i < dwCount; i++)
+	{
+		pdwOrder[i] = i;
+	}
+	for (i = dwCount / 2; i > 0; i--)
+	{
+		paging64_SiftDown(pqwVas, pdwOrder, i - 1, dwCount);
+	}
+	for (i = dwCount; i > 1; i--)
+	{
+		dwTemp = pdwOrder[0];
+		pdwOrder[0] = pdwOrder[i - 1];
+		pdwOrder[i - 1] = dwTemp;
+		paging64_SiftDown(pqwVas, pdwOrder, 0, i - 1);
+	}
+}
+
+UINT32
+Paging64WalkBatch(
+	_In_								PPAGING64_READER		ptReader,
+	_In_								CR3_REG					tCr3,
+	_In_reads_(dwCount)					const UINT64*			pqwVas,
+	_In_								UINT32					dwCount,
+	_Inout_updates_opt_(dwCount)		PUINT32					pdwOrder,
+	_Out_writes_(dwCount)				PPAGING64_TRANSLATION	ptTranslations,
+	_Out_writes_(dwCount)				NTSTATUS*				peStatuses
+)
+{
+	PAGING64_BATCH_CURSOR tCursor = { 0 };
+	UINT32 dwTranslated = 0;
+	UINT32 dwIndex = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptReader);
+	NT_ASSERT((NULL != pqwVas) || (0 == dwCount));
+	NT_ASSERT((NULL != ptTranslations) || (0 == dwCount));
+	NT_ASSERT((NULL != peStatuses) || (0 == dwCount));
+
+	if (NULL != pdwOrder)
+	{
+		paging64_SortByAddress(pqwVas, dwCount, pdwOrder);
+	}
+
+	tCursor.qwPml4eKey = PAGING64_BATCH_NO_KEY;
+	tCursor.qwPdpteKey = PAGING64_BATCH_NO_KEY;
+	tCursor.qwPdeKey = PAGING64_BATCH_NO_KEY;
+
+	for (i = 0; i < dwCount; i++)
+	{
+		dwIndex = (NULL != pdwOrder) ? pdwOrder[i] : i;
+		peStatuses[dwIndex] = paging64_BatchTranslateOne(ptReader, tCr3, &tCursor,
+			pqwVas[dwIndex], &ptTranslations[dwIndex]);
+		if (NT_SUCCESS(peStatuses[dwIndex]))
+		{
+			dwTranslated++;
+		}
+	}
+
+	return dwTranslated;
+}
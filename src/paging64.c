@@ -0,0 +1,218 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		paging64.c
+* @section	Atomic access to IA-32e paging entries
+*/
+
+#include "paging64.h"
+
+// Vol 2A, CPUID - Extended Function CPUID Information
+#define PAGING64_CPUID_EXTENDED_MAX			0x80000000
+#define PAGING64_CPUID_EXTENDED_FEATURES	0x80000001
+#define PAGING64_CPUID80000001_EDX_PAGE1GB	(1 << 26)
+
+UINT64
+Paging64EntryUpdate(
+	_Inout_	volatile UINT64*	pqwEntry,
+	_In_	UINT64				qwMask,
+	_In_	UINT64				qwValue
+)
+{
+	UINT64 qwPrevious = 0;
+
+	(VOID)Paging64EntryUpdateIf(pqwEntry, 0, 0, qwMask, qwValue, &qwPrevious);
+	return qwPrevious;
+}
+
+BOOLEAN
+Paging64EntryUpdateIf(
+	_Inout_		volatile UINT64*	pqwEntry,
+	_In_		UINT64				qwExpectMask,
+	_In_		UINT64				qwExpectValue,
+	_In_		UINT64				qwMask,
+	_In_		UINT64				qwValue,
+	_Out_opt_	PUINT64				pqwPrevious
+)
+{
+	UINT64 qwOld = 0;
+	UINT64 qwSeen = PAGING64_ENTRY_READ(pqwEntry);
+	BOOLEAN bUpdated = FALSE;
+
+	NT_ASSERT(NULL != pqwEntry);
+	NT_ASSERT(0 == (qwValue & ~qwMask));
+
+	// Retry only when the entry changed under us, e.g. the processor set A/D
+	do
+	{
+		qwOld = qwSeen;
+		if ((qwOld & qwExpectMask) != qwExpectValue)
+		{
+			break;
+		}
+		qwSeen = PAGING64_ENTRY_COMPARE_EXCHANGE(pqwEntry, (qwOld & ~qwMask) | qwValue, qwOld);
+		bUpdated = (qwSeen == qwOld);
+	} while (!bUpdated);
+
+	if (NULL != pqwPrevious)
+	{
+		*pqwPrevious = qwOld;
+	}
+	return bUpdated;
+}
+
+NTSTATUS
+Paging64ChunkIteratorInit(
+	_Out_	PPAGING64_CHUNK_ITERATOR	ptIterator,
+	_In_	UINT64						qwAddress,
+	_In_	UINT64						qwSize,
+	_In_	UINT64						qwAlignWith,
+	_In_	BOOLEAN						bUse1GbPages
+)
+{
+	NT_ASSERT(NULL != ptIterator);
+
+	RtlZeroMemory(ptIterator, sizeof(*ptIterator));
+	ptIterator->bDone = TRUE;
+
+	if (0 == qwSize)
+	{
+		return STATUS_SUCCESS;
+	}
+	if (qwSize - 1 > MAXUINT64 - qwAddress)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	ptIterator->qwNext = (UINT64)PAGE_ALIGN_4KB(qwAddress);
+	ptIterator->qwLast = (qwAddress + (qwSize - 1)) | (PAGE_SIZE_4KB - 1);
+	ptIterator->qwAlignDelta = (qwAddress ^ qwAlignWith) & ~(UINT64)(PAGE_SIZE_4KB - 1);
+	ptIterator->bDone = FALSE;
+
+	// A page size is usable only if both sides of the span agree on its offset bits
+	ptIterator->eLargest = PAGE_TYPE_4KB;
+	if (bUse1GbPages && (0 == BYTE_OFFSET_1GB(ptIterator->qwAlignDelta)))
+	{
+		ptIterator->eLargest = PAGE_TYPE_1GB;
+	}
+	else if (0 == BYTE_OFFSET_2MB(ptIterator->qwAlignDelta))
+	{
+		ptIterator->eLargest = PAGE_TYPE_2MB;
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+* Get the number of whole pages of a size in [qwAddress, qwLast], without overflowing
+*/
+static
+__inline
+UINT64
+paging64_WholePages(
+	_In_	UINT64		qwAddress,
+	_In_	UINT64		qwLast,
+	_In_	PAGE_TYPE64	ePageType
+)
+{
+	UINT64 qwOffsetMask = PAGE_TYPE64_SIZE(ePageType) - 1;
+	UINT64 qwSpan = qwLast - qwAddress;
+
+	return (qwSpan >> PAGE_TYPE64_SHIFT(ePageType))
+		+ ((qwOffsetMask == (qwSpan & qwOffsetMask)) ? 1 : 0);
+}
+
+BOOLEAN
+Paging64ChunkIteratorNext(
+	_Inout_	PPAGING64_CHUNK_ITERATOR	ptIterator,
+	_Out_	PPAGING64_CHUNK				ptChunk
+)
+{
+	PAGE_TYPE64 ePageType = PAGE_TYPE_4KB;
+	UINT64 qwAddress = 0;
+	UINT64 qwBoundaryLast = 0;
+	UINT64 qwRunLast = 0;
+
+	NT_ASSERT(NULL != ptIterator);
+	NT_ASSERT(NULL != ptChunk);
+
+	if (ptIterator->bDone)
+	{
+		return FALSE;
+	}
+	qwAddress = ptIterator->qwNext;
+
+	// Largest page that starts here and fits in the rest of the span
+	for (ePageType = ptIterator->eLargest; ePageType < PAGE_TYPE_4KB; ePageType++)
+	{
+		if ((0 == (qwAddress & (PAGE_TYPE64_SIZE(ePageType) - 1)))
+			&& (0 != paging64_WholePages(qwAddress, ptIterator->qwLast, ePageType)))
+		{
+			break;
+		}
+	}
+
+	// The run stops early only where the next larger page size becomes usable
+	qwRunLast = ptIterator->qwLast;
+	if (ePageType != ptIterator->eLargest)
+	{
+		qwBoundaryLast = qwAddress | (PAGE_TYPE64_SIZE(ePageType - 1) - 1);
+		if ((qwBoundaryLast < ptIterator->qwLast)
+			&& (0 != paging64_WholePages(qwBoundaryLast + 1, ptIterator->qwLast,
+				(PAGE_TYPE64)(ePageType - 1))))
+		{
+			qwRunLast = qwBoundaryLast;
+		}
+	}
+
+	ptChunk->qwAddress = qwAddress;
+	ptChunk->ePageType = ePageType;
+	ptChunk->qwPageCount = paging64_WholePages(qwAddress, qwRunLast, ePageType);
+
+	// The last page of the chunk may end exactly at 2^64
+	qwRunLast = qwAddress + ((ptChunk->qwPageCount << PAGE_TYPE64_SHIFT(ePageType)) - 1);
+	if (qwRunLast == ptIterator->qwLast)
+	{
+		ptIterator->bDone = TRUE;
+	}
+	else
+	{
+		ptIterator->qwNext = qwRunLast + 1;
+	}
+	return TRUE;
+}
+
+BOOLEAN
+Paging64Is1GbPageSupported(
+	VOID
+)
+{
+	INT32 adwCpuInfo[4] = { 0 };
+
+	__cpuid(adwCpuInfo, PAGING64_CPUID_EXTENDED_MAX);
+	if ((UINT32)adwCpuInfo[0] < PAGING64_CPUID_EXTENDED_FEATURES)
+	{
+		return FALSE;
+	}
+	__cpuid(adwCpuInfo, PAGING64_CPUID_EXTENDED_FEATURES);
+	return (0 != (adwCpuInfo[3] & PAGING64_CPUID80000001_EDX_PAGE1GB));
+}
@@ -0,0 +1,334 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		pml64.c
+* @section	Page-modification logging and the dirty page bitmap it feeds
+*/
+
+#include "pml64.h"
+
+/**
+* Move the valid entries of the log to the bitmap. The processor decrements
+* the index after each entry it writes, so after logging into entry 0 the
+* 16-bit index wraps to 0xFFFF and the whole log is valid.
+* @param ptVcpu - vCPU log
+* @param qwIndex - value of VMCS_FIELD_GUEST_PML_INDEX
+* @return Number of entries drained
+*/
+static
+UINT32
+pml64_DrainLog(
+	_Inout_	PPML64_VCPU	ptVcpu,
+	_In_	UINT64		qwIndex
+)
+{
+	UINT32 dwFirst = 0;
+	UINT32 i = 0;
+
+	qwIndex &= MAXUINT16;
+	if (qwIndex < PML64_LOG_ENTRIES)
+	{
+		dwFirst = (UINT32)qwIndex + 1;
+	}
+
+	for (i = dwFirst; i < PML64_LOG_ENTRIES; i++)
+	{
+		Pml64DirtyBitmapMark(ptVcpu->ptBitmap, ptVcpu->pqwLog[i]);
+	}
+
+	ptVcpu->qwDrainedEntries += PML64_LOG_ENTRIES - dwFirst;
+	return PML64_LOG_ENTRIES - dwFirst;
+}
+
+static
+NTSTATUS
+pml64_SetEnabled(
+	_In_	BOOLEAN	bEnable
+)
+{
+	size_t cbControls = 0;
+	VMX_PROCBASED_CTLS2 tControls = { 0 };
+
+	if (VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL, &cbControls))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	*(PUINT32)&tControls = (UINT32)cbControls;
+	tControls.EnablePml = bEnable;
+	if (VMX_SUCCESS != __vmx_vmwrite(VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL, *(PUINT32)&tControls))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID
+Pml64DirtyBitmapInit(
+	_Out_								PPML64_DIRTY_BITMAP	ptBitmap,
+	_Out_writes_(PML64_BITMAP_WORDS(qwPageCount))	volatile LONG64*	pqwBits,
+	_In_								UINT64				qwPageCount
+)
+{
+	NT_ASSERT(NULL != ptBitmap);
+	NT_ASSERT((NULL != pqwBits) || (0 == qwPageCount));
+
+	RtlZeroMemory(ptBitmap, sizeof(*ptBitmap));
+	RtlZeroMemory((PVOID)pqwBits, PML64_BITMAP_WORDS(qwPageCount) * sizeof(UINT64));
+	ptBitmap->pqwBits = pqwBits;
+	ptBitmap->qwPageCount = qwPageCount;
+}
+
+VOID
+Pml64DirtyBitmapMark(
+	_Inout_	PPML64_DIRTY_BITMAP	ptBitmap,
+	_In_	UINT64				qwGuestPhysicalAddress
+)
+{
+	UINT64 qwPage = qwGuestPhysicalAddress >> PAGE_SHIFT_4KB;
+	volatile LONG64* pqwWord = NULL;
+	LONG64 qwBit = 0;
+
+	NT_ASSERT(NULL != ptBitmap);
+
+	if (qwPage >= ptBitmap->qwPageCount)
+	{
+		(VOID)InterlockedIncrement64(&ptBitmap->qwOutOfRangePages);
+		return;
+	}
+
+	// Pages are usually written many times per round, skip the locked operation
+	// when the bit is already set
+	pqwWord = &ptBitmap->pqwBits[qwPage / PML64_BITMAP_BITS_PER_WORD];
+	qwBit = (LONG64)(1ULL << (qwPage % PML64_BITMAP_BITS_PER_WORD));
+	if (0 == (*pqwWord & qwBit))
+	{
+		(VOID)InterlockedOr64(pqwWord, qwBit);
+	}
+}
+
+UINT64
+Pml64DirtyBitmapHarvest(
+	_Inout_								PPML64_DIRTY_BITMAP	ptBitmap,
+	_In_								UINT64				qwFirstPage,
+	_In_								UINT64				qwPageCount,
+	_Out_writes_(PML64_BITMAP_WORDS(qwPageCount))	PUINT64				pqwDirtyBits
+)
+{
+	volatile LONG64* pqwWord = NULL;
+	UINT64 qwMask = 0;
+	UINT64 qwBits = 0;
+	UINT64 qwHarvested = 0;
+	UINT64 qwWords = 0;
+	UINT64 i = 0;
+
+	NT_ASSERT(NULL != ptBitmap);
+	NT_ASSERT((NULL != pqwDirtyBits) || (0 == qwPageCount));
+	NT_ASSERT(0 == (qwFirstPage % PML64_BITMAP_BITS_PER_WORD));
+
+	RtlZeroMemory(pqwDirtyBits, PML64_BITMAP_WORDS(qwPageCount) * sizeof(UINT64));
+	if (qwFirstPage >= ptBitmap->qwPageCount)
+	{
+		return 0;
+	}
+	if (qwPageCount > ptBitmap->qwPageCount - qwFirstPage)
+	{
+		qwPageCount = ptBitmap->qwPageCount - qwFirstPage;
+	}
+
+	qwWords = PML64_BITMAP_WORDS(qwPageCount);
+	pqwWord = &ptBitmap->pqwBits[qwFirstPage / PML64_BITMAP_BITS_PER_WORD];
+	for (i = 0; i < qwWords; i++, pqwWord++)
+	{
+		// Clean words are the common case late in a migration
+		if (0 == *pqwWord)
+		{
+			continue;
+		}
+
+		// Only the pages of the range are taken from a partial last word
+		qwMask = MAXUINT64;
+		if ((i == qwWords - 1) && (0 != (qwPageCount % PML64_BITMAP_BITS_PER_WORD)))
+		{
+			qwMask = (1ULL << (qwPageCount % PML64_BITMAP_BITS_PER_WORD)) - 1;
+			qwBits = (UINT64)InterlockedAnd64(pqwWord, ~(LONG64)qwMask) & qwMask;
+		}
+		else
+		{
+			qwBits = (UINT64)InterlockedExchange64(pqwWord, 0);
+		}
+
+		pqwDirtyBits[i] = qwBits;
+		for (; 0 != qwBits; qwBits &= qwBits - 1)
+		{
+			qwHarvested++;
+		}
+	}
+
+	return qwHarvested;
+}
+
+NTSTATUS
+Pml64VcpuInit(
+	_Out_	PPML64_VCPU					ptVcpu,
+	_In_	PPAGING64_TABLE_ALLOCATOR	ptAllocator,
+	_In_	PPML64_DIRTY_BITMAP			ptBitmap
+)
+{
+	NT_ASSERT(NULL != ptVcpu);
+	NT_ASSERT(NULL != ptAllocator);
+	NT_ASSERT(NULL != ptBitmap);
+
+	RtlZeroMemory(ptVcpu, sizeof(*ptVcpu));
+	ptVcpu->tAllocator = *ptAllocator;
+	ptVcpu->ptBitmap = ptBitmap;
+
+	ptVcpu->pqwLog = (PUINT64)ptAllocator->pfnAllocTable(ptAllocator->pvContext,
+		&ptVcpu->qwLogPhysicalAddress);
+	if (NULL == ptVcpu->pqwLog)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID
+Pml64VcpuDestroy(
+	_Inout_	PPML64_VCPU	ptVcpu
+)
+{
+	NT_ASSERT(NULL != ptVcpu);
+
+	if (NULL == ptVcpu->pqwLog)
+	{
+		return;
+	}
+
+	ptVcpu->tAllocator.pfnFreeTable(ptVcpu->tAllocator.pvContext, ptVcpu->pqwLog,
+		ptVcpu->qwLogPhysicalAddress);
+	ptVcpu->pqwLog = NULL;
+	ptVcpu->qwLogPhysicalAddress = 0;
+}
+
+NTSTATUS
+Pml64VcpuEnable(
+	_Inout_	PPML64_VCPU	ptVcpu
+)
+{
+	NT_ASSERT(NULL != ptVcpu);
+	NT_ASSERT(NULL != ptVcpu->pqwLog);
+
+	if ((VMX_SUCCESS != __vmx_vmwrite(VMCS_FIELD_PML_ADDRESS_FULL, ptVcpu->qwLogPhysicalAddress))
+		|| (VMX_SUCCESS != __vmx_vmwrite(VMCS_FIELD_GUEST_PML_INDEX, PML64_LOG_INDEX_START)))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	return pml64_SetEnabled(TRUE);
+}
+
+NTSTATUS
+Pml64VcpuDisable(
+	_Inout_	PPML64_VCPU	ptVcpu
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+
+	NT_ASSERT(NULL != ptVcpu);
+
+	eStatus = Pml64VcpuDrain(ptVcpu, NULL);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+	return pml64_SetEnabled(FALSE);
+}
+
+NTSTATUS
+Pml64VcpuDrain(
+	_Inout_		PPML64_VCPU	ptVcpu,
+	_Out_opt_	PUINT32		pdwDrained
+)
+{
+	size_t cbIndex = 0;
+	UINT32 dwDrained = 0;
+
+	NT_ASSERT(NULL != ptVcpu);
+	NT_ASSERT(NULL != ptVcpu->pqwLog);
+
+	if (VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_GUEST_PML_INDEX, &cbIndex))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	// An untouched log is the common case for on-demand drains
+	if (PML64_LOG_INDEX_START != (cbIndex & MAXUINT16))
+	{
+		dwDrained = pml64_DrainLog(ptVcpu, cbIndex);
+		if (VMX_SUCCESS != __vmx_vmwrite(VMCS_FIELD_GUEST_PML_INDEX, PML64_LOG_INDEX_START))
+		{
+			return STATUS_UNSUCCESSFUL;
+		}
+	}
+
+	if (NULL != pdwDrained)
+	{
+		*pdwDrained = dwDrained;
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Pml64HandleFullExit(
+	_Inout_	PPML64_VCPU	ptVcpu
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	size_t cbQualification = 0;
+	size_t cbInterruptibility = 0;
+
+	NT_ASSERT(NULL != ptVcpu);
+
+	ptVcpu->qwFullExits++;
+	eStatus = Pml64VcpuDrain(ptVcpu, NULL);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+
+	if (VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_EXIT_QUALIFICATION, &cbQualification))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	if (0 == (cbQualification & PML64_EXIT_QUALIFICATION_NMI_UNBLOCKING))
+	{
+		return STATUS_SUCCESS;
+	}
+
+	// Vol 3C, 27.2.3 - the IRET that unblocked NMIs didn't complete
+	if ((VMX_SUCCESS != __vmx_vmread(VMCS_FIELD_GUEST_INTERRUPTIBILITY_INFO, &cbInterruptibility))
+		|| (VMX_SUCCESS != __vmx_vmwrite(VMCS_FIELD_GUEST_INTERRUPTIBILITY_INFO,
+			cbInterruptibility | PML64_INTERRUPTIBILITY_BLOCKING_BY_NMI)))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	return STATUS_SUCCESS;
+}
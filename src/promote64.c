@@ -0,0 +1,267 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		promote64.c
+* @section	Background promotion of split EPT tables back to large pages
+*/
+
+#include "promote64.h"
+
+// Levels of the hierarchy, numbered like the walk: PT = 1 ... PML4 = 4
+#define PROMOTE64_LEVEL_PD		2
+#define PROMOTE64_LEVEL_PDPT	3
+#define PROMOTE64_LEVEL_PML4	4
+
+// Shift of the guest-physical range covered by a single entry of a level
+#define PROMOTE64_LEVEL_SHIFT(dwLevel)	(PAGE_SHIFT_4KB + 9 * ((dwLevel) - 1))
+
+// Guest-physical address following the range of the entry of a level that maps an address
+#define PROMOTE64_NEXT_ENTRY(qwAddress, dwLevel) \
+	(((qwAddress) | ((1ULL << PROMOTE64_LEVEL_SHIFT(dwLevel)) - 1)) + 1)
+
+static
+__inline
+UINT64
+promote64_ReadEntry(
+	_In_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT64				qwTablePhysicalAddress,
+	_In_	UINT64				qwGuestPhysicalAddress,
+	_In_	UINT32				dwLevel
+)
+{
+	PUINT64 pqwTable = (PUINT64)ptEpt->tAllocator.pfnPhysToVirt(ptEpt->tAllocator.pvContext,
+		qwTablePhysicalAddress);
+
+	return *(volatile UINT64*)&pqwTable[
+		(qwGuestPhysicalAddress >> PROMOTE64_LEVEL_SHIFT(dwLevel)) & (PAGING64_PTE_COUNT - 1)];
+}
+
+/**
+* Check whether a table references a lower-level table, i.e. whether it has
+* anything to promote below it
+*/
+static
+BOOLEAN
+promote64_HasTables(
+	_In_	PEPT64_HIERARCHY	ptEpt,
+	_In_	UINT64				qwTablePhysicalAddress
+)
+{
+	PUINT64 pqwTable = (PUINT64)ptEpt->tAllocator.pfnPhysToVirt(ptEpt->tAllocator.pvContext,
+		qwTablePhysicalAddress);
+	UINT32 i = 0;
+
+	for (i = 0; i < PAGING64_PTE_COUNT; i++)
+	{
+		if (EPT_IS_TABLE(*(volatile UINT64*)&pqwTable[i]))
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/**
+* Try to promote a table to a large leaf, and account for the outcome
+* @param ptScanner - scanner
+* @param dwCpu - index of the current CPU
+* @param qwGuestPhysicalAddress - address mapped by the table
+* @param ePageType - size of the large leaf
+* @return STATUS_INSUFFICIENT_RESOURCES if the scan must stop, STATUS_SUCCESS otherwise
+*/
+static
+NTSTATUS
+promote64_TryMerge(
+	_Inout_	PPROMOTE64_EPT_SCANNER	ptScanner,
+	_In_	UINT32					dwCpu,
+	_In_	UINT64					qwGuestPhysicalAddress,
+	_In_	PAGE_TYPE64				ePageType
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+
+	eStatus = Ept64MergeTable(ptScanner->ptPool, dwCpu, qwGuestPhysicalAddress, ePageType);
+	if (STATUS_INSUFFICIENT_RESOURCES == eStatus)
+	{
+		return eStatus;
+	}
+
+	ptScanner->tStatistics.qwTablesExamined++;
+	if (NT_SUCCESS(eStatus))
+	{
+		if (PAGE_TYPE_1GB == ePageType)
+		{
+			ptScanner->tStatistics.qwPromoted1Gb++;
+		}
+		else
+		{
+			ptScanner->tStatistics.qwPromoted2Mb++;
+		}
+		ptScanner->tStatistics.qwTablesReclaimed++;
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+* Visit the entry at the cursor and move the cursor past it: a PML4E or PDPTE
+* that maps no table, a PDPT or page directory that references no table (the
+* directory is then promoted as a whole), or a single PDE, followed by its
+* directory once its last PDE was visited
+* @param ptScanner - scanner
+* @param dwCpu - index of the current CPU
+* @return STATUS_INSUFFICIENT_RESOURCES if the scan must stop, STATUS_SUCCESS otherwise
+*/
+static
+NTSTATUS
+promote64_Step(
+	_Inout_	PPROMOTE64_EPT_SCANNER	ptScanner,
+	_In_	UINT32					dwCpu
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	PEPT64_HIERARCHY ptEpt = ptScanner->ptPool->ptEpt;
+	UINT64 qwCursor = ptScanner->qwCursor;
+	UINT64 qwEntry = 0;
+
+	// Empty or large regions above the PDEs are skipped as a whole
+	qwEntry = promote64_ReadEntry(ptEpt, ptEpt->qwPml4PhysicalAddress, qwCursor,
+		PROMOTE64_LEVEL_PML4);
+	if (!EPT_IS_TABLE(qwEntry)
+		|| ((0 == (qwCursor & ((1ULL << PROMOTE64_LEVEL_SHIFT(PROMOTE64_LEVEL_PML4)) - 1)))
+			&& !promote64_HasTables(ptEpt, qwEntry & PAGING64_PHYS_ADDR_MASK)))
+	{
+		ptScanner->qwCursor = PROMOTE64_NEXT_ENTRY(qwCursor, PROMOTE64_LEVEL_PML4);
+		return STATUS_SUCCESS;
+	}
+	qwEntry = promote64_ReadEntry(ptEpt, qwEntry & PAGING64_PHYS_ADDR_MASK, qwCursor,
+		PROMOTE64_LEVEL_PDPT);
+	if (!EPT_IS_TABLE(qwEntry))
+	{
+		ptScanner->qwCursor = PROMOTE64_NEXT_ENTRY(qwCursor, PROMOTE64_LEVEL_PDPT);
+		return STATUS_SUCCESS;
+	}
+
+	// A directory of leaves only has no page table to visit, it may still become a 1GB leaf
+	if ((0 == (qwCursor & ((1ULL << PROMOTE64_LEVEL_SHIFT(PROMOTE64_LEVEL_PDPT)) - 1)))
+		&& !promote64_HasTables(ptEpt, qwEntry & PAGING64_PHYS_ADDR_MASK))
+	{
+		if (ptEpt->tCapabilities.support1gb)
+		{
+			eStatus = promote64_TryMerge(ptScanner, dwCpu, qwCursor, PAGE_TYPE_1GB);
+			if (!NT_SUCCESS(eStatus))
+			{
+				return eStatus;
+			}
+		}
+		ptScanner->qwCursor = PROMOTE64_NEXT_ENTRY(qwCursor, PROMOTE64_LEVEL_PDPT);
+		return STATUS_SUCCESS;
+	}
+
+	qwEntry = promote64_ReadEntry(ptEpt, qwEntry & PAGING64_PHYS_ADDR_MASK, qwCursor,
+		PROMOTE64_LEVEL_PD);
+	if (EPT_IS_TABLE(qwEntry) && ptEpt->tCapabilities.support2mb)
+	{
+		eStatus = promote64_TryMerge(ptScanner, dwCpu, qwCursor, PAGE_TYPE_2MB);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+	}
+
+	// Promoting the directory only pays off once all its page tables had their chance
+	qwCursor = PROMOTE64_NEXT_ENTRY(qwCursor, PROMOTE64_LEVEL_PD);
+	if ((0 == (qwCursor & ((1ULL << PROMOTE64_LEVEL_SHIFT(PROMOTE64_LEVEL_PDPT)) - 1)))
+		&& ptEpt->tCapabilities.support1gb)
+	{
+		eStatus = promote64_TryMerge(ptScanner, dwCpu,
+			qwCursor - (1ULL << PROMOTE64_LEVEL_SHIFT(PROMOTE64_LEVEL_PDPT)), PAGE_TYPE_1GB);
+		if (!NT_SUCCESS(eStatus))
+		{
+			// The last PDE is a leaf by now, resuming from it only retries the directory
+			return eStatus;
+		}
+	}
+
+	ptScanner->qwCursor = qwCursor;
+	return STATUS_SUCCESS;
+}
+
+VOID
+Promote64EptScannerInit(
+	_Out_	PPROMOTE64_EPT_SCANNER	ptScanner,
+	_In_	PEPT64_SPLIT_POOL		ptPool,
+	_In_	UINT32					dwTablesPerScan
+)
+{
+	NT_ASSERT(NULL != ptScanner);
+	NT_ASSERT(NULL != ptPool);
+	NT_ASSERT(0 != dwTablesPerScan);
+
+	RtlZeroMemory(ptScanner, sizeof(*ptScanner));
+	ptScanner->ptPool = ptPool;
+	ptScanner->dwTablesPerScan = dwTablesPerScan;
+}
+
+UINT32
+Promote64EptScan(
+	_Inout_	PPROMOTE64_EPT_SCANNER	ptScanner,
+	_In_	UINT32					dwCpu
+)
+{
+	UINT64 qwReclaimedBefore = 0;
+	UINT32 dwVisited = 0;
+
+	NT_ASSERT(NULL != ptScanner);
+
+	qwReclaimedBefore = ptScanner->tStatistics.qwTablesReclaimed;
+
+	// Every visit counts, leaves and empty entries too, so sparse or large
+	// mappings can't make a scan walk the whole guest-physical space
+	for (dwVisited = 0; dwVisited < ptScanner->dwTablesPerScan; dwVisited++)
+	{
+		if (!NT_SUCCESS(promote64_Step(ptScanner, dwCpu)))
+		{
+			break;
+		}
+		if (EPT64_GUEST_PHYSICAL_LIMIT <= ptScanner->qwCursor)
+		{
+			ptScanner->qwCursor = 0;
+			ptScanner->tStatistics.qwPasses++;
+			break;
+		}
+	}
+
+	return (UINT32)(ptScanner->tStatistics.qwTablesReclaimed - qwReclaimedBefore);
+}
+
+VOID
+Promote64EptGetStatistics(
+	_In_	PPROMOTE64_EPT_SCANNER	ptScanner,
+	_Out_	PPROMOTE64_STATISTICS	ptStatistics
+)
+{
+	NT_ASSERT(NULL != ptScanner);
+	NT_ASSERT(NULL != ptStatistics);
+
+	*ptStatistics = ptScanner->tStatistics;
+}
@@ -0,0 +1,467 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptarena64.c
+* @section	Page-aligned arena allocator for paging-structure tables
+*/
+
+#include "ptarena64.h"
+
+static
+__inline
+VOID
+ptarena_Lock(
+	_Inout_	PPTARENA	ptArena
+)
+{
+	while (0 != InterlockedCompareExchange(&ptArena->lLock, 1, 0))
+	{
+		YieldProcessor();
+	}
+}
+
+static
+__inline
+VOID
+ptarena_Unlock(
+	_Inout_	PPTARENA	ptArena
+)
+{
+	InterlockedExchange(&ptArena->lLock, 0);
+}
+
+static
+__inline
+UINT32
+ptarena_Hash(
+	_In_	UINT64	qwAddress
+)
+{
+	return (UINT32)(((qwAddress >> PTARENA_CHUNK_SHIFT) * 0x9E3779B97F4A7C15ULL)
+		>> (64 - PTARENA_HASH_SHIFT));
+}
+
+static
+VOID
+ptarena_IndexInsert(
+	_Inout_	PUINT16	pwIndex,
+	_In_	UINT64	qwAddress,
+	_In_	UINT16	wChunk
+)
+{
+	UINT32 dwSlot = ptarena_Hash(qwAddress);
+
+	while (0 != pwIndex[dwSlot])
+	{
+		dwSlot = (dwSlot + 1) & (PTARENA_HASH_SIZE - 1);
+	}
+	pwIndex[dwSlot] = wChunk + 1;
+}
+
+/**
+* Find the chunk containing an address
+* @param ptArena - arena to search
+* @param bVirtual - whether qwAddress is a virtual or a physical address
+* @param qwAddress - address to look for
+* @return The chunk, or NULL if no chunk contains the address
+*/
+static
+PPTARENA_CHUNK
+ptarena_IndexLookup(
+	_In_	PPTARENA	ptArena,
+	_In_	BOOLEAN		bVirtual,
+	_In_	UINT64		qwAddress
+)
+{
+	const UINT16* pwIndex = bVirtual ? ptArena->awVirtualIndex : ptArena->awPhysicalIndex;
+	PPTARENA_CHUNK ptChunk = NULL;
+	UINT64 qwBase = 0;
+	UINT32 dwSlot = ptarena_Hash(qwAddress);
+
+	while (0 != pwIndex[dwSlot])
+	{
+		ptChunk = &ptArena->atChunks[pwIndex[dwSlot] - 1];
+		qwBase = bVirtual ? (UINT64)ptChunk->pcVirtualAddress : ptChunk->qwPhysicalAddress;
+		if (qwAddress - qwBase < PTARENA_CHUNK_SIZE)
+		{
+			return ptChunk;
+		}
+		dwSlot = (dwSlot + 1) & (PTARENA_HASH_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+/**
+* Add a new chunk to the arena, must be called with the lock held
+* @param ptArena - arena to grow
+* @param dwCpu - CPU the chunk is allocated for
+* @return TRUE if a chunk was added
+*/
+static
+BOOLEAN
+ptarena_AddChunk(
+	_Inout_	PPTARENA	ptArena,
+	_In_	UINT32		dwCpu
+)
+{
+	PPTARENA_CHUNK ptChunk = NULL;
+	UINT16 wChunk = 0;
+	UINT64 qwVirtual = 0;
+
+	if (PTARENA_MAX_CHUNKS == ptArena->dwChunkCount)
+	{
+		return FALSE;
+	}
+
+	wChunk = (UINT16)ptArena->dwChunkCount;
+	ptChunk = &ptArena->atChunks[wChunk];
+	ptChunk->pcVirtualAddress = (PUINT8)ptArena->tBackend.pfnAllocChunk(ptArena->tBackend.pvContext,
+		PTARENA_CHUNK_SIZE, dwCpu, &ptChunk->qwPhysicalAddress);
+	if (NULL == ptChunk->pcVirtualAddress)
+	{
+		return FALSE;
+	}
+
+	// A chunk that isn't 2MB aligned spans two slots, so index both of them
+	qwVirtual = (UINT64)ptChunk->pcVirtualAddress;
+	ptarena_IndexInsert(ptArena->awVirtualIndex, qwVirtual, wChunk);
+	if (0 != BYTE_OFFSET_2MB(qwVirtual))
+	{
+		ptarena_IndexInsert(ptArena->awVirtualIndex, qwVirtual + PTARENA_CHUNK_SIZE - 1, wChunk);
+	}
+	ptarena_IndexInsert(ptArena->awPhysicalIndex, ptChunk->qwPhysicalAddress, wChunk);
+	if (0 != BYTE_OFFSET_2MB(ptChunk->qwPhysicalAddress))
+	{
+		ptarena_IndexInsert(ptArena->awPhysicalIndex,
+			ptChunk->qwPhysicalAddress + PTARENA_CHUNK_SIZE - 1, wChunk);
+	}
+
+	ptArena->dwChunkCount++;
+	ptArena->dwNextUnusedPage = 0;
+	return TRUE;
+}
+
+/**
+* Take a free page from the shared free list, growing the arena if needed.
+* Must be called with the lock held.
+* @param ptArena - arena to take the page from
+* @param dwCpu - index of the CPU the page is for
+* @return The page, or NULL if the arena can't grow
+*/
+static
+PVOID
+ptarena_TakeSharedPage(
+	_Inout_	PPTARENA	ptArena,
+	_In_	UINT32		dwCpu
+)
+{
+	PVOID pvPage = NULL;
+	PPTARENA_CHUNK ptChunk = NULL;
+
+	for (;;)
+	{
+		if (NULL != ptArena->pvFreeList)
+		{
+			pvPage = ptArena->pvFreeList;
+			ptArena->pvFreeList = *(PVOID*)pvPage;
+			ptArena->dwFreeCount--;
+			return pvPage;
+		}
+		if ((0 != ptArena->dwChunkCount) && (ptArena->dwNextUnusedPage < PTARENA_PAGES_PER_CHUNK))
+		{
+			ptChunk = &ptArena->atChunks[ptArena->dwChunkCount - 1];
+			pvPage = ptChunk->pcVirtualAddress + ((SIZE_T)ptArena->dwNextUnusedPage * PAGE_SIZE_4KB);
+			ptArena->dwNextUnusedPage++;
+			return pvPage;
+		}
+		if (!ptarena_AddChunk(ptArena, dwCpu))
+		{
+			return NULL;
+		}
+	}
+}
+
+/**
+* Move a batch of free pages to a CPU's free list, growing the arena if needed
+* @param ptArena - arena to take the pages from
+* @param ptCache - free list of the CPU
+* @param dwCpu - index of the CPU
+*/
+static
+VOID
+ptarena_RefillCache(
+	_Inout_	PPTARENA			ptArena,
+	_Inout_	PPTARENA_CPU_CACHE	ptCache,
+	_In_	UINT32				dwCpu
+)
+{
+	PVOID pvPage = NULL;
+
+	ptarena_Lock(ptArena);
+	while (ptCache->dwCount < PTARENA_CPU_BATCH)
+	{
+		pvPage = ptarena_TakeSharedPage(ptArena, dwCpu);
+		if (NULL == pvPage)
+		{
+			break;
+		}
+		*(PVOID*)pvPage = ptCache->pvFreeList;
+		ptCache->pvFreeList = pvPage;
+		ptCache->dwCount++;
+	}
+	ptarena_Unlock(ptArena);
+}
+
+/**
+* Move a batch of free pages from a CPU's free list to the shared free list
+* @param ptArena - arena that owns the pages
+* @param ptCache - free list of the CPU
+*/
+static
+VOID
+ptarena_DrainCache(
+	_Inout_	PPTARENA			ptArena,
+	_Inout_	PPTARENA_CPU_CACHE	ptCache
+)
+{
+	PVOID pvFirst = ptCache->pvFreeList;
+	PVOID pvLast = pvFirst;
+	UINT32 i = 0;
+
+	// Unlink the batch without the lock, then splice it in with a single update
+	for (i = 1; i < PTARENA_CPU_BATCH; i++)
+	{
+		pvLast = *(PVOID*)pvLast;
+	}
+	ptCache->pvFreeList = *(PVOID*)pvLast;
+	ptCache->dwCount -= PTARENA_CPU_BATCH;
+
+	ptarena_Lock(ptArena);
+	*(PVOID*)pvLast = ptArena->pvFreeList;
+	ptArena->pvFreeList = pvFirst;
+	ptArena->dwFreeCount += PTARENA_CPU_BATCH;
+	ptarena_Unlock(ptArena);
+}
+
+VOID
+PtArenaInit(
+	_Out_	PPTARENA			ptArena,
+	_In_	PPTARENA_BACKEND	ptBackend
+)
+{
+	NT_ASSERT(NULL != ptArena);
+	NT_ASSERT(NULL != ptBackend);
+
+	RtlZeroMemory(ptArena, sizeof(*ptArena));
+	ptArena->tBackend = *ptBackend;
+}
+
+PVOID
+PtArenaAllocTable(
+	_Inout_	PPTARENA	ptArena,
+	_Out_	PUINT64		pqwPhysicalAddress
+)
+{
+	PPTARENA_CPU_CACHE ptCache = NULL;
+	UINT32 dwCpu = 0;
+	PVOID pvPage = NULL;
+
+	NT_ASSERT(NULL != ptArena);
+	NT_ASSERT(NULL != pqwPhysicalAddress);
+
+	// CPUs beyond the caches share the locked list rather than another CPU's cache
+	dwCpu = ptArena->tBackend.pfnCurrentCpu(ptArena->tBackend.pvContext);
+	if (PTARENA_MAX_CPUS <= dwCpu)
+	{
+		ptarena_Lock(ptArena);
+		pvPage = ptarena_TakeSharedPage(ptArena, dwCpu);
+		ptarena_Unlock(ptArena);
+		if (NULL == pvPage)
+		{
+			*pqwPhysicalAddress = 0;
+			return NULL;
+		}
+	}
+	else
+	{
+		ptCache = &ptArena->atCpuCaches[dwCpu];
+		if (0 == ptCache->dwCount)
+		{
+			ptarena_RefillCache(ptArena, ptCache, dwCpu);
+			if (0 == ptCache->dwCount)
+			{
+				*pqwPhysicalAddress = 0;
+				return NULL;
+			}
+		}
+
+		pvPage = ptCache->pvFreeList;
+		ptCache->pvFreeList = *(PVOID*)pvPage;
+		ptCache->dwCount--;
+	}
+	InterlockedIncrement64(&ptArena->qwPagesInUse);
+
+	RtlZeroMemory(pvPage, PAGE_SIZE_4KB);
+	*pqwPhysicalAddress = PtArenaVirtToPhys(ptArena, pvPage);
+	return pvPage;
+}
+
+VOID
+PtArenaFreeTable(
+	_Inout_	PPTARENA	ptArena,
+	_In_	PVOID		pvTable
+)
+{
+	PPTARENA_CPU_CACHE ptCache = NULL;
+	UINT32 dwCpu = 0;
+
+	NT_ASSERT(NULL != ptArena);
+	NT_ASSERT(NULL != pvTable);
+	NT_ASSERT(0 == BYTE_OFFSET_4KB(pvTable));
+
+	InterlockedDecrement64(&ptArena->qwPagesInUse);
+	dwCpu = ptArena->tBackend.pfnCurrentCpu(ptArena->tBackend.pvContext);
+	if (PTARENA_MAX_CPUS <= dwCpu)
+	{
+		ptarena_Lock(ptArena);
+		*(PVOID*)pvTable = ptArena->pvFreeList;
+		ptArena->pvFreeList = pvTable;
+		ptArena->dwFreeCount++;
+		ptarena_Unlock(ptArena);
+		return;
+	}
+
+	ptCache = &ptArena->atCpuCaches[dwCpu];
+	*(PVOID*)pvTable = ptCache->pvFreeList;
+	ptCache->pvFreeList = pvTable;
+	ptCache->dwCount++;
+
+	if (ptCache->dwCount > PTARENA_CPU_LIMIT)
+	{
+		ptarena_DrainCache(ptArena, ptCache);
+	}
+}
+
+UINT64
+PtArenaVirtToPhys(
+	_In_	PPTARENA	ptArena,
+	_In_	PVOID		pvAddress
+)
+{
+	PPTARENA_CHUNK ptChunk = NULL;
+
+	NT_ASSERT(NULL != ptArena);
+
+	ptChunk = ptarena_IndexLookup(ptArena, TRUE, (UINT64)pvAddress);
+	if (NULL == ptChunk)
+	{
+		return 0;
+	}
+	return ptChunk->qwPhysicalAddress + ((PUINT8)pvAddress - ptChunk->pcVirtualAddress);
+}
+
+PVOID
+PtArenaPhysToVirt(
+	_In_	PPTARENA	ptArena,
+	_In_	UINT64		qwPhysicalAddress
+)
+{
+	PPTARENA_CHUNK ptChunk = NULL;
+
+	NT_ASSERT(NULL != ptArena);
+
+	ptChunk = ptarena_IndexLookup(ptArena, FALSE, qwPhysicalAddress);
+	if (NULL == ptChunk)
+	{
+		return NULL;
+	}
+	return ptChunk->pcVirtualAddress + (qwPhysicalAddress - ptChunk->qwPhysicalAddress);
+}
+
+VOID
+PtArenaReleaseAll(
+	_Inout_ PPTARENA ptArena
+)
+{
+	PTARENA_BACKEND tBackend = { 0 };
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptArena);
+
+	tBackend = ptArena->tBackend;
+	for (i = 0; i < ptArena->dwChunkCount; i++)
+	{
+		tBackend.pfnFreeChunk(tBackend.pvContext, ptArena->atChunks[i].pcVirtualAddress,
+			PTARENA_CHUNK_SIZE);
+	}
+
+	PtArenaInit(ptArena, &tBackend);
+}
+
+static
+PVOID
+ptarena_AllocatorAlloc(
+	_In_opt_	PVOID	pvContext,
+	_Out_		PUINT64	pqwPhysicalAddress
+)
+{
+	return PtArenaAllocTable((PPTARENA)pvContext, pqwPhysicalAddress);
+}
+
+static
+VOID
+ptarena_AllocatorFree(
+	_In_opt_	PVOID	pvContext,
+	_In_		PVOID	pvTable,
+	_In_		UINT64	qwPhysicalAddress
+)
+{
+	UNREFERENCED_PARAMETER(qwPhysicalAddress);
+	PtArenaFreeTable((PPTARENA)pvContext, pvTable);
+}
+
+static
+PVOID
+ptarena_AllocatorPhysToVirt(
+	_In_opt_	PVOID	pvContext,
+	_In_		UINT64	qwPhysicalAddress
+)
+{
+	return PtArenaPhysToVirt((PPTARENA)pvContext, qwPhysicalAddress);
+}
+
+VOID
+PtArenaGetAllocator(
+	_In_	PPTARENA					ptArena,
+	_Out_	PPAGING64_TABLE_ALLOCATOR	ptAllocator
+)
+{
+	NT_ASSERT(NULL != ptArena);
+	NT_ASSERT(NULL != ptAllocator);
+
+	ptAllocator->pfnAllocTable = ptarena_AllocatorAlloc;
+	ptAllocator->pfnFreeTable = ptarena_AllocatorFree;
+	ptAllocator->pfnPhysToVirt = ptarena_AllocatorPhysToVirt;
+	ptAllocator->pvContext = ptArena;
+}
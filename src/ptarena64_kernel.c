@@ -0,0 +1,106 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptarena64_kernel.c
+* @section	Kernel backend of the paging-structure arena.
+*			Kept in its own file so user-mode builds can leave it out.
+*/
+
+#include "ptarena64.h"
+
+static
+PVOID
+ptarena_KernelAllocChunk(
+	_In_opt_	PVOID	pvContext,
+	_In_		SIZE_T	cbSize,
+	_In_		UINT32	dwCpu,
+	_Out_		PUINT64	pqwPhysicalAddress
+)
+{
+	PHYSICAL_ADDRESS tLowest = { 0 };
+	PHYSICAL_ADDRESS tHighest = { 0 };
+	PHYSICAL_ADDRESS tBoundary = { 0 };
+	PROCESSOR_NUMBER tProcessor = { 0 };
+	USHORT wNode = 0;
+	PVOID pvChunk = NULL;
+
+	UNREFERENCED_PARAMETER(pvContext);
+
+	// Keep the tables on the NUMA node of the CPU that walks them
+	if (NT_SUCCESS(KeGetProcessorNumberFromIndex(dwCpu, &tProcessor)))
+	{
+		KeQueryNodeForProcessor(&tProcessor, &wNode);
+	}
+
+	// A boundary of the chunk size forces the chunk to be naturally aligned
+	tHighest.QuadPart = MAXLONG64;
+	tBoundary.QuadPart = cbSize;
+	pvChunk = MmAllocateContiguousMemorySpecifyCacheNode(cbSize, tLowest, tHighest, tBoundary,
+		MmCached, wNode);
+	if (NULL == pvChunk)
+	{
+		*pqwPhysicalAddress = 0;
+		return NULL;
+	}
+
+	*pqwPhysicalAddress = (UINT64)MmGetPhysicalAddress(pvChunk).QuadPart;
+	return pvChunk;
+}
+
+static
+VOID
+ptarena_KernelFreeChunk(
+	_In_opt_	PVOID	pvContext,
+	_In_		PVOID	pvChunk,
+	_In_		SIZE_T	cbSize
+)
+{
+	UNREFERENCED_PARAMETER(pvContext);
+	UNREFERENCED_PARAMETER(cbSize);
+
+	MmFreeContiguousMemory(pvChunk);
+}
+
+static
+UINT32
+ptarena_KernelCurrentCpu(
+	_In_opt_	PVOID	pvContext
+)
+{
+	UNREFERENCED_PARAMETER(pvContext);
+
+	return KeGetCurrentProcessorNumberEx(NULL);
+}
+
+VOID
+PtArenaGetKernelBackend(
+	_Out_ PPTARENA_BACKEND ptBackend
+)
+{
+	NT_ASSERT(NULL != ptBackend);
+
+	ptBackend->pfnAllocChunk = ptarena_KernelAllocChunk;
+	ptBackend->pfnFreeChunk = ptarena_KernelFreeChunk;
+	ptBackend->pfnCurrentCpu = ptarena_KernelCurrentCpu;
+	ptBackend->pvContext = NULL;
+}
@@ -0,0 +1,116 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptarena64_user.c
+* @section	User-mode backend of the paging-structure arena, to run and benchmark it
+*			outside the kernel. Kept in its own file so kernel builds can leave it out.
+*/
+
+#include <sys/mman.h>
+
+#include "ptarena64.h"
+
+// Threads get consecutive indexes, which stand for CPU numbers
+static volatile LONG g_lNextThreadIndex = 0;
+static __thread LONG g_lThreadIndex = -1;
+
+static
+PVOID
+ptarena_UserAllocChunk(
+	_In_opt_	PVOID	pvContext,
+	_In_		SIZE_T	cbSize,
+	_In_		UINT32	dwCpu,
+	_Out_		PUINT64	pqwPhysicalAddress
+)
+{
+	PUINT8 pcMapping = NULL;
+	PUINT8 pcChunk = NULL;
+	SIZE_T cbHead = 0;
+
+	UNREFERENCED_PARAMETER(pvContext);
+	UNREFERENCED_PARAMETER(dwCpu);
+
+	*pqwPhysicalAddress = 0;
+
+	// Map twice the size and trim it so the chunk is naturally aligned
+	pcMapping = (PUINT8)mmap(NULL, 2 * cbSize, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == (PVOID)pcMapping)
+	{
+		return NULL;
+	}
+	pcChunk = (PUINT8)(((UINT64)pcMapping + cbSize - 1) & ~((UINT64)cbSize - 1));
+	cbHead = (SIZE_T)(pcChunk - pcMapping);
+	if (0 != cbHead)
+	{
+		munmap(pcMapping, cbHead);
+	}
+	munmap(pcChunk + cbSize, cbSize - cbHead);
+	(VOID)madvise(pcChunk, cbSize, MADV_HUGEPAGE);
+
+	// There are no physical addresses in user mode, the identity keeps the
+	// arena's lookups and the tables' addr fields consistent
+	*pqwPhysicalAddress = (UINT64)pcChunk;
+	return pcChunk;
+}
+
+static
+VOID
+ptarena_UserFreeChunk(
+	_In_opt_	PVOID	pvContext,
+	_In_		PVOID	pvChunk,
+	_In_		SIZE_T	cbSize
+)
+{
+	UNREFERENCED_PARAMETER(pvContext);
+
+	munmap(pvChunk, cbSize);
+}
+
+static
+UINT32
+ptarena_UserCurrentCpu(
+	_In_opt_	PVOID	pvContext
+)
+{
+	UNREFERENCED_PARAMETER(pvContext);
+
+	if (0 > g_lThreadIndex)
+	{
+		g_lThreadIndex = InterlockedIncrement(&g_lNextThreadIndex) - 1;
+	}
+	return (UINT32)g_lThreadIndex;
+}
+
+VOID
+PtArenaGetUserBackend(
+	_Out_ PPTARENA_BACKEND ptBackend
+)
+{
+	NT_ASSERT(NULL != ptBackend);
+
+	ptBackend->pfnAllocChunk = ptarena_UserAllocChunk;
+	ptBackend->pfnFreeChunk = ptarena_UserFreeChunk;
+	ptBackend->pfnCurrentCpu = ptarena_UserCurrentCpu;
+	ptBackend->pvContext = NULL;
+}
@@ -0,0 +1,351 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptscan64.c
+* @section	Parallel scan of whole IA-32e address spaces
+*/
+
+#include "ptscan64.h"
+
+// Linear addresses of the scan are built without their sign extension
+#define PTSCAN64_SIGN_EXTEND(Va)	\
+	((0 != ((Va) & (1ULL << 47))) ? ((Va) | 0xFFFF000000000000ULL) : (Va))
+
+static
+const UINT64*
+ptscan64_ReadTable(
+	_Inout_	PPTSCAN64_WORKER	ptWorker,
+	_In_	UINT64				qwEntry
+)
+{
+	const UINT64* pqwTable = NULL;
+
+	pqwTable = (const UINT64*)ptWorker->ptScan->pfnReadTable(ptWorker->pvReaderContext,
+		qwEntry & PAGING64_PHYS_ADDR_MASK);
+	if (NULL == pqwTable)
+	{
+		ptWorker->tStats.qwReadFailures++;
+	}
+	else
+	{
+		ptWorker->tStats.qwTablesRead++;
+	}
+	return pqwTable;
+}
+
+/**
+* Account for a leaf and pass it to the visitor
+* @param ptWorker - worker that found the leaf
+* @param qwVa - linear address mapped by the leaf, without sign extension
+* @param qwEntry - the leaf
+* @param ePageType - size of the page mapped by the leaf
+* @param dwUpperProtection - PTSCAN64_PROT_* accumulated over the upper levels
+* @return FALSE if the visitor stopped the scan
+*/
+static
+BOOLEAN
+ptscan64_VisitLeaf(
+	_Inout_	PPTSCAN64_WORKER	ptWorker,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwEntry,
+	_In_	PAGE_TYPE64			ePageType,
+	_In_	UINT32				dwUpperProtection
+)
+{
+	PPTSCAN64 ptScan = ptWorker->ptScan;
+	PAGING64_TRANSLATION tLeaf = { 0 };
+	UINT32 dwProtection = 0;
+
+	// rw and us must be set on every level, xd on any level
+	dwProtection = dwUpperProtection
+		& ((UINT32)FIELD64_GET(qwEntry, PTE64_RW) * PTSCAN64_PROT_RW
+			| (UINT32)FIELD64_GET(qwEntry, PTE64_US) * PTSCAN64_PROT_US
+			| PTSCAN64_PROT_XD);
+	dwProtection |= (UINT32)FIELD64_GET(qwEntry, PTE64_XD) * PTSCAN64_PROT_XD;
+
+	ptWorker->tStats.aqwLeafCount[ePageType]++;
+	ptWorker->tStats.aqwProtectionCount[dwProtection]++;
+	ptWorker->tStats.qwMappedBytes += PAGE_TYPE64_SIZE(ePageType);
+
+	if (NULL == ptScan->pfnVisitLeaf)
+	{
+		return TRUE;
+	}
+
+	tLeaf.qwPhysicalAddress = qwEntry & PAGING64_PHYS_ADDR_MASK
+		& ~(PAGE_TYPE64_SIZE(ePageType) - 1);
+	tLeaf.qwLeafEntry = qwEntry;
+	tLeaf.ePageType = ePageType;
+	tLeaf.bWritable = (0 != (dwProtection & PTSCAN64_PROT_RW));
+	tLeaf.bUser = (0 != (dwProtection & PTSCAN64_PROT_US));
+	tLeaf.bExecuteDisable = (0 != (dwProtection & PTSCAN64_PROT_XD));
+	if (ptScan->pfnVisitLeaf(ptScan->pvVisitContext, ptWorker->dwIndex,
+		PTSCAN64_SIGN_EXTEND(qwVa), &tLeaf))
+	{
+		return TRUE;
+	}
+
+	InterlockedExchange(&ptScan->lAbort, 1);
+	return FALSE;
+}
+
+/**
+* Accumulate the rights of a non-leaf entry on top of the upper levels'
+*/
+static
+__inline
+UINT32
+ptscan64_TableProtection(
+	_In_	UINT64	qwEntry,
+	_In_	UINT32	dwUpperProtection
+)
+{
+	UINT32 dwProtection = dwUpperProtection
+		& ((UINT32)FIELD64_GET(qwEntry, PDE64_RW) * PTSCAN64_PROT_RW
+			| (UINT32)FIELD64_GET(qwEntry, PDE64_US) * PTSCAN64_PROT_US
+			| PTSCAN64_PROT_XD);
+
+	return dwProtection | (UINT32)FIELD64_GET(qwEntry, PDE64_XD) * PTSCAN64_PROT_XD;
+}
+
+/**
+* Scan the leaves below a PDPTE
+* @return FALSE if the scan was stopped
+*/
+static
+BOOLEAN
+ptscan64_ScanPdpte(
+	_Inout_	PPTSCAN64_WORKER	ptWorker,
+	_In_	UINT64				qwVa,
+	_In_	UINT64				qwPdpte,
+	_In_	UINT32				dwProtection
+)
+{
+	const UINT64* pqwTable = NULL;
+	UINT64 qwPde = 0;
+	UINT64 qwPdeVa = 0;
+	UINT32 dwPdeProtection = 0;
+	UINT32 i = 0;
+	UINT32 j = 0;
+
+	if (PAGING64_IS_LEAF(qwPdpte))
+	{
+		return ptscan64_VisitLeaf(ptWorker, qwVa, qwPdpte, PAGE_TYPE_1GB, dwProtection);
+	}
+	dwProtection = ptscan64_TableProtection(qwPdpte, dwProtection);
+
+	// Reading a page table invalidates the directory, so walk a copy of it
+	pqwTable = ptscan64_ReadTable(ptWorker, qwPdpte);
+	if (NULL == pqwTable)
+	{
+		return TRUE;
+	}
+	RtlCopyMemory(ptWorker->aqwPd, pqwTable, sizeof(ptWorker->aqwPd));
+
+	for (i = 0; i < PAGING64_PDE_COUNT; i++)
+	{
+		qwPde = ptWorker->aqwPd[i];
+		if (0 == (qwPde & PAGING64_ENTRY_PRESENT))
+		{
+			continue;
+		}
+		if (0 != ptWorker->ptScan->lAbort)
+		{
+			return FALSE;
+		}
+
+		qwPdeVa = qwVa + ((UINT64)i << PAGE_SHIFT_2MB);
+		if (PAGING64_IS_LEAF(qwPde))
+		{
+			if (!ptscan64_VisitLeaf(ptWorker, qwPdeVa, qwPde, PAGE_TYPE_2MB, dwProtection))
+			{
+				return FALSE;
+			}
+			continue;
+		}
+
+		dwPdeProtection = ptscan64_TableProtection(qwPde, dwProtection);
+		pqwTable = ptscan64_ReadTable(ptWorker, qwPde);
+		if (NULL == pqwTable)
+		{
+			continue;
+		}
+		for (j = 0; j < PAGING64_PTE_COUNT; j++)
+		{
+			if ((0 != (pqwTable[j] & PAGING64_ENTRY_PRESENT))
+				&& !ptscan64_VisitLeaf(ptWorker, qwPdeVa + ((UINT64)j << PAGE_SHIFT_4KB),
+					pqwTable[j], PAGE_TYPE_4KB, dwPdeProtection))
+			{
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+NTSTATUS
+PtScan64Init(
+	_Out_						PPTSCAN64				ptScan,
+	_In_						PFN_PAGING64_READ_TABLE	pfnReadTable,
+	_In_reads_(dwWorkerCount)	PVOID*					ppvReaderContexts,
+	_In_						UINT32					dwWorkerCount,
+	_In_						CR3_REG					tCr3,
+	_In_opt_					PFN_PTSCAN64_VISIT_LEAF	pfnVisitLeaf,
+	_In_opt_					PVOID					pvVisitContext
+)
+{
+	const UINT64* pqwPml4 = NULL;
+	UINT32 dwPresentCount = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptScan);
+	NT_ASSERT(NULL != pfnReadTable);
+	NT_ASSERT(NULL != ppvReaderContexts);
+
+	if ((0 == dwWorkerCount) || (PTSCAN64_MAX_WORKERS < dwWorkerCount))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	RtlZeroMemory(ptScan, sizeof(*ptScan));
+	ptScan->pfnReadTable = pfnReadTable;
+	ptScan->pfnVisitLeaf = pfnVisitLeaf;
+	ptScan->pvVisitContext = pvVisitContext;
+	ptScan->dwWorkerCount = dwWorkerCount;
+	for (i = 0; i < dwWorkerCount; i++)
+	{
+		ptScan->atWorkers[i].ptScan = ptScan;
+		ptScan->atWorkers[i].dwIndex = i;
+		ptScan->atWorkers[i].pvReaderContext = ppvReaderContexts[i];
+	}
+
+	pqwPml4 = ptscan64_ReadTable(&ptScan->atWorkers[0], tCr3.qwValue);
+	if (NULL == pqwPml4)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+	RtlCopyMemory(ptScan->aqwPml4, pqwPml4, sizeof(ptScan->aqwPml4));
+
+	// Only present PML4Es are split into items, empty 512GB regions cost nothing
+	for (i = 0; i < PAGING64_PML4E_COUNT; i++)
+	{
+		if (0 != (ptScan->aqwPml4[i] & PAGING64_ENTRY_PRESENT))
+		{
+			ptScan->awPresentPml4e[dwPresentCount++] = (UINT16)i;
+		}
+	}
+	ptScan->dwItemCount = dwPresentCount * PTSCAN64_ITEMS_PER_PML4E;
+	return STATUS_SUCCESS;
+}
+
+VOID
+PtScan64Work(
+	_Inout_	PPTSCAN64	ptScan,
+	_In_	UINT32		dwWorker
+)
+{
+	PPTSCAN64_WORKER ptWorker = NULL;
+	UINT64 aqwPdptes[PTSCAN64_ITEM_PDPTES] = { 0 };
+	const UINT64* pqwPdpt = NULL;
+	UINT64 qwPml4e = 0;
+	UINT64 qwVa = 0;
+	UINT32 dwPml4Index = 0;
+	UINT32 dwFirstPdpte = 0;
+	UINT32 dwProtection = 0;
+	UINT32 dwItem = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptScan);
+	NT_ASSERT(dwWorker < ptScan->dwWorkerCount);
+	ptWorker = &ptScan->atWorkers[dwWorker];
+
+	for (;;)
+	{
+		dwItem = (UINT32)InterlockedIncrement(&ptScan->lNextItem) - 1;
+		if ((dwItem >= ptScan->dwItemCount) || (0 != ptScan->lAbort))
+		{
+			break;
+		}
+
+		dwPml4Index = ptScan->awPresentPml4e[dwItem / PTSCAN64_ITEMS_PER_PML4E];
+		dwFirstPdpte = (dwItem % PTSCAN64_ITEMS_PER_PML4E) * PTSCAN64_ITEM_PDPTES;
+		qwPml4e = ptScan->aqwPml4[dwPml4Index];
+		dwProtection = ptscan64_TableProtection(qwPml4e,
+			PTSCAN64_PROT_RW | PTSCAN64_PROT_US);
+
+		// The item's PDPTEs are copied since walking below them reuses the reader
+		pqwPdpt = ptscan64_ReadTable(ptWorker, qwPml4e);
+		if (NULL == pqwPdpt)
+		{
+			continue;
+		}
+		RtlCopyMemory(aqwPdptes, &pqwPdpt[dwFirstPdpte], sizeof(aqwPdptes));
+
+		for (i = 0; i < PTSCAN64_ITEM_PDPTES; i++)
+		{
+			if (0 == (aqwPdptes[i] & PAGING64_ENTRY_PRESENT))
+			{
+				continue;
+			}
+			qwVa = ((UINT64)dwPml4Index << 39) | ((UINT64)(dwFirstPdpte + i) << PAGE_SHIFT_1GB);
+			if (!ptscan64_ScanPdpte(ptWorker, qwVa, aqwPdptes[i], dwProtection))
+			{
+				return;
+			}
+		}
+	}
+}
+
+NTSTATUS
+PtScan64GetStats(
+	_In_	PPTSCAN64		ptScan,
+	_Out_	PPTSCAN64_STATS	ptStats
+)
+{
+	PPTSCAN64_STATS ptWorkerStats = NULL;
+	UINT32 i = 0;
+	UINT32 j = 0;
+
+	NT_ASSERT(NULL != ptScan);
+	NT_ASSERT(NULL != ptStats);
+
+	RtlZeroMemory(ptStats, sizeof(*ptStats));
+	for (i = 0; i < ptScan->dwWorkerCount; i++)
+	{
+		ptWorkerStats = &ptScan->atWorkers[i].tStats;
+		for (j = 0; j < PAGE_TYPES_COUNT; j++)
+		{
+			ptStats->aqwLeafCount[j] += ptWorkerStats->aqwLeafCount[j];
+		}
+		for (j = 0; j < PTSCAN64_PROT_COUNT; j++)
+		{
+			ptStats->aqwProtectionCount[j] += ptWorkerStats->aqwProtectionCount[j];
+		}
+		ptStats->qwMappedBytes += ptWorkerStats->qwMappedBytes;
+		ptStats->qwTablesRead += ptWorkerStats->qwTablesRead;
+		ptStats->qwReadFailures += ptWorkerStats->qwReadFailures;
+	}
+
+	return (0 != ptScan->lAbort) ? STATUS_CANCELLED : STATUS_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptscan64_kernel.c
+* @section	Kernel threads running the parallel address space scan.
+*			Kept in its own file so user-mode builds can leave it out.
+*/
+
+#include "ptscan64.h"
+
+static
+VOID
+ptscan64_KernelThread(
+	_In_	PVOID	pvContext
+)
+{
+	PPTSCAN64_WORKER ptWorker = (PPTSCAN64_WORKER)pvContext;
+
+	PtScan64Work(ptWorker->ptScan, ptWorker->dwIndex);
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS
+PtScan64RunKernelThreads(
+	_Inout_	PPTSCAN64	ptScan
+)
+{
+	HANDLE ahThreads[PTSCAN64_MAX_WORKERS] = { 0 };
+	OBJECT_ATTRIBUTES tAttributes = { 0 };
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptScan);
+
+	InitializeObjectAttributes(&tAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+	for (i = 1; i < ptScan->dwWorkerCount; i++)
+	{
+		// Items are claimed from a shared cursor, so a missing worker only costs parallelism
+		if (!NT_SUCCESS(PsCreateSystemThread(&ahThreads[i], THREAD_ALL_ACCESS, &tAttributes,
+			NULL, NULL, ptscan64_KernelThread, &ptScan->atWorkers[i])))
+		{
+			ahThreads[i] = NULL;
+		}
+	}
+
+	PtScan64Work(ptScan, 0);
+
+	for (i = 1; i < ptScan->dwWorkerCount; i++)
+	{
+		if (NULL != ahThreads[i])
+		{
+			ZwWaitForSingleObject(ahThreads[i], FALSE, NULL);
+			ZwClose(ahThreads[i]);
+		}
+	}
+
+	return (0 != ptScan->lAbort) ? STATUS_CANCELLED : STATUS_SUCCESS;
+}
@@ -0,0 +1,167 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptscan64_user.c
+* @section	User-mode image files and threads for the parallel address space scan.
+*			Kept in its own file so kernel builds can leave it out.
+*/
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ptscan64.h"
+
+NTSTATUS
+PtScan64OpenImageFile(
+	_Out_	PPTSCAN64_IMAGE	ptImage,
+	_In_	const CHAR*		pszPath
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	struct stat tStat = { 0 };
+	PVOID pvBase = NULL;
+	INT32 iFd = -1;
+
+	NT_ASSERT(NULL != ptImage);
+	NT_ASSERT(NULL != pszPath);
+
+	RtlZeroMemory(ptImage, sizeof(*ptImage));
+
+	iFd = open(pszPath, O_RDONLY);
+	if (0 > iFd)
+	{
+		return STATUS_NOT_FOUND;
+	}
+	if ((0 != fstat(iFd, &tStat)) || (0 == tStat.st_size))
+	{
+		close(iFd);
+		return STATUS_NOT_FOUND;
+	}
+
+	// The mapping keeps the file referenced, tables are read straight from it
+	pvBase = mmap(NULL, (SIZE_T)tStat.st_size, PROT_READ, MAP_SHARED, iFd, 0);
+	close(iFd);
+	if (MAP_FAILED == pvBase)
+	{
+		return STATUS_NOT_FOUND;
+	}
+	ptImage->pcBase = (const UINT8*)pvBase;
+	ptImage->cbSize = (UINT64)tStat.st_size;
+
+	if ((sizeof(UINT64) <= ptImage->cbSize) && (PTSNAP64_MAGIC == *(const UINT64*)pvBase))
+	{
+		eStatus = PtSnap64OpenReader(&ptImage->tSnapshot, pvBase, ptImage->cbSize);
+		if (!NT_SUCCESS(eStatus))
+		{
+			PtScan64CloseImageFile(ptImage);
+			return eStatus;
+		}
+		ptImage->bSnapshot = TRUE;
+		ptImage->tCr3 = ptImage->tSnapshot.ptHeader->tCr3;
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID
+PtScan64CloseImageFile(
+	_Inout_	PPTSCAN64_IMAGE	ptImage
+)
+{
+	NT_ASSERT(NULL != ptImage);
+
+	if (NULL != ptImage->pcBase)
+	{
+		munmap((PVOID)ptImage->pcBase, (SIZE_T)ptImage->cbSize);
+	}
+	RtlZeroMemory(ptImage, sizeof(*ptImage));
+}
+
+const VOID*
+PtScan64ReadImageTable(
+	_In_opt_	PVOID	pvContext,
+	_In_		UINT64	qwTablePhysicalAddress
+)
+{
+	PPTSCAN64_IMAGE ptImage = (PPTSCAN64_IMAGE)pvContext;
+
+	NT_ASSERT(NULL != ptImage);
+
+	if (ptImage->bSnapshot)
+	{
+		return PtSnap64ReadTable(&ptImage->tSnapshot, qwTablePhysicalAddress);
+	}
+
+	// Compared as sizes so a hostile entry can't wrap around the end of the image
+	if ((PAGE_SIZE_4KB > ptImage->cbSize)
+		|| (qwTablePhysicalAddress > ptImage->cbSize - PAGE_SIZE_4KB))
+	{
+		return NULL;
+	}
+	return ptImage->pcBase + qwTablePhysicalAddress;
+}
+
+static
+PVOID
+ptscan64_UserThread(
+	_In_	PVOID	pvContext
+)
+{
+	PPTSCAN64_WORKER ptWorker = (PPTSCAN64_WORKER)pvContext;
+
+	PtScan64Work(ptWorker->ptScan, ptWorker->dwIndex);
+	return NULL;
+}
+
+NTSTATUS
+PtScan64RunUserThreads(
+	_Inout_	PPTSCAN64	ptScan
+)
+{
+	pthread_t atThreads[PTSCAN64_MAX_WORKERS];
+	BOOLEAN abCreated[PTSCAN64_MAX_WORKERS] = { 0 };
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptScan);
+
+	for (i = 1; i < ptScan->dwWorkerCount; i++)
+	{
+		// Items are claimed from a shared cursor, so a missing worker only costs parallelism
+		abCreated[i] = (0 == pthread_create(&atThreads[i], NULL, ptscan64_UserThread,
+			&ptScan->atWorkers[i]));
+	}
+
+	PtScan64Work(ptScan, 0);
+
+	for (i = 1; i < ptScan->dwWorkerCount; i++)
+	{
+		if (abCreated[i])
+		{
+			pthread_join(atThreads[i], NULL);
+		}
+	}
+
+	return (0 != ptScan->lAbort) ? STATUS_CANCELLED : STATUS_SUCCESS;
+}
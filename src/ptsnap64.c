@@ -0,0 +1,412 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		ptsnap64.c
+* @section	Memory-mappable snapshots of IA-32e paging hierarchies
+*/
+
+#include "ptsnap64.h"
+
+// Depth of a table in the hierarchy, PML4 first
+#define PTSNAP64_LEVEL_PML4	0
+#define PTSNAP64_LEVEL_PDPT	1
+#define PTSNAP64_LEVEL_PD	2
+#define PTSNAP64_LEVEL_PT	3
+
+#define PTSNAP64_TABLES_OFFSET	PAGE_SIZE_4KB
+#define PTSNAP64_TABLE_OFFSET(qwTableNumber) \
+	(PTSNAP64_TABLES_OFFSET + ((UINT64)(qwTableNumber) << PAGE_SHIFT_4KB))
+
+// Marks a free slot of the index while it is used as a hash set
+#define PTSNAP64_FREE_SLOT	MAXUINT64
+
+// The index is written out in pieces of this many entries
+#define PTSNAP64_INDEX_WRITE_ENTRIES	4096
+
+/**
+* Find the slot of a table in the open-addressed index
+* @return The slot holding qwPhysicalAddress, or the free slot it would go in
+*/
+static
+PPTSNAP64_INDEX_ENTRY
+ptsnap64_FindSlot(
+	_In_	PPTSNAP64_WRITER	ptWriter,
+	_In_	UINT64				qwPhysicalAddress
+)
+{
+	UINT64 qwMask = (1ULL << ptWriter->dwIndexShift) - 1;
+	UINT64 qwSlot = 0;
+
+	qwSlot = ((qwPhysicalAddress >> PAGE_SHIFT_4KB) * 0x9E3779B97F4A7C15ULL)
+		>> (64 - ptWriter->dwIndexShift);
+	while ((PTSNAP64_FREE_SLOT != ptWriter->ptIndex[qwSlot].qwTableNumber)
+		&& (qwPhysicalAddress != ptWriter->ptIndex[qwSlot].qwPhysicalAddress))
+	{
+		qwSlot = (qwSlot + 1) & qwMask;
+	}
+	return &ptWriter->ptIndex[qwSlot];
+}
+
+/**
+* Write a table and everything below it, depth first
+* @param ptWriter - writer of the snapshot
+* @param qwPhysicalAddress - physical address of the table
+* @param dwLevel - PTSNAP64_LEVEL_* of the table
+* @return STATUS_SUCCESS on success, tables that can't be read are only counted
+*/
+static
+NTSTATUS
+ptsnap64_WriteTable(
+	_Inout_	PPTSNAP64_WRITER	ptWriter,
+	_In_	UINT64				qwPhysicalAddress,
+	_In_	UINT32				dwLevel
+)
+{
+	NTSTATUS eStatus = STATUS_UNSUCCESSFUL;
+	PPTSNAP64_INDEX_ENTRY ptSlot = NULL;
+	const VOID* pvTable = NULL;
+	UINT64 qwEntry = 0;
+	UINT32 i = 0;
+
+	ptSlot = ptsnap64_FindSlot(ptWriter, qwPhysicalAddress);
+	if (PTSNAP64_FREE_SLOT != ptSlot->qwTableNumber)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	// Keep the set at most 3/4 full so probing stays short
+	if (ptWriter->qwTableCount + 1 > ((1ULL << ptWriter->dwIndexShift) / 4) * 3)
+	{
+		return STATUS_BUFFER_TOO_SMALL;
+	}
+
+	pvTable = ptWriter->tSource.pfnReadTable(ptWriter->tSource.pvContext, qwPhysicalAddress);
+	if (NULL == pvTable)
+	{
+		ptWriter->qwReadFailures++;
+		return STATUS_SUCCESS;
+	}
+
+	eStatus = ptWriter->pfnWrite(ptWriter->pvWriteContext,
+		PTSNAP64_TABLE_OFFSET(ptWriter->qwTableCount), pvTable, PAGE_SIZE_4KB);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+	ptSlot->qwPhysicalAddress = qwPhysicalAddress;
+	ptSlot->qwTableNumber = ptWriter->qwTableCount;
+	ptWriter->qwTableCount++;
+
+	if (PTSNAP64_LEVEL_PT == dwLevel)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	// Reading the tables below invalidates this one
+	RtlCopyMemory(ptWriter->aqwPath[dwLevel], pvTable, PAGE_SIZE_4KB);
+	for (i = 0; i < PAGING64_PML4E_COUNT; i++)
+	{
+		qwEntry = ptWriter->aqwPath[dwLevel][i];
+		if ((PTSNAP64_LEVEL_PML4 == dwLevel) ?
+			(0 == (qwEntry & PAGING64_ENTRY_PRESENT)) : !PAGING64_IS_TABLE(qwEntry))
+		{
+			continue;
+		}
+		eStatus = ptsnap64_WriteTable(ptWriter, qwEntry & PAGING64_PHYS_ADDR_MASK, dwLevel + 1);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+static
+VOID
+ptsnap64_SiftDown(
+	_Inout_	PPTSNAP64_INDEX_ENTRY	ptIndex,
+	_In_	UINT64					qwRoot,
+	_In_	UINT64					qwCount
+)
+{
+	PTSNAP64_INDEX_ENTRY tTemp = { 0 };
+	UINT64 qwChild = 0;
+
+	while ((qwChild = 2 * qwRoot + 1) < qwCount)
+	{
+		if ((qwChild + 1 < qwCount)
+			&& (ptIndex[qwChild].qwPhysicalAddress < ptIndex[qwChild + 1].qwPhysicalAddress))
+		{
+			qwChild++;
+		}
+		if (ptIndex[qwRoot].qwPhysicalAddress >= ptIndex[qwChild].qwPhysicalAddress)
+		{
+			return;
+		}
+		tTemp = ptIndex[qwRoot];
+		ptIndex[qwRoot] = ptIndex[qwChild];
+		ptIndex[qwChild] = tTemp;
+		qwRoot = qwChild;
+	}
+}
+
+/**
+* Pack the used slots of the hash set at its start and sort them by physical address
+*/
+static
+VOID
+ptsnap64_BuildIndex(
+	_Inout_	PPTSNAP64_WRITER	ptWriter
+)
+{
+	PPTSNAP64_INDEX_ENTRY ptIndex = ptWriter->ptIndex;
+	PTSNAP64_INDEX_ENTRY tTemp = { 0 };
+	UINT64 qwUsed = 0;
+	UINT64 i = 0;
+
+	for (i = 0; i < (1ULL << ptWriter->dwIndexShift); i++)
+	{
+		if (PTSNAP64_FREE_SLOT != ptIndex[i].qwTableNumber)
+		{
+			ptIndex[qwUsed++] = ptIndex[i];
+		}
+	}
+	NT_ASSERT(qwUsed == ptWriter->qwTableCount);
+
+	// Heapsort sorts in place, the index buffer is the only memory we have
+	for (i = qwUsed / 2; i > 0; i--)
+	{
+		ptsnap64_SiftDown(ptIndex, i - 1, qwUsed);
+	}
+	for (i = qwUsed; i > 1; i--)
+	{
+		tTemp = ptIndex[0];
+		ptIndex[0] = ptIndex[i - 1];
+		ptIndex[i - 1] = tTemp;
+		ptsnap64_SiftDown(ptIndex, 0, i - 1);
+	}
+}
+
+NTSTATUS
+PtSnap64Write(
+	_Out_								PPTSNAP64_WRITER		ptWriter,
+	_In_								PPAGING64_READER		ptSource,
+	_In_								CR3_REG					tCr3,
+	_In_								PFN_PTSNAP64_WRITE		pfnWrite,
+	_In_opt_							PVOID					pvWriteContext,
+	_Out_writes_(1ULL << dwIndexShift)	PPTSNAP64_INDEX_ENTRY	ptIndex,
+	_In_								UINT32					dwIndexShift,
+	_Out_opt_							PUINT64					pqwSnapshotSize
+)
+{
+	NTSTATUS eStatus = STATUS_UNSUCCESSFUL;
+	PTSNAP64_HEADER tHeader = { 0 };
+	UINT64 qwIndexOffset = 0;
+	UINT64 qwWritten = 0;
+	UINT64 qwChunk = 0;
+	UINT64 i = 0;
+
+	NT_ASSERT(NULL != ptWriter);
+	NT_ASSERT(NULL != ptSource);
+	NT_ASSERT(NULL != pfnWrite);
+	NT_ASSERT(NULL != ptIndex);
+	NT_ASSERT((2 <= dwIndexShift) && (48 >= dwIndexShift));
+
+	RtlZeroMemory(ptWriter, sizeof(*ptWriter));
+	ptWriter->tSource = *ptSource;
+	ptWriter->pfnWrite = pfnWrite;
+	ptWriter->pvWriteContext = pvWriteContext;
+	ptWriter->ptIndex = ptIndex;
+	ptWriter->dwIndexShift = dwIndexShift;
+	for (i = 0; i < (1ULL << dwIndexShift); i++)
+	{
+		ptIndex[i].qwPhysicalAddress = 0;
+		ptIndex[i].qwTableNumber = PTSNAP64_FREE_SLOT;
+	}
+
+	// Until the final header is written the snapshot has no magic, so an
+	// interrupted dump can never be mistaken for a valid one
+	eStatus = pfnWrite(pvWriteContext, 0, ptWriter->aqwPath[0], PAGE_SIZE_4KB);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+
+	eStatus = ptsnap64_WriteTable(ptWriter, tCr3.qwValue & PAGING64_PHYS_ADDR_MASK,
+		PTSNAP64_LEVEL_PML4);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+	if (0 == ptWriter->qwTableCount)
+	{
+		return STATUS_ACCESS_VIOLATION;
+	}
+
+	ptsnap64_BuildIndex(ptWriter);
+	qwIndexOffset = PTSNAP64_TABLE_OFFSET(ptWriter->qwTableCount);
+	for (qwWritten = 0; qwWritten < ptWriter->qwTableCount; qwWritten += qwChunk)
+	{
+		qwChunk = ptWriter->qwTableCount - qwWritten;
+		if (PTSNAP64_INDEX_WRITE_ENTRIES < qwChunk)
+		{
+			qwChunk = PTSNAP64_INDEX_WRITE_ENTRIES;
+		}
+		eStatus = pfnWrite(pvWriteContext,
+			qwIndexOffset + qwWritten * sizeof(PTSNAP64_INDEX_ENTRY),
+			&ptIndex[qwWritten], (UINT32)(qwChunk * sizeof(PTSNAP64_INDEX_ENTRY)));
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+	}
+
+	tHeader.qwMagic = PTSNAP64_MAGIC;
+	tHeader.dwVersion = PTSNAP64_VERSION;
+	tHeader.dwHeaderSize = sizeof(tHeader);
+	tHeader.tCr3 = tCr3;
+	tHeader.qwTableCount = ptWriter->qwTableCount;
+	tHeader.qwTablesOffset = PTSNAP64_TABLES_OFFSET;
+	tHeader.qwIndexOffset = qwIndexOffset;
+	tHeader.qwReadFailures = ptWriter->qwReadFailures;
+	eStatus = pfnWrite(pvWriteContext, 0, &tHeader, sizeof(tHeader));
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+
+	if (NULL != pqwSnapshotSize)
+	{
+		*pqwSnapshotSize = qwIndexOffset
+			+ ptWriter->qwTableCount * sizeof(PTSNAP64_INDEX_ENTRY);
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+PtSnap64OpenReader(
+	_Out_						PPTSNAP64_READER	ptReader,
+	_In_reads_bytes_(cbSnapshot)	const VOID*			pvSnapshot,
+	_In_						UINT64				cbSnapshot
+)
+{
+	const PTSNAP64_HEADER* ptHeader = (const PTSNAP64_HEADER*)pvSnapshot;
+	const PTSNAP64_INDEX_ENTRY* ptIndex = NULL;
+	UINT64 i = 0;
+
+	NT_ASSERT(NULL != ptReader);
+	NT_ASSERT(NULL != pvSnapshot);
+
+	RtlZeroMemory(ptReader, sizeof(*ptReader));
+
+	// Tables are handed out as-is, they must be page aligned in memory too
+	if ((0 != BYTE_OFFSET_4KB(pvSnapshot))
+		|| (PAGE_SIZE_4KB > cbSnapshot)
+		|| (PTSNAP64_MAGIC != ptHeader->qwMagic)
+		|| (PTSNAP64_VERSION != ptHeader->dwVersion)
+		|| (sizeof(PTSNAP64_HEADER) != ptHeader->dwHeaderSize))
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	// Compare counts rather than offsets so hostile sizes can't overflow
+	if ((0 != BYTE_OFFSET_4KB(ptHeader->qwTablesOffset))
+		|| (0 != BYTE_OFFSET_4KB(ptHeader->qwIndexOffset))
+		|| (PAGE_SIZE_4KB > ptHeader->qwTablesOffset)
+		|| (ptHeader->qwTablesOffset > ptHeader->qwIndexOffset)
+		|| (ptHeader->qwIndexOffset > cbSnapshot)
+		|| (ptHeader->qwTableCount >
+			((ptHeader->qwIndexOffset - ptHeader->qwTablesOffset) >> PAGE_SHIFT_4KB))
+		|| (ptHeader->qwTableCount >
+			(cbSnapshot - ptHeader->qwIndexOffset) / sizeof(PTSNAP64_INDEX_ENTRY)))
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	// Lookups binary search the index, it must be strictly sorted
+	ptIndex = (const PTSNAP64_INDEX_ENTRY*)((const UINT8*)pvSnapshot + ptHeader->qwIndexOffset);
+	for (i = 0; i < ptHeader->qwTableCount; i++)
+	{
+		if ((ptIndex[i].qwTableNumber >= ptHeader->qwTableCount)
+			|| (0 != (ptIndex[i].qwPhysicalAddress & ~PAGING64_PHYS_ADDR_MASK))
+			|| ((0 != i) && (ptIndex[i - 1].qwPhysicalAddress >= ptIndex[i].qwPhysicalAddress)))
+		{
+			return STATUS_INVALID_IMAGE_FORMAT;
+		}
+	}
+
+	ptReader->pcBase = (const UINT8*)pvSnapshot;
+	ptReader->cbSize = cbSnapshot;
+	ptReader->ptHeader = ptHeader;
+	ptReader->ptIndex = ptIndex;
+	return STATUS_SUCCESS;
+}
+
+const VOID*
+PtSnap64ReadTable(
+	_In_opt_	PVOID	pvContext,
+	_In_		UINT64	qwTablePhysicalAddress
+)
+{
+	PPTSNAP64_READER ptReader = (PPTSNAP64_READER)pvContext;
+	UINT64 qwLow = 0;
+	UINT64 qwHigh = 0;
+	UINT64 qwMiddle = 0;
+
+	NT_ASSERT(NULL != ptReader);
+
+	qwHigh = ptReader->ptHeader->qwTableCount;
+	while (qwLow < qwHigh)
+	{
+		qwMiddle = qwLow + (qwHigh - qwLow) / 2;
+		if (ptReader->ptIndex[qwMiddle].qwPhysicalAddress < qwTablePhysicalAddress)
+		{
+			qwLow = qwMiddle + 1;
+		}
+		else
+		{
+			qwHigh = qwMiddle;
+		}
+	}
+	if ((qwLow == ptReader->ptHeader->qwTableCount)
+		|| (ptReader->ptIndex[qwLow].qwPhysicalAddress != qwTablePhysicalAddress))
+	{
+		return NULL;
+	}
+	return ptReader->pcBase + ptReader->ptHeader->qwTablesOffset
+		+ (ptReader->ptIndex[qwLow].qwTableNumber << PAGE_SHIFT_4KB);
+}
+
+CR3_REG
+PtSnap64GetReader(
+	_In_	PPTSNAP64_READER	ptSnapshot,
+	_Out_	PPAGING64_READER	ptReader
+)
+{
+	NT_ASSERT(NULL != ptSnapshot);
+	NT_ASSERT(NULL != ptReader);
+
+	ptReader->pfnReadTable = PtSnap64ReadTable;
+	ptReader->pvContext = ptSnapshot;
+	return ptSnapshot->ptHeader->tCr3;
+}
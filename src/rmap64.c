@@ -0,0 +1,429 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		rmap64.c
+* @section	Reverse map from physical pages to the linear addresses mapping them
+*/
+
+#include "rmap64.h"
+
+static
+__inline
+VOID
+rmap64_Lock(
+	_Inout_	PRMAP64	ptRmap
+)
+{
+	while (0 != InterlockedCompareExchange(&ptRmap->lLock, 1, 0))
+	{
+		YieldProcessor();
+	}
+}
+
+static
+__inline
+VOID
+rmap64_Unlock(
+	_Inout_	PRMAP64	ptRmap
+)
+{
+	InterlockedExchange(&ptRmap->lLock, 0);
+}
+
+static
+__inline
+UINT32
+rmap64_Hash(
+	_In_	UINT64	qwPfn,
+	_In_	UINT32	dwBucketShift
+)
+{
+	return (UINT32)((qwPfn * 0x9E3779B97F4A7C15ULL) >> (64 - dwBucketShift));
+}
+
+/**
+* Take an entry from the free list, growing the map by a slab if it's empty.
+* Called with the lock held.
+*/
+static
+PRMAP64_ENTRY
+rmap64_AllocEntry(
+	_Inout_	PRMAP64	ptRmap
+)
+{
+	PRMAP64_ENTRY ptEntry = NULL;
+	PRMAP64_SLAB ptSlab = NULL;
+	UINT64 qwPhysicalAddress = 0;
+	UINT32 i = 0;
+
+	if (NULL == ptRmap->ptFreeList)
+	{
+		ptSlab = (PRMAP64_SLAB)ptRmap->tAllocator.pfnAllocTable(ptRmap->tAllocator.pvContext,
+			&qwPhysicalAddress);
+		if (NULL == ptSlab)
+		{
+			return NULL;
+		}
+		ptSlab->qwPhysicalAddress = qwPhysicalAddress;
+		ptSlab->ptNext = ptRmap->ptSlabs;
+		ptRmap->ptSlabs = ptSlab;
+
+		for (i = 0; i < ARRAYSIZE(ptSlab->atEntries); i++)
+		{
+			ptSlab->atEntries[i].ptNext = ptRmap->ptFreeList;
+			ptRmap->ptFreeList = &ptSlab->atEntries[i];
+		}
+	}
+
+	ptEntry = ptRmap->ptFreeList;
+	ptRmap->ptFreeList = ptEntry->ptNext;
+	return ptEntry;
+}
+
+UINT32
+Rmap64GetBucketShift(
+	_In_	UINT64	qwExpectedMappings
+)
+{
+	UINT32 dwShift = RMAP64_MIN_BUCKET_SHIFT;
+
+	while ((dwShift < RMAP64_MAX_BUCKET_SHIFT)
+		&& (RMAP64_BUCKET_COUNT(dwShift) < qwExpectedMappings))
+	{
+		dwShift++;
+	}
+	return dwShift;
+}
+
+VOID
+Rmap64Init(
+	_Out_										PRMAP64						ptRmap,
+	_In_										PPAGING64_TABLE_ALLOCATOR	ptAllocator,
+	_Out_writes_(RMAP64_BUCKET_COUNT(dwBucketShift))	PRMAP64_ENTRY*				aptBuckets,
+	_In_										UINT32						dwBucketShift
+)
+{
+	NT_ASSERT(NULL != ptRmap);
+	NT_ASSERT(NULL != ptAllocator);
+	NT_ASSERT(NULL != aptBuckets);
+	NT_ASSERT((RMAP64_MIN_BUCKET_SHIFT <= dwBucketShift) && (RMAP64_MAX_BUCKET_SHIFT >= dwBucketShift));
+
+	RtlZeroMemory(ptRmap, sizeof(*ptRmap));
+	ptRmap->tAllocator = *ptAllocator;
+	ptRmap->aptBuckets = aptBuckets;
+	ptRmap->dwBucketShift = dwBucketShift;
+	RtlZeroMemory(aptBuckets, RMAP64_BUCKETS_SIZE(dwBucketShift));
+}
+
+BOOLEAN
+Rmap64IsOverloaded(
+	_In_	PRMAP64	ptRmap
+)
+{
+	NT_ASSERT(NULL != ptRmap);
+
+	return (ptRmap->qwEntryCount > RMAP64_MAX_LOAD * RMAP64_BUCKET_COUNT(ptRmap->dwBucketShift));
+}
+
+NTSTATUS
+Rmap64Resize(
+	_Inout_										PRMAP64			ptRmap,
+	_Out_writes_(RMAP64_BUCKET_COUNT(dwBucketShift))	PRMAP64_ENTRY*	aptBuckets,
+	_In_										UINT32			dwBucketShift,
+	_Out_										PRMAP64_ENTRY**	ppptOldBuckets
+)
+{
+	PRMAP64_ENTRY* aptOldBuckets = NULL;
+	PRMAP64_ENTRY ptEntry = NULL;
+	UINT32 dwBucket = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptRmap);
+	NT_ASSERT(NULL != aptBuckets);
+	NT_ASSERT(NULL != ppptOldBuckets);
+
+	*ppptOldBuckets = NULL;
+	if ((RMAP64_MIN_BUCKET_SHIFT > dwBucketShift) || (RMAP64_MAX_BUCKET_SHIFT < dwBucketShift))
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	RtlZeroMemory(aptBuckets, RMAP64_BUCKETS_SIZE(dwBucketShift));
+
+	rmap64_Lock(ptRmap);
+	aptOldBuckets = ptRmap->aptBuckets;
+	for (i = 0; i < RMAP64_BUCKET_COUNT(ptRmap->dwBucketShift); i++)
+	{
+		while (NULL != aptOldBuckets[i])
+		{
+			ptEntry = aptOldBuckets[i];
+			aptOldBuckets[i] = ptEntry->ptNext;
+			dwBucket = rmap64_Hash(ptEntry->qwPfn, dwBucketShift);
+			ptEntry->ptNext = aptBuckets[dwBucket];
+			aptBuckets[dwBucket] = ptEntry;
+		}
+	}
+	ptRmap->aptBuckets = aptBuckets;
+	ptRmap->dwBucketShift = dwBucketShift;
+	rmap64_Unlock(ptRmap);
+
+	*ppptOldBuckets = aptOldBuckets;
+	return STATUS_SUCCESS;
+}
+
+VOID
+Rmap64Destroy(
+	_Inout_ PRMAP64 ptRmap
+)
+{
+	PRMAP64_SLAB ptSlab = NULL;
+
+	NT_ASSERT(NULL != ptRmap);
+
+	while (NULL != ptRmap->ptSlabs)
+	{
+		ptSlab = ptRmap->ptSlabs;
+		ptRmap->ptSlabs = ptSlab->ptNext;
+		ptRmap->tAllocator.pfnFreeTable(ptRmap->tAllocator.pvContext, ptSlab,
+			ptSlab->qwPhysicalAddress);
+	}
+
+	ptRmap->ptFreeList = NULL;
+	ptRmap->qwEntryCount = 0;
+	ptRmap->bIncomplete = FALSE;
+	RtlZeroMemory(ptRmap->aptBuckets, RMAP64_BUCKETS_SIZE(ptRmap->dwBucketShift));
+}
+
+VOID
+Rmap64LeafNotify(
+	_In_opt_	PVOID		pvContext,
+	_In_		UINT64		qwPml4PhysicalAddress,
+	_In_		UINT64		qwVa,
+	_In_		UINT64		qwPa,
+	_In_		PAGE_TYPE64	ePageType,
+	_In_		BOOLEAN		bMapped
+)
+{
+	PRMAP64 ptRmap = (PRMAP64)pvContext;
+	UINT64 qwPfn = qwPa >> PAGE_SHIFT_4KB;
+	PRMAP64_ENTRY* pptLink = NULL;
+	PRMAP64_ENTRY ptEntry = NULL;
+
+	NT_ASSERT(NULL != ptRmap);
+
+	rmap64_Lock(ptRmap);
+	pptLink = &ptRmap->aptBuckets[rmap64_Hash(qwPfn, ptRmap->dwBucketShift)];
+
+	if (bMapped)
+	{
+		ptEntry = rmap64_AllocEntry(ptRmap);
+		if (NULL == ptEntry)
+		{
+			ptRmap->bIncomplete = TRUE;
+		}
+		else
+		{
+			ptEntry->qwPfn = qwPfn;
+			ptEntry->qwPml4PhysicalAddress = qwPml4PhysicalAddress;
+			ptEntry->qwVa = qwVa;
+			ptEntry->ePageType = ePageType;
+			ptEntry->ptNext = *pptLink;
+			*pptLink = ptEntry;
+			ptRmap->qwEntryCount++;
+		}
+	}
+	else
+	{
+		for (; NULL != *pptLink; pptLink = &(*pptLink)->ptNext)
+		{
+			ptEntry = *pptLink;
+			if ((ptEntry->qwPfn == qwPfn) && (ptEntry->qwVa == qwVa)
+				&& (ptEntry->qwPml4PhysicalAddress == qwPml4PhysicalAddress)
+				&& (ptEntry->ePageType == ePageType))
+			{
+				*pptLink = ptEntry->ptNext;
+				ptEntry->ptNext = ptRmap->ptFreeList;
+				ptRmap->ptFreeList = ptEntry;
+				ptRmap->qwEntryCount--;
+				break;
+			}
+		}
+	}
+
+	rmap64_Unlock(ptRmap);
+}
+
+NTSTATUS
+Rmap64AttachHierarchy(
+	_Inout_	PRMAP64				ptRmap,
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy
+)
+{
+	BOOLEAN bWasIncomplete = FALSE;
+	BOOLEAN bFailed = FALSE;
+
+	NT_ASSERT(NULL != ptRmap);
+	NT_ASSERT(NULL != ptHierarchy);
+
+	rmap64_Lock(ptRmap);
+	bWasIncomplete = ptRmap->bIncomplete;
+	ptRmap->bIncomplete = FALSE;
+	rmap64_Unlock(ptRmap);
+
+	Paging64HierarchyEnumLeaves(ptHierarchy, Rmap64LeafNotify, ptRmap);
+
+	rmap64_Lock(ptRmap);
+	bFailed = ptRmap->bIncomplete;
+	ptRmap->bIncomplete = bWasIncomplete;
+	rmap64_Unlock(ptRmap);
+
+	if (bFailed)
+	{
+		Rmap64DetachHierarchy(ptRmap, ptHierarchy);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	rmap64_Lock(ptRmap);
+	ptRmap->dwHierarchyCount++;
+	rmap64_Unlock(ptRmap);
+
+	Paging64HierarchySetLeafNotify(ptHierarchy, Rmap64LeafNotify, ptRmap);
+	return STATUS_SUCCESS;
+}
+
+VOID
+Rmap64DetachHierarchy(
+	_Inout_	PRMAP64				ptRmap,
+	_Inout_	PPAGING64_HIERARCHY	ptHierarchy
+)
+{
+	PRMAP64_ENTRY* pptLink = NULL;
+	PRMAP64_ENTRY ptEntry = NULL;
+	BOOLEAN bAttached = FALSE;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptRmap);
+	NT_ASSERT(NULL != ptHierarchy);
+
+	if ((Rmap64LeafNotify == ptHierarchy->pfnLeafNotify)
+		&& (ptRmap == ptHierarchy->pvLeafNotifyContext))
+	{
+		Paging64HierarchySetLeafNotify(ptHierarchy, NULL, NULL);
+		bAttached = TRUE;
+	}
+
+	rmap64_Lock(ptRmap);
+	if (bAttached)
+	{
+		NT_ASSERT(0 != ptRmap->dwHierarchyCount);
+		ptRmap->dwHierarchyCount--;
+	}
+	for (i = 0; i < RMAP64_BUCKET_COUNT(ptRmap->dwBucketShift); i++)
+	{
+		pptLink = &ptRmap->aptBuckets[i];
+		while (NULL != *pptLink)
+		{
+			ptEntry = *pptLink;
+			if (ptEntry->qwPml4PhysicalAddress != ptHierarchy->qwPml4PhysicalAddress)
+			{
+				pptLink = &ptEntry->ptNext;
+				continue;
+			}
+			*pptLink = ptEntry->ptNext;
+			ptEntry->ptNext = ptRmap->ptFreeList;
+			ptRmap->ptFreeList = ptEntry;
+			ptRmap->qwEntryCount--;
+		}
+	}
+
+	// Nothing is followed anymore, so nothing can be missing from the map
+	if ((0 == ptRmap->dwHierarchyCount) && (0 == ptRmap->qwEntryCount))
+	{
+		ptRmap->bIncomplete = FALSE;
+	}
+	rmap64_Unlock(ptRmap);
+}
+
+NTSTATUS
+Rmap64Lookup(
+	_Inout_										PRMAP64			ptRmap,
+	_In_										UINT64			qwPa,
+	_Out_writes_to_(dwMaxMappings, dwMaxMappings)	PRMAP64_MAPPING	ptMappings,
+	_In_										UINT32			dwMaxMappings,
+	_Out_										PUINT32			pdwMappingCount
+)
+{
+	static const UINT64 s_aqwPageMasks[PAGE_TYPES_COUNT] = {
+		PAGE_SIZE_1GB - 1,	// PAGE_TYPE_1GB
+		PAGE_SIZE_2MB - 1,	// PAGE_TYPE_2MB
+		PAGE_SIZE_4KB - 1	// PAGE_TYPE_4KB
+	};
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	PAGE_TYPE64 ePageType = PAGE_TYPE_FIRST;
+	PRMAP64_ENTRY ptEntry = NULL;
+	UINT64 qwPageBase = 0;
+	UINT64 qwPfn = 0;
+	UINT32 dwCount = 0;
+
+	NT_ASSERT(NULL != ptRmap);
+	NT_ASSERT((NULL != ptMappings) || (0 == dwMaxMappings));
+	NT_ASSERT(NULL != pdwMappingCount);
+
+	rmap64_Lock(ptRmap);
+
+	// A page of each size could contain the address, each is indexed by its own base
+	for (ePageType = PAGE_TYPE_FIRST; ePageType < PAGE_TYPES_COUNT; ePageType++)
+	{
+		qwPageBase = qwPa & ~s_aqwPageMasks[ePageType];
+		qwPfn = qwPageBase >> PAGE_SHIFT_4KB;
+
+		for (ptEntry = ptRmap->aptBuckets[rmap64_Hash(qwPfn, ptRmap->dwBucketShift)]; NULL != ptEntry;
+			ptEntry = ptEntry->ptNext)
+		{
+			if ((ptEntry->qwPfn != qwPfn) || (ptEntry->ePageType != ePageType))
+			{
+				continue;
+			}
+			if (dwCount < dwMaxMappings)
+			{
+				ptMappings[dwCount].qwPml4PhysicalAddress = ptEntry->qwPml4PhysicalAddress;
+				ptMappings[dwCount].qwVa = ptEntry->qwVa + (qwPa - qwPageBase);
+				ptMappings[dwCount].ePageType = ePageType;
+			}
+			dwCount++;
+		}
+	}
+
+	if (ptRmap->bIncomplete)
+	{
+		eStatus = STATUS_INSUFFICIENT_RESOURCES;
+	}
+	else if (dwCount > dwMaxMappings)
+	{
+		eStatus = STATUS_BUFFER_TOO_SMALL;
+	}
+
+	rmap64_Unlock(ptRmap);
+
+	*pdwMappingCount = dwCount;
+	return eStatus;
+}
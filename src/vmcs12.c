@@ -0,0 +1,159 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcs12.c
+* @section	Software VMCS of a nested hypervisor (VMCS12) with perfect-hash field access
+*			See Intel's: Software Developers Manual Vol 3C, 24.11.2 VMREAD, VMWRITE, and Encodings of VMCS Fields
+*/
+
+#include "vmcs12.h"
+
+// Use X-Macros to build the hash table at compile time, empty slots are 0
+static const UINT16 g_Vmcs12Offsets[VMCS12_HASH_SLOTS] = {
+#define X(FieldName, Encoding) [VMCS12_HASH(Encoding)] = (UINT16)FIELD_OFFSET(VMCS12, tNatural.FieldName),
+	VMCS_FIELDS_NATURAL
+#undef X
+#define X(FieldName, Encoding) [VMCS12_HASH(Encoding)] = (UINT16)FIELD_OFFSET(VMCS12, t64Bit.FieldName),
+	VMCS_FIELDS_64BIT
+#undef X
+#define X(FieldName, Encoding) [VMCS12_HASH(Encoding)] = (UINT16)FIELD_OFFSET(VMCS12, t32Bit.FieldName),
+	VMCS_FIELDS_32BIT
+#undef X
+#define X(FieldName, Encoding) [VMCS12_HASH(Encoding)] = (UINT16)FIELD_OFFSET(VMCS12, t16Bit.FieldName),
+	VMCS_FIELDS_16BIT
+#undef X
+};
+
+VOID
+Vmcs12Init(
+	_Out_	PVMCS12	ptVmcs12,
+	_In_	UINT32	dwRevisionId
+)
+{
+	NT_ASSERT(NULL != ptVmcs12);
+
+	RtlZeroMemory(ptVmcs12, sizeof(*ptVmcs12));
+	ptVmcs12->dwRevisionId = dwRevisionId;
+}
+
+UINT32
+Vmcs12GetFieldOffset(
+	_In_ VMCS_FIELD_ENCODING eField
+)
+{
+	// Only 64-bit fields have a high access
+	if ((0 != ((UINT32)eField & ~VMCS12_ENCODING_MASK))
+		|| (VMCS_FIELD_ACCESS_HIGH(eField)
+			&& (VMCS_FIELD_WIDTH_64BIT != VMCS_FIELD_WIDTH_OF(eField))))
+	{
+		return 0;
+	}
+	return g_Vmcs12Offsets[VMCS12_HASH(eField)];
+}
+
+NTSTATUS
+Vmcs12Read(
+	_In_	PVMCS12				ptVmcs12,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT64				pqwValue
+)
+{
+	PUINT8 pcField = NULL;
+	UINT32 dwOffset = 0;
+
+	NT_ASSERT(NULL != ptVmcs12);
+	NT_ASSERT(NULL != pqwValue);
+
+	*pqwValue = 0;
+	dwOffset = Vmcs12GetFieldOffset(eField);
+	if (0 == dwOffset)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	pcField = (PUINT8)ptVmcs12 + dwOffset;
+	switch (VMCS_FIELD_WIDTH_OF(eField))
+	{
+	case VMCS_FIELD_WIDTH_16BIT:
+		*pqwValue = *(PUINT16)pcField;
+		break;
+	case VMCS_FIELD_WIDTH_32BIT:
+		*pqwValue = *(PUINT32)pcField;
+		break;
+	case VMCS_FIELD_WIDTH_64BIT:
+		*pqwValue = (VMCS_FIELD_ACCESS_HIGH(eField))
+			? (*(PUINT64)pcField >> 32)
+			: *(PUINT64)pcField;
+		break;
+	default:
+		*pqwValue = *(PUINT64)pcField;
+		break;
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+Vmcs12Write(
+	_Inout_	PVMCS12				ptVmcs12,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_In_	UINT64				qwValue,
+	_In_	BOOLEAN				bWriteReadOnly
+)
+{
+	PUINT8 pcField = NULL;
+	UINT32 dwOffset = 0;
+
+	NT_ASSERT(NULL != ptVmcs12);
+
+	dwOffset = Vmcs12GetFieldOffset(eField);
+	if (0 == dwOffset)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (!bWriteReadOnly && (VMCS_FIELD_TYPE_READ_ONLY == VMCS_FIELD_TYPE_OF(eField)))
+	{
+		return STATUS_ACCESS_DENIED;
+	}
+
+	pcField = (PUINT8)ptVmcs12 + dwOffset;
+	switch (VMCS_FIELD_WIDTH_OF(eField))
+	{
+	case VMCS_FIELD_WIDTH_16BIT:
+		*(PUINT16)pcField = (UINT16)qwValue;
+		break;
+	case VMCS_FIELD_WIDTH_32BIT:
+		*(PUINT32)pcField = (UINT32)qwValue;
+		break;
+	case VMCS_FIELD_WIDTH_64BIT:
+		if (VMCS_FIELD_ACCESS_HIGH(eField))
+		{
+			qwValue = (*(PUINT64)pcField & MAXUINT32) | ((qwValue & MAXUINT32) << 32);
+		}
+		*(PUINT64)pcField = qwValue;
+		break;
+	default:
+		*(PUINT64)pcField = qwValue;
+		break;
+	}
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,209 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcsbitmap.c
+* @section	Builder of the VMREAD and VMWRITE bitmaps used with VMCS shadowing
+*			See Intel's: Software Developers Manual Vol 3C, 24.6.15 VMCS Shadowing Bitmap Addresses
+*/
+
+#include "vmcsbitmap.h"
+
+static
+__inline
+VOID
+vmcsbitmap_SetBit(
+	_Inout_	PUINT8	pcBitmap,
+	_In_	UINT32	dwEncoding,
+	_In_	BOOLEAN	bExit
+)
+{
+	if (bExit)
+	{
+		pcBitmap[dwEncoding / 8] |= (UINT8)(1 << (dwEncoding % 8));
+	}
+	else
+	{
+		pcBitmap[dwEncoding / 8] &= (UINT8)~(1 << (dwEncoding % 8));
+	}
+}
+
+VOID
+VmcsBitmapInit(
+	_Out_writes_bytes_(VMCSBITMAP_SIZE) PUINT8 pcBitmap
+)
+{
+	NT_ASSERT(NULL != pcBitmap);
+
+	RtlFillMemory(pcBitmap, VMCSBITMAP_SIZE, 0xff);
+}
+
+NTSTATUS
+VmcsBitmapSetField(
+	_Inout_updates_bytes_(VMCSBITMAP_SIZE)	PUINT8				pcBitmap,
+	_In_									VMCS_FIELD_ENCODING	eField,
+	_In_									BOOLEAN				bPass
+)
+{
+	UINT32 dwEncoding = (UINT32)eField;
+
+	NT_ASSERT(NULL != pcBitmap);
+
+	if (VMCSBITMAP_ENCODING_LIMIT <= dwEncoding)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	vmcsbitmap_SetBit(pcBitmap, dwEncoding, !bPass);
+	if (VMCS_FIELD_WIDTH_64BIT == VMCS_FIELD_WIDTH_OF(eField))
+	{
+		vmcsbitmap_SetBit(pcBitmap, dwEncoding ^ 1, !bPass);
+	}
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+VmcsBitmapPassFields(
+	_Inout_updates_bytes_(VMCSBITMAP_SIZE)	PUINT8						pcBitmap,
+	_In_reads_(dwCount)						const VMCS_FIELD_ENCODING*	peFields,
+	_In_									UINT32						dwCount
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != pcBitmap);
+	NT_ASSERT((NULL != peFields) || (0 == dwCount));
+
+	for (i = 0; i < dwCount; i++)
+	{
+		eStatus = VmcsBitmapSetField(pcBitmap, peFields[i], TRUE);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+	}
+	return STATUS_SUCCESS;
+}
+
+UINT32
+VmcsBitmapPassTypes(
+	_Inout_updates_bytes_(VMCSBITMAP_SIZE)	PUINT8	pcBitmap,
+	_In_									UINT32	dwPolicy,
+	_In_									UINT32	dwMaxIndex
+)
+{
+	const VMCS_FIELD_INFO* ptInfo = NULL;
+	UINT32 dwPassed = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != pcBitmap);
+
+	for (i = 0; i < VMCS_FIELD_INDEX_COUNT; i++)
+	{
+		ptInfo = VTX_GetVmcsFieldInfo((VMCS_FIELD_INDEX)i);
+		if ((0 != (dwPolicy & VMCSBITMAP_PASS_TYPE(ptInfo->eType)))
+			&& (VMCS_FIELD_ENCODING_INDEX(ptInfo->eEncoding) <= dwMaxIndex))
+		{
+			(VOID)VmcsBitmapSetField(pcBitmap, ptInfo->eEncoding, TRUE);
+			dwPassed++;
+		}
+	}
+	return dwPassed;
+}
+
+VOID
+VmcsBitmapBuild(
+	_Out_writes_bytes_(VMCSBITMAP_SIZE)	PUINT8				pcVmreadBitmap,
+	_Out_writes_bytes_(VMCSBITMAP_SIZE)	PUINT8				pcVmwriteBitmap,
+	_In_								UINT32				dwReadPolicy,
+	_In_								UINT32				dwWritePolicy,
+	_In_								IA32_VMX_MISC		tMisc,
+	_In_								IA32_VMX_VMCS_ENUM	tVmcsEnum
+)
+{
+	NT_ASSERT(NULL != pcVmreadBitmap);
+	NT_ASSERT(NULL != pcVmwriteBitmap);
+
+	// Without VMWRITE to any field, L0 can't copy the exit information to the shadow VMCS
+	if (!tMisc.vmwriteAll)
+	{
+		dwReadPolicy &= ~VMCSBITMAP_PASS_READ_ONLY;
+		dwWritePolicy &= ~VMCSBITMAP_PASS_READ_ONLY;
+	}
+
+	VmcsBitmapInit(pcVmreadBitmap);
+	VmcsBitmapInit(pcVmwriteBitmap);
+	(VOID)VmcsBitmapPassTypes(pcVmreadBitmap, dwReadPolicy, (UINT32)tVmcsEnum.maxIndex);
+	(VOID)VmcsBitmapPassTypes(pcVmwriteBitmap, dwWritePolicy, (UINT32)tVmcsEnum.maxIndex);
+}
+
+NTSTATUS
+VmcsBitmapEnableShadowing(
+	_In_	UINT64	qwVmreadBitmapPhysicalAddress,
+	_In_	UINT64	qwVmwriteBitmapPhysicalAddress,
+	_In_	UINT64	qwShadowVmcsPhysicalAddress
+)
+{
+	LARGE_INTEGER tAllowed = { 0 };
+	VMX_PROCBASED_CTLS tPrimary = { 0 };
+	VMX_PROCBASED_CTLS2 tControls = { 0 };
+
+	// Vol 3D, A.3.2 and A.3.3: the allowed 1-settings are the high 32 bits, and
+	// IA32_VMX_PROCBASED_CTLS2 only exists if the secondary controls may be used
+	tAllowed.QuadPart = __readmsr(MSR_CODE_IA32_VMX_PROCBASED_CTLS);
+	*(PUINT32)&tPrimary = (UINT32)tAllowed.HighPart;
+	if (!tPrimary.UseProcbased2)
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+	tAllowed.QuadPart = __readmsr(MSR_CODE_IA32_VMX_PROCBASED_CTLS2);
+	*(PUINT32)&tControls = (UINT32)tAllowed.HighPart;
+	if (!tControls.VmcsShadowing)
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	if ((VMX_SUCCESS != VMX_VMWRITE64(VMCS_FIELD_VMREAD_BITMAP_FULL,
+			qwVmreadBitmapPhysicalAddress))
+		|| (VMX_SUCCESS != VMX_VMWRITE64(VMCS_FIELD_VMWRITE_BITMAP_FULL,
+			qwVmwriteBitmapPhysicalAddress))
+		|| (VMX_SUCCESS != VMX_VMWRITE64(VMCS_FIELD_VMCS_LINK_POINTER_FULL,
+			qwShadowVmcsPhysicalAddress))
+		|| (VMX_SUCCESS != VMX_VMREAD32(VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL,
+			(PUINT32)&tControls))
+		|| (VMX_SUCCESS != VMX_VMREAD32(VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL,
+			(PUINT32)&tPrimary)))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	// The secondary controls are ignored unless the primary controls activate them
+	tControls.VmcsShadowing = TRUE;
+	tPrimary.UseProcbased2 = TRUE;
+	if ((VMX_SUCCESS != VMX_VMWRITE32(VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL, *(PUINT32)&tControls))
+		|| (VMX_SUCCESS != VMX_VMWRITE32(VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL, *(PUINT32)&tPrimary)))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	return STATUS_SUCCESS;
+}
@@ -0,0 +1,224 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcscache64.c
+* @section	Per-vCPU write-back cache of the current VMCS fields
+*/
+
+#include "vmcscache64.h"
+
+#define VMCSCACHE_WORD(eIndex)	((UINT32)(eIndex) / 64)
+#define VMCSCACHE_BIT(eIndex)	(1ULL << ((UINT32)(eIndex) % 64))
+
+/**
+* Make sure the value of a field is cached
+* @param ptCache - cache
+* @param eIndex - index of the field
+* @return STATUS_SUCCESS on success
+*		  STATUS_UNSUCCESSFUL if the VMCS couldn't be read
+*/
+static
+NTSTATUS
+vmcscache_Fill(
+	_Inout_	PVMCSCACHE			ptCache,
+	_In_	VMCS_FIELD_INDEX	eIndex
+)
+{
+	UINT32 dwWord = VMCSCACHE_WORD(eIndex);
+	UINT64 qwBit = VMCSCACHE_BIT(eIndex);
+
+	if (0 != (ptCache->aqwValid[dwWord] & qwBit))
+	{
+		return STATUS_SUCCESS;
+	}
+
+	if (VMX_SUCCESS != ptCache->tBackend.pfnRead(ptCache->tBackend.pvContext,
+		VTX_GetVmcsFieldInfo(eIndex)->eEncoding, &ptCache->aqwValues[eIndex]))
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+	ptCache->tStatistics.qwBackendReads++;
+	ptCache->aqwValid[dwWord] |= qwBit;
+	return STATUS_SUCCESS;
+}
+
+VOID
+VmcsCacheInit(
+	_Out_	PVMCSCACHE			ptCache,
+	_In_	PVMCSCACHE_BACKEND	ptBackend
+)
+{
+	NT_ASSERT(NULL != ptCache);
+	NT_ASSERT(NULL != ptBackend);
+
+	RtlZeroMemory(ptCache, sizeof(*ptCache));
+	ptCache->tBackend = *ptBackend;
+}
+
+VOID
+VmcsCacheInvalidate(
+	_Inout_ PVMCSCACHE ptCache
+)
+{
+	UINT64 qwDirty = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptCache);
+
+	for (i = 0; i < VMCSCACHE_BITMAP_WORDS; i++)
+	{
+		// A dirty field kept past the invalidation would later overwrite a newer value
+		for (qwDirty = ptCache->aqwDirty[i]; 0 != qwDirty; qwDirty &= qwDirty - 1)
+		{
+			ptCache->tStatistics.qwDroppedWrites++;
+		}
+		ptCache->aqwDirty[i] = 0;
+		ptCache->aqwValid[i] = 0;
+	}
+}
+
+NTSTATUS
+VmcsCacheRead(
+	_Inout_	PVMCSCACHE			ptCache,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_Out_	PUINT64				pqwValue
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	VMCS_FIELD_INDEX eIndex = VMCS_FIELD_INDEX_COUNT;
+
+	NT_ASSERT(NULL != ptCache);
+	NT_ASSERT(NULL != pqwValue);
+
+	*pqwValue = 0;
+	eIndex = VTX_GetVmcsFieldIndex(eField);
+	if (VMCS_FIELD_INDEX_COUNT == eIndex)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	ptCache->tStatistics.qwAccesses++;
+	eStatus = vmcscache_Fill(ptCache, eIndex);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+
+	*pqwValue = (VMCS_FIELD_ACCESS_HIGH(eField))
+		? (ptCache->aqwValues[eIndex] >> 32)
+		: ptCache->aqwValues[eIndex];
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+VmcsCacheWrite(
+	_Inout_	PVMCSCACHE			ptCache,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_In_	UINT64				qwValue
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	VMCS_FIELD_INDEX eIndex = VMCS_FIELD_INDEX_COUNT;
+	UINT32 dwWord = 0;
+	UINT64 qwBit = 0;
+
+	NT_ASSERT(NULL != ptCache);
+
+	eIndex = VTX_GetVmcsFieldIndex(eField);
+	if (VMCS_FIELD_INDEX_COUNT == eIndex)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (VMCS_FIELD_TYPE_READ_ONLY == VMCS_FIELD_TYPE_OF(eField))
+	{
+		return STATUS_ACCESS_DENIED;
+	}
+	dwWord = VMCSCACHE_WORD(eIndex);
+	qwBit = VMCSCACHE_BIT(eIndex);
+
+	ptCache->tStatistics.qwAccesses++;
+	if (VMCS_FIELD_ACCESS_HIGH(eField))
+	{
+		// The field is written back whole, so its lower half must be known
+		eStatus = vmcscache_Fill(ptCache, eIndex);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+		qwValue = (ptCache->aqwValues[eIndex] & MAXUINT32) | ((qwValue & MAXUINT32) << 32);
+	}
+
+	if (0 != (ptCache->aqwDirty[dwWord] & qwBit))
+	{
+		ptCache->tStatistics.qwCoalescedWrites++;
+	}
+	ptCache->aqwValues[eIndex] = qwValue;
+	ptCache->aqwValid[dwWord] |= qwBit;
+	ptCache->aqwDirty[dwWord] |= qwBit;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+VmcsCacheFlush(
+	_Inout_ PVMCSCACHE ptCache
+)
+{
+	UINT64 qwDirty = 0;
+	ULONG dwBit = 0;
+	UINT32 dwIndex = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptCache);
+
+	for (i = 0; i < VMCSCACHE_BITMAP_WORDS; i++)
+	{
+		qwDirty = ptCache->aqwDirty[i];
+		while (_BitScanForward64(&dwBit, qwDirty))
+		{
+			dwIndex = i * 64 + dwBit;
+			if (VMX_SUCCESS != ptCache->tBackend.pfnWrite(ptCache->tBackend.pvContext,
+				VTX_GetVmcsFieldInfo((VMCS_FIELD_INDEX)dwIndex)->eEncoding,
+				ptCache->aqwValues[dwIndex]))
+			{
+				ptCache->aqwDirty[i] = qwDirty;
+				return STATUS_UNSUCCESSFUL;
+			}
+			ptCache->tStatistics.qwBackendWrites++;
+			qwDirty &= qwDirty - 1;
+		}
+		ptCache->aqwDirty[i] = 0;
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID
+VmcsCacheGetStatistics(
+	_In_	PVMCSCACHE				ptCache,
+	_Out_	PVMCSCACHE_STATISTICS	ptStatistics
+)
+{
+	NT_ASSERT(NULL != ptCache);
+	NT_ASSERT(NULL != ptStatistics);
+
+	*ptStatistics = ptCache->tStatistics;
+}
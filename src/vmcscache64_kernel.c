@@ -0,0 +1,72 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcscache64_kernel.c
+* @section	Kernel backend of the VMCS cache.
+*			Kept in its own file so user-mode builds can leave it out.
+*/
+
+#include "vmcscache64.h"
+
+static
+VMX_OPCODE_RC
+vmcscache_KernelRead(
+	_In_opt_	PVOID				pvContext,
+	_In_		VMCS_FIELD_ENCODING	eField,
+	_Out_		PUINT64				pqwValue
+)
+{
+	size_t cbValue = 0;
+	VMX_OPCODE_RC eRc = VMX_SUCCESS;
+
+	UNREFERENCED_PARAMETER(pvContext);
+
+	eRc = (VMX_OPCODE_RC)__vmx_vmread(eField, &cbValue);
+	*pqwValue = (UINT64)cbValue;
+	return eRc;
+}
+
+static
+VMX_OPCODE_RC
+vmcscache_KernelWrite(
+	_In_opt_	PVOID				pvContext,
+	_In_		VMCS_FIELD_ENCODING	eField,
+	_In_		UINT64				qwValue
+)
+{
+	UNREFERENCED_PARAMETER(pvContext);
+
+	return (VMX_OPCODE_RC)__vmx_vmwrite(eField, (size_t)qwValue);
+}
+
+VOID
+VmcsCacheGetKernelBackend(
+	_Out_ PVMCSCACHE_BACKEND ptBackend
+)
+{
+	NT_ASSERT(NULL != ptBackend);
+
+	ptBackend->pfnRead = vmcscache_KernelRead;
+	ptBackend->pfnWrite = vmcscache_KernelWrite;
+	ptBackend->pvContext = NULL;
+}
@@ -0,0 +1,108 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcscache64_user.c
+* @section	User-mode backend of the VMCS cache, over a VMCS simulated in memory, to
+*			run and benchmark the cache outside the kernel.
+*			Kept in its own file so kernel builds can leave it out.
+*/
+
+#include "vmcscache64.h"
+
+/**
+* Mask of the bits a field of a given width holds
+*/
+static
+__inline
+UINT64
+vmcscache_UserWidthMask(
+	_In_	VMCS_FIELD_WIDTH	eWidth
+)
+{
+	switch (eWidth)
+	{
+	case VMCS_FIELD_WIDTH_16BIT:
+		return 0xffffULL;
+	case VMCS_FIELD_WIDTH_32BIT:
+		return 0xffffffffULL;
+	default:
+		return MAXUINT64;
+	}
+}
+
+static
+VMX_OPCODE_RC
+vmcscache_UserRead(
+	_In_opt_	PVOID				pvContext,
+	_In_		VMCS_FIELD_ENCODING	eField,
+	_Out_		PUINT64				pqwValue
+)
+{
+	PUINT64 aqwVmcs = (PUINT64)pvContext;
+	VMCS_FIELD_INDEX eIndex = VTX_GetVmcsFieldIndex(eField);
+
+	NT_ASSERT(NULL != aqwVmcs);
+
+	// Like VMREAD of an unsupported component
+	if (VMCS_FIELD_INDEX_COUNT == eIndex)
+	{
+		return VMX_ERROR;
+	}
+	*pqwValue = aqwVmcs[eIndex];
+	return VMX_SUCCESS;
+}
+
+static
+VMX_OPCODE_RC
+vmcscache_UserWrite(
+	_In_opt_	PVOID				pvContext,
+	_In_		VMCS_FIELD_ENCODING	eField,
+	_In_		UINT64				qwValue
+)
+{
+	PUINT64 aqwVmcs = (PUINT64)pvContext;
+	VMCS_FIELD_INDEX eIndex = VTX_GetVmcsFieldIndex(eField);
+
+	NT_ASSERT(NULL != aqwVmcs);
+
+	if (VMCS_FIELD_INDEX_COUNT == eIndex)
+	{
+		return VMX_ERROR;
+	}
+	aqwVmcs[eIndex] = qwValue & vmcscache_UserWidthMask(VTX_GetVmcsFieldInfo(eIndex)->eWidth);
+	return VMX_SUCCESS;
+}
+
+VOID
+VmcsCacheGetUserBackend(
+	_Out_									PVMCSCACHE_BACKEND	ptBackend,
+	_Inout_updates_(VMCS_FIELD_INDEX_COUNT)	PUINT64				aqwVmcs
+)
+{
+	NT_ASSERT(NULL != ptBackend);
+	NT_ASSERT(NULL != aqwVmcs);
+
+	ptBackend->pfnRead = vmcscache_UserRead;
+	ptBackend->pfnWrite = vmcscache_UserWrite;
+	ptBackend->pvContext = aqwVmcs;
+}
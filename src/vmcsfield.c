@@ -0,0 +1,73 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcsfield.c
+* @section	VMCS field catalogue, apart from VT-x.c so user-mode builds can use it
+*/
+
+#include "VT-x.h"
+
+// Use X-Macros to define the VMCS field metadata array, in VMCS_FIELD_INDEX order
+static const VMCS_FIELD_INFO g_VmcsFields[VMCS_FIELD_INDEX_COUNT] = {
+#define X(FieldName, Encoding) \
+	{ (VMCS_FIELD_ENCODING)(Encoding), VMCS_FIELD_WIDTH_OF(Encoding), VMCS_FIELD_TYPE_OF(Encoding), #FieldName },
+	VMCS_FIELDS_16BIT
+	VMCS_FIELDS_64BIT
+	VMCS_FIELDS_32BIT
+	VMCS_FIELDS_NATURAL
+#undef X
+};
+
+VMCS_FIELD_INDEX
+VTX_GetVmcsFieldIndex(
+	_In_ const VMCS_FIELD_ENCODING eField
+)
+{
+	// Generated switch, the compiler turns it into a jump table or a binary search
+	switch (eField)
+	{
+#define X(FieldName, Encoding) case FieldName: return FieldName##_INDEX;
+	VMCS_FIELDS_16BIT
+	VMCS_FIELDS_32BIT
+	VMCS_FIELDS_NATURAL
+#undef X
+#define X(FieldName, Encoding) \
+	case FieldName##_FULL: \
+	case FieldName##_HIGH: \
+		return FieldName##_INDEX;
+	VMCS_FIELDS_64BIT
+#undef X
+	default:
+		return VMCS_FIELD_INDEX_COUNT;
+	}
+}
+
+const VMCS_FIELD_INFO*
+VTX_GetVmcsFieldInfo(
+	_In_ const VMCS_FIELD_INDEX eIndex
+)
+{
+	NT_ASSERT(eIndex < VMCS_FIELD_INDEX_COUNT);
+
+	return &g_VmcsFields[eIndex];
+}
@@ -0,0 +1,780 @@
+/**
+* MIT License
+*
+* Copyright (c) 2017 Viral Security Group
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*
+* @file		vmcsmerge.c
+* @section	Incremental merge of the L1 VMCS12 and L0's policy into the VMCS02 of a nested guest
+*/
+
+#include "vmcsmerge.h"
+
+#define VMCSMERGE_WORD(eIndex)	((UINT32)(eIndex) / 64)
+#define VMCSMERGE_BIT(eIndex)	(1ULL << ((UINT32)(eIndex) % 64))
+
+// VMCS02 fields computed from several sources, recomputed together
+typedef enum _VMCSMERGE_GROUP
+{
+	VMCSMERGE_GROUP_CONTROLS = 0,	// Pin-based, processor-based, exit and entry controls
+	VMCSMERGE_GROUP_EXCEPTIONS,		// Exception bitmap, page-fault error code mask and match
+	VMCSMERGE_GROUP_CR0,			// CR0 guest/host mask, read shadow and guest CR0
+	VMCSMERGE_GROUP_CR4,			// CR4 guest/host mask, read shadow and guest CR4
+	VMCSMERGE_GROUP_MSR_BITMAP,
+	VMCSMERGE_GROUP_IO_BITMAPS,
+	VMCSMERGE_GROUP_TSC_OFFSET,
+	VMCSMERGE_GROUP_COUNT
+} VMCSMERGE_GROUP, *PVMCSMERGE_GROUP;
+
+#define VMCSMERGE_GROUP_BIT(eGroup)	(1UL << (eGroup))
+#define VMCSMERGE_ALL_GROUPS		(VMCSMERGE_GROUP_BIT(VMCSMERGE_GROUP_COUNT) - 1)
+#define VMCSMERGE_BITMAP_GROUPS		(VMCSMERGE_GROUP_BIT(VMCSMERGE_GROUP_MSR_BITMAP) \
+									| VMCSMERGE_GROUP_BIT(VMCSMERGE_GROUP_IO_BITMAPS))
+
+// What a change of a VMCS12 field implies for VMCS02
+typedef enum _VMCSMERGE_ACTION
+{
+	VMCSMERGE_ACTION_BY_TYPE = 0,	// Copy control and guest-state fields, ignore host-state and read-only ones
+	VMCSMERGE_ACTION_IGNORE,		// Owned by L0 or only used on nested VM exit
+	VMCSMERGE_ACTION_TRANSLATE,		// L1 guest-physical address, written as host-physical
+	VMCSMERGE_ACTION_GROUP			// VMCSMERGE_ACTION_GROUP + eGroup: recompute the group
+} VMCSMERGE_ACTION, *PVMCSMERGE_ACTION;
+
+#define VMCSMERGE_GROUP_ACTION(eGroup)	((UINT8)(VMCSMERGE_ACTION_GROUP + (eGroup)))
+
+static const UINT8 g_acVmcsMergeActions[VMCS_FIELD_INDEX_COUNT] = {
+	// L0 owns these, the nested guest runs with its own values
+	[VMCS_FIELD_VPID_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_POSTED_INTR_NOTIFICATION_VECTOR_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_EPTP_INDEX_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_GUEST_PML_INDEX_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VM_EXIT_MSR_STORE_ADDR_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VM_EXIT_MSR_LOAD_ADDR_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VM_ENTRY_MSR_LOAD_ADDR_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VM_EXIT_MSR_STORE_COUNT_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VM_EXIT_MSR_LOAD_COUNT_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VM_ENTRY_MSR_LOAD_COUNT_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_EXECUTIVE_VMCS_PTR_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_PML_ADDRESS_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_PI_DESC_ADDR_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VM_FUNCTION_CONTROL_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_EPT_POINTER_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_EPTP_LIST_ADDR_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VMREAD_BITMAP_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VMWRITE_BITMAP_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VIRT_EXCEPTION_INFO_INDEX] = VMCSMERGE_ACTION_IGNORE,
+	[VMCS_FIELD_VMCS_LINK_POINTER_INDEX] = VMCSMERGE_ACTION_IGNORE,
+
+	[VMCS_FIELD_VIRTUAL_APIC_PAGE_ADDR_INDEX] = VMCSMERGE_ACTION_TRANSLATE,
+	[VMCS_FIELD_APIC_ACCESS_ADDR_INDEX] = VMCSMERGE_ACTION_TRANSLATE,
+
+	[VMCS_FIELD_PIN_BASED_VM_EXEC_CONTROL_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CONTROLS),
+	[VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CONTROLS),
+	[VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CONTROLS),
+	[VMCS_FIELD_VM_EXIT_CONTROLS_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CONTROLS),
+	[VMCS_FIELD_VM_ENTRY_CONTROLS_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CONTROLS),
+
+	[VMCS_FIELD_EXCEPTION_BITMAP_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_EXCEPTIONS),
+	[VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MASK_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_EXCEPTIONS),
+	[VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MATCH_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_EXCEPTIONS),
+
+	[VMCS_FIELD_CR0_GUEST_HOST_MASK_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CR0),
+	[VMCS_FIELD_CR0_READ_SHADOW_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CR0),
+	[VMCS_FIELD_GUEST_CR0_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CR0),
+
+	[VMCS_FIELD_CR4_GUEST_HOST_MASK_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CR4),
+	[VMCS_FIELD_CR4_READ_SHADOW_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CR4),
+	[VMCS_FIELD_GUEST_CR4_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_CR4),
+
+	[VMCS_FIELD_MSR_BITMAP_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_MSR_BITMAP),
+	[VMCS_FIELD_IO_BITMAP_A_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_IO_BITMAPS),
+	[VMCS_FIELD_IO_BITMAP_B_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_IO_BITMAPS),
+	[VMCS_FIELD_TSC_OFFSET_INDEX] = VMCSMERGE_GROUP_ACTION(VMCSMERGE_GROUP_TSC_OFFSET),
+};
+
+// Groups that also depend on the sources of a group, e.g. whether L1 uses MSR
+// bitmaps is a processor-based control
+static const UINT32 g_adwVmcsMergeDependents[VMCSMERGE_GROUP_COUNT] = {
+	[VMCSMERGE_GROUP_CONTROLS] = VMCSMERGE_BITMAP_GROUPS | VMCSMERGE_GROUP_BIT(VMCSMERGE_GROUP_TSC_OFFSET),
+};
+
+/**
+* Write a VMCS02 field through the cache
+* @param ptMerge - merge engine
+* @param eField - full encoding of the field
+* @param qwValue - value to write
+*/
+static
+VOID
+vmcsmerge_Write(
+	_Inout_	PVMCSMERGE			ptMerge,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_In_	UINT64				qwValue
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+
+	// Only fails for unknown encodings, _HIGH accesses and read-only fields
+	// (STATUS_ACCESS_DENIED), none of them written here
+	eStatus = VmcsCacheWrite(ptMerge->ptVmcs02, eField, qwValue);
+	NT_ASSERT(NT_SUCCESS(eStatus));
+	UNREFERENCED_PARAMETER(eStatus);
+	ptMerge->tStatistics.qwVmcs02Writes++;
+}
+
+/**
+* Translate an L1 guest-physical address
+* @param ptMerge - merge engine
+* @param qwGuestPhysicalAddress - L1 guest-physical address
+* @param pqwHostPhysicalAddress - receives the host-physical address
+* @param ppvHostVirtualAddress - receives the host mapping, NULL if not needed
+* @return STATUS_SUCCESS on success, otherwise the translator's error
+*/
+static
+NTSTATUS
+vmcsmerge_Translate(
+	_In_		PVMCSMERGE		ptMerge,
+	_In_		UINT64			qwGuestPhysicalAddress,
+	_Out_		PUINT64			pqwHostPhysicalAddress,
+	_Out_opt_	const VOID**	ppvHostVirtualAddress
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	const VOID* pvHostVirtualAddress = NULL;
+
+	eStatus = ptMerge->tTranslator.pfnTranslate(ptMerge->tTranslator.pvContext,
+		qwGuestPhysicalAddress, pqwHostPhysicalAddress, &pvHostVirtualAddress);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+
+	if (NULL != ppvHostVirtualAddress)
+	{
+		if (NULL == pvHostVirtualAddress)
+		{
+			return STATUS_NOT_MAPPED_DATA;
+		}
+		*ppvHostVirtualAddress = pvHostVirtualAddress;
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+* Merge an L0 and an L1 exit bitmap: a set bit in either one causes a VM exit
+* @param pvMerged - receives the merged bitmap
+* @param pvL0 - L0 bitmap, NULL if L0 intercepts nothing
+* @param pvL1 - L1 bitmap, NULL to use qwL1Default instead
+* @param qwL1Default - every 64 bits of the L1 bitmap if pvL1 is NULL
+* @param cbSize - size of the bitmaps, a multiple of 8
+*/
+static
+VOID
+vmcsmerge_MergeBitmap(
+	_Out_writes_bytes_(cbSize)		PVOID		pvMerged,
+	_In_reads_bytes_opt_(cbSize)	const VOID*	pvL0,
+	_In_reads_bytes_opt_(cbSize)	const VOID*	pvL1,
+	_In_							UINT64		qwL1Default,
+	_In_							UINT32		cbSize
+)
+{
+	PUINT64 pqwMerged = (PUINT64)pvMerged;
+	const UINT64* pqwL0 = (const UINT64*)pvL0;
+	const UINT64* pqwL1 = (const UINT64*)pvL1;
+	UINT32 i = 0;
+
+	for (i = 0; i < cbSize / sizeof(UINT64); i++)
+	{
+		pqwMerged[i] = ((NULL != pqwL1) ? pqwL1[i] : qwL1Default)
+			| ((NULL != pqwL0) ? pqwL0[i] : 0);
+	}
+}
+
+/**
+* Intersect the execution, exit and entry controls of L0 and L1
+* @param ptMerge - merge engine
+* @return STATUS_SUCCESS
+*/
+static
+NTSTATUS
+vmcsmerge_Controls(
+	_Inout_ PVMCSMERGE ptMerge
+)
+{
+	PVMCS12 ptVmcs12 = ptMerge->ptVmcs12;
+	PVMCSMERGE_POLICY ptPolicy = &ptMerge->tPolicy;
+	VMX_PROCBASED_CTLS tProcBased = { 0 };
+	UINT32 dwProcBased2 = 0;
+
+	// L1's secondary controls only apply if its primary controls activate them
+	*(PUINT32)&tProcBased = ptVmcs12->t32Bit.VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL;
+	if (tProcBased.UseProcbased2)
+	{
+		dwProcBased2 = ptVmcs12->t32Bit.VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL;
+	}
+	dwProcBased2 = (dwProcBased2 & ptPolicy->tProcBased2.dwAllowed) | ptPolicy->tProcBased2.dwRequired;
+
+	// L0 always runs the nested guest with the merged bitmaps
+	*(PUINT32)&tProcBased = (*(PUINT32)&tProcBased & ptPolicy->tProcBased.dwAllowed)
+		| ptPolicy->tProcBased.dwRequired;
+	tProcBased.UseIoBitmaps = TRUE;
+	tProcBased.UseMsrBitmaps = TRUE;
+	tProcBased.UseProcbased2 = (0 != dwProcBased2);
+
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_PIN_BASED_VM_EXEC_CONTROL,
+		(ptVmcs12->t32Bit.VMCS_FIELD_PIN_BASED_VM_EXEC_CONTROL & ptPolicy->tPinBased.dwAllowed)
+		| ptPolicy->tPinBased.dwRequired);
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL, *(PUINT32)&tProcBased);
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_SECONDARY_VM_EXEC_CONTROL, dwProcBased2);
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_VM_EXIT_CONTROLS,
+		(ptVmcs12->t32Bit.VMCS_FIELD_VM_EXIT_CONTROLS & ptPolicy->tExit.dwAllowed)
+		| ptPolicy->tExit.dwRequired);
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_VM_ENTRY_CONTROLS,
+		(ptVmcs12->t32Bit.VMCS_FIELD_VM_ENTRY_CONTROLS & ptPolicy->tEntry.dwAllowed)
+		| ptPolicy->tEntry.dwRequired);
+	return STATUS_SUCCESS;
+}
+
+/**
+* Combine the exceptions L0 and L1 intercept
+* @param ptMerge - merge engine
+* @return STATUS_SUCCESS
+*/
+static
+NTSTATUS
+vmcsmerge_Exceptions(
+	_Inout_ PVMCSMERGE ptMerge
+)
+{
+	PVMCS12 ptVmcs12 = ptMerge->ptVmcs12;
+	VMX_EXCEPTION_BITMAP tL0 = { 0 };
+	UINT32 dwPfMask = ptVmcs12->t32Bit.VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MASK;
+	UINT32 dwPfMatch = ptVmcs12->t32Bit.VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MATCH;
+
+	*(PUINT32)&tL0 = ptMerge->tPolicy.dwExceptionBitmap;
+	if (tL0.PF)
+	{
+		// L0 needs every #PF, with the bit set and mask = match = 0 all of them exit
+		dwPfMask = 0;
+		dwPfMatch = 0;
+	}
+
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_EXCEPTION_BITMAP,
+		ptVmcs12->t32Bit.VMCS_FIELD_EXCEPTION_BITMAP | *(PUINT32)&tL0);
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MASK, dwPfMask);
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_PAGE_FAULT_ERROR_CODE_MATCH, dwPfMatch);
+	return STATUS_SUCCESS;
+}
+
+/**
+* Combine the CR0 or CR4 bits L0 and L1 own. L2 must read L1's shadow for the
+* bits L1 owns and the real value for the bits only L0 owns.
+* @param ptMerge - merge engine
+* @param qwL0Mask - bits of the register L0 owns
+* @param qwL1Mask - bits of the register L1 owns
+* @param qwL1Shadow - read shadow of L1
+* @param qwGuestValue - value of the register in L2
+* @param eMask - guest/host mask field
+* @param eShadow - read shadow field
+* @param eGuest - guest-state field
+* @return STATUS_SUCCESS
+*/
+static
+NTSTATUS
+vmcsmerge_ControlRegister(
+	_Inout_	PVMCSMERGE			ptMerge,
+	_In_	UINT64				qwL0Mask,
+	_In_	UINT64				qwL1Mask,
+	_In_	UINT64				qwL1Shadow,
+	_In_	UINT64				qwGuestValue,
+	_In_	VMCS_FIELD_ENCODING	eMask,
+	_In_	VMCS_FIELD_ENCODING	eShadow,
+	_In_	VMCS_FIELD_ENCODING	eGuest
+)
+{
+	vmcsmerge_Write(ptMerge, eMask, qwL0Mask | qwL1Mask);
+	vmcsmerge_Write(ptMerge, eShadow, (qwL1Shadow & qwL1Mask) | (qwGuestValue & ~qwL1Mask));
+	vmcsmerge_Write(ptMerge, eGuest, qwGuestValue);
+	return STATUS_SUCCESS;
+}
+
+/**
+* Check an L1 bitmap address like VM entry does
+* @param ptMerge - merge engine
+* @param qwGuestPhysicalAddress - address of the bitmap in VMCS12
+* @return TRUE if the address is 4KB aligned and within L1's physical-address width
+*/
+static
+__inline
+BOOLEAN
+vmcsmerge_IsValidBitmapAddress(
+	_In_	PVMCSMERGE	ptMerge,
+	_In_	UINT64		qwGuestPhysicalAddress
+)
+{
+	return (0 == BYTE_OFFSET_4KB(qwGuestPhysicalAddress))
+		&& (0 == (qwGuestPhysicalAddress >> ptMerge->tPolicy.dwPhysicalAddressWidth));
+}
+
+/**
+* Merge the MSR bitmaps of L0 and L1
+* @param ptMerge - merge engine
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_ADDRESS if L1's bitmap address fails the VM-entry checks
+*		  Otherwise the translator's error
+*/
+static
+NTSTATUS
+vmcsmerge_MsrBitmap(
+	_Inout_ PVMCSMERGE ptMerge
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	PVMCS12 ptVmcs12 = ptMerge->ptVmcs12;
+	VMX_PROCBASED_CTLS tProcBased = { 0 };
+	UINT64 qwHostPhysicalAddress = 0;
+	const VOID* pvL1 = NULL;
+
+	*(PUINT32)&tProcBased = ptVmcs12->t32Bit.VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL;
+	if (tProcBased.UseMsrBitmaps)
+	{
+		if (!vmcsmerge_IsValidBitmapAddress(ptMerge, ptVmcs12->t64Bit.VMCS_FIELD_MSR_BITMAP))
+		{
+			return STATUS_INVALID_ADDRESS;
+		}
+		eStatus = vmcsmerge_Translate(ptMerge, ptVmcs12->t64Bit.VMCS_FIELD_MSR_BITMAP,
+			&qwHostPhysicalAddress, &pvL1);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+	}
+
+	// Without MSR bitmaps every RDMSR and WRMSR exits to L1
+	vmcsmerge_MergeBitmap(ptMerge->tPages.ptMsrBitmaps, ptMerge->tPolicy.ptMsrBitmaps,
+		pvL1, MAXUINT64, sizeof(VMX_MSR_BITMAPS));
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_MSR_BITMAP_FULL, ptMerge->tPages.qwMsrBitmapsPhysicalAddress);
+	return STATUS_SUCCESS;
+}
+
+/**
+* Merge the I/O bitmaps of L0 and L1
+* @param ptMerge - merge engine
+* @return STATUS_SUCCESS on success
+*		  STATUS_INVALID_ADDRESS if one of L1's bitmap addresses fails the VM-entry checks
+*		  Otherwise the translator's error
+*/
+static
+NTSTATUS
+vmcsmerge_IoBitmaps(
+	_Inout_ PVMCSMERGE ptMerge
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	PVMCS12 ptVmcs12 = ptMerge->ptVmcs12;
+	const VMX_IO_BITMAPS* ptL0 = ptMerge->tPolicy.ptIoBitmaps;
+	VMX_PROCBASED_CTLS tProcBased = { 0 };
+	UINT64 qwHostPhysicalAddress = 0;
+	const VOID* pvL1A = NULL;
+	const VOID* pvL1B = NULL;
+	UINT64 qwL1Default = 0;
+
+	*(PUINT32)&tProcBased = ptVmcs12->t32Bit.VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL;
+	if (tProcBased.UseIoBitmaps)
+	{
+		if (!vmcsmerge_IsValidBitmapAddress(ptMerge, ptVmcs12->t64Bit.VMCS_FIELD_IO_BITMAP_A)
+			|| !vmcsmerge_IsValidBitmapAddress(ptMerge, ptVmcs12->t64Bit.VMCS_FIELD_IO_BITMAP_B))
+		{
+			return STATUS_INVALID_ADDRESS;
+		}
+		eStatus = vmcsmerge_Translate(ptMerge, ptVmcs12->t64Bit.VMCS_FIELD_IO_BITMAP_A,
+			&qwHostPhysicalAddress, &pvL1A);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+		eStatus = vmcsmerge_Translate(ptMerge, ptVmcs12->t64Bit.VMCS_FIELD_IO_BITMAP_B,
+			&qwHostPhysicalAddress, &pvL1B);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+	}
+	else if (tProcBased.UncondIoExit)
+	{
+		qwL1Default = MAXUINT64;
+	}
+
+	vmcsmerge_MergeBitmap(ptMerge->tPages.ptIoBitmaps->tIoBitmapA,
+		(NULL != ptL0) ? ptL0->tIoBitmapA : NULL, pvL1A, qwL1Default, PAGE_SIZE);
+	vmcsmerge_MergeBitmap(ptMerge->tPages.ptIoBitmaps->tIoBitmapB,
+		(NULL != ptL0) ? ptL0->tIoBitmapB : NULL, pvL1B, qwL1Default, PAGE_SIZE);
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_IO_BITMAP_A_FULL, ptMerge->tPages.qwIoBitmapsPhysicalAddress);
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_IO_BITMAP_B_FULL,
+		ptMerge->tPages.qwIoBitmapsPhysicalAddress + FIELD_OFFSET(VMX_IO_BITMAPS, tIoBitmapB));
+	return STATUS_SUCCESS;
+}
+
+/**
+* Combine the TSC offsets of L0 and L1
+* @param ptMerge - merge engine
+* @return STATUS_SUCCESS
+*/
+static
+NTSTATUS
+vmcsmerge_TscOffset(
+	_Inout_ PVMCSMERGE ptMerge
+)
+{
+	PVMCS12 ptVmcs12 = ptMerge->ptVmcs12;
+	VMX_PROCBASED_CTLS tProcBased = { 0 };
+	UINT64 qwTscOffset = ptMerge->tPolicy.qwTscOffset;
+
+	*(PUINT32)&tProcBased = ptVmcs12->t32Bit.VMCS_FIELD_CPU_BASED_VM_EXEC_CONTROL;
+	if (tProcBased.UseTscOffseting)
+	{
+		qwTscOffset += ptVmcs12->t64Bit.VMCS_FIELD_TSC_OFFSET;
+	}
+	vmcsmerge_Write(ptMerge, VMCS_FIELD_TSC_OFFSET_FULL, qwTscOffset);
+	return STATUS_SUCCESS;
+}
+
+/**
+* Recompute a group of derived VMCS02 fields
+* @param ptMerge - merge engine
+* @param eGroup - group to recompute
+* @return STATUS_SUCCESS on success, otherwise the translator's error
+*/
+static
+NTSTATUS
+vmcsmerge_Group(
+	_Inout_	PVMCSMERGE		ptMerge,
+	_In_	VMCSMERGE_GROUP	eGroup
+)
+{
+	PVMCS12 ptVmcs12 = ptMerge->ptVmcs12;
+
+	switch (eGroup)
+	{
+	case VMCSMERGE_GROUP_CONTROLS:
+		return vmcsmerge_Controls(ptMerge);
+	case VMCSMERGE_GROUP_EXCEPTIONS:
+		return vmcsmerge_Exceptions(ptMerge);
+	case VMCSMERGE_GROUP_CR0:
+		return vmcsmerge_ControlRegister(ptMerge, ptMerge->tPolicy.qwCr0GuestHostMask,
+			ptVmcs12->tNatural.VMCS_FIELD_CR0_GUEST_HOST_MASK,
+			ptVmcs12->tNatural.VMCS_FIELD_CR0_READ_SHADOW,
+			ptVmcs12->tNatural.VMCS_FIELD_GUEST_CR0,
+			VMCS_FIELD_CR0_GUEST_HOST_MASK, VMCS_FIELD_CR0_READ_SHADOW, VMCS_FIELD_GUEST_CR0);
+	case VMCSMERGE_GROUP_CR4:
+		return vmcsmerge_ControlRegister(ptMerge, ptMerge->tPolicy.qwCr4GuestHostMask,
+			ptVmcs12->tNatural.VMCS_FIELD_CR4_GUEST_HOST_MASK,
+			ptVmcs12->tNatural.VMCS_FIELD_CR4_READ_SHADOW,
+			ptVmcs12->tNatural.VMCS_FIELD_GUEST_CR4,
+			VMCS_FIELD_CR4_GUEST_HOST_MASK, VMCS_FIELD_CR4_READ_SHADOW, VMCS_FIELD_GUEST_CR4);
+	case VMCSMERGE_GROUP_MSR_BITMAP:
+		return vmcsmerge_MsrBitmap(ptMerge);
+	case VMCSMERGE_GROUP_IO_BITMAPS:
+		return vmcsmerge_IoBitmaps(ptMerge);
+	case VMCSMERGE_GROUP_TSC_OFFSET:
+		return vmcsmerge_TscOffset(ptMerge);
+	default:
+		NT_ASSERT(FALSE);
+		return STATUS_INVALID_PARAMETER;
+	}
+}
+
+/**
+* Merge a VMCS12 field L1 wrote, or pend the group it belongs to
+* @param ptMerge - merge engine
+* @param eIndex - index of the field
+* @return STATUS_SUCCESS on success, otherwise the translator's error
+*/
+static
+NTSTATUS
+vmcsmerge_Field(
+	_Inout_	PVMCSMERGE			ptMerge,
+	_In_	VMCS_FIELD_INDEX	eIndex
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	const VMCS_FIELD_INFO* ptInfo = VTX_GetVmcsFieldInfo(eIndex);
+	UINT8 cAction = g_acVmcsMergeActions[eIndex];
+	VMCSMERGE_GROUP eGroup = VMCSMERGE_GROUP_CONTROLS;
+	UINT64 qwValue = 0;
+
+	ptMerge->tStatistics.qwFieldsMerged++;
+	if (VMCSMERGE_ACTION_GROUP <= cAction)
+	{
+		eGroup = (VMCSMERGE_GROUP)(cAction - VMCSMERGE_ACTION_GROUP);
+		ptMerge->dwPendingGroups |= VMCSMERGE_GROUP_BIT(eGroup) | g_adwVmcsMergeDependents[eGroup];
+		return STATUS_SUCCESS;
+	}
+
+	if ((VMCSMERGE_ACTION_IGNORE == cAction)
+		|| (VMCS_FIELD_TYPE_HOST == ptInfo->eType)
+		|| (VMCS_FIELD_TYPE_READ_ONLY == ptInfo->eType))
+	{
+		return STATUS_SUCCESS;
+	}
+
+	eStatus = Vmcs12Read(ptMerge->ptVmcs12, ptInfo->eEncoding, &qwValue);
+	NT_ASSERT(NT_SUCCESS(eStatus));
+
+	// An unused address is left 0 by L1, there's nothing to translate then
+	if ((VMCSMERGE_ACTION_TRANSLATE == cAction) && (0 != qwValue))
+	{
+		eStatus = vmcsmerge_Translate(ptMerge, qwValue, &qwValue, NULL);
+		if (!NT_SUCCESS(eStatus))
+		{
+			return eStatus;
+		}
+	}
+
+	vmcsmerge_Write(ptMerge, ptInfo->eEncoding, qwValue);
+	return STATUS_SUCCESS;
+}
+
+VOID
+VmcsMergeInit(
+	_Out_	PVMCSMERGE				ptMerge,
+	_In_	PVMCS12					ptVmcs12,
+	_In_	PVMCSCACHE				ptVmcs02,
+	_In_	PVMCSMERGE_POLICY		ptPolicy,
+	_In_	PVMCSMERGE_TRANSLATOR	ptTranslator,
+	_In_	PVMCSMERGE_PAGES		ptPages
+)
+{
+	NT_ASSERT(NULL != ptMerge);
+	NT_ASSERT(NULL != ptVmcs12);
+	NT_ASSERT(NULL != ptVmcs02);
+	NT_ASSERT(NULL != ptPolicy);
+	NT_ASSERT(NULL != ptTranslator);
+	NT_ASSERT(NULL != ptPages);
+	NT_ASSERT(NULL != ptPages->ptMsrBitmaps);
+	NT_ASSERT(NULL != ptPages->ptIoBitmaps);
+	NT_ASSERT((0 != ptPolicy->dwPhysicalAddressWidth) && (64 > ptPolicy->dwPhysicalAddressWidth));
+
+	RtlZeroMemory(ptMerge, sizeof(*ptMerge));
+	ptMerge->ptVmcs12 = ptVmcs12;
+	ptMerge->ptVmcs02 = ptVmcs02;
+	ptMerge->tPolicy = *ptPolicy;
+	ptMerge->tTranslator = *ptTranslator;
+	ptMerge->tPages = *ptPages;
+	VmcsMergeMarkAllDirty(ptMerge);
+}
+
+NTSTATUS
+VmcsMergeVmwrite(
+	_Inout_	PVMCSMERGE			ptMerge,
+	_In_	VMCS_FIELD_ENCODING	eField,
+	_In_	UINT64				qwValue
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	VMCS_FIELD_INDEX eIndex = VMCS_FIELD_INDEX_COUNT;
+
+	NT_ASSERT(NULL != ptMerge);
+
+	eStatus = Vmcs12Write(ptMerge->ptVmcs12, eField, qwValue, FALSE);
+	if (!NT_SUCCESS(eStatus))
+	{
+		return eStatus;
+	}
+
+	eIndex = VTX_GetVmcsFieldIndex(eField);
+	ptMerge->aqwDirty[VMCSMERGE_WORD(eIndex)] |= VMCSMERGE_BIT(eIndex);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+VmcsMergeMarkDirty(
+	_Inout_	PVMCSMERGE			ptMerge,
+	_In_	VMCS_FIELD_ENCODING	eField
+)
+{
+	VMCS_FIELD_INDEX eIndex = VMCS_FIELD_INDEX_COUNT;
+
+	NT_ASSERT(NULL != ptMerge);
+
+	eIndex = VTX_GetVmcsFieldIndex(eField);
+	if (VMCS_FIELD_INDEX_COUNT == eIndex)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	ptMerge->aqwDirty[VMCSMERGE_WORD(eIndex)] |= VMCSMERGE_BIT(eIndex);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+VmcsMergeSyncFromShadow(
+	_Inout_									PVMCSMERGE			ptMerge,
+	_In_reads_bytes_(VMCSBITMAP_SIZE)		const UINT8*		pcVmwriteBitmap,
+	_In_									PVMCSCACHE_BACKEND	ptShadow
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	const VMCS_FIELD_INFO* ptInfo = NULL;
+	UINT32 dwEncoding = 0;
+	UINT64 qwShadow = 0;
+	UINT64 qwValue = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptMerge);
+	NT_ASSERT(NULL != pcVmwriteBitmap);
+	NT_ASSERT(NULL != ptShadow);
+
+	for (i = 0; i < VMCS_FIELD_INDEX_COUNT; i++)
+	{
+		ptInfo = VTX_GetVmcsFieldInfo((VMCS_FIELD_INDEX)i);
+		dwEncoding = (UINT32)ptInfo->eEncoding;
+		if ((VMCSBITMAP_ENCODING_LIMIT <= dwEncoding)
+			|| (0 != (pcVmwriteBitmap[dwEncoding / 8] & (1 << (dwEncoding % 8)))))
+		{
+			continue;
+		}
+
+		if (VMX_SUCCESS != ptShadow->pfnRead(ptShadow->pvContext, ptInfo->eEncoding, &qwShadow))
+		{
+			return STATUS_UNSUCCESSFUL;
+		}
+
+		// Only the fields L1 actually changed cost a merge
+		eStatus = Vmcs12Read(ptMerge->ptVmcs12, ptInfo->eEncoding, &qwValue);
+		NT_ASSERT(NT_SUCCESS(eStatus));
+		if (qwShadow == qwValue)
+		{
+			continue;
+		}
+		eStatus = Vmcs12Write(ptMerge->ptVmcs12, ptInfo->eEncoding, qwShadow, TRUE);
+		NT_ASSERT(NT_SUCCESS(eStatus));
+		ptMerge->aqwDirty[VMCSMERGE_WORD(i)] |= VMCSMERGE_BIT(i);
+	}
+	return STATUS_SUCCESS;
+}
+
+VOID
+VmcsMergeMarkAllDirty(
+	_Inout_ PVMCSMERGE ptMerge
+)
+{
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptMerge);
+
+	for (i = 0; i < VMCS_FIELD_INDEX_COUNT / 64; i++)
+	{
+		ptMerge->aqwDirty[i] = MAXUINT64;
+	}
+	if (0 != VMCS_FIELD_INDEX_COUNT % 64)
+	{
+		ptMerge->aqwDirty[i] = VMCSMERGE_BIT(VMCS_FIELD_INDEX_COUNT) - 1;
+	}
+	ptMerge->dwPendingGroups = VMCSMERGE_ALL_GROUPS;
+}
+
+VOID
+VmcsMergeMarkBitmapsDirty(
+	_Inout_ PVMCSMERGE ptMerge
+)
+{
+	NT_ASSERT(NULL != ptMerge);
+
+	ptMerge->dwPendingGroups |= VMCSMERGE_BITMAP_GROUPS;
+}
+
+VOID
+VmcsMergeSetPolicy(
+	_Inout_	PVMCSMERGE			ptMerge,
+	_In_	PVMCSMERGE_POLICY	ptPolicy
+)
+{
+	NT_ASSERT(NULL != ptMerge);
+	NT_ASSERT(NULL != ptPolicy);
+	NT_ASSERT((0 != ptPolicy->dwPhysicalAddressWidth) && (64 > ptPolicy->dwPhysicalAddressWidth));
+
+	ptMerge->tPolicy = *ptPolicy;
+	ptMerge->dwPendingGroups = VMCSMERGE_ALL_GROUPS;
+}
+
+NTSTATUS
+VmcsMergeNestedEntry(
+	_Inout_ PVMCSMERGE ptMerge
+)
+{
+	NTSTATUS eStatus = STATUS_SUCCESS;
+	UINT64 aqwDirty[VMCSCACHE_BITMAP_WORDS] = { 0 };
+	UINT32 dwPendingGroups = 0;
+	UINT64 qwDirty = 0;
+	ULONG dwBit = 0;
+	UINT32 i = 0;
+
+	NT_ASSERT(NULL != ptMerge);
+
+	// A failed entry leaves everything dirty, the fields merged before the
+	// failure are merged again on the next one
+	RtlCopyMemory(aqwDirty, ptMerge->aqwDirty, sizeof(aqwDirty));
+	dwPendingGroups = ptMerge->dwPendingGroups;
+
+	ptMerge->tStatistics.qwEntries++;
+	for (i = 0; (i < VMCSCACHE_BITMAP_WORDS) && NT_SUCCESS(eStatus); i++)
+	{
+		qwDirty = ptMerge->aqwDirty[i];
+		ptMerge->aqwDirty[i] = 0;
+		while (_BitScanForward64(&dwBit, qwDirty) && NT_SUCCESS(eStatus))
+		{
+			eStatus = vmcsmerge_Field(ptMerge, (VMCS_FIELD_INDEX)(i * 64 + dwBit));
+			qwDirty &= qwDirty - 1;
+		}
+	}
+
+	// Groups are recomputed once however many of their sources changed
+	while (NT_SUCCESS(eStatus) && _BitScanForward(&dwBit, ptMerge->dwPendingGroups))
+	{
+		eStatus = vmcsmerge_Group(ptMerge, (VMCSMERGE_GROUP)dwBit);
+		if (NT_SUCCESS(eStatus))
+		{
+			ptMerge->tStatistics.qwGroupsRecomputed++;
+			ptMerge->dwPendingGroups &= ~VMCSMERGE_GROUP_BIT(dwBit);
+		}
+	}
+
+	if (!NT_SUCCESS(eStatus))
+	{
+		for (i = 0; i < VMCSCACHE_BITMAP_WORDS; i++)
+		{
+			ptMerge->aqwDirty[i] |= aqwDirty[i];
+		}
+		ptMerge->dwPendingGroups |= dwPendingGroups;
+	}
+	return eStatus;
+}
+
+VOID
+VmcsMergeGetStatistics(
+	_In_	PVMCSMERGE				ptMerge,
+	_Out_	PVMCSMERGE_STATISTICS	ptStatistics
+)
+{
+	NT_ASSERT(NULL != ptMerge);
+	NT_ASSERT(NULL != ptStatistics);
+
+	*ptStatistics = ptMerge->tStatistics;
+}